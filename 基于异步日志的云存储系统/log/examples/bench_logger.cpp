@@ -0,0 +1,391 @@
+/*
+ * 日志器压测程序
+ * 驱动 AysncLogger / CoroutineStyleAsyncLogger / CoroutineAsyncLogger，
+ * 覆盖 1-64 个生产者线程、不同消息大小、ASYNC_SAFE/ASYNC_UNSAFE、flush_log 的三个等级以及各个落地方向(含 NullFlush)。
+ * 每个用例输出一行 JSON(JSON Lines)，包含 msgs/s、MB/s 以及单次调用延迟的 p50/p99/p999，方便在版本之间对比回归。
+ *
+ * 编译: make bench_logger (见同目录 Makefile)
+ * 用法: ./bench_logger [--threads 1,2,4] [--sizes 32,256] [--messages 20000]
+ *                      [--sinks null,file,roll,stdout] [--loggers classic,style,coroutine] [--out result.jsonl]
+ */
+#include "../log_codes/MyLog.hpp"
+#include "../log_codes/ThreadPool.hpp"
+#include "../log_codes/Util.hpp"
+#include "../log_codes/CoroutineStyleAsyncLogger.hpp"
+#if __cplusplus >= 202002L
+#include "../log_codes/CoroutineAsyncLogger.hpp"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+ThreadPool *tp = nullptr;
+mylog::Util::JsonData *g_conf_data;
+
+namespace bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::vector<size_t> threads = {1, 2, 4, 8, 16, 32, 64};
+        std::vector<size_t> sizes = {32, 256, 4096};
+        size_t messages = 20000; // 每个生产者线程写入的消息数
+        std::vector<std::string> sinks = {"null", "file", "roll"};
+        std::vector<std::string> loggers = {"classic", "style", "coroutine"};
+        std::string out = "./bench_logger.jsonl";
+        std::string dir = "./bench_logfile/";
+    };
+
+    // 一个用例的描述，同时也是输出结果的维度
+    struct Case
+    {
+        std::string logger;
+        std::string mode = "-"; // classic: ASYNC_SAFE / ASYNC_UNSAFE；style: per_message / batched；coroutine没有该维度
+        int flush_log = -1;     // 只对写文件的落地方向有意义，其他为-1
+        std::string sink;
+        size_t threads;
+        size_t msg_size;
+    };
+
+    struct Result
+    {
+        double produce_sec = 0; // 所有生产者写完的时间
+        double drain_sec = 0;   // 生产者写完后到后端全部落地的时间
+        size_t messages = 0;
+        size_t bytes = 0;
+        uint64_t p50_ns = 0, p99_ns = 0, p999_ns = 0, max_ns = 0;
+        size_t buffer_capacity = 0; // 生产结束时两个缓冲区的容量之和(仅classic)
+        size_t resident_bytes = 0;  // 生产结束时两个缓冲区的常驻内存(仅classic)
+    };
+
+    static std::vector<std::string> Split(const std::string &s)
+    {
+        std::vector<std::string> ret;
+        std::stringstream ss(s);
+        std::string item;
+        while (std::getline(ss, item, ','))
+            if (!item.empty())
+                ret.push_back(item);
+        return ret;
+    }
+
+    static bool Contains(const std::vector<std::string> &v, const std::string &s)
+    {
+        return std::find(v.begin(), v.end(), s) != v.end();
+    }
+
+    static uint64_t Percentile(std::vector<uint32_t> &samples, double q)
+    {
+        if (samples.empty())
+            return 0;
+        size_t idx = std::min(samples.size() - 1, (size_t)(q * samples.size()));
+        std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+        return samples[idx];
+    }
+
+    // 以 threads 个线程并发调用 log_one，记录每次调用的耗时
+    // log_one(线程号, 序号) 执行一次日志调用；drain 在生产结束后调用，阻塞到后端全部落地
+    static Result Drive(const Case &c, size_t messages,
+                        const std::function<void(size_t, size_t)> &log_one,
+                        const std::function<void()> &drain)
+    {
+        Result r;
+        std::vector<std::vector<uint32_t>> lat(c.threads);
+        std::vector<std::thread> producers;
+        std::atomic<size_t> ready(0);
+        std::atomic<bool> go(false);
+        for (size_t t = 0; t < c.threads; ++t)
+        {
+            lat[t].reserve(messages);
+            producers.emplace_back([&, t]()
+                                   {
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                for (size_t i = 0; i < messages; ++i)
+                {
+                    auto b = Clock::now();
+                    log_one(t, i);
+                    auto e = Clock::now();
+                    lat[t].push_back((uint32_t)std::min<int64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(e - b).count(), UINT32_MAX));
+                } });
+        }
+        while (ready.load() != c.threads)
+            std::this_thread::yield();
+        auto begin = Clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto &th : producers)
+            th.join();
+        auto produced = Clock::now();
+        drain();
+        auto drained = Clock::now();
+
+        r.produce_sec = std::chrono::duration<double>(produced - begin).count();
+        r.drain_sec = std::chrono::duration<double>(drained - produced).count();
+        r.messages = c.threads * messages;
+
+        std::vector<uint32_t> all;
+        all.reserve(r.messages);
+        for (auto &v : lat)
+            all.insert(all.end(), v.begin(), v.end());
+        r.p50_ns = Percentile(all, 0.50);
+        r.p99_ns = Percentile(all, 0.99);
+        r.p999_ns = Percentile(all, 0.999);
+        r.max_ns = all.empty() ? 0 : *std::max_element(all.begin(), all.end());
+        return r;
+    }
+
+    static void Report(FILE *fp, const Case &c, const Result &r)
+    {
+        double total = r.produce_sec + r.drain_sec;
+        double mps = r.produce_sec > 0 ? r.messages / r.produce_sec : 0;
+        double mbps = r.produce_sec > 0 ? r.bytes / r.produce_sec / (1024.0 * 1024.0) : 0;
+        double e2e_mps = total > 0 ? r.messages / total : 0;
+        fprintf(fp,
+                "{\"logger\":\"%s\",\"mode\":\"%s\",\"flush_log\":%d,\"sink\":\"%s\",\"threads\":%zu,"
+                "\"msg_size\":%zu,\"messages\":%zu,\"bytes\":%zu,\"produce_sec\":%.6f,\"drain_sec\":%.6f,"
+                "\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"e2e_msgs_per_sec\":%.1f,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,"
+                "\"buffer_capacity\":%zu,\"resident_bytes\":%zu}\n",
+                c.logger.c_str(), c.mode.c_str(), c.flush_log, c.sink.c_str(), c.threads,
+                c.msg_size, r.messages, r.bytes, r.produce_sec, r.drain_sec,
+                mps, mbps, e2e_mps,
+                (unsigned long long)r.p50_ns, (unsigned long long)r.p99_ns,
+                (unsigned long long)r.p999_ns, (unsigned long long)r.max_ns,
+                r.buffer_capacity, r.resident_bytes);
+        fflush(fp);
+        std::cerr << c.logger << " " << c.mode << " flush_log=" << c.flush_log << " sink=" << c.sink
+                  << " threads=" << c.threads << " size=" << c.msg_size << " -> "
+                  << (uint64_t)mps << " msg/s, p99 " << r.p99_ns << " ns" << std::endl;
+    }
+
+    // 每个用例使用独立的文件，避免用例之间相互影响
+    static mylog::LogFlush::ptr MakeSink(const Options &o, const Case &c, size_t seq)
+    {
+        std::string base = o.dir + c.logger + "_" + std::to_string(seq);
+        if (c.sink == "file")
+            return mylog::LogFlushFactory::CreateLog<mylog::FileFlush>(base + ".log");
+        if (c.sink == "roll")
+            return mylog::LogFlushFactory::CreateLog<mylog::RollFileFlush>(base + "_roll", 64 * 1024 * 1024);
+        if (c.sink == "stdout")
+            return mylog::LogFlushFactory::CreateLog<mylog::StdoutFlush>();
+        return mylog::LogFlushFactory::CreateLog<mylog::NullFlush>();
+    }
+
+    // 需要遍历 flush_log 的落地方向
+    static std::vector<int> FlushLevels(const std::string &sink)
+    {
+        if (sink == "file" || sink == "roll")
+            return {0, 1, 2};
+        return {-1};
+    }
+
+    // 配置快照是只读的，修改刷盘等级需要发布一份新快照，落地方向在下一批数据时读到它
+    static void SetFlushLevel(int level)
+    {
+        mylog::Util::JsonData conf(*mylog::Util::JsonData::GetJsonData());
+        conf.flush_log = level;
+        mylog::Util::JsonData::Publish(conf);
+    }
+
+    static void RunClassic(const Options &o, FILE *fp, size_t &seq)
+    {
+        for (auto type : {mylog::AsyncType::ASYNC_SAFE, mylog::AsyncType::ASYNC_UNSAFE})
+            for (auto &sink : o.sinks)
+                for (int level : FlushLevels(sink))
+                    for (size_t threads : o.threads)
+                        for (size_t size : o.sizes)
+                        {
+                            Case c{"classic", type == mylog::AsyncType::ASYNC_SAFE ? "ASYNC_SAFE" : "ASYNC_UNSAFE",
+                                   level, sink, threads, size};
+                            if (level >= 0)
+                                bench::SetFlushLevel(level);
+                            std::vector<mylog::LogFlush::ptr> flushs{MakeSink(o, c, seq++)};
+                            auto logger = std::make_shared<mylog::AysncLogger>("bench_classic", flushs, type);
+                            std::string payload(size, 'x');
+                            mylog::BufferMetrics m;
+                            Result r = Drive(c, o.messages,
+                                             [&](size_t, size_t)
+                                             { logger->Info(__FILE__, __LINE__, "%s", payload.c_str()); },
+                                             [&]()
+                                             {
+                                                 m = logger->GetMetrics();
+                                                 logger.reset(); // 析构时AsyncWorker会处理完剩余数据
+                                             });
+                            r.bytes = r.messages * size;
+                            r.buffer_capacity = m.productor_capacity + m.consumer_capacity;
+                            r.resident_bytes = m.resident_bytes;
+                            Report(fp, c, r);
+                        }
+    }
+
+    static void RunStyle(const Options &o, FILE *fp, size_t &seq)
+    {
+        using namespace mylog::coroutine_style;
+        const mylog::Util::JsonData *conf = mylog::Util::JsonData::GetJsonData();
+        CoroutineLogManager::getInstance().initialize(std::max(2u, std::thread::hardware_concurrency()),
+                                                      mylog::Affinity::CpusFor(conf->scheduler_cpus, conf->reserved_cpus));
+        const std::pair<const char *, SubmitMode> modes[] = {{"per_message", SubmitMode::PerMessage},
+                                                             {"batched", SubmitMode::Batched}};
+        for (auto &[mode_name, mode] : modes)
+        for (auto &sink : o.sinks)
+            for (int level : FlushLevels(sink))
+                for (size_t threads : o.threads)
+                    for (size_t size : o.sizes)
+                    {
+                        Case c{"style", mode_name, level, sink, threads, size};
+                        if (level >= 0)
+                            bench::SetFlushLevel(level);
+                        auto flush = MakeSink(o, c, seq++);
+                        std::vector<CoroutineStyleAsyncLogger::FlushFunction> flushers{
+                            [flush](const std::string &data)
+                            { flush->Flush(data.data(), data.size()); }};
+                        auto logger = std::make_shared<CoroutineStyleAsyncLogger>("bench_style", flushers, mode);
+                        std::string payload(size, 'x');
+                        std::vector<std::future<void>> last(threads);
+                        Result r = Drive(c, o.messages,
+                                         [&](size_t t, size_t i)
+                                         {
+                                             // 只保留每个线程最后一条消息的future，用于判断是否落地
+                                             if (i + 1 == o.messages)
+                                                 last[t] = logger->log_async("INFO", payload);
+                                             else
+                                                 logger->info(payload);
+                                         },
+                                         [&]()
+                                         {
+                                             for (auto &f : last)
+                                                 if (f.valid())
+                                                     f.wait();
+                                             logger->stop();
+                                         });
+                        r.bytes = r.messages * size;
+                        Report(fp, c, r);
+                    }
+        CoroutineLogManager::getInstance().shutdown();
+    }
+
+#if __cplusplus >= 202002L
+    static void RunCoroutine(const Options &o, FILE *fp, size_t &seq)
+    {
+        using namespace mylog::coroutine;
+        for (auto &sink : o.sinks)
+            for (int level : FlushLevels(sink))
+                for (size_t threads : o.threads)
+                    for (size_t size : o.sizes)
+                    {
+                        Case c{"coroutine", "-", level, sink, threads, size};
+                        if (level >= 0)
+                            bench::SetFlushLevel(level);
+                        auto flush = MakeSink(o, c, seq++);
+                        std::vector<std::function<void(const std::string &)>> flushers{
+                            [flush](const std::string &data)
+                            { flush->Flush(data.data(), data.size()); }};
+                        auto logger = std::make_unique<CoroutineAsyncLogger>("bench_coroutine", flushers);
+                        std::string payload(size, 'x');
+                        Result r = Drive(c, o.messages,
+                                         [&](size_t, size_t)
+                                         { logger->log("INFO", payload); },
+                                         [&]()
+                                         { logger.reset(); });
+                        r.bytes = r.messages * size;
+                        Report(fp, c, r);
+                    }
+    }
+#endif
+
+    static std::vector<size_t> ToSizes(const std::string &s)
+    {
+        std::vector<size_t> ret;
+        for (auto &e : Split(s))
+            ret.push_back(std::stoul(e));
+        return ret;
+    }
+
+    static bool ParseArgs(int argc, char *argv[], Options *o)
+    {
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            std::string k = argv[i], v = argv[i + 1];
+            if (k == "--threads")
+                o->threads = ToSizes(v);
+            else if (k == "--sizes")
+                o->sizes = ToSizes(v);
+            else if (k == "--messages")
+                o->messages = std::stoul(v);
+            else if (k == "--sinks")
+                o->sinks = Split(v);
+            else if (k == "--loggers")
+                o->loggers = Split(v);
+            else if (k == "--out")
+                o->out = v;
+            else if (k == "--dir")
+                o->dir = v;
+            else
+            {
+                std::cerr << "unknown option: " << k << std::endl;
+                return false;
+            }
+        }
+        return (argc % 2) == 1;
+    }
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    bench::Options o;
+    if (!bench::ParseArgs(argc, argv, &o))
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " [--threads 1,2,4] [--sizes 32,256] [--messages N] [--sinks null,file,roll,stdout]"
+                     " [--loggers classic,style,coroutine] [--out file] [--dir logdir/]"
+                  << std::endl;
+        return 1;
+    }
+    if (mylog::Util::JsonData::GetJsonData()->buffer_size == 0) // 没有读到配置文件时使用config.conf中的默认值
+    {
+        mylog::Util::JsonData conf(*mylog::Util::JsonData::GetJsonData());
+        conf.buffer_size = 10000000;
+        conf.threshold = 10000000000;
+        conf.linear_growth = 10000000;
+        conf.thread_count = 3;
+        mylog::Util::JsonData::Publish(conf);
+    }
+    g_conf_data = mylog::Util::JsonData::GetJsonData();
+    tp = new ThreadPool(g_conf_data->thread_count,
+                        mylog::Affinity::CpusFor(g_conf_data->pool_cpus, g_conf_data->reserved_cpus));
+    mylog::Util::File::CreateDirectory(o.dir);
+
+    FILE *fp = (o.out == "-") ? stdout : fopen(o.out.c_str(), "w");
+    if (fp == NULL)
+    {
+        perror("open result file failed");
+        return 1;
+    }
+    size_t seq = 0;
+    if (bench::Contains(o.loggers, "classic"))
+        bench::RunClassic(o, fp, seq);
+    if (bench::Contains(o.loggers, "style"))
+        bench::RunStyle(o, fp, seq);
+#if __cplusplus >= 202002L
+    if (bench::Contains(o.loggers, "coroutine"))
+        bench::RunCoroutine(o, fp, seq);
+#else
+    if (bench::Contains(o.loggers, "coroutine"))
+        std::cerr << "CoroutineAsyncLogger needs -std=c++20, skipped" << std::endl;
+#endif
+    if (fp != stdout)
+        fclose(fp);
+    delete tp;
+    return 0;
+}
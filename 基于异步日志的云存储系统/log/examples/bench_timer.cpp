@@ -0,0 +1,150 @@
+/*
+ * 时间轮压测程序
+ * 向 TimerWheel 注册大量定时器(默认100万个，延迟在 [1, max-delay] ms 内均匀分布)，按比例取消一部分，
+ * 统计插入/取消的单次开销，以及剩余定时器实际触发时刻相对预期时刻的延迟分布。
+ * 结果输出一行 JSON，字段含义与 bench_logger 保持一致的风格。
+ *
+ * 编译: make bench_timer (见同目录 Makefile)
+ * 用法: ./bench_timer [--timers 1000000] [--max-delay 2000] [--cancel 0.5] [--out result.jsonl]
+ */
+#include "../log_codes/TimerWheel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        size_t timers = 1000000;
+        size_t max_delay = 2000; // ms
+        double cancel = 0.5;     // 取消的比例
+        std::string out = "-";
+    };
+
+    static bool ParseArgs(int argc, char *argv[], Options *o)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                return false;
+            std::string val = argv[++i];
+            if (arg == "--timers")
+                o->timers = std::stoul(val);
+            else if (arg == "--max-delay")
+                o->max_delay = std::max<size_t>(1, std::stoul(val));
+            else if (arg == "--cancel")
+                o->cancel = std::min(1.0, std::max(0.0, std::stod(val)));
+            else if (arg == "--out")
+                o->out = val;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    static double Percentile(std::vector<int64_t> &v, double p)
+    {
+        if (v.empty())
+            return 0;
+        size_t k = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+        std::nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k] / 1000.0; // us -> ms
+    }
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    bench::Options o;
+    if (!bench::ParseArgs(argc, argv, &o))
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " [--timers N] [--max-delay ms] [--cancel ratio] [--out file]" << std::endl;
+        return 1;
+    }
+
+    mylog::TimerWheel wheel;
+    std::vector<mylog::TimerWheel::TimerId> ids(o.timers);
+    std::vector<bench::Clock::time_point> expect(o.timers);
+    std::vector<int64_t> late(o.timers, INT64_MIN); // 实际触发时刻 - 预期时刻(us)，INT64_MIN表示未触发
+    std::atomic<size_t> fired{0};
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> dist(1, o.max_delay);
+    std::vector<size_t> delays(o.timers);
+    for (auto &d : delays)
+        d = dist(rng);
+
+    // 插入
+    auto t0 = bench::Clock::now();
+    for (size_t i = 0; i < o.timers; ++i)
+    {
+        expect[i] = bench::Clock::now() + std::chrono::milliseconds(delays[i]);
+        ids[i] = wheel.Schedule(std::chrono::milliseconds(delays[i]), [i, &expect, &late, &fired]()
+                                {
+            late[i] = std::chrono::duration_cast<std::chrono::microseconds>(bench::Clock::now() - expect[i]).count();
+            fired.fetch_add(1, std::memory_order_relaxed); });
+    }
+    auto t1 = bench::Clock::now();
+
+    // 取消，间隔均匀地取消一部分，已经触发的定时器取消会失败
+    size_t cancel_try = 0, cancelled = 0;
+    if (o.cancel > 0)
+    {
+        size_t step = std::max<size_t>(1, static_cast<size_t>(1.0 / o.cancel));
+        for (size_t i = 0; i < o.timers; i += step)
+        {
+            ++cancel_try;
+            if (wheel.Cancel(ids[i]))
+                ++cancelled;
+        }
+    }
+    auto t2 = bench::Clock::now();
+
+    // 等待剩余的定时器全部触发
+    size_t expected = o.timers - cancelled;
+    auto deadline = t2 + std::chrono::milliseconds(o.max_delay + 5000);
+    while (fired.load(std::memory_order_relaxed) < expected && bench::Clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    wheel.Stop();
+
+    std::vector<int64_t> lat;
+    lat.reserve(expected);
+    for (auto v : late)
+        if (v != INT64_MIN)
+            lat.push_back(v);
+
+    double insert_ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / std::max<size_t>(1, o.timers);
+    double cancel_ns = std::chrono::duration<double, std::nano>(t2 - t1).count() / std::max<size_t>(1, cancel_try);
+    double p50 = bench::Percentile(lat, 0.50);
+    double p99 = bench::Percentile(lat, 0.99);
+    double max = lat.empty() ? 0 : *std::max_element(lat.begin(), lat.end()) / 1000.0;
+    size_t early = std::count_if(lat.begin(), lat.end(), [](int64_t v)
+                                 { return v < 0; }); // 提前触发的个数，正常应为0
+
+    FILE *fp = (o.out == "-") ? stdout : fopen(o.out.c_str(), "w");
+    if (fp == NULL)
+    {
+        perror("open result file failed");
+        return 1;
+    }
+    fprintf(fp,
+            "{\"timers\":%zu,\"max_delay_ms\":%zu,\"insert_ns_per_op\":%.1f,\"cancel_ns_per_op\":%.1f,"
+            "\"cancelled\":%zu,\"fired\":%zu,\"expected\":%zu,\"late_p50_ms\":%.3f,\"late_p99_ms\":%.3f,\"late_max_ms\":%.3f,\"early\":%zu}\n",
+            o.timers, o.max_delay, insert_ns, cancel_ns, cancelled, fired.load(), expected, p50, p99, max, early);
+    if (fp != stdout)
+        fclose(fp);
+    return fired.load() == expected ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+/*
+ * 存储服务的HTTP压测程序
+ * 每个连接一个线程，HTTP/1.1 keep-alive 连续发送同一个请求，统计 req/s 以及单个请求延迟的 p50/p99/p999，
+ * 非2xx的响应计入errors；连接出错时重连，同样计入errors。
+ * 依次用 --conns 中的每个连接数跑 --seconds 秒，每个用例输出一行 JSON(JSON Lines)；
+ * 配合服务端 Storage.conf 中不同的 event_loops 运行，可以看到吞吐随事件循环个数(CPU核数)的变化。
+ *
+ * 编译: make http_bench (见同目录 Makefile)
+ * 用法: ./http_bench [--host 127.0.0.1] [--port 8081] [--path /] [--conns 1,4,16,64] [--seconds 5]
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        int port = 8081;
+        std::string path = "/";
+        std::vector<size_t> conns = {1, 4, 16, 64};
+        int seconds = 5;
+    };
+
+    struct Result
+    {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        std::vector<uint32_t> lat_us;
+    };
+
+    static int Connect(const Options &opt)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opt.port);
+        inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    // 读一个完整的响应，支持Content-Length和chunked两种响应体，返回响应的字节数，连接出错返回-1
+    static long ReadResponse(int fd, std::string &buf, int *status)
+    {
+        char tmp[64 * 1024];
+        size_t head_end;
+        while ((head_end = buf.find("\r\n\r\n")) == std::string::npos)
+        {
+            ssize_t n = read(fd, tmp, sizeof(tmp));
+            if (n <= 0)
+                return -1;
+            buf.append(tmp, n);
+        }
+        std::string head = buf.substr(0, head_end);
+        for (auto &c : head)
+            c = tolower(c);
+        if (head.compare(0, 9, "http/1.1 ") != 0)
+            return -1;
+        *status = atoi(head.c_str() + 9);
+        size_t pos = head_end + 4;
+        if (head.find("transfer-encoding: chunked") != std::string::npos)
+        {
+            while (true)
+            {
+                size_t eol;
+                while ((eol = buf.find("\r\n", pos)) == std::string::npos)
+                {
+                    ssize_t n = read(fd, tmp, sizeof(tmp));
+                    if (n <= 0)
+                        return -1;
+                    buf.append(tmp, n);
+                }
+                size_t len = strtoul(buf.c_str() + pos, NULL, 16);
+                size_t need = eol + 2 + len + 2;
+                while (buf.size() < need)
+                {
+                    ssize_t n = read(fd, tmp, sizeof(tmp));
+                    if (n <= 0)
+                        return -1;
+                    buf.append(tmp, n);
+                }
+                pos = need;
+                if (len == 0)
+                    break;
+            }
+        }
+        else
+        {
+            size_t cl = head.find("content-length:");
+            size_t len = cl == std::string::npos ? 0 : strtoul(head.c_str() + cl + 15, NULL, 10);
+            while (buf.size() < pos + len)
+            {
+                ssize_t n = read(fd, tmp, sizeof(tmp));
+                if (n <= 0)
+                    return -1;
+                buf.append(tmp, n);
+            }
+            pos += len;
+        }
+        buf.erase(0, pos);
+        return static_cast<long>(pos);
+    }
+
+    static void Worker(const Options &opt, const std::atomic<bool> &stop, Result *res)
+    {
+        std::string req = "GET " + opt.path + " HTTP/1.1\r\nHost: " + opt.host + "\r\nConnection: keep-alive\r\n\r\n";
+        std::string buf;
+        int fd = -1;
+        res->lat_us.reserve(1 << 16);
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            if (fd < 0 && (fd = Connect(opt)) < 0)
+            {
+                ++res->errors;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            auto t0 = Clock::now();
+            long n = -1;
+            int status = 0;
+            if (write(fd, req.data(), req.size()) == static_cast<ssize_t>(req.size()))
+                n = ReadResponse(fd, buf, &status);
+            if (n < 0)
+            {
+                ++res->errors;
+                close(fd);
+                fd = -1;
+                buf.clear();
+                continue;
+            }
+            if (status < 200 || status >= 300)
+                ++res->errors; // 响应完整，连接继续使用
+            res->lat_us.push_back(static_cast<uint32_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count()));
+            ++res->requests;
+            res->bytes += n;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    static std::vector<size_t> ParseList(const std::string &s)
+    {
+        std::vector<size_t> v;
+        std::stringstream ss(s);
+        std::string item;
+        while (std::getline(ss, item, ','))
+            if (!item.empty())
+                v.push_back(std::stoul(item));
+        return v;
+    }
+
+    static void RunCase(const Options &opt, size_t conns)
+    {
+        std::atomic<bool> stop(false);
+        std::vector<Result> results(conns);
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (size_t i = 0; i < conns; ++i)
+            threads.emplace_back(Worker, std::cref(opt), std::cref(stop), &results[i]);
+        std::this_thread::sleep_for(std::chrono::seconds(opt.seconds));
+        stop = true;
+        for (auto &t : threads)
+            t.join();
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+        Result all;
+        for (auto &r : results)
+        {
+            all.requests += r.requests;
+            all.errors += r.errors;
+            all.bytes += r.bytes;
+            all.lat_us.insert(all.lat_us.end(), r.lat_us.begin(), r.lat_us.end());
+        }
+        std::sort(all.lat_us.begin(), all.lat_us.end());
+        auto pct = [&](double p) -> uint32_t
+        {
+            if (all.lat_us.empty())
+                return 0;
+            return all.lat_us[std::min(all.lat_us.size() - 1, static_cast<size_t>(p * all.lat_us.size()))];
+        };
+        printf("{\"path\":\"%s\",\"conns\":%zu,\"requests\":%lu,\"errors\":%lu,\"req_s\":%.0f,\"MB_s\":%.2f,"
+               "\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u}\n",
+               opt.path.c_str(), conns, all.requests, all.errors, all.requests / secs,
+               all.bytes / secs / 1024 / 1024, pct(0.5), pct(0.99), pct(0.999));
+        fflush(stdout);
+    }
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    bench::Options opt;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i], val = argv[i + 1];
+        if (key == "--host")
+            opt.host = val;
+        else if (key == "--port")
+            opt.port = std::stoi(val);
+        else if (key == "--path")
+            opt.path = val;
+        else if (key == "--conns")
+            opt.conns = bench::ParseList(val);
+        else if (key == "--seconds")
+            opt.seconds = std::stoi(val);
+        else
+        {
+            std::cerr << "unknown option " << key << std::endl;
+            return 1;
+        }
+    }
+    for (size_t c : opt.conns)
+        bench::RunCase(opt, c);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * 远程日志收集端(RemoteFlush 的本地替身，用于联调和测试)
+ * 单线程 poll 处理多个连接：校验每一帧的 crc，解压后追加到输出文件，再回复累计确认。
+ * 按 (session,seq) 去重，发送端重连后重发的帧只确认不重复写入。
+ * --exit-after N 处理 N 帧后不确认直接退出，用来模拟收集端宕机，测试发送端的落盘和重发。
+ *
+ * 编译: make log_collector (见同目录 Makefile，BUNDLE=1 时支持解压 lz4/zstd 帧)
+ * 用法: ./log_collector <port> [-o collected.log] [--exit-after N]
+ */
+#include "../log_codes/LogFrame.hpp"
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Conn
+{
+    int fd;
+    std::string in; // 未处理完的数据
+};
+
+static std::unordered_map<uint64_t, uint64_t> last_seq; // 每个session已落地的最大seq
+static FILE *out_fp = stdout;
+static uint64_t frames = 0;
+static long exit_after = -1;
+
+// 处理缓冲区中完整的帧，回复确认；数据非法时返回false，由调用者断开连接
+static bool HandleFrames(Conn &c)
+{
+    size_t pos = 0;
+    std::vector<mylog::Frame::FrameAck> acks;
+    while (c.in.size() - pos >= sizeof(mylog::Frame::FrameHeader))
+    {
+        mylog::Frame::FrameHeader h;
+        memcpy(&h, c.in.data() + pos, sizeof(h));
+        if (!mylog::Frame::ParseHeader(&h))
+        {
+            std::cerr << "bad frame header" << std::endl;
+            return false;
+        }
+        if (c.in.size() - pos - sizeof(h) < h.data_len)
+            break; // 帧还没收全
+        std::string data = c.in.substr(pos + sizeof(h), h.data_len);
+        if (mylog::Frame::Crc32(data.data(), data.size()) != h.crc)
+        {
+            std::cerr << "crc mismatch, session " << h.session << " seq " << h.seq << std::endl;
+            return false;
+        }
+        std::string raw;
+        if (!mylog::Frame::Decode(static_cast<mylog::Frame::Codec>(h.codec), data, h.raw_len, &raw))
+        {
+            std::cerr << "decode failed, codec " << int(h.codec) << " (built without bundle?)" << std::endl;
+            return false;
+        }
+        pos += sizeof(h) + h.data_len;
+        uint64_t &last = last_seq[h.session];
+        if (h.seq > last) // 重发的帧只确认不写入
+        {
+            fwrite(raw.data(), 1, raw.size(), out_fp);
+            last = h.seq;
+        }
+        if (exit_after >= 0 && ++frames >= static_cast<uint64_t>(exit_after))
+        {
+            fflush(out_fp);
+            std::cerr << "exit after " << frames << " frames" << std::endl;
+            exit(0);
+        }
+        if (!acks.empty() && acks.back().session == h.session)
+            acks.back().seq = h.seq;
+        else
+            acks.push_back(mylog::Frame::FrameAck{0, h.session, h.seq});
+    }
+    c.in.erase(0, pos);
+    if (acks.empty())
+        return true;
+    fflush(out_fp); // 确认之前先交给内核
+    for (auto &a : acks)
+    {
+        mylog::Frame::FrameAck ack = mylog::Frame::MakeAck(a.session, last_seq[a.session]);
+        if (send(c.fd, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack))
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = 0;
+    std::string out = "-";
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            out = argv[++i];
+        else if (arg == "--exit-after" && i + 1 < argc)
+            exit_after = atol(argv[++i]);
+        else if (port == 0 && arg[0] != '-')
+            port = atoi(arg.c_str());
+        else
+            port = 0, i = argc;
+    }
+    if (port <= 0 || port > 65535)
+    {
+        std::cerr << "usage: " << argv[0] << " <port> [-o collected.log] [--exit-after N]" << std::endl;
+        return 1;
+    }
+    if (out != "-" && (out_fp = fopen(out.c_str(), "ab")) == NULL)
+    {
+        perror("open output file failed");
+        return 1;
+    }
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 32) < 0)
+    {
+        std::cout << __FILE__ << __LINE__ << "bind/listen error: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::cerr << "log collector listening on " << port << std::endl;
+
+    std::vector<Conn> conns;
+    char buf[64 * 1024];
+    while (true)
+    {
+        std::vector<struct pollfd> pfds;
+        pfds.push_back({lfd, POLLIN, 0});
+        for (auto &c : conns)
+            pfds.push_back({c.fd, POLLIN, 0});
+        if (poll(pfds.data(), pfds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            return 1;
+        }
+        if (pfds[0].revents & POLLIN)
+        {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd >= 0)
+                conns.push_back(Conn{cfd, std::string()});
+        }
+        for (size_t i = 1; i < pfds.size(); ++i)
+        {
+            if (pfds[i].revents == 0)
+                continue;
+            Conn &c = conns[i - 1];
+            ssize_t n = read(c.fd, buf, sizeof(buf));
+            if (n > 0)
+            {
+                c.in.append(buf, n);
+                if (HandleFrames(c))
+                    continue;
+            }
+            else if (n < 0 && errno == EINTR)
+                continue;
+            close(c.fd);
+            c.fd = -1;
+        }
+        for (size_t i = 0; i < conns.size();)
+        {
+            if (conns[i].fd < 0)
+            {
+                conns[i] = std::move(conns.back());
+                conns.pop_back();
+            }
+            else
+                ++i;
+        }
+    }
+    return 0;
+}
@@ -33,7 +33,8 @@ void test() {
 }
 
 void init_thread_pool() {
-    tp = new ThreadPool(g_conf_data->thread_count);
+    tp = new ThreadPool(g_conf_data->thread_count,
+                        mylog::Affinity::CpusFor(g_conf_data->pool_cpus, g_conf_data->reserved_cpus));
 }
 int main() {
     g_conf_data = mylog::Util::JsonData::GetJsonData();
@@ -0,0 +1,117 @@
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+/*
+线程绑核工具:
+(1)CPU列表使用与taskset/cgroup相同的写法，如 "0-3,8,10-11"，空字符串表示不绑定;
+(2)CpusFor从某类线程的CPU列表中去掉预留给事件循环的CPU(reserved)，只配置了reserved时取其余所有在线CPU，
+   这样后台线程(日志消费者、线程池、调度器)不会和事件循环抢同一个核;
+(3)PinCurrentThread把调用线程绑定到给定的CPU集合上，集合内部由内核调度。
+绑核之后再分配的内存按first-touch策略落在该线程所在的NUMA节点，
+因此日志消费者线程在绑核后重新分配自己的缓冲区，保证和它在同一个节点上。
+不依赖Util.hpp，线程池也可以直接使用。
+*/
+namespace mylog
+{
+    class Affinity
+    {
+    public:
+        // 解析 "0-3,8" 形式的CPU列表，忽略非法的段，结果去重并排序
+        static std::vector<int> ParseCpuList(const std::string &list)
+        {
+            std::vector<int> cpus;
+            size_t pos = 0;
+            while (pos < list.size())
+            {
+                size_t end = list.find(',', pos);
+                if (end == std::string::npos)
+                    end = list.size();
+                std::string item = list.substr(pos, end - pos);
+                pos = end + 1;
+                item.erase(std::remove(item.begin(), item.end(), ' '), item.end());
+                if (item.empty())
+                    continue;
+                char *rest = nullptr;
+                long first = strtol(item.c_str(), &rest, 10);
+                long last = first;
+                if (*rest == '-')
+                    last = strtol(rest + 1, &rest, 10);
+                if (*rest != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+                {
+                    fprintf(stderr, "ignore invalid cpu list item: %s\n", item.c_str());
+                    continue;
+                }
+                for (long cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(static_cast<int>(cpu));
+            }
+            std::sort(cpus.begin(), cpus.end());
+            cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+            return cpus;
+        }
+
+        // 某类线程可以使用的CPU：list中去掉reserved；list为空而reserved不为空时，取所有在线CPU去掉reserved
+        static std::vector<int> CpusFor(const std::string &list, const std::string &reserved = "")
+        {
+            std::vector<int> cpus = ParseCpuList(list);
+            std::vector<int> skip = ParseCpuList(reserved);
+            if (skip.empty())
+                return cpus;
+            if (cpus.empty())
+                cpus = OnlineCpus();
+            std::vector<int> result;
+            std::set_difference(cpus.begin(), cpus.end(), skip.begin(), skip.end(), std::back_inserter(result));
+            if (result.empty()) // 全被预留时不绑定，避免线程无处可跑
+            {
+                fprintf(stderr, "all cpus [%s] are reserved, thread left unpinned\n", list.c_str());
+                return {};
+            }
+            return result;
+        }
+
+        // 把当前线程绑定到cpus上，cpus为空时什么也不做
+        static bool PinCurrentThread(const std::vector<int> &cpus)
+        {
+            if (cpus.empty())
+                return true;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus)
+                CPU_SET(cpu, &set);
+            int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (ret != 0)
+            {
+                fprintf(stderr, "pthread_setaffinity_np failed: %s\n", strerror(ret));
+                return false;
+            }
+            return true;
+        }
+
+        // 进程允许使用的CPU(受taskset/cgroup限制)，取不到时按在线CPU数计算
+        static std::vector<int> OnlineCpus()
+        {
+            std::vector<int> cpus;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            {
+                for (int i = 0; i < CPU_SETSIZE; ++i)
+                    if (CPU_ISSET(i, &set))
+                        cpus.push_back(i);
+                return cpus;
+            }
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            for (long i = 0; i < n && i < CPU_SETSIZE; ++i)
+                cpus.push_back(static_cast<int>(i));
+            return cpus;
+        }
+    };
+} // namespace mylog
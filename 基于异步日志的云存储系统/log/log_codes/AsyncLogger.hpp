@@ -8,6 +8,7 @@
 #include "AsyncWorker.hpp"
 #include "Message.hpp"
 #include "LogFlush.hpp"
+#include "ShmRing.hpp"
 #include "backlog/clientBackupLog.hpp"
 #include "ThreadPool.hpp"
 /*----------将组织好的日志放入缓冲区---------*/
@@ -20,14 +21,30 @@ namespace mylog{
             : logger_name_(logger_name),//初始化日志器的名字
               flushs_(flushs.begin(), flushs.end()),//添加实例化方式给日志器，如日志输出到文件还是标准输出等
               asyncworker(std::make_shared<AsyncWorker>(//启动异步工作器
-                  std::bind(&AsyncLogger::RealFlush, this, std::placeholders::_1),
-                  type)) {}
-            virtual ~AysncLogger(){};
+                  std::bind(&AysncLogger::RealFlush, this, std::placeholders::_1),
+                  type, OpenShmRing(),
+                  std::bind(&AysncLogger::RealFlushUrgent, this, std::placeholders::_1, std::placeholders::_2)))
+            {
+                if (Util::JsonData::GetJsonData()->crash_handler)//致命信号时把未落地的日志写到各个落地文件
+                {
+                    CrashHandler::Install();
+                    if (!CrashHandler::Register(this, &AysncLogger::EmergencyDump))
+                        std::cout << __FILE__ << __LINE__ << "too many loggers for crash handler" << std::endl;
+                }
+            }
+            virtual ~AysncLogger(){ CrashHandler::Unregister(this); };
             /* 接收文件名 (file)、行号 (line)、格式化字符串 (format) 和可变参数 (...)，生成一条 DEBUG 级别的日志，并写入日志系统*/
             std::string Name(){return logger_name_;}
+            // 按当前配置快照判断该等级是否需要输出，热路径上只有一次原子load
+            static bool Enabled(LogLevel::value level)
+            {
+                return level >= Util::JsonData::GetJsonData()->log_level;
+            }
             /*在serialize时把日志信息中的日志级别定义为DEBUG。*/
        void Debug(const std::string &file,size_t line,const std::string format,...)
             {
+                if (!Enabled(LogLevel::value::DEBUG))//低于配置等级的日志不做格式化
+                    return;
                  // 获取可变参数列表中的格式
                  va_list va;//处理可变参数，日志函数需要支持不定数量的参数
                  va_start(va,format);//初始化 va_list，使其指向 format 之后的第一个可变参数。
@@ -40,7 +57,7 @@ namespace mylog{
                 va_end(va); // 将va指针置空
                 
                 serialize(LogLevel::value::DEBUG, file, line,
-                        ret); // 生成格式化日志信息并写文件
+                        ret, r); // 生成格式化日志信息并写文件
                 free(ret);
                 ret = nullptr;
 
@@ -49,6 +66,8 @@ namespace mylog{
        void Info(const std::string &file, size_t line, const std::string format,
                     ...)
             {
+                if (!Enabled(LogLevel::value::INFO))//低于配置等级的日志不做格式化
+                    return;
                 va_list va;
                 va_start(va, format);
                 char *ret;
@@ -58,7 +77,7 @@ namespace mylog{
                 va_end(va);
 
                 serialize(LogLevel::value::INFO, file, line,
-                        ret);
+                        ret, r);
 
                 free(ret);
                 ret = nullptr;
@@ -66,6 +85,8 @@ namespace mylog{
         void Warn(const std::string &file, size_t line, const std::string format,
                   ...)
         {
+            if (!Enabled(LogLevel::value::WARN))//低于配置等级的日志不做格式化
+                return;
             va_list va;
             va_start(va, format);
             char *ret;
@@ -75,7 +96,7 @@ namespace mylog{
             va_end(va);
 
             serialize(LogLevel::value::WARN, file, line,
-                      ret);
+                      ret, r);
             free(ret);
             ret = nullptr;
         }
@@ -83,6 +104,8 @@ namespace mylog{
         void Error(const std::string &file, size_t line, const std::string format,
                    ...)
         {
+            if (!Enabled(LogLevel::value::ERROR))//低于配置等级的日志不做格式化
+                return;
             va_list va;
             va_start(va, format);
             char *ret;
@@ -92,7 +115,7 @@ namespace mylog{
             va_end(va);
 
             serialize(LogLevel::value::ERROR, file, line,
-                      ret);
+                      ret, r);
 
             free(ret);
             ret = nullptr;
@@ -101,6 +124,8 @@ namespace mylog{
         void Fatal(const std::string &file, size_t line, const std::string format,
                    ...)
         {
+            if (!Enabled(LogLevel::value::FATAL))//低于配置等级的日志不做格式化
+                return;
             va_list va;
             va_start(va, format);
             char *ret;
@@ -110,58 +135,190 @@ namespace mylog{
             va_end(va);
 
             serialize(LogLevel::value::FATAL, file, line,
-                      ret);
+                      ret, r);
 
             free(ret);
             ret = nullptr;
         }
 
         //在这里将日志消息组织起来，并写入文件(依靠Message中的format函数s)
+        //日志体达到large_payload_size时走大日志路径，接管ret的所有权并把ret置空(调用者随后的free(ret)不做任何事)
         void serialize(LogLevel::value level, const std::string &file, size_t line,
-                       char *ret)
+                       char *&ret, int len)
         {
+            CrashHandler::ThreadInit();//打日志的线程都装上备用栈，栈溢出时也能应急落地
+            size_t large = Util::JsonData::GetJsonData()->large_payload_size;
+            if (large > 0 && len > 0 && static_cast<size_t>(len) >= large)
+            {
+                SerializeLarge(level, file, line, ret, len);
+                return;
+            }
             // std::cout << "Debug:serialize begin\n";
             LogMessage msg(level, file, line, logger_name_, ret);//创建日志消息对象,将用户传入的字符串中的各种参数传给该对象LogMessage
             std::string data = msg.format();//将消息进行格式化
             if (level == LogLevel::value::FATAL ||
                 level == LogLevel::value::ERROR)//特殊处理ERROR和FATAL级别的日志，并进行备份
             {
-                try
-                {
-                    auto ret = tp->enqueue(start_backup, data);//使用线程池进行备份，即调用start_backup函数进行套接字通信，发送备份信息
-                    ret.get();
-                }
-                catch (const std::runtime_error &e)
-                {
-                    // 该线程池没有把stop设置为true的逻辑，所以不做处理
-                    std::cout << __FILE__ << __LINE__ << "thread pool closed" << std::endl;
-                }
+                Backup(data);
+                FlushUrgent(level, data);//走高优先级通道，不排在大批普通日志后面
+                return;
             }
              //获取到string类型的日志信息后就可以输出到异步缓冲区了，异步工作器后续会对其进行刷新
             Flush(data.c_str(), data.size());
 
             // std::cout << "Debug:serialize Flush\n";
         }
+
+        // 大日志：只格式化日志头，vasprintf得到的日志体作为引用计数的数据块直接交给异步工作器，
+        // 落地时日志头、日志体、换行由writev一次写出，日志体在整个过程中不再拷贝
+        void SerializeLarge(LogLevel::value level, const std::string &file, size_t line,
+                            char *&ret, int len)
+        {
+            std::shared_ptr<const char> body(ret, [](const char *p) { free(const_cast<char *>(p)); });
+            ret = nullptr;
+            LogMessage msg(level, file, line, logger_name_, std::string());
+            std::string head = msg.FormatHeader();
+            static const std::string tail = "\n";
+            if (level == LogLevel::value::FATAL ||
+                level == LogLevel::value::ERROR)//备份和高优先级通道需要完整的一条日志，只有这种情况才拼接
+            {
+                std::string data = head + std::string(body.get(), len) + tail;
+                Backup(data);
+                FlushUrgent(level, data);
+                return;
+            }
+            asyncworker->PushLarge(head, std::move(body), len, tail);
+        }
+
+        void Backup(const std::string &data)
+        {
+            if (tp == nullptr)
+                return; // 命令行工具(index_tool、bench_logger)不创建线程池，也不备份
+            try
+            {
+                // 使用线程池进行备份，即调用start_backup函数进行套接字通信，发送备份信息
+                // 备份结果不影响本地落地，不创建future也不等待，避免网络重连阻塞打日志的线程
+                tp->enqueue_detached(start_backup, data);
+            }
+            catch (const std::runtime_error &e)
+            {
+                // 线程池析构过程中才会抛出，此时放弃备份
+                std::cout << __FILE__ << __LINE__ << "thread pool closed" << std::endl;
+            }
+        }
        /*异步写入机制*/
         void Flush(const char *data, size_t len)
         {
             asyncworker->Push(data, len); // Push函数本身是线程安全的，这里不加锁
         }
 
+        // ERROR/FATAL写入高优先级通道；配置了fatal_sync时FATAL阻塞到落盘完成
+        void FlushUrgent(LogLevel::value level, const std::string &data)
+        {
+            bool durable = level == LogLevel::value::FATAL && Util::JsonData::GetJsonData()->fatal_sync;
+            asyncworker->PushUrgent(data.c_str(), data.size(), durable);
+        }
+
+        // 高优先级通道的落地：写完立即刷新C库缓冲，需要时fdatasync
+        void RealFlushUrgent(Buffer &buffer, bool durable)
+        {
+            RealFlush(buffer);
+            for (auto &e : flushs_)
+                e->Sync(durable);
+        }
+
         void RealFlush(Buffer &buffer)
         { // 由异步线程进行实际写文件
             if (flushs_.empty())
                 return;
+            size_t flush_log = Util::JsonData::GetJsonData()->flush_log;//每批数据读一次配置快照
             for (auto &e : flushs_)
-            {  //e是Flush这个类，即控制把日志输出到哪的类。
-                e->Flush(buffer.Begin(), buffer.ReadableSize());
+                e->SetFlushLog(flush_log);
+            if (buffer.HasExtents())//这一批里有大日志体，连同连续数据一起分散写
+            {
+                buffer.ToIovec(&iov_);
+                for (auto &e : flushs_)
+                    e->FlushV(iov_.data(), static_cast<int>(iov_.size()));
+            }
+            else
+            {
+                for (auto &e : flushs_)
+                {  //e是Flush这个类，即控制把日志输出到哪的类。
+                    e->Flush(buffer.Begin(), buffer.ReadableSize());
+                }
             }
+            // 返回后AsyncWorker就会释放环中的这一批，flush_log为0时数据可能还在C库缓冲里，
+            // 先交给内核，进程崩溃时才不会两边都丢
+            if (ring_attached_)
+                for (auto &e : flushs_)
+                    e->Sync(false);
+        }
+
+        // 缓冲区容量、常驻内存等运行指标
+        BufferMetrics GetMetrics()
+        {
+            return asyncworker->GetMetrics();
         }
 
         protected:
+            // 打开配置的共享内存环，把上次崩溃时没来得及落地的日志先写到各个落地方向，再清空环交给AsyncWorker使用
+            ShmRing::ptr OpenShmRing()
+            {
+                const Util::JsonData *conf = Util::JsonData::GetJsonData();
+                if (conf->shm_ring_dir.empty() || conf->shm_ring_size == 0)
+                    return nullptr;
+                std::string path = conf->shm_ring_dir + "/" + logger_name_ + ".ring";
+                ShmRing::ptr ring = ShmRing::Open(path, conf->shm_ring_size);
+                if (!ring)
+                    return nullptr;
+                bool marked = false;
+                size_t recovered = ring->Recover([this, &path, &marked](const char *data, size_t len)
+                {
+                    if (!marked) // 第一条恢复的记录前写一行标记，方便区分
+                    {
+                        marked = true;
+                        std::string mark = "---- recovered from " + path + " ----\n";
+                        for (auto &e : flushs_)
+                            e->Flush(mark.c_str(), mark.size());
+                    }
+                    for (auto &e : flushs_)
+                        e->Flush(data, len);
+                });
+                if (recovered > 0)
+                    std::cout << __FILE__ << __LINE__ << "recovered " << recovered
+                              << " records from " << path << std::endl;
+                if (ring->Capacity() < conf->shm_ring_size) // 配置改大了，按新大小重建
+                {
+                    ring.reset();
+                    ring = ShmRing::Create(path, conf->shm_ring_size);
+                    ring_attached_ = (ring != nullptr);
+                    return ring;
+                }
+                ring->Reset();
+                ring_attached_ = true;
+                return ring;
+            }
+
+            // 崩溃处理函数的回调，运行在信号处理上下文中，只能做异步信号安全的操作
+            static void EmergencyDump(void *ctx, int sig)
+            {
+                AysncLogger *self = static_cast<AysncLogger *>(ctx);
+                for (auto &e : self->flushs_)
+                {
+                    int fd = e->Fd();
+                    if (fd < 0)
+                        continue;
+                    CrashHandler::WriteBanner(fd, sig, self->logger_name_.c_str());
+                    self->asyncworker->EmergencyDump(fd);
+                    CrashHandler::WriteBacktrace(fd);
+                }
+            }
+
             std::mutex mtx_;//锁
             std::string logger_name_;//日志器名字
             std::vector<LogFlush::ptr> flushs_; // 输出到指定方向(刷盘方式s),此处std::vector<LogFlush> flush_;不能使用logflush作为元素类型，logflush是纯虚类，不能实例化
+            std::vector<struct iovec> iov_;//RealFlush分散写时复用，只在异步线程中使用
+            bool ring_attached_ = false;//是否使用共享内存环，在asyncworker之前声明，OpenShmRing设置后不会被默认值覆盖
             mylog::AsyncWorker::ptr asyncworker;//启动异步工作器  
 
     };
@@ -1,31 +1,61 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <mutex>
 #include <thread>
 
-#include "AsyncBuffer.hpp"
+#include "Asyncbuffer.hpp"
+#include "ShmRing.hpp"
+#include "CrashHandler.hpp"
+#include "Affinity.hpp"
 
 /*
 AsyncWorker 是一个异步工作器类，主要用于实现生产者-消费者模式下的异步日志记录功能。
 (1)接收生产者线程推送的数据（如日志消息）;
 (2)将数据缓冲在内存中;
 (3)在适当的时机（缓冲区满或主动刷新时）将缓冲数据通过回调函数写入目标（如文件);
+(4)可选的共享内存环(ShmRing)：写入生产者缓冲区的数据同时镜像到环中，落地完成后再释放，进程崩溃后可以从环中找回未落地的日志;
+(5)两个缓冲区的位置和长度在锁内修改后同时发布到原子变量中，崩溃处理函数只读这些原子变量，不碰mtx_，不会死锁;
+(6)配置了backend_cpus/reserved_cpus时，消费者线程先绑核，再在本线程重新分配两个缓冲区，按first-touch落在本线程的NUMA节点;
+(7)缓冲区大小自适应：消费者按每批数据量的滑动平均提前调整缓冲区，空闲超过buffer_idle_ms后收缩并归还物理内存，
+   GetMetrics报告容量、常驻内存和扩缩容次数;
+(8)大日志体通过PushLarge以引用计数数据块的形式挂在缓冲区上，不拷贝；崩溃应急落地只写连续数据部分，不包含这些数据块;
+(9)高优先级通道：ERROR/FATAL通过PushUrgent写入另一对小缓冲区，消费者每次醒来先处理它，不用排在大批INFO数据后面；
+   要求落盘(durable)的日志，生产者一直等到落地回调(包括fdatasync)完成才返回，进程随后崩溃也不会丢;
 */
 
 namespace mylog
 {
     enum class AsyncType { ASYNC_SAFE, ASYNC_UNSAFE };//安全模式,即缓冲区满阻塞生产者;非安全模式则不阻塞生产者
     using functor=std::function<void(Buffer&)>;//别名
-    class Asyncbuffer{
+    using urgent_functor=std::function<void(Buffer&, bool durable)>;//高优先级通道的落地回调，durable表示需要落盘
+
+    // 异步工作器缓冲区的运行指标
+    struct BufferMetrics
+    {
+        size_t productor_capacity = 0;  // 生产者缓冲区容量
+        size_t consumer_capacity = 0;   // 消费者缓冲区容量
+        size_t resident_bytes = 0;      // 两个缓冲区实际占用的物理内存
+        bool huge_pages = false;        // 是否有缓冲区使用了大页
+        size_t batch_ewma = 0;          // 每批落地数据量的滑动平均
+        uint64_t grows = 0;             // 扩容次数(生产者写入时扩容 + 消费者提前扩容)
+        uint64_t shrinks = 0;           // 收缩次数
+        uint64_t idle_releases = 0;     // 空闲归还内存的次数
+    };
+    class AsyncWorker{
     public:
     using ptr=std::shared_ptr<AsyncWorker>;
-     AsyncWorker(const functor& cb, AsyncType async_type = AsyncType::ASYNC_SAFE)
+     AsyncWorker(const functor& cb, AsyncType async_type = AsyncType::ASYNC_SAFE,
+                 ShmRing::ptr ring = nullptr, const urgent_functor& urgent_cb = nullptr)
         : async_type_(async_type),
-          callback_(cb),
           stop_(false),
+          callback_(cb),
+          urgent_callback_(urgent_cb),
+          ring_(std::move(ring)),
           thread_(std::thread(&AsyncWorker::ThreadEntry, this)) {}//该线程持续运行，直到stop_被设置为true且所有的缓冲区数据被处理完毕
     ~AsyncWorker() { Stop(); }
      void Push(const char *data,size_t len)//生产者接口
@@ -35,47 +65,330 @@ namespace mylog
             cond_productor_.wait(lock, [&]() {
                 return len <= buffer_productor_.WriteableSize();
             });
+        if (len > buffer_productor_.WriteableSize())
+        {
+            grows_.fetch_add(1, std::memory_order_relaxed);
+            WithdrawProductor();
+        }
         buffer_productor_.Push(data,len);//生产数据
+        if (ring_)
+            ring_->Append(data, len);//镜像到共享内存环，崩溃后用于恢复
+        PublishProductor();
         cond_consumer_.notify_one();
      }
+
+    // 高优先级通道的生产者接口，没有设置urgent_cb时退化为普通的Push。
+    // 不镜像到共享内存环：这些日志很快就会落地，崩溃时由应急落地写出
+    void PushUrgent(const char *data, size_t len, bool durable)
+    {
+        if (!urgent_callback_)
+        {
+            Push(data, len);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (AsyncType::ASYNC_SAFE == async_type_)
+            cond_productor_.wait(lock, [&]() {
+                return len <= urgent_productor_.WriteableSize() || urgent_productor_.IsEmpty();
+            });
+        if (len > urgent_productor_.WriteableSize())
+            crash_urgent_len_.store(0, std::memory_order_release);//同WithdrawProductor
+        urgent_productor_.Push(data, len);
+        uint64_t seq = ++urgent_pushed_;
+        if (durable)
+            urgent_durable_ = true;
+        PublishUrgent();
+        cond_consumer_.notify_one();
+        if (durable)//等到这一条(以及它之前的高优先级日志)落盘
+            cond_urgent_done_.wait(lock, [&]() { return urgent_done_ >= seq || stop_; });
+    }
+
+    // 大日志的生产者接口：head和tail拷贝进缓冲区，body只保存引用，落地时三段按顺序写出。
+    // 安全模式下数据块的总量同样不超过缓冲区容量(缓冲区里没有别的数据块时总是放行，保证单条超大日志能写入)
+    void PushLarge(const std::string &head, std::shared_ptr<const char> body, size_t body_len, const std::string &tail)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        size_t inline_len = head.size() + tail.size();
+        if (AsyncType::ASYNC_SAFE == async_type_)
+            cond_productor_.wait(lock, [&]() {
+                return inline_len <= buffer_productor_.WriteableSize() &&
+                       (!buffer_productor_.HasExtents() ||
+                        buffer_productor_.ExtentBytes() + body_len <= buffer_productor_.Capacity());
+            });
+        if (inline_len > buffer_productor_.WriteableSize())
+        {
+            grows_.fetch_add(1, std::memory_order_relaxed);
+            WithdrawProductor();
+        }
+        buffer_productor_.Push(head.data(), head.size());
+        if (ring_)
+        {
+            ring_->Append(head.data(), head.size());
+            ring_->Append(body.get(), body_len);
+            ring_->Append(tail.data(), tail.size());
+        }
+        buffer_productor_.PushExtent(std::move(body), body_len);
+        buffer_productor_.Push(tail.data(), tail.size());
+        PublishProductor();
+        cond_consumer_.notify_one();
+    }
+
+    // 只在致命信号处理流程中调用：不加锁、不分配内存，把还没落地的数据按先后顺序直接写到fd
+    void EmergencyDump(int fd)
+    {
+        size_t urgent_len = crash_urgent_len_.load(std::memory_order_acquire);
+        if (urgent_len > 0)
+        {
+            CrashHandler::WriteStr(fd, "---- urgent buffer ----\n");
+            CrashHandler::WriteAll(fd, crash_urgent_data_.load(std::memory_order_acquire), urgent_len);
+        }
+        if (crash_consumer_busy_.load(std::memory_order_acquire))
+        {
+            CrashHandler::WriteStr(fd, "---- consumer buffer (may be partially written already) ----\n");
+            CrashHandler::WriteAll(fd, crash_consumer_data_.load(std::memory_order_acquire),
+                                   crash_consumer_len_.load(std::memory_order_acquire));
+        }
+        CrashHandler::WriteStr(fd, "---- producer buffer ----\n");
+        size_t productor_len = crash_productor_len_.load(std::memory_order_acquire);//先读长度，扩容期间为0，不会读到已失效的旧映射
+        if (productor_len > 0)
+            CrashHandler::WriteAll(fd, crash_productor_data_.load(std::memory_order_acquire), productor_len);
+    }
     
-    void stop(){
-        stop_=true;
+    BufferMetrics GetMetrics()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);//交换和空闲收缩在mtx_下进行
+        std::unique_lock<std::mutex> resize_lock(resize_mtx_);//消费者调整自己的缓冲区在resize_mtx_下进行
+        BufferMetrics m;
+        m.productor_capacity = buffer_productor_.Capacity();
+        m.consumer_capacity = buffer_consumer_.Capacity();
+        m.resident_bytes = buffer_productor_.ResidentBytes() + buffer_consumer_.ResidentBytes();
+        m.huge_pages = buffer_productor_.HugePages() || buffer_consumer_.HugePages();
+        m.batch_ewma = batch_ewma_;
+        m.grows = grows_.load(std::memory_order_relaxed);
+        m.shrinks = shrinks_.load(std::memory_order_relaxed);
+        m.idle_releases = idle_releases_.load(std::memory_order_relaxed);
+        return m;
+    }
+
+    void Stop(){
+        {
+            std::unique_lock<std::mutex> lock(mtx_);//在锁内修改，避免消费者检查完条件、还没睡下时错过通知
+            stop_=true;
+        }
         cond_consumer_.notify_all(); //所有线程把缓冲区内数据处理完就结束了
-        thread_.join();//线程加入执行
+        if (thread_.joinable())
+            thread_.join();//线程加入执行
     }
     private:
         
         void ThreadEntry()//工作线程执行入口
         {
+          PinAndLocalize();
           while(1)
           {
-            std::unique_lock<std::mutex>lock(mtx_);
-            if(buffer_productor_.IsEmpty()&&stop_) //有数据则交换（进行消费），无数据就阻塞
+            if (DrainUrgent())//每一轮先处理高优先级通道
+                continue;
+            uint64_t ring_mark = 0;
+            size_t batch = 0;
             {
-                 cond_consumer_.wait(lock, [&]() {
-                        return stop_ || !buffer_productor_.IsEmpty();});
+                std::unique_lock<std::mutex>lock(mtx_);
+                //有数据则交换（进行消费），无数据就阻塞；配置了buffer_idle_ms时最多等这么久，超时就收缩缓冲区
+                auto ready = [&]() { return stop_ || !buffer_productor_.IsEmpty() || !urgent_productor_.IsEmpty(); };
+                size_t idle_ms = Util::JsonData::GetJsonData()->buffer_idle_ms;
+                if (idle_ms > 0 && !idle_released_)
+                {
+                    if (!cond_consumer_.wait_for(lock, std::chrono::milliseconds(idle_ms), ready))
+                    {
+                        ReleaseIdle();
+                        continue;
+                    }
+                }
+                else
+                    cond_consumer_.wait(lock, ready);
+                if(!urgent_productor_.IsEmpty())
+                   continue;//回到开头先处理高优先级通道
+                if(stop_&&buffer_productor_.IsEmpty())
+                   return;//生产缓冲区空退出
+                idle_released_ = false;
                 buffer_productor_.Swap(buffer_consumer_);
-              if (async_type_ == AsyncType::ASYNC_SAFE)//在安全模式下，若生产者由于之前因缓冲区满而被阻塞就会唤醒
-                    cond_productor_.notify_one();
+                batch = buffer_consumer_.ReadableSize();
+                crash_consumer_data_.store(buffer_consumer_.Begin(), std::memory_order_relaxed);
+                crash_consumer_len_.store(buffer_consumer_.ReadableSize(), std::memory_order_relaxed);
+                crash_consumer_busy_.store(true, std::memory_order_release);
+                PublishProductor();
+                if (ring_)
+                    ring_mark = ring_->Head();//环中到这个位置为止的记录都在这一批里
+                if (async_type_ == AsyncType::ASYNC_SAFE)//在安全模式下，若生产者由于之前因缓冲区满而被阻塞就会唤醒
+                    cond_productor_.notify_all();
             }
-            callback_(buffer_consumer_);//回调函数，传入Buffer对象
+            callback_(buffer_consumer_);//回调函数，传入Buffer对象，落地期间不持有锁，生产者可以继续写
+            crash_consumer_busy_.store(false, std::memory_order_release);
             buffer_consumer_.Reset();
-            if(stop_&&buffer_productor_.IsEmpty())
-               return;//生产缓冲区空退出
+            AdaptBufferSize(batch);
+            if (ring_)
+            {
+                std::unique_lock<std::mutex>lock(mtx_);//callback_返回时这一批已经离开C库缓冲交给内核(见RealFlush)，释放环中对应的记录
+                ring_->MarkFlushed(ring_mark);
+            }
           }
         }
+        // 处理一次高优先级通道，没有数据时返回false。
+        // 普通批量正在落地时高优先级日志要等它写完(落地方向不是线程安全的)，但不会再排在下一批后面
+        bool DrainUrgent()
+        {
+            bool durable = false;
+            uint64_t seq = 0;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (urgent_productor_.IsEmpty())
+                    return false;
+                urgent_productor_.Swap(urgent_consumer_);
+                durable = urgent_durable_;
+                urgent_durable_ = false;
+                seq = urgent_pushed_;
+                PublishUrgent();
+                if (async_type_ == AsyncType::ASYNC_SAFE)
+                    cond_productor_.notify_all();
+            }
+            urgent_callback_(urgent_consumer_, durable);
+            urgent_consumer_.Reset();
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                urgent_done_ = seq;
+            }
+            cond_urgent_done_.notify_all();
+            return true;
+        }
+
         AsyncType async_type_;
         std::atomic<bool> stop_;  // 用于控制异步工作器的启动
         std::mutex mtx_;
         mylog::Buffer buffer_productor_;//分别定义消费者缓冲区和生产者缓冲区
         mylog::Buffer buffer_consumer_;
+        static constexpr size_t kUrgentBufferSize = 64 * 1024;
+        mylog::Buffer urgent_productor_{kUrgentBufferSize};//高优先级通道，只放ERROR/FATAL
+        mylog::Buffer urgent_consumer_{kUrgentBufferSize};
+        std::condition_variable cond_urgent_done_;//需要落盘的高优先级日志在此等待落地完成
+        uint64_t urgent_pushed_ = 0;//写入高优先级通道的条数，在mtx_下读写
+        uint64_t urgent_done_ = 0;//已经落地的条数
+        bool urgent_durable_ = false;//当前高优先级缓冲区中是否有需要落盘的日志
         std::condition_variable cond_productor_;
         std::condition_variable cond_consumer_;
-        std::thread thread_;
 
-        functor callback_;  // (使用绑定器定义类型的)回调函数，用来告知工作器如何落地
+        // 消费者缓冲区刚清空时调整它的容量(也是配置热加载后的安全点)，两次交换后两个缓冲区都会生效。
+        // 安全模式下容量就是阻塞上限，必须与buffer_size一致；
+        // 非安全模式下目标容量取每批数据量滑动平均的两倍(不小于buffer_size)：不够时提前扩容，避免生产者在锁内扩容；
+        // 超过目标四倍、且这么大的容量已经有buffer_idle_ms没有用上时收缩
+        void AdaptBufferSize(size_t batch)
+        {
+            const Util::JsonData *conf = Util::JsonData::GetJsonData();
+            size_t base = conf->buffer_size;
+            if (base == 0)
+                return;
+            std::unique_lock<std::mutex> lock(resize_mtx_);
+            batch_ewma_ = batch_ewma_ == 0 ? batch : (batch_ewma_ * 7 + batch) / 8;
+            size_t cap = buffer_consumer_.Capacity();
+            if (async_type_ == AsyncType::ASYNC_SAFE)
+            {
+                if (cap != base)
+                    buffer_consumer_.ResetCapacity(base);
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (batch * 4 > cap)
+                last_busy_ = now;
+            size_t target = std::max(base, 2 * batch_ewma_);
+            if (cap < target)
+            {
+                buffer_consumer_.ResetCapacity(target);
+                grows_.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (cap > 4 * target && now - last_busy_ >= std::chrono::milliseconds(conf->buffer_idle_ms))
+            {
+                buffer_consumer_.ResetCapacity(target);
+                shrinks_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // 在mtx_内调用，两个缓冲区都为空：非安全模式收缩回buffer_size，再把物理页还给内核，直到下次有数据前不再重复
+        void ReleaseIdle()
+        {
+            size_t base = Util::JsonData::GetJsonData()->buffer_size;
+            for (Buffer *buf : {&buffer_productor_, &buffer_consumer_})
+            {
+                if (async_type_ == AsyncType::ASYNC_UNSAFE && base != 0 && buf->Capacity() > base)
+                {
+                    buf->ResetCapacity(base);
+                    shrinks_.fetch_add(1, std::memory_order_relaxed);
+                }
+                buf->Release();
+            }
+            batch_ewma_ = 0;
+            idle_released_ = true;
+            idle_releases_.fetch_add(1, std::memory_order_relaxed);
+            PublishProductor();
+        }
+
+        // 绑核后由消费者线程自己重新分配缓冲区并逐页写一次，页面在本线程所在的节点上分配。
+        // 生产者已经写入数据时保留生产者缓冲区，只是这一块不在本节点上，不影响正确性
+        void PinAndLocalize()
+        {
+            const Util::JsonData *conf = Util::JsonData::GetJsonData();
+            std::vector<int> cpus = Affinity::CpusFor(conf->backend_cpus, conf->reserved_cpus);
+            if (cpus.empty() || !Affinity::PinCurrentThread(cpus))
+                return;
+            std::unique_lock<std::mutex> lock(mtx_);
+            buffer_consumer_.ResetCapacity(buffer_consumer_.Capacity());
+            buffer_consumer_.Prefault();
+            if (buffer_productor_.IsEmpty())
+            {
+                buffer_productor_.ResetCapacity(buffer_productor_.Capacity());
+                buffer_productor_.Prefault();
+                PublishProductor();
+            }
+        }
+
+        // 在mtx_内调用，把高优先级通道当前的可读区间发布给崩溃处理函数
+        void PublishUrgent()
+        {
+            crash_urgent_data_.store(urgent_productor_.Begin(), std::memory_order_relaxed);
+            crash_urgent_len_.store(urgent_productor_.ReadableSize(), std::memory_order_release);
+        }
 
+        // 在mtx_内调用，把生产者缓冲区当前的可读区间发布给崩溃处理函数
+        void PublishProductor()
+        {
+            crash_productor_data_.store(buffer_productor_.Begin(), std::memory_order_relaxed);
+            crash_productor_len_.store(buffer_productor_.ReadableSize(), std::memory_order_release);
+        }
+
+        // 在mtx_内、生产者缓冲区扩容之前调用：mremap可能把映射搬走，旧地址随即失效，
+        // 先撤下发布的区间，扩容并写入后由PublishProductor重新登记新地址
+        void WithdrawProductor()
+        {
+            crash_productor_len_.store(0, std::memory_order_release);
+        }
+
+        std::atomic<const char *> crash_productor_data_{nullptr};//崩溃时读取的缓冲区快照
+        std::atomic<size_t> crash_productor_len_{0};
+        std::atomic<const char *> crash_consumer_data_{nullptr};
+        std::atomic<size_t> crash_consumer_len_{0};
+        std::atomic<bool> crash_consumer_busy_{false};//消费者缓冲区是否正在落地
+        std::atomic<const char *> crash_urgent_data_{nullptr};
+        std::atomic<size_t> crash_urgent_len_{0};
+
+        std::mutex resize_mtx_;//消费者调整自己的缓冲区时持有，和GetMetrics互斥
+        size_t batch_ewma_ = 0;//每批数据量的滑动平均
+        std::chrono::steady_clock::time_point last_busy_ = std::chrono::steady_clock::now();//最近一次批量用到容量四分之一以上的时刻
+        bool idle_released_ = false;//空闲后已经归还过内存，在mtx_下读写
+        std::atomic<uint64_t> grows_{0};
+        std::atomic<uint64_t> shrinks_{0};
+        std::atomic<uint64_t> idle_releases_{0};
+
+        functor callback_;  // (使用绑定器定义类型的)回调函数，用来告知工作器如何落地
+        urgent_functor urgent_callback_; // 高优先级通道的落地回调，为空时不启用高优先级通道
+        ShmRing::ptr ring_; // 为空时不做崩溃镜像
+        std::thread thread_;// 放在最后，保证线程启动时其他成员都已初始化
 
     };
 }
@@ -1,38 +1,93 @@
 //设计日志的缓冲区类
 #pragma once
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<unistd.h>
+#include<algorithm>
 #include<cassert>
+#include<cstring>
+#include<memory>
+#include<new>
 #include<string>
 #include<vector>
 #include "Util.hpp"
 /*
 (1)环形缓冲区变种：通过 read_pos_ 和 write_pos_ 标记读写位置，实现高效数据流转。
-(2)动态扩容策略：根据配置参数（g_conf_data）自动调整缓冲区大小，平衡内存占用与性能。
-(3)线程安全性：代码本身未加锁，在外部（生产者-消费者模型中使用互斥锁）保证了多线程安全。
+(2)动态扩容策略：根据配置参数（当前的配置快照）自动调整缓冲区大小，阈值以下成倍扩容，阈值以上线性扩容；
+   何时收缩、提前扩到多大由AsyncWorker根据观察到的批量大小决定(见AsyncWorker::AdaptBufferSize)。
+(3)内存直接用mmap申请：扩容用mremap搬移页表而不拷贝数据；空闲时可以把物理页还给内核；
+   可以按配置huge_pages使用透明大页(thp)或预留的大页(explicit)，减少大块拷贝时的TLB缺失；用mincore统计常驻内存。
+(4)大日志体不拷贝进缓冲区：PushExtent只记录一个引用计数的数据块和它在连续数据中的插入位置，
+   落地时ToIovec把连续数据和这些数据块按顺序拼成iovec，由落地方向用writev一次写出。
+(5)线程安全性：代码本身未加锁，在外部（生产者-消费者模型中使用互斥锁）保证了多线程安全。
 */
 
-extern mylog::Util::JsonData *g_conf_data;
-
 namespace mylog{
     class Buffer{
         public:
           Buffer():write_pos_(0),read_pos_(0)//初始的缓冲区大小由配置文件决定
           {
-            buffer_.resize(g_conf_data->buffer_size);
+            Allocate(Util::JsonData::GetJsonData()->buffer_size);
+          }
+
+          explicit Buffer(size_t size):write_pos_(0),read_pos_(0)//指定初始大小，用于高优先级通道等小缓冲区
+          {
+            Allocate(size);
           }
 
+          ~Buffer()
+          {
+            Unmap(data_,map_size_);
+          }
+
+          Buffer(const Buffer &)=delete;
+          Buffer &operator=(const Buffer &)=delete;
+
           void Push(const char *data,size_t len)//生产者
           {
              ToBeEnough(len); // 确保容量足够
             // 开始写入
-            std::copy(data, data + len, &buffer_[write_pos_]);//将从data开始的长度为len的数据写入buffer_中
+            memcpy(data_+write_pos_,data,len);//将从data开始的长度为len的数据写入缓冲区中
             write_pos_ += len;//更新写的位置
-            
+
+          }
+
+          void PushExtent(std::shared_ptr<const char> data,size_t len)//在当前写位置插入一个外部数据块，只保存引用
+          {
+            extent_bytes_+=len;
+            extents_.push_back(Extent{write_pos_,std::move(data),len});
+          }
+
+          bool HasExtents()
+          {
+            return !extents_.empty();
+          }
+
+          size_t ExtentBytes()//外部数据块的总字节数，安全模式下也计入容量限制
+          {
+            return extent_bytes_;
+          }
+
+          // 把待读取的内容按顺序转成iovec：连续数据被外部数据块分成若干段
+          void ToIovec(std::vector<struct iovec> *iov)
+          {
+            iov->clear();
+            size_t pos=read_pos_;
+            for(auto &e:extents_)
+            {
+              if(e.offset>pos)
+                iov->push_back({data_+pos,e.offset-pos});
+              iov->push_back({const_cast<char*>(e.data.get()),e.len});
+              pos=std::max(pos,e.offset);
+            }
+            if(write_pos_>pos)
+              iov->push_back({data_+pos,write_pos_-pos});
           }
 
           char *ReadBegin(int len)
           {
              assert(len <= ReadableSize());
-             return &buffer_[read_pos_];
+             return data_+read_pos_;
           }
 
           bool IsEmpty()
@@ -42,13 +97,18 @@ namespace mylog{
 
           void Swap(Buffer &buf)//直接交换指针，减少磁盘IO
           {
-             buffer_.swap(buf.buffer_);//直接交换两个vector底层数据(指针,大小，容量等),不涉及数据的拷贝
+             std::swap(data_,buf.data_);//只交换映射的起始地址和大小，不涉及数据的拷贝
+             std::swap(capacity_,buf.capacity_);
+             std::swap(map_size_,buf.map_size_);
+             std::swap(huge_,buf.huge_);
              std::swap(read_pos_,buf.read_pos_);
              std::swap(write_pos_,buf.write_pos_);
+             extents_.swap(buf.extents_);
+             std::swap(extent_bytes_,buf.extent_bytes_);
           }
 
           size_t WriteableSize(){
-            return buffer_.size()-write_pos_;//写空间剩余的容量
+            return capacity_-write_pos_;//写空间剩余的容量
           }
 
           size_t ReadableSize()
@@ -57,7 +117,7 @@ namespace mylog{
           }
 
           const char *Begin(){
-            return &buffer_[read_pos_];//返回开始读取位置的指针
+            return data_+read_pos_;//返回开始读取位置的指针
           }
 
           void MoveWritePos(int len)//已经向缓冲区写入len字节的数据，更新可写空间
@@ -72,32 +132,179 @@ namespace mylog{
             read_pos_+=len;
           }
 
-          void Reset(){//重置
+          void Reset(){//重置，同时释放对外部数据块的引用
             write_pos_=0;
             read_pos_=0;
+            extents_.clear();
+            extent_bytes_=0;
+          }
+
+          size_t Capacity(){
+            return capacity_;
+          }
+
+          bool HugePages(){//是否使用了大页(透明大页或预留大页)
+            return huge_!=HugeMode::NONE;
+          }
+
+          void ResetCapacity(size_t size)//调整容量，只在缓冲区为空时调用，旧的映射整个归还
+          {
+            assert(IsEmpty());
+            char *old=data_;
+            size_t old_map_size=map_size_;
+            Allocate(size);
+            Unmap(old,old_map_size);
+            Reset();
+          }
+
+          void Release()//空闲时把物理页还给内核，容量不变，之后再写入时按需重新分配零页
+          {
+            assert(IsEmpty());
+            if(data_!=nullptr)
+              madvise(data_,map_size_,MADV_DONTNEED);
+          }
+
+          void Prefault()//由调用线程逐页写一次，按first-touch把物理页分配在调用线程所在的NUMA节点上
+          {
+            size_t page=PageSize();
+            for(size_t off=0;off<map_size_;off+=page)
+              data_[off]=0;
+          }
+
+          size_t ResidentBytes()//当前实际占用的物理内存
+          {
+            if(data_==nullptr)
+              return 0;
+            size_t page=PageSize();
+            std::vector<unsigned char> vec((map_size_+page-1)/page);
+            if(mincore(data_,map_size_,vec.data())==-1)
+              return 0;
+            size_t pages=0;
+            for(unsigned char v:vec)
+              pages+=v&1;
+            return pages*page;
           }
 
         protected:
+           enum class HugeMode{NONE,THP,EXPLICIT};
+           static constexpr size_t kHugePageSize=2*1024*1024;
+
+           static size_t PageSize()
+           {
+             static const size_t page=sysconf(_SC_PAGESIZE);
+             return page;
+           }
+
+           // 按配置huge_pages申请映射：explicit使用预留的大页，申请失败退回透明大页；thp只做madvise提示；
+           // 小于一个大页的缓冲区不使用大页。映射长度按页对齐，可用容量仍然是size，安全模式下的阻塞上限不变
+           void Allocate(size_t size)
+           {
+             data_=nullptr;
+             capacity_=map_size_=0;
+             huge_=HugeMode::NONE;
+             if(size==0)
+               return;
+             const std::string &mode=Util::JsonData::GetJsonData()->huge_pages;
+             bool large=size>=kHugePageSize;
+             if(large&&mode=="explicit")
+             {
+               size_t len=(size+kHugePageSize-1)&~(kHugePageSize-1);
+               void *p=mmap(nullptr,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+               if(p!=MAP_FAILED)
+               {
+                 data_=static_cast<char*>(p);
+                 capacity_=size;
+                 map_size_=len;
+                 huge_=HugeMode::EXPLICIT;
+                 return;
+               }
+             }
+             size_t len=(size+PageSize()-1)&~(PageSize()-1);
+             void *p=mmap(nullptr,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+             if(p==MAP_FAILED)
+             {
+               perror("mmap log buffer failed");
+               throw std::bad_alloc();
+             }
+             data_=static_cast<char*>(p);
+             capacity_=size;
+             map_size_=len;
+             if(large&&WantHugePages()&&madvise(data_,map_size_,MADV_HUGEPAGE)==0)
+               huge_=HugeMode::THP;
+           }
+
+           static bool WantHugePages()
+           {
+             const std::string &mode=Util::JsonData::GetJsonData()->huge_pages;
+             return mode=="thp"||mode=="explicit";
+           }
+
+           static void Unmap(char *data,size_t map_size)
+           {
+             if(data!=nullptr)
+               munmap(data,map_size);
+           }
 
            void ToBeEnough(size_t len)
            {
-            int buffersize=buffer_.size();
-            if(len>=WriteableSize())//容量不足，扩容
+            if(len<=WriteableSize())
+              return;
+            //容量不足，扩容：阈值以下成倍扩容，阈值以上线性扩容，都至少保证能放下这次的数据
+            const Util::JsonData *conf = Util::JsonData::GetJsonData();
+            size_t need=write_pos_+len;
+            size_t next=capacity_<conf->threshold ? 2*capacity_ : capacity_+conf->linear_growth;
+            Grow(std::max(need,next));
+           }
+
+           void Grow(size_t size)
+           {
+            if(size<=map_size_)//映射对齐多出来的部分就够用
             {
-              if(buffer_.size()<g_conf_data->threshold)
+              capacity_=size;
+              return;
+            }
+            if(data_!=nullptr&&huge_!=HugeMode::EXPLICIT)//普通页直接mremap，内核搬移页表，不拷贝数据
+            {
+              size_t len=(size+PageSize()-1)&~(PageSize()-1);
+              void *p=mremap(data_,map_size_,len,MREMAP_MAYMOVE);
+              if(p!=MAP_FAILED)
               {
-                buffer_.resize(2*buffer_.size()+buffersize);//成倍扩容
-
-              }
-              else{
-                buffer_.resize(g_conf_data->linear_growth+buffersize);//线性扩容
+                data_=static_cast<char*>(p);
+                capacity_=size;
+                map_size_=len;
+                if(huge_==HugeMode::NONE&&len>=kHugePageSize&&WantHugePages()&&madvise(data_,map_size_,MADV_HUGEPAGE)==0)
+                  huge_=HugeMode::THP;//扩容后才超过一个大页，补上提示
+                return;
               }
             }
+            char *old=data_;//预留大页或mremap失败时，申请新的映射并拷贝已有数据
+            size_t old_map_size=map_size_;
+            Allocate(size);
+            if(old!=nullptr)
+              memcpy(data_,old+read_pos_,write_pos_-read_pos_);
+            for(auto &e:extents_)//数据整体前移了read_pos_
+              e.offset-=std::min(e.offset,read_pos_);
+            write_pos_-=read_pos_;
+            read_pos_=0;
+            Unmap(old,old_map_size);
            }
-           std::vector<char>buffer_;
+
+           struct Extent
+           {
+             size_t offset;//插入位置，即写入时的write_pos_
+             std::shared_ptr<const char> data;
+             size_t len;
+           };
+
+           char *data_=nullptr;
+           size_t capacity_=0;//可用容量
+           size_t map_size_=0;//映射长度，按页(或大页)对齐
+           HugeMode huge_=HugeMode::NONE;
            size_t write_pos_;
            size_t read_pos_;
+           std::vector<Extent> extents_;//按插入位置有序
+           size_t extent_bytes_=0;
 
     };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Util.hpp"
+/*
+配置文件监视器：用inotify监视配置文件所在的目录，文件被改写(IN_CLOSE_WRITE)或被替换(IN_MOVED_TO，编辑器常用的
+先写临时文件再rename的方式)时调用 JsonData::Reload 发布新的配置快照，不需要重启进程。
+监视目录而不是文件本身，文件被rename替换后依然能收到通知。
+解析失败时保留原配置，所以写到一半的文件不会生效。线程阻塞在poll上，Stop时通过eventfd唤醒。
+*/
+namespace mylog
+{
+    class ConfigWatcher
+    {
+    public:
+        static ConfigWatcher &GetInstance()
+        {
+            static ConfigWatcher watcher;
+            return watcher;
+        }
+
+        // 开始监视配置文件，重复调用无效
+        bool Start(const std::string &path = Util::JsonData::ConfigPath())
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (thread_.joinable())
+                return true;
+            path_ = path;
+            std::string dir = Util::File::Path(path);
+            if (dir.empty())
+                dir = "./";
+            name_ = path.substr(dir.size());
+
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ == -1)
+            {
+                std::cout << __FILE__ << __LINE__ << "inotify_init failed" << std::endl;
+                perror(NULL);
+                return false;
+            }
+            if (inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+            {
+                std::cout << __FILE__ << __LINE__ << "watch config dir failed " << dir << std::endl;
+                perror(NULL);
+                close(inotify_fd_);
+                inotify_fd_ = -1;
+                return false;
+            }
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wake_fd_ == -1)
+            {
+                perror("eventfd failed");
+                close(inotify_fd_);
+                inotify_fd_ = -1;
+                return false;
+            }
+            thread_ = std::thread(&ConfigWatcher::ThreadEntry, this);
+            return true;
+        }
+
+        void Stop()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!thread_.joinable())
+                return;
+            uint64_t one = 1;
+            if (write(wake_fd_, &one, sizeof(one)) == -1)
+                perror("wake config watcher failed");
+            thread_.join();
+            close(inotify_fd_);
+            close(wake_fd_);
+            inotify_fd_ = wake_fd_ = -1;
+        }
+
+    private:
+        ConfigWatcher() = default;
+        ~ConfigWatcher() { Stop(); }
+
+        void ThreadEntry()
+        {
+            alignas(struct inotify_event) char buf[4096];
+            struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+            while (true)
+            {
+                if (poll(fds, 2, -1) == -1)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    perror("config watcher poll failed");
+                    return;
+                }
+                if (fds[1].revents & POLLIN)
+                    return;
+                bool changed = false;
+                ssize_t n;
+                while ((n = read(inotify_fd_, buf, sizeof(buf))) > 0) // 一次把积压的事件读完，合并成一次重载
+                {
+                    for (char *p = buf; p < buf + n;)
+                    {
+                        struct inotify_event *ev = reinterpret_cast<struct inotify_event *>(p);
+                        if (ev->len > 0 && name_ == ev->name)
+                            changed = true;
+                        p += sizeof(struct inotify_event) + ev->len;
+                    }
+                }
+                if (changed)
+                {
+                    if (Util::JsonData::Reload(path_))
+                        std::cout << __FILE__ << __LINE__ << "config reloaded, version "
+                                  << Util::JsonData::GetJsonData()->version << std::endl;
+                    else
+                        std::cout << __FILE__ << __LINE__ << "config reload failed, keep current config" << std::endl;
+                }
+            }
+        }
+
+        std::mutex mtx_;
+        std::thread thread_;
+        std::string path_;
+        std::string name_;
+        int inotify_fd_ = -1;
+        int wake_fd_ = -1;
+    };
+} // namespace mylog
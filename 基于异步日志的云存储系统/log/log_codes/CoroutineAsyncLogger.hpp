@@ -1,55 +1,206 @@
 #pragma once
 #include <coroutine>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <future>
-#include <queue>
+#include <iomanip>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string>
-#include <vector>
-#include <chrono>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <utility>
+#include <vector>
 
+/*
+基于C++20协程的异步日志器(事件驱动):
+(1)CoroutineScheduler: 固定数量的工作线程 + 运行队列，被唤醒的协程句柄放入运行队列由工作线程resume，队列为空时线程阻塞在条件变量上，空闲不占CPU;
+(2)CoroutineBuffer: 缓冲区满时生产者协程挂起在"有空间"等待队列上，缓冲区空时消费者协程挂起在"有数据"等待队列上，
+   对端操作完成后把等待者投递给调度器，做到恰好在有空间/有数据时被唤醒，没有轮询和sleep;
+(3)Task<T>: 惰性启动的协程任务，co_await时通过对称转移(symmetric transfer)启动，结束时恢复等待它的协程。
+*/
 namespace mylog {
 namespace coroutine {
 
-// 协程任务类型
+// 协程调度器
+class CoroutineScheduler {
+public:
+    static CoroutineScheduler& getInstance() {
+        static CoroutineScheduler instance;
+        return instance;
+    }
+
+    // 启动工作线程，重复调用无效；未显式启动时第一次投递会按CPU核数启动
+    void start(size_t thread_count = std::thread::hardware_concurrency()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        start_locked(thread_count);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+    // 把可以继续执行的协程放入运行队列
+    void post(std::coroutine_handle<> h) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (workers_.empty()) {
+                start_locked(std::thread::hardware_concurrency());
+            }
+            run_queue_.push_back(h);
+        }
+        cv_.notify_one();
+    }
+
+    // co_await schedule() 把当前协程切换到调度器的工作线程上继续执行
+    auto schedule() {
+        struct ScheduleAwaiter {
+            CoroutineScheduler* scheduler;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { scheduler->post(h); }
+            void await_resume() const noexcept {}
+        };
+        return ScheduleAwaiter{this};
+    }
+
+    // 让出执行权，排到运行队列末尾
+    auto yield() { return schedule(); }
+
+private:
+    CoroutineScheduler() = default;
+    ~CoroutineScheduler() { stop(); }
+
+    void start_locked(size_t thread_count) {
+        if (!workers_.empty()) {
+            return;
+        }
+        stop_ = false;
+        thread_count = std::max<size_t>(thread_count, 1);
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers_.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    void worker_loop() {
+        for (;;) {
+            std::coroutine_handle<> h;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || !run_queue_.empty(); });
+                if (stop_ && run_queue_.empty()) {
+                    return;
+                }
+                h = run_queue_.front();
+                run_queue_.pop_front();
+            }
+            h.resume();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::coroutine_handle<>> run_queue_;
+    std::vector<std::thread> workers_;
+    bool stop_ = false;
+};
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation_;
+    std::exception_ptr exception_;
+    bool detached_ = false;
+
+    // 结束时：被detach的任务自行销毁；否则恢复等待它的协程
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            PromiseBase& promise = h.promise();
+            if (promise.detached_) {
+                h.destroy();
+                return std::noop_coroutine();
+            }
+            if (promise.continuation_) {
+                return promise.continuation_;
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() {
+        exception_ = std::current_exception();
+        if (detached_) {
+            std::cerr << "detached coroutine task exited with exception" << std::endl;
+        }
+    }
+};
+
 template<typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value_;
+    void return_value(T val) { value_ = std::move(val); }
+    T result() {
+        if (exception_) {
+            std::rethrow_exception(exception_);
+        }
+        return std::move(*value_);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    void return_void() noexcept {}
+    void result() {
+        if (exception_) {
+            std::rethrow_exception(exception_);
+        }
+    }
+};
+
+} // namespace detail
+
+// 协程任务类型
+template<typename T = void>
 class Task {
 public:
-    struct promise_type {
-        T value;
-        std::exception_ptr exception;
-        
+    struct promise_type : detail::Promise<T> {
         Task get_return_object() {
             return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
         }
-        
-        std::suspend_never initial_suspend() { return {}; }
-        std::suspend_never final_suspend() noexcept { return {}; }
-        
-        void return_value(T val) {
-            value = std::move(val);
-        }
-        
-        void unhandled_exception() {
-            exception = std::current_exception();
-        }
     };
-    
+
     using handle_type = std::coroutine_handle<promise_type>;
-    
-    Task(handle_type h) : handle_(h) {}
-    
+
+    Task() = default;
+    explicit Task(handle_type h) : handle_(h) {}
+
     ~Task() {
         if (handle_) {
             handle_.destroy();
         }
     }
-    
+
     Task(const Task&) = delete;
     Task& operator=(const Task&) = delete;
-    
+
     Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
     Task& operator=(Task&& other) noexcept {
         if (this != &other) {
@@ -60,190 +211,293 @@ public:
         }
         return *this;
     }
-    
+
+    // co_await task: 记录等待者并转移到task执行，task结束时恢复等待者
+    auto operator co_await() && noexcept {
+        struct TaskAwaiter {
+            handle_type handle;
+            bool await_ready() const noexcept { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation_ = awaiting;
+                return handle;
+            }
+            T await_resume() { return handle.promise().result(); }
+        };
+        return TaskAwaiter{handle_};
+    }
+
+    // 在当前线程启动任务并放弃所有权，任务结束后自行销毁
+    void detach() && {
+        handle_type h = std::exchange(handle_, {});
+        h.promise().detached_ = true;
+        h.resume();
+    }
+
     T get() {
-        if (handle_.promise().exception) {
-            std::rethrow_exception(handle_.promise().exception);
-        }
-        return std::move(handle_.promise().value);
+        return handle_.promise().result();
     }
-    
+
     bool is_ready() const {
-        return handle_.done();
+        return !handle_ || handle_.done();
     }
-    
+
 private:
     handle_type handle_;
 };
 
-// 异步等待器
-class AsyncAwaiter {
-public:
-    AsyncAwaiter(std::chrono::milliseconds delay = std::chrono::milliseconds(1))
-        : delay_(delay) {}
-    
-    bool await_ready() const noexcept { return false; }
-    
-    void await_suspend(std::coroutine_handle<> h) {
-        // 在延迟后恢复协程
-        std::thread([h, delay = delay_]() {
-            std::this_thread::sleep_for(delay);
-            h.resume();
-        }).detach();
-    }
-    
-    void await_resume() noexcept {}
-    
-private:
-    std::chrono::milliseconds delay_;
+namespace detail {
+
+template<typename T>
+struct SyncWaitState {
+    std::promise<T> promise;
 };
 
-// 协程调度器
-class CoroutineScheduler {
-public:
-    static CoroutineScheduler& getInstance() {
-        static CoroutineScheduler instance;
-        return instance;
-    }
-    
-    template<typename F>
-    auto schedule(F&& func) -> Task<void> {
-        co_await AsyncAwaiter();
-        func();
-        co_return;
-    }
-    
-    void yield() {
-        return AsyncAwaiter();
+// 参数按引用保存在协程帧中，sync_wait 阻塞到结束，所以引用始终有效
+template<typename T>
+Task<void> sync_wait_impl(Task<T>& task, SyncWaitState<T>& state) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await std::move(task);
+            state.promise.set_value();
+        } else {
+            state.promise.set_value(co_await std::move(task));
+        }
+    } catch (...) {
+        state.promise.set_exception(std::current_exception());
     }
-    
-private:
-    CoroutineScheduler() = default;
-};
+}
+
+} // namespace detail
+
+// 在普通线程中启动协程任务并阻塞等待其结果
+template<typename T>
+T sync_wait(Task<T> task) {
+    detail::SyncWaitState<T> state;
+    auto future = state.promise.get_future();
+    detail::sync_wait_impl(task, state).detach();
+    return future.get();
+}
 
 // 协程缓冲区
 class CoroutineBuffer {
 public:
-    CoroutineBuffer(size_t initial_size = 8192) 
+    CoroutineBuffer(size_t initial_size = 8192)
         : buffer_(initial_size), write_pos_(0), read_pos_(0) {}
-    
-    Task<void> push_async(const std::string& data) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        
-        // 如果缓冲区空间不足，等待消费者消费
-        while (write_pos_ + data.size() > buffer_.size()) {
-            co_await AsyncAwaiter(std::chrono::milliseconds(1));
-            expand_if_needed(data.size());
-        }
-        
-        // 写入数据
-        std::copy(data.begin(), data.end(), buffer_.begin() + write_pos_);
-        write_pos_ += data.size();
-        
-        // 通知消费者
-        cv_.notify_one();
-        co_return;
+
+    // 尝试直接写入，缓冲区空间不足时返回false；已关闭时丢弃数据并返回true
+    bool try_push(const std::string& data) {
+        std::coroutine_handle<> consumer;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_) {
+                return true;
+            }
+            if (write_pos_ + data.size() > buffer_.size()) {
+                if (write_pos_ != read_pos_) {
+                    return false;
+                }
+                expand_if_needed(data.size()); // 单条数据比整个缓冲区还大时扩容
+            }
+            std::copy(data.begin(), data.end(), buffer_.begin() + write_pos_);
+            write_pos_ += data.size();
+            consumer = take_one(pop_waiters_);
+        }
+        resume_later(consumer); // 唤醒等待数据的消费者
+        return true;
     }
-    
+
+    Task<void> push_async(std::string data) {
+        // 如果缓冲区空间不足，挂起到消费者取走数据为止
+        while (!try_push(data)) {
+            co_await SpaceAwaiter{*this, data.size()};
+        }
+    }
+
+    // 取走当前全部数据；缓冲区已关闭且没有数据时返回空串
     Task<std::string> pop_async() {
-        std::unique_lock<std::mutex> lock(mutex_);
-        
-        // 等待数据可用
-        while (write_pos_ == read_pos_) {
-            cv_.wait(lock);
-            co_await AsyncAwaiter(std::chrono::milliseconds(1));
-        }
-        
-        // 读取数据
-        std::string result(buffer_.begin() + read_pos_, buffer_.begin() + write_pos_);
-        read_pos_ = write_pos_ = 0; // 重置缓冲区
-        
+        std::string result;
+        while (!try_pop(result)) {
+            if (is_closed()) {
+                co_return std::string();
+            }
+            co_await DataAwaiter{*this};
+        }
         co_return result;
     }
-    
+
+    bool try_pop(std::string& out) {
+        std::deque<std::coroutine_handle<>> producers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (write_pos_ == read_pos_) {
+                return false;
+            }
+            out.assign(buffer_.begin() + read_pos_, buffer_.begin() + write_pos_);
+            read_pos_ = write_pos_ = 0; // 重置缓冲区
+            producers.swap(push_waiters_);
+        }
+        for (auto h : producers) { // 唤醒所有等待空间的生产者
+            resume_later(h);
+        }
+        return true;
+    }
+
+    // 关闭缓冲区，唤醒所有等待者；之后的写入会被丢弃，读取在取完剩余数据后返回空串
+    void close() {
+        std::deque<std::coroutine_handle<>> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            waiters.swap(push_waiters_);
+            for (auto h : pop_waiters_) {
+                waiters.push_back(h);
+            }
+            pop_waiters_.clear();
+        }
+        for (auto h : waiters) {
+            resume_later(h);
+        }
+    }
+
     bool empty() const {
         std::lock_guard<std::mutex> lock(mutex_);
         return write_pos_ == read_pos_;
     }
-    
+
+    bool is_closed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_;
+    }
+
 private:
+    // 等待"有空间"，挂起前在锁内复查条件，避免丢失唤醒
+    struct SpaceAwaiter {
+        CoroutineBuffer& buffer;
+        size_t len;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> lock(buffer.mutex_);
+            if (buffer.closed_ || buffer.write_pos_ + len <= buffer.buffer_.size() ||
+                buffer.write_pos_ == buffer.read_pos_) {
+                return false; // 条件已满足，不挂起
+            }
+            buffer.push_waiters_.push_back(h);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // 等待"有数据"
+    struct DataAwaiter {
+        CoroutineBuffer& buffer;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> lock(buffer.mutex_);
+            if (buffer.closed_ || buffer.write_pos_ != buffer.read_pos_) {
+                return false;
+            }
+            buffer.pop_waiters_.push_back(h);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    static std::coroutine_handle<> take_one(std::deque<std::coroutine_handle<>>& waiters) {
+        if (waiters.empty()) {
+            return {};
+        }
+        auto h = waiters.front();
+        waiters.pop_front();
+        return h;
+    }
+
+    // 被唤醒的协程交给调度器的工作线程恢复，不在当前线程内联执行
+    static void resume_later(std::coroutine_handle<> h) {
+        if (h) {
+            CoroutineScheduler::getInstance().post(h);
+        }
+    }
+
     void expand_if_needed(size_t required_size) {
         if (write_pos_ + required_size > buffer_.size()) {
             buffer_.resize(std::max(buffer_.size() * 2, write_pos_ + required_size));
         }
     }
-    
+
     mutable std::mutex mutex_;
-    std::condition_variable cv_;
     std::vector<char> buffer_;
     size_t write_pos_;
     size_t read_pos_;
+    bool closed_ = false;
+    std::deque<std::coroutine_handle<>> push_waiters_; // 等待空间的生产者
+    std::deque<std::coroutine_handle<>> pop_waiters_;  // 等待数据的消费者
 };
 
 // 协程版本的异步日志器
 class CoroutineAsyncLogger {
 public:
-    CoroutineAsyncLogger(const std::string& name, 
-                        std::vector<std::function<void(const std::string&)>> flushers)
-        : name_(name), flushers_(std::move(flushers)), running_(true) {
-        // 启动消费者协程
-        consumer_task_ = start_consumer();
+    CoroutineAsyncLogger(const std::string& name,
+                        std::vector<std::function<void(const std::string&)>> flushers,
+                        size_t buffer_size = 4 * 1024 * 1024)
+        : name_(name), flushers_(std::move(flushers)), buffer_(buffer_size) {
+        // 启动消费者协程，它在调度器的工作线程上运行，没有数据时挂起
+        consumer_done_ = consumer_exit_.get_future();
+        start_consumer().detach();
     }
-    
+
     ~CoroutineAsyncLogger() {
-        running_ = false;
-        // 这里应该等待协程完成，但为了简化示例代码省略
+        // 关闭缓冲区会唤醒消费者，它把剩余数据落地后退出
+        buffer_.close();
+        consumer_done_.wait();
     }
-    
+
     Task<void> log_async(const std::string& level, const std::string& message) {
-        std::string formatted = format_message(level, message);
-        co_await buffer_.push_async(formatted);
+        co_await buffer_.push_async(format_message(level, message));
     }
-    
-    // 同步接口（内部使用协程）
+
+    // 同步接口：有空间时直接写入，缓冲区满时阻塞到消费者腾出空间，保证同一线程内的日志顺序
     void log(const std::string& level, const std::string& message) {
-        auto task = log_async(level, message);
-        // 在实际实现中，这里应该有更好的方式来处理协程
-        // 这里简化为直接调用
+        std::string formatted = format_message(level, message);
+        if (!buffer_.try_push(formatted)) {
+            sync_wait(buffer_.push_async(std::move(formatted)));
+        }
     }
-    
+
 private:
     Task<void> start_consumer() {
-        while (running_) {
-            if (!buffer_.empty()) {
-                auto data = co_await buffer_.pop_async();
-                
-                // 异步刷盘
-                for (auto& flusher : flushers_) {
-                    co_await CoroutineScheduler::getInstance().schedule([&]() {
-                        flusher(data);
-                    });
-                }
+        co_await CoroutineScheduler::getInstance().schedule();
+        for (;;) {
+            std::string data = co_await buffer_.pop_async();
+            if (data.empty()) {
+                break; // 已关闭且数据已取完
+            }
+            for (auto& flusher : flushers_) {
+                flusher(data);
             }
-            
-            // 让出执行权，避免busy waiting
-            co_await AsyncAwaiter(std::chrono::milliseconds(10));
         }
+        consumer_exit_.set_value();
     }
-    
+
     std::string format_message(const std::string& level, const std::string& message) {
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
-        
+        struct tm t;
+        localtime_r(&time_t, &t);
+
         std::ostringstream oss;
-        oss << "[" << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S") << "] "
+        oss << "[" << std::put_time(&t, "%Y-%m-%d %H:%M:%S") << "] "
             << "[" << level << "] "
             << "[" << name_ << "] "
             << message << std::endl;
-        
+
         return oss.str();
     }
-    
+
     std::string name_;
     std::vector<std::function<void(const std::string&)>> flushers_;
     CoroutineBuffer buffer_;
-    std::atomic<bool> running_;
-    Task<void> consumer_task_;
+    std::promise<void> consumer_exit_;
+    std::future<void> consumer_done_;
 };
 
 } // namespace coroutine
@@ -6,6 +6,7 @@
  * 1. 使用更轻量级的协程调度替代线程池
  * 2. 简化异步操作的复杂度
  * 3. 更好的资源管理
+ * 4. 批量提交模式(SubmitMode::Batched)：日志挂到无锁链表上整批写入，只在需要时创建future
  */
 
 #pragma once
@@ -24,6 +25,8 @@
 #include <iomanip>
 #include <unordered_map>
 #include <iostream>
+#include "TimerWheel.hpp"
+#include "Affinity.hpp"
 
 namespace mylog {
 namespace coroutine_style {
@@ -83,31 +86,57 @@ public:
         return future;
     }
     
-    // 延迟执行任务
+    // 投递任务但不关心结果，不创建promise/future
+    void post(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            task_queue_.push(std::move(task));
+        }
+        condition_.notify_one();
+    }
+    
+    // 延迟执行任务：由时间轮计时，到期后投递给工作线程执行，不再为每个任务创建线程。
+    // 调度器没有运行时在定时器线程中执行；stop时还没到期的任务被丢弃，future得到broken_promise
     template<typename F>
     auto async_execute_delayed(F&& func, std::chrono::milliseconds delay) -> std::future<void> {
         auto promise = std::make_shared<std::promise<void>>();
         auto future = promise->get_future();
         
-        std::thread([func = std::forward<F>(func), promise, delay]() {
-            std::this_thread::sleep_for(delay);
+        schedule_delayed([func = std::forward<F>(func), promise]() mutable {
             try {
                 func();
                 promise->set_value();
             } catch (...) {
                 promise->set_exception(std::current_exception());
             }
-        }).detach();
+        }, delay);
         
         return future;
     }
     
-    // 启动调度器
-    void start(size_t thread_count = std::thread::hardware_concurrency()) {
+    // 可取消的延迟任务，适合周期刷盘、重试退避这类可能被撤销的定时操作。
+    // 时间轮和任务队列都存放std::function，要求可拷贝，这里把可调用对象放到shared_ptr里，只移动的lambda也能传进来
+    template<typename F>
+    TimerWheel::TimerId schedule_delayed(F&& func, std::chrono::milliseconds delay) {
+        auto holder = std::make_shared<typename std::decay<F>::type>(std::forward<F>(func));
+        return timer_wheel_.Schedule(delay, [this, holder]() {
+            post_or_run([holder]() { (*holder)(); });
+        });
+    }
+    
+    // 取消尚未到期的延迟任务，已经投递执行的返回false
+    bool cancel_delayed(TimerWheel::TimerId id) {
+        return timer_wheel_.Cancel(id);
+    }
+    
+    // 启动调度器，cpus不为空时工作线程绑定到这些CPU上
+    void start(size_t thread_count = std::thread::hardware_concurrency(), std::vector<int> cpus = {}) {
         stop_ = false;
         for (size_t i = 0; i < thread_count; ++i) {
-            workers_.emplace_back([this]() {
-                while (!stop_) {
+            workers_.emplace_back([this, cpus]() {
+                Affinity::PinCurrentThread(cpus);
+                // 停止后先把队列中剩下的任务执行完再退出，已经投递的任务不会丢
+                for (;;) {
                     Task task;
                     {
                         std::unique_lock<std::mutex> lock(queue_mutex_);
@@ -126,8 +155,9 @@ public:
         }
     }
     
-    // 停止调度器
+    // 停止调度器，时间轮一起停止：未到期的延迟任务被丢弃，对应的future得到broken_promise
     void stop() {
+        timer_wheel_.Stop();
         {
             std::lock_guard<std::mutex> lock(queue_mutex_);
             stop_ = true;
@@ -142,13 +172,31 @@ public:
     
 private:
     TaskScheduler() = default;
-    ~TaskScheduler() { stop(); }
+    ~TaskScheduler() {
+        stop();
+    }
+    
+    // 到期的延迟任务：调度器在运行时投递给工作线程，从未start或已经stop时直接在定时器线程中执行，
+    // 否则任务留在没有人取的队列里，async_execute_delayed返回的future永远不会就绪
+    void post_or_run(Task task) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            if (!stop_) {
+                task_queue_.push(std::move(task));
+                lock.unlock();
+                condition_.notify_one();
+                return;
+            }
+        }
+        task();
+    }
     
     std::queue<Task> task_queue_;
     std::mutex queue_mutex_;
     std::condition_variable condition_;
     std::vector<std::thread> workers_;
-    std::atomic<bool> stop_{false};
+    std::atomic<bool> stop_{true}; // 调用start之前没有工作线程，和停止状态相同
+    TimerWheel timer_wheel_;
 };
 
 // 协程风格的异步缓冲区
@@ -160,54 +208,64 @@ public:
     // 异步写入数据
     std::future<void> push_async(const std::string& data) {
         return TaskScheduler::getInstance().async_execute([this, data]() {
-            std::unique_lock<std::mutex> lock(mutex_);
-            
-            // 等待空间可用
-            write_cv_.wait(lock, [this, &data]() {
-                return write_pos_ + data.size() <= buffer_.size() || !running_;
-            });
-            
-            if (!running_) return;
-            
-            // 扩展缓冲区如果需要
-            if (write_pos_ + data.size() > buffer_.size()) {
-                buffer_.resize(std::max(buffer_.size() * 2, write_pos_ + data.size()));
-            }
-            
-            // 写入数据
-            std::copy(data.begin(), data.end(), buffer_.begin() + write_pos_);
-            write_pos_ += data.size();
-            
-            // 通知读取者
-            read_cv_.notify_one();
+            push(data.data(), data.size());
         });
     }
     
+    // 同步写入数据，空间不足时阻塞到消费者取走数据
+    void push(const char* data, size_t len) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        
+        // 等待空间可用；缓冲区为空时即使放不下也直接扩容，否则超大的数据会一直等下去
+        write_cv_.wait(lock, [this, len]() {
+            return write_pos_ + len <= buffer_.size() || write_pos_ == read_pos_ || !running_;
+        });
+        
+        if (!running_) return;
+        
+        // 扩展缓冲区如果需要
+        if (write_pos_ + len > buffer_.size()) {
+            buffer_.resize(std::max(buffer_.size() * 2, write_pos_ + len));
+        }
+        
+        // 写入数据
+        std::copy(data, data + len, buffer_.begin() + write_pos_);
+        write_pos_ += len;
+        
+        // 通知读取者
+        read_cv_.notify_one();
+    }
+    
     // 异步读取数据
     std::future<std::string> pop_async() {
         return TaskScheduler::getInstance().async_execute([this]() -> std::string {
-            std::unique_lock<std::mutex> lock(mutex_);
-            
-            // 等待数据可用
-            read_cv_.wait(lock, [this]() {
-                return write_pos_ > read_pos_ || !running_;
-            });
-            
-            if (!running_ && write_pos_ == read_pos_) {
-                return "";
-            }
-            
-            // 读取数据
-            std::string result(buffer_.begin() + read_pos_, buffer_.begin() + write_pos_);
-            reset_buffer();
-            
-            // 通知写入者
-            write_cv_.notify_one();
-            
-            return result;
+            return pop();
         });
     }
     
+    // 同步读取数据，没有数据时阻塞
+    std::string pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        
+        // 等待数据可用
+        read_cv_.wait(lock, [this]() {
+            return write_pos_ > read_pos_ || !running_;
+        });
+        
+        if (!running_ && write_pos_ == read_pos_) {
+            return "";
+        }
+        
+        // 读取数据
+        std::string result(buffer_.begin() + read_pos_, buffer_.begin() + write_pos_);
+        reset_buffer();
+        
+        // 通知写入者，缓冲区已清空，所有等待的写入者都可能放得下
+        write_cv_.notify_all();
+        
+        return result;
+    }
+    
     void stop() {
         {
             std::lock_guard<std::mutex> lock(mutex_);
@@ -232,14 +290,21 @@ private:
     std::atomic<bool> running_{true};
 };
 
+// 日志提交方式
+enum class SubmitMode {
+    PerMessage, // 每条日志向调度器提交一个任务
+    Batched     // 日志先挂到无锁链表上，由一个drain任务整批写入缓冲区
+};
+
 // 协程风格的异步日志器
 class CoroutineStyleAsyncLogger {
 public:
     using FlushFunction = std::function<void(const std::string&)>;
     
     CoroutineStyleAsyncLogger(const std::string& name, 
-                             std::vector<FlushFunction> flushers)
-        : name_(name), flushers_(std::move(flushers)), running_(true) {
+                             std::vector<FlushFunction> flushers,
+                             SubmitMode mode = SubmitMode::PerMessage)
+        : name_(name), flushers_(std::move(flushers)), mode_(mode), running_(true) {
         
         // 启动异步消费者
         start_consumer();
@@ -247,22 +312,45 @@ public:
     
     ~CoroutineStyleAsyncLogger() {
         stop();
+        // stop之后才提交的日志已经没有drain任务处理，直接释放
+        PendingNode* list = pending_.exchange(nullptr, std::memory_order_acquire);
+        while (list) {
+            PendingNode* next = list->next;
+            delete list;
+            list = next;
+        }
     }
     
     // 异步日志写入
     std::future<void> log_async(const std::string& level, const std::string& message) {
-        if (!running_) {
+        if (!enter()) {
             auto promise = std::promise<void>();
             promise.set_value();
             return promise.get_future();
         }
         
         std::string formatted = format_message(level, message);
-        return buffer_.push_async(formatted);
+        if (mode_ == SubmitMode::Batched) {
+            // 只有调用方需要完成信号时才创建promise，写入缓冲区后由drain任务兑现
+            auto node = new PendingNode{std::move(formatted), std::make_unique<std::promise<void>>(), nullptr};
+            auto future = node->done->get_future();
+            submit(node);
+            leave();
+            return future;
+        }
+        auto future = buffer_.push_async(formatted);
+        leave();
+        return future;
     }
     
     // 同步日志写入接口
     void log(const std::string& level, const std::string& message) {
+        if (mode_ == SubmitMode::Batched) {
+            if (!enter()) return;
+            submit(new PendingNode{format_message(level, message), nullptr, nullptr});
+            leave();
+            return;
+        }
         auto future = log_async(level, message);
         // 对于同步接口，我们可以选择等待或者不等待
         // 这里为了性能，选择不等待
@@ -276,34 +364,112 @@ public:
     void fatal(const std::string& message) { log("FATAL", message); }
     
     void stop() {
-        running_ = false;
+        running_.store(false, std::memory_order_seq_cst);
+        // 等待正在提交的生产者退出、已经提交的drain任务把链表上的日志写入缓冲区，之后不会再有任务访问this
+        while (inflight_.load(std::memory_order_seq_cst) != 0) {
+            std::this_thread::yield();
+        }
         buffer_.stop();
+        // 等待消费者把剩余数据落地后退出
+        if (consumer_done_.valid()) {
+            consumer_done_.wait();
+        }
     }
     
 private:
+    // 批量模式下等待写入缓冲区的一条日志
+    struct PendingNode {
+        std::string data;
+        std::unique_ptr<std::promise<void>> done; // 只有log_async才会设置
+        PendingNode* next;
+    };
+    
+    // 生产者先登记再检查running_，和stop()先清running_再读计数是store-buffering的形状，两边都用seq_cst：
+    // 要么生产者看到已停止而撤销登记，要么stop()看到登记并等它离开。先检查后登记的话，
+    // 生产者可能在stop()读到0之后才登记，接着访问已经析构的对象
+    bool enter() {
+        inflight_.fetch_add(1, std::memory_order_seq_cst);
+        if (running_.load(std::memory_order_seq_cst)) {
+            return true;
+        }
+        leave();
+        return false;
+    }
+    
+    void leave() {
+        inflight_.fetch_sub(1, std::memory_order_release);
+    }
+    
+    // 多生产者无锁入链表，只有链表上没有待处理的drain任务时才向调度器提交一个。
+    // 入链表(写pending_)后读drain_pending_，和drain中写drain_pending_后读pending_是store-buffering的形状，
+    // 两边都必须是seq_cst，否则双方可能都读到旧值：submit以为drain还在，drain以为链表已空，这条日志就没人处理了
+    void submit(PendingNode* node) {
+        node->next = pending_.load(std::memory_order_relaxed);
+        while (!pending_.compare_exchange_weak(node->next, node,
+                                               std::memory_order_seq_cst,
+                                               std::memory_order_relaxed)) {
+        }
+        if (!drain_pending_.exchange(true, std::memory_order_seq_cst)) {
+            // 调用方已经登记过，计数不会在这里从0变成1，relaxed即可
+            inflight_.fetch_add(1, std::memory_order_relaxed);
+            TaskScheduler::getInstance().post([this]() { drain(); });
+        }
+    }
+    
+    // 一次取走整条链表，拼接成一块后写入缓冲区；清除标志后复查链表，避免丢掉并发提交的日志
+    void drain() {
+        std::string batch;
+        for (;;) {
+            PendingNode* list = pending_.exchange(nullptr, std::memory_order_acquire);
+            if (list == nullptr) {
+                drain_pending_.store(false, std::memory_order_seq_cst);
+                if (pending_.load(std::memory_order_seq_cst) == nullptr ||
+                    drain_pending_.exchange(true, std::memory_order_seq_cst)) {
+                    break;
+                }
+                continue;
+            }
+            
+            // 链表是后进先出的，反转后恢复提交顺序
+            PendingNode* ordered = nullptr;
+            while (list) {
+                PendingNode* next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+            
+            batch.clear();
+            for (PendingNode* n = ordered; n; n = n->next) {
+                batch += n->data;
+            }
+            buffer_.push(batch.data(), batch.size());
+            
+            while (ordered) {
+                PendingNode* next = ordered->next;
+                if (ordered->done) {
+                    ordered->done->set_value();
+                }
+                delete ordered;
+                ordered = next;
+            }
+        }
+        leave();
+    }
+    
     void start_consumer() {
         // 启动消费者协程
-        TaskScheduler::getInstance().async_execute([this]() {
-            while (running_) {
+        // 消费者本身已经占用一个工作线程，直接在这里读取和刷盘；如果再把pop和flush提交给调度器并等待，
+        // 工作线程被阻塞的写入任务占满时会互相等待而死锁
+        consumer_done_ = TaskScheduler::getInstance().async_execute([this]() {
+            for (;;) {
                 try {
-                    auto data_future = buffer_.pop_async();
-                    auto data = data_future.get();
+                    auto data = buffer_.pop();
                     
-                    if (data.empty()) continue;
+                    if (data.empty()) break; // 已停止且数据已取完
                     
-                    // 异步刷盘到所有输出目标
-                    std::vector<std::future<void>> flush_futures;
                     for (const auto& flusher : flushers_) {
-                        flush_futures.push_back(
-                            TaskScheduler::getInstance().async_execute([flusher, data]() {
-                                flusher(data);
-                            })
-                        );
-                    }
-                    
-                    // 等待所有刷盘操作完成
-                    for (auto& future : flush_futures) {
-                        future.wait();
+                        flusher(data);
                     }
                     
                 } catch (const std::exception& e) {
@@ -321,7 +487,9 @@ private:
             now.time_since_epoch()) % 1000;
         
         std::ostringstream oss;
-        oss << "[" << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S");
+        struct tm t;
+        localtime_r(&time_t, &t); // std::localtime返回共享的静态对象，多线程下不安全
+        oss << "[" << std::put_time(&t, "%Y-%m-%d %H:%M:%S");
         oss << "." << std::setfill('0') << std::setw(3) << ms.count() << "] ";
         oss << "[" << level << "] ";
         oss << "[" << name_ << "] ";
@@ -333,7 +501,13 @@ private:
     std::string name_;
     std::vector<FlushFunction> flushers_;
     AsyncBuffer buffer_;
+    SubmitMode mode_;
     std::atomic<bool> running_;
+    std::future<void> consumer_done_;
+    
+    std::atomic<PendingNode*> pending_{nullptr};  // 批量模式下待写入的日志(后进先出)
+    std::atomic<bool> drain_pending_{false};      // 是否已有drain任务在排队或执行
+    std::atomic<int> inflight_{0};                // 正在提交的生产者和尚未结束的drain任务数
 };
 
 // 协程风格的日志管理器
@@ -344,8 +518,8 @@ public:
         return instance;
     }
     
-    void initialize(size_t thread_count = std::thread::hardware_concurrency()) {
-        TaskScheduler::getInstance().start(thread_count);
+    void initialize(size_t thread_count = std::thread::hardware_concurrency(), std::vector<int> cpus = {}) {
+        TaskScheduler::getInstance().start(thread_count, std::move(cpus));
     }
     
     void shutdown() {
@@ -0,0 +1,246 @@
+#pragma once
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+/*
+致命信号(SIGSEGV/SIGABRT/SIGBUS/SIGFPE/SIGILL)的应急落地:
+(1)日志器在配置了crash_handler时把自己登记到这里，登记的是一个函数指针和上下文，不涉及内存分配;
+(2)信号处理函数运行在预先分配的备用栈上，只调用write、backtrace_symbols_fd等异步信号安全的函数，
+   不加锁、不分配内存，由各日志器把生产者/消费者缓冲区中还没落地的内容和调用栈直接写到落地文件的fd;
+   备用栈是线程级的，每个线程第一次打日志时由ThreadInit分配自己的备用栈，线程退出时释放，
+   任何打日志的线程栈溢出都能进入处理函数;
+(3)处理完之后恢复默认处理方式并重新raise信号，保留core dump和原有的退出码;
+   其他线程同时崩溃时停在处理函数里，等落地的线程重新raise后随进程一起结束。
+backtrace第一次调用时会加载libgcc并分配内存，因此在Install时提前调用一次。
+*/
+namespace mylog
+{
+    class CrashHandler
+    {
+    public:
+        using DumpFn = void (*)(void *ctx, int sig);
+
+        // 安装信号处理函数，重复调用只生效一次
+        static void Install()
+        {
+            if (Installed().exchange(true))
+                return;
+
+            void *warm[1];
+            backtrace(warm, 1); // 预热，避免在信号处理函数中第一次调用时分配内存
+
+            ThreadInit(); // 调用Install的线程
+
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = &CrashHandler::OnSignal;
+            // 不用SA_RESETHAND：那样同一信号在其他线程第二次触发时直接按默认方式终止进程，落地被打断。
+            // 处理期间屏蔽全部致命信号，落地过程中本线程再次崩溃时由内核直接终止，不会重入
+            const int signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+            sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&sa.sa_mask);
+            for (int sig : signals)
+                sigaddset(&sa.sa_mask, sig);
+            for (int sig : signals)
+                sigaction(sig, &sa, nullptr);
+        }
+
+        // 给当前线程装上备用栈，每个线程只做一次，没有Install过时什么也不做。日志器在每条日志的入口调用
+        static void ThreadInit()
+        {
+            thread_local AltStack stack;
+            if (stack.mem == nullptr && Installed().load(std::memory_order_relaxed))
+                stack.Setup();
+        }
+
+        // 登记需要在崩溃时应急落地的对象，槽位用完时返回false
+        static bool Register(void *ctx, DumpFn fn)
+        {
+            for (auto &slot : Slots())
+            {
+                void *expected = nullptr;
+                if (slot.ctx.compare_exchange_strong(expected, ctx))
+                {
+                    slot.fn.store(fn, std::memory_order_release);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static void Unregister(void *ctx)
+        {
+            for (auto &slot : Slots())
+            {
+                if (slot.ctx.load(std::memory_order_acquire) == ctx)
+                {
+                    slot.fn.store(nullptr, std::memory_order_release);
+                    slot.ctx.store(nullptr, std::memory_order_release);
+                }
+            }
+        }
+
+        // 以下函数只在信号处理流程中使用，都是异步信号安全的
+        static void WriteAll(int fd, const char *data, size_t len)
+        {
+            while (len > 0)
+            {
+                ssize_t n = write(fd, data, len);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return; // EFAULT等错误直接放弃，不能让处理函数再次崩溃
+                }
+                data += n;
+                len -= n;
+            }
+        }
+
+        static void WriteStr(int fd, const char *s) { WriteAll(fd, s, strlen(s)); }
+
+        // 写一行 "---- fatal signal N (name), emergency dump of logger xxx ----"
+        static void WriteBanner(int fd, int sig, const char *logger_name)
+        {
+            char num[16];
+            char *p = num + sizeof(num);
+            unsigned v = static_cast<unsigned>(sig);
+            do
+            {
+                *--p = static_cast<char>('0' + v % 10);
+                v /= 10;
+            } while (v != 0 && p > num);
+            WriteStr(fd, "\n---- fatal signal ");
+            WriteAll(fd, p, num + sizeof(num) - p);
+            WriteStr(fd, " (");
+            WriteStr(fd, SignalName(sig));
+            WriteStr(fd, "), emergency dump of logger ");
+            WriteStr(fd, logger_name);
+            WriteStr(fd, " ----\n");
+        }
+
+        // 写出信号发生时的调用栈
+        static void WriteBacktrace(int fd)
+        {
+            WriteStr(fd, "---- backtrace ----\n");
+            backtrace_symbols_fd(Frames(), FrameCount(), fd);
+            WriteStr(fd, "---- end of emergency dump ----\n");
+        }
+
+    private:
+        static constexpr int kMaxLoggers = 32;
+        static constexpr size_t kAltStackSize = 64 * 1024;
+        static constexpr int kMaxFrames = 64;
+
+        struct Slot
+        {
+            std::atomic<void *> ctx{nullptr};
+            std::atomic<DumpFn> fn{nullptr};
+        };
+
+        static Slot (&Slots())[kMaxLoggers]
+        {
+            static Slot slots[kMaxLoggers];
+            return slots;
+        }
+
+        static std::atomic<bool> &Installed()
+        {
+            static std::atomic<bool> installed{false};
+            return installed;
+        }
+
+        // 线程的备用栈，线程退出时先从内核注销再释放
+        struct AltStack
+        {
+            void *mem = nullptr;
+
+            void Setup()
+            {
+                void *p = mmap(nullptr, kAltStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                    return;
+                stack_t ss;
+                memset(&ss, 0, sizeof(ss));
+                ss.ss_sp = p;
+                ss.ss_size = kAltStackSize;
+                if (sigaltstack(&ss, nullptr) != 0)
+                {
+                    munmap(p, kAltStackSize);
+                    return;
+                }
+                mem = p;
+            }
+
+            ~AltStack()
+            {
+                if (mem == nullptr)
+                    return;
+                stack_t ss;
+                memset(&ss, 0, sizeof(ss));
+                ss.ss_flags = SS_DISABLE;
+                sigaltstack(&ss, nullptr);
+                munmap(mem, kAltStackSize);
+            }
+        };
+
+        static void **Frames()
+        {
+            static void *frames[kMaxFrames];
+            return frames;
+        }
+
+        static int &FrameCount()
+        {
+            static int count = 0;
+            return count;
+        }
+
+        static const char *SignalName(int sig)
+        {
+            switch (sig)
+            {
+            case SIGSEGV: return "SIGSEGV";
+            case SIGABRT: return "SIGABRT";
+            case SIGBUS: return "SIGBUS";
+            case SIGFPE: return "SIGFPE";
+            case SIGILL: return "SIGILL";
+            default: return "unknown";
+            }
+        }
+
+        static void OnSignal(int sig, siginfo_t *, void *)
+        {
+            static std::atomic<bool> entered{false};
+            if (entered.exchange(true)) // 多个线程同时崩溃时只由第一个线程落地
+            {
+                // 这里直接raise的话，默认处理会在第一个线程落地完成之前终止整个进程；
+                // 停在这里，等落地的线程重新raise后随进程一起结束
+                for (;;)
+                    pause();
+            }
+            int saved_errno = errno;
+            FrameCount() = backtrace(Frames(), kMaxFrames);
+            for (auto &slot : Slots())
+            {
+                void *ctx = slot.ctx.load(std::memory_order_acquire);
+                DumpFn fn = slot.fn.load(std::memory_order_acquire);
+                if (ctx != nullptr && fn != nullptr)
+                    fn(ctx, sig);
+            }
+            errno = saved_errno;
+            // 恢复默认处理后重新发送信号，处理函数返回时信号解除屏蔽，按原本的方式终止进程
+            struct sigaction dfl;
+            memset(&dfl, 0, sizeof(dfl));
+            dfl.sa_handler = SIG_DFL;
+            sigemptyset(&dfl.sa_mask);
+            sigaction(sig, &dfl, nullptr);
+            raise(sig);
+        }
+    };
+} // namespace mylog
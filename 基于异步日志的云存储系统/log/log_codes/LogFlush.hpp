@@ -1,6 +1,13 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <fstream>
 #include <memory>
+#include <vector>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "Util.hpp"
 /*
@@ -8,7 +15,6 @@
 提供了多种日志落地方式（标准输出、普通文件、滚动文件），
 并采用了工厂模式来创建不同的日志输出器。
 */
-extern mylog::Util::JsonData* g_conf_data;//声明变量 g_conf_data ​​在其他文件中定义​​（当前文件仅声明，不分配内存）
 namespace mylog{
     class LogFlush
     {
@@ -16,6 +22,56 @@ namespace mylog{
         using ptr = std::shared_ptr<LogFlush>;
         virtual ~LogFlush() {}
         virtual void Flush(const char *data, size_t len) = 0;//不同的写文件方式Flush的实现不同
+        // 分散写：缓冲区中挂了大日志体时，连续数据和数据块按顺序组成iovec一次写出；默认逐段调用Flush
+        virtual void FlushV(const struct iovec *iov, int iovcnt)
+        {
+            for (int i = 0; i < iovcnt; ++i)
+                Flush(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+        }
+        virtual int Fd() { return -1; }//崩溃时应急落地用的文件描述符，-1表示不支持
+        // 高优先级日志写完后立即调用：把C库缓冲交给内核，durable为true时再fdatasync到磁盘
+        virtual void Sync(bool durable) {}
+        // 异步线程每批数据开始前调用一次，这一批的所有落地方向都按同一个配置快照的刷盘策略执行，热加载后下一批生效
+        void SetFlushLog(size_t flush_log) { flush_log_ = flush_log; }
+
+    protected:
+        size_t flush_log_ = Util::JsonData::GetJsonData()->flush_log;//刷盘策略，只在异步线程中读写
+
+        // 把iovec全部写到fd，处理部分写入、EINTR和IOV_MAX的限制，返回写入的字节数，出错返回-1
+        static ssize_t WriteV(int fd, const struct iovec *iov, int iovcnt)
+        {
+            std::vector<struct iovec> rest(iov, iov + iovcnt);//部分写入时需要修改iovec，拷贝一份
+            size_t idx = 0, total = 0;
+            while (idx < rest.size())
+            {
+                int cnt = static_cast<int>(std::min<size_t>(rest.size() - idx, IOV_MAX));
+                ssize_t n = writev(fd, &rest[idx], cnt);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return -1;
+                }
+                total += n;
+                while (n > 0 && idx < rest.size())//跳过已经写完的段，最后一段可能只写了一部分
+                {
+                    if (static_cast<size_t>(n) >= rest[idx].iov_len)
+                    {
+                        n -= rest[idx].iov_len;
+                        ++idx;
+                    }
+                    else
+                    {
+                        rest[idx].iov_base = static_cast<char *>(rest[idx].iov_base) + n;
+                        rest[idx].iov_len -= n;
+                        n = 0;
+                    }
+                }
+                while (idx < rest.size() && rest[idx].iov_len == 0)
+                    ++idx;
+            }
+            return static_cast<ssize_t>(total);
+        }
     };
 
     class StdoutFlush : public LogFlush//日志输出到标准输出
@@ -25,7 +81,24 @@ namespace mylog{
         void Flush(const char *data, size_t len) override{
             cout.write(data, len);
         }
+        void FlushV(const struct iovec *iov, int iovcnt) override{
+            cout.flush();//先把cout中已有的内容写出，保证顺序
+            if (WriteV(STDOUT_FILENO, iov, iovcnt) < 0)
+                perror("writev stdout failed");
+        }
+        void Sync(bool durable) override{
+            cout.flush();
+        }
+        int Fd() override { return STDOUT_FILENO; }
     };//直接将日志内容写入到标准输出std::cout
+
+    class NullFlush : public LogFlush//丢弃所有日志，用于压测时隔离前端(格式化+缓冲区)的开销
+    {
+    public:
+        using ptr = std::shared_ptr<NullFlush>;
+        void Flush(const char *data, size_t len) override {}
+        void FlushV(const struct iovec *iov, int iovcnt) override {}
+    };
     /*
     将日志写入单个固定文件
         支持三种刷盘策略：
@@ -47,8 +120,13 @@ namespace mylog{
             if(fs_==NULL){
                 std::cout <<__FILE__<<__LINE__<<"open log file failed"<< std::endl;
                 perror(NULL);
+                return;
             }
+            if(Util::JsonData::GetJsonData()->crash_handler)//启用崩溃处理时不使用C库缓冲，落地的数据都已经交给内核，崩溃时不会丢在FILE缓冲区里
+                setvbuf(fs_, NULL, _IONBF, 0);
+            fd_ = fileno(fs_);
         }
+        int Fd() override { return fd_.load(std::memory_order_acquire); }
         void Flush(const char *data, size_t len) override{
             fwrite(data,1,len,fs_);
             if(ferror(fs_))//ferror检查文件操作是否出错
@@ -56,22 +134,42 @@ namespace mylog{
                 std::cout <<__FILE__<<__LINE__<<"write log file failed"<< std::endl;
                 perror(NULL);
             }
-            if(g_conf_data->flush_log == 1)//刷新C库缓冲区
+            if(flush_log_ == 1)//刷新C库缓冲区
             {
                 if(fflush(fs_)==EOF)//fflush是将C标准库写入操作系统,成功返回0，失败返回EOF
                 {
                     std::cout <<__FILE__<<__LINE__<<"fflush file failed"<< std::endl;
                     perror(NULL);
                 }
-            }else if(g_conf_data->flush_log == 2){
+            }else if(flush_log_ == 2){
                 fflush(fs_);
                 fsync(fileno(fs_));//fsync是强制写入C盘,开销很大，需要磁盘IO成功
             }
         }
+        void FlushV(const struct iovec *iov, int iovcnt) override{
+            if(fs_==NULL)
+                return;
+            fflush(fs_);//C库缓冲中已有的数据先交给内核，再用writev直接写，保证顺序
+            if(WriteV(fileno(fs_), iov, iovcnt) < 0)
+            {
+                std::cout <<__FILE__<<__LINE__<<"writev log file failed"<< std::endl;
+                perror(NULL);
+            }
+            if(flush_log_ == 2)//writev已经绕过C库缓冲，flush_log为1时无需再做什么
+                fsync(fileno(fs_));
+        }
+        void Sync(bool durable) override{
+            if(fs_==NULL)
+                return;
+            fflush(fs_);
+            if(durable && fdatasync(fileno(fs_))==-1)//只同步数据和文件长度，比fsync少一次元数据写
+                perror("fdatasync log file failed");
+        }
 
     private:
         std::string filename_;
         FILE* fs_ = NULL; 
+        std::atomic<int> fd_{-1};
     };
 
     class RollFileFlush : public LogFlush//日志输出到文件,并按大小生成日志文件
@@ -84,6 +182,8 @@ namespace mylog{
             Util::File::CreateDirectory(Util::File::Path(filename));
         }
 
+        int Fd() override { return fd_.load(std::memory_order_acquire); }
+
         void Flush(const char *data, size_t len) override
         {
             // 确认文件大小不满足滚动需求
@@ -95,23 +195,50 @@ namespace mylog{
                 perror(NULL);
             }
             cur_size_ += len;//同FileFlush的刷盘策略
-            if(g_conf_data->flush_log == 1){
+            if(flush_log_ == 1){
                 if(fflush(fs_)){
                     std::cout <<__FILE__<<__LINE__<<"fflush file failed"<< std::endl;
                     perror(NULL);
                 }
-            }else if(g_conf_data->flush_log == 2){
+            }else if(flush_log_ == 2){
                 fflush(fs_);
                 fsync(fileno(fs_));
             }
         }
 
+        void FlushV(const struct iovec *iov, int iovcnt) override
+        {
+            InitLogFile();
+            if(fs_==NULL)
+                return;
+            fflush(fs_);//同FileFlush::FlushV
+            ssize_t n = WriteV(fileno(fs_), iov, iovcnt);
+            if(n < 0){
+                std::cout <<__FILE__<<__LINE__<<"writev log file failed"<< std::endl;
+                perror(NULL);
+                return;
+            }
+            cur_size_ += n;
+            if(flush_log_ == 2)
+                fsync(fileno(fs_));
+        }
+
+        void Sync(bool durable) override
+        {
+            if(fs_==NULL)
+                return;
+            fflush(fs_);
+            if(durable && fdatasync(fileno(fs_))==-1)
+                perror("fdatasync log file failed");
+        }
+
     private:
         void InitLogFile()
         {
             if (fs_==NULL || cur_size_ >= max_size_)
             {
                 if(fs_!=NULL){
+                    fd_.store(-1, std::memory_order_release);//先摘掉fd，崩溃处理不会写到正在关闭的文件
                     fclose(fs_);
                     fs_=NULL;
                 }   
@@ -120,6 +247,10 @@ namespace mylog{
                 if(fs_==NULL){
                     std::cout <<__FILE__<<__LINE__<<"open file failed"<< std::endl;
                     perror(NULL);
+                }else{
+                    if(Util::JsonData::GetJsonData()->crash_handler)//同FileFlush
+                        setvbuf(fs_, NULL, _IONBF, 0);
+                    fd_.store(fileno(fs_), std::memory_order_release);
                 }
                 cur_size_ = 0;
             }
@@ -149,6 +280,7 @@ namespace mylog{
         std::string basename_;
         // std::ofstream ofs_;
         FILE* fs_ = NULL;
+        std::atomic<int> fd_{-1};
     };
 
     class LogFlushFactory
@@ -0,0 +1,200 @@
+#pragma once
+#include <arpa/inet.h>
+#include <endian.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#ifdef MYLOG_WITH_BUNDLE
+#include "bundle.h"
+#endif
+/*
+远程日志传输的帧格式，发送端(RemoteFlush)和收集端(examples/log_collector)共用:
+(1)数据帧 = 帧头(FrameHeader，网络字节序) + 数据；一批日志压成一帧，数据按codec压缩；
+(2)session是发送端每次启动时生成的随机数，seq在同一个session内从1开始递增，
+   收集端按(session,seq)去重，重连后重发未确认的帧不会重复落地；
+(3)确认帧(FrameAck)是累计确认：收到某个session的seq，表示该session中不大于seq的帧都已落地；
+(4)crc32覆盖压缩后的数据，收集端校验失败直接断开连接，发送端重连后重发；
+(5)压缩依赖bundle库，编译时定义MYLOG_WITH_BUNDLE才启用，否则一律不压缩(codec为NONE)。
+*/
+namespace mylog
+{
+    namespace Frame
+    {
+        static const uint32_t kDataMagic = 0x4D4C4746; // "MLGF"
+        static const uint32_t kAckMagic = 0x4D4C4741;  // "MLGA"
+        static const uint8_t kVersion = 1;
+        static const uint32_t kMaxFrameSize = 64 * 1024 * 1024; // 单帧数据上限，收集端据此拒绝异常帧
+
+        enum Codec : uint8_t
+        {
+            NONE = 0,
+            LZ4 = 1,
+            ZSTD = 2,
+        };
+
+#pragma pack(push, 1)
+        struct FrameHeader
+        {
+            uint32_t magic;
+            uint8_t version;
+            uint8_t codec;
+            uint16_t reserved;
+            uint64_t session;
+            uint64_t seq;
+            uint32_t raw_len;  // 解压后的长度
+            uint32_t data_len; // 帧头后面数据的长度
+            uint32_t crc;      // 数据的crc32
+        };
+
+        struct FrameAck
+        {
+            uint32_t magic;
+            uint64_t session;
+            uint64_t seq;
+        };
+#pragma pack(pop)
+
+        // 与zlib兼容的crc32(多项式0xEDB88320)，按slicing-by-8每次处理8个字节，表在第一次调用时生成
+        inline uint32_t Crc32(const void *data, size_t len, uint32_t crc = 0)
+        {
+            static const struct Table
+            {
+                uint32_t v[8][256];
+                Table()
+                {
+                    for (uint32_t i = 0; i < 256; ++i)
+                    {
+                        uint32_t c = i;
+                        for (int k = 0; k < 8; ++k)
+                            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                        v[0][i] = c;
+                    }
+                    for (uint32_t i = 0; i < 256; ++i)
+                        for (int t = 1; t < 8; ++t)
+                            v[t][i] = (v[t - 1][i] >> 8) ^ v[0][v[t - 1][i] & 0xFF];
+                }
+            } table;
+            const unsigned char *p = static_cast<const unsigned char *>(data);
+            crc = ~crc;
+            while (len >= 8)
+            {
+                uint32_t lo, hi;
+                memcpy(&lo, p, 4);
+                memcpy(&hi, p + 4, 4);
+                lo = le32toh(lo) ^ crc;
+                hi = le32toh(hi);
+                crc = table.v[7][lo & 0xFF] ^ table.v[6][(lo >> 8) & 0xFF] ^
+                      table.v[5][(lo >> 16) & 0xFF] ^ table.v[4][lo >> 24] ^
+                      table.v[3][hi & 0xFF] ^ table.v[2][(hi >> 8) & 0xFF] ^
+                      table.v[1][(hi >> 16) & 0xFF] ^ table.v[0][hi >> 24];
+                p += 8;
+                len -= 8;
+            }
+            while (len-- > 0)
+                crc = table.v[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        // 配置中的压缩方式："lz4"、"zstd"，其他值或未启用bundle时不压缩
+        inline Codec ParseCodec(const std::string &name)
+        {
+#ifdef MYLOG_WITH_BUNDLE
+            if (name == "lz4")
+                return LZ4;
+            if (name == "zstd")
+                return ZSTD;
+#endif
+            return NONE;
+        }
+
+#ifdef MYLOG_WITH_BUNDLE
+        inline unsigned BundleFormat(Codec codec)
+        {
+            return codec == ZSTD ? bundle::ZSTD : bundle::LZ4;
+        }
+#endif
+
+        // 按codec压缩一批数据；压缩失败或压缩后没有变小时退回不压缩，codec会被改成NONE
+        inline std::string Encode(const char *data, size_t len, Codec *codec)
+        {
+#ifdef MYLOG_WITH_BUNDLE
+            if (*codec != NONE)
+            {
+                std::string packed = bundle::pack(BundleFormat(*codec), std::string(data, len));
+                if (!packed.empty() && packed.size() < len)
+                    return packed;
+            }
+#endif
+            *codec = NONE;
+            return std::string(data, len);
+        }
+
+        // 解压一帧数据，失败返回false。直接从data指向的内存解压，接收端不必先把帧拷贝成string
+        inline bool Decode(Codec codec, const char *data, size_t len, size_t raw_len, std::string *out)
+        {
+            if (codec == NONE)
+            {
+                out->assign(data, len);
+                return out->size() == raw_len;
+            }
+#ifdef MYLOG_WITH_BUNDLE
+            return bundle::unpack(*out, std::string_view(data, len)) && out->size() == raw_len;
+#else
+            return false;
+#endif
+        }
+
+        inline bool Decode(Codec codec, const std::string &data, size_t raw_len, std::string *out)
+        {
+            return Decode(codec, data.data(), data.size(), raw_len, out);
+        }
+
+        // 生成网络字节序的帧头
+        inline FrameHeader MakeHeader(Codec codec, uint64_t session, uint64_t seq,
+                                      size_t raw_len, const std::string &data)
+        {
+            FrameHeader h;
+            memset(&h, 0, sizeof(h));
+            h.magic = htonl(kDataMagic);
+            h.version = kVersion;
+            h.codec = codec;
+            h.session = htobe64(session);
+            h.seq = htobe64(seq);
+            h.raw_len = htonl(static_cast<uint32_t>(raw_len));
+            h.data_len = htonl(static_cast<uint32_t>(data.size()));
+            h.crc = htonl(Crc32(data.data(), data.size()));
+            return h;
+        }
+
+        // 把帧头转成主机字节序，魔数、版本或长度不对时返回false
+        inline bool ParseHeader(FrameHeader *h)
+        {
+            h->magic = ntohl(h->magic);
+            h->session = be64toh(h->session);
+            h->seq = be64toh(h->seq);
+            h->raw_len = ntohl(h->raw_len);
+            h->data_len = ntohl(h->data_len);
+            h->crc = ntohl(h->crc);
+            return h->magic == kDataMagic && h->version == kVersion &&
+                   h->data_len <= kMaxFrameSize && h->raw_len <= kMaxFrameSize;
+        }
+
+        inline FrameAck MakeAck(uint64_t session, uint64_t seq)
+        {
+            FrameAck a;
+            a.magic = htonl(kAckMagic);
+            a.session = htobe64(session);
+            a.seq = htobe64(seq);
+            return a;
+        }
+
+        inline bool ParseAck(FrameAck *a)
+        {
+            a->magic = ntohl(a->magic);
+            a->session = be64toh(a->session);
+            a->seq = be64toh(a->seq);
+            return a->magic == kAckMagic;
+        }
+    } // namespace Frame
+} // namespace mylog
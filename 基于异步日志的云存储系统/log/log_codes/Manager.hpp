@@ -1,4 +1,5 @@
 #include<unordered_map>
+#include<shared_mutex>
 #include "AsyncLogger.hpp"
 
 /*日志管理器，负责统一管理多个异步日志器*/
@@ -14,7 +15,7 @@ namespace mylog{
 
         bool LoggerExist(const std::string &name)
         {
-            std::unique_lock<std::mutex> lck(mtx_);//使用互斥锁保护日志器的集合
+            std::shared_lock<std::shared_mutex> lck(mtx_);//使用读写锁保护日志器的集合，查询只加读锁
             if(loggers_.find(name)!=loggers_.end())
                   return true;
             return false;
@@ -25,17 +26,17 @@ namespace mylog{
             if(LoggerExist(logger->Name()))
                return;//防止重复添加
             
-            std::unique_lock<std::mutex>lck(mtx_);
+            std::unique_lock<std::shared_mutex>lck(mtx_);
             loggers_.emplace(std::make_pair(logger->Name(),std::move(logger)));//自动推导,emplace避免临时对象，emplace直接在容器中构造元素
 
         }
 
         AysncLogger::ptr GetLogger(const std::string &name)//获取日志器,从全局管理容器中按名称查找并返回对应的日志器对象
         {
-            std::unique_lock<std::mutex>lck(mtx_);//加锁
+            std::shared_lock<std::shared_mutex>lck(mtx_);//多个事件循环线程并发获取日志器，只加读锁
             auto it=loggers_.find(name);
             if(it==loggers_.end())
-                retrun nullptr;//未找到，返回空指针
+                return nullptr;//未找到，返回空指针
             return it->second;
         }//找到，则返回对应的日志对象的指针
 
@@ -50,7 +51,7 @@ namespace mylog{
         
          }
        private:
-          std::mutex mtx_;
+          std::shared_mutex mtx_;
           AysncLogger::ptr default_logger_;//默认日志器对象，声明共享指针
           std::unordered_map<std::string,AysncLogger::ptr>loggers_;//日志器集合
     };
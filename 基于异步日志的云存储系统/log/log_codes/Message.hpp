@@ -20,17 +20,20 @@ namespace mylog{
           ctime_(Util::Date::Now()),
           tid_(std::this_thread::get_id()) {}
         std::string format(){//格式化:时间+拼接日志头+拼接日志体+组合最终的日志
+            return FormatHeader() + payload_ + "\n";//返回格式化后的日志
+        }//拼接组织起来
+
+        std::string FormatHeader(){//只生成日志头"[时间][线程id][等级][日志器][文件:行号]\t"，大日志体单独落地时使用
            std::stringstream ret;
            struct tm t;
-           localtime_r(&crime_,&t);
+           localtime_r(&ctime_,&t);
            char buf[128];
            strftime(buf, sizeof(buf), "%H:%M:%S", &t);
             std::string tmp1 = '[' + std::string(buf) + "][";
-            std::string tmp2 = '[' + std::string(LogLevel::ToString(level_)) + "][" + name_ + "][" + file_name_ + ":" + std::to_string(line_) + "]\t" + payload_ + "\n";
+            std::string tmp2 = '[' + std::string(LogLevel::ToString(level_)) + "][" + name_ + "][" + file_name_ + ":" + std::to_string(line_) + "]\t";
             ret << tmp1 << tid_ << tmp2;
-            return ret.str();//返回格式化后的日志
-
-        }//拼接组织起来
+            return ret.str();
+        }
         size_t line_;           // 行号
         time_t ctime_;          // 时间
         std::string file_name_; // 文件名
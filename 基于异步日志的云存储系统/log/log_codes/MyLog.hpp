@@ -1,5 +1,7 @@
 #pragma once
 #include "Manager.hpp"
+#include "ConfigWatcher.hpp"
+#include "RemoteFlush.hpp"
 
 /*日志系统的用户接口封装:简化日志库的调用方式，同时提供灵活性和易用性*/
 namespace mylog {
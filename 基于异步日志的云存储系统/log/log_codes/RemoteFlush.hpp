@@ -0,0 +1,563 @@
+#pragma once
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include "LogFlush.hpp"
+#include "LogFrame.hpp"
+/*
+远程日志落地：把消费者线程每次落地的一批日志压缩成一帧，通过TCP发给日志收集端(examples/log_collector)。
+(1)发送出去的帧在收到收集端的累计确认之前一直保留在内存队列中，断线重连后从队头重发，收集端按(session,seq)去重；
+(2)内存队列超过remote_window字节或网络不通时，新的帧追加到remote_spool_dir下的落盘文件；
+   落盘文件非空时后来的帧也只能追加到它后面，内存队列有空间时再从文件头按顺序读回，保证发送顺序不变；
+   上次进程退出时没发完的落盘文件会在启动后最先重发；没有配置remote_spool_dir时只能丢弃新帧并计数；
+(3)所有网络操作都是非阻塞的，每次Flush最多花remote_budget_ms毫秒：连不上、发不完就留到下一批再继续，
+   连接失败后按指数退避(最长5秒)再重连，断网期间Flush只是追加落盘文件，不会拖慢异步线程；
+(4)http_path为空时直接和log_collector通信；设为"/ingest"时每帧包成一个HTTP POST发给存储服务器，
+   同一连接上流水线发送，响应体就是累计确认，非200的响应：5xx稍后重连重发，4xx丢弃该帧；
+(5)Flush/FlushV/Sync都只在异步线程中调用，内部不加锁，统计数据用原子变量供其他线程读取。
+由于只在有日志落地时推进发送，断网恢复后要等下一批日志到来才会开始重发。
+*/
+namespace mylog
+{
+    struct RemoteStats
+    {
+        uint64_t frames = 0;   // 生成的帧数
+        uint64_t acked = 0;    // 已确认的帧数
+        uint64_t spooled = 0;  // 写入落盘文件的帧数
+        uint64_t dropped = 0;  // 没有落盘文件时丢弃的帧数
+        uint64_t reconnects = 0;
+        uint64_t pending_bytes = 0; // 内存队列中未确认的字节数
+        uint64_t spool_bytes = 0;   // 落盘文件中还没读回内存的字节数
+    };
+
+    class RemoteFlush : public LogFlush
+    {
+    public:
+        using ptr = std::shared_ptr<RemoteFlush>;
+        using Clock = std::chrono::steady_clock;
+
+        // name用于区分落盘文件，同一进程内多个RemoteFlush需要使用不同的name；HTTP方式下也作为来源名(LogSource)
+        RemoteFlush(const std::string &addr, uint16_t port, const std::string &name = "remote",
+                    const std::string &http_path = "")
+            : session_(NewSession()), http_path_(http_path)
+        {
+            if (!http_path_.empty())
+                http_head_ = "POST " + http_path_ + " HTTP/1.1\r\nHost: " + addr + ":" + std::to_string(port) +
+                             "\r\nLogSource: " + name + "\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
+            memset(&server_addr_, 0, sizeof(server_addr_));
+            server_addr_.sin_family = AF_INET;
+            server_addr_.sin_port = htons(port);
+            if (inet_aton(addr.c_str(), &server_addr_.sin_addr) == 0)
+                std::cout << __FILE__ << __LINE__ << "invalid remote addr: " << addr << std::endl;
+            OpenSpool(name);
+            next_connect_ = Clock::now();
+        }
+
+        ~RemoteFlush()
+        {
+            Pump(Deadline());//退出前再尝试发一次，没发完的留在落盘文件和内存中(内存中的会丢失)
+            SpoolInflight();
+            CloseSocket();
+            if (spool_fd_ >= 0)
+                close(spool_fd_);
+        }
+
+        void Flush(const char *data, size_t len) override
+        {
+            if (len == 0)
+                return;
+            Clock::time_point deadline = Deadline();
+            Enqueue(data, len);
+            Pump(deadline);
+        }
+
+        void FlushV(const struct iovec *iov, int iovcnt) override
+        {
+            std::string batch;//压缩需要连续的数据，这里拼成一块
+            for (int i = 0; i < iovcnt; ++i)
+                batch.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+            Flush(batch.data(), batch.size());
+        }
+
+        void Sync(bool durable) override
+        {
+            Pump(Deadline());//远程落地不等待确认，尽快把高优先级日志发出去即可
+        }
+
+        RemoteStats Stats()
+        {
+            RemoteStats s;
+            s.frames = frames_.load(std::memory_order_relaxed);
+            s.acked = acked_.load(std::memory_order_relaxed);
+            s.spooled = spooled_.load(std::memory_order_relaxed);
+            s.dropped = dropped_.load(std::memory_order_relaxed);
+            s.reconnects = reconnects_.load(std::memory_order_relaxed);
+            s.pending_bytes = pending_bytes_.load(std::memory_order_relaxed);
+            s.spool_bytes = spool_bytes_.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        struct PendingFrame
+        {
+            uint64_t session;
+            uint64_t seq;
+            std::string bytes; // 帧头+数据
+            std::string head;  // HTTP方式下的请求头，发送前生成
+        };
+
+        static uint64_t NewSession()
+        {
+            std::random_device rd;
+            uint64_t s = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+            s ^= static_cast<uint64_t>(Clock::now().time_since_epoch().count());
+            return s == 0 ? 1 : s;
+        }
+
+        static Clock::time_point Deadline()
+        {
+            return Clock::now() + std::chrono::milliseconds(Util::JsonData::GetJsonData()->remote_budget_ms);
+        }
+
+        static int Remaining(Clock::time_point deadline)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            return left > 0 ? static_cast<int>(left) : 0;
+        }
+
+        void OpenSpool(const std::string &name)
+        {
+            const std::string &dir = Util::JsonData::GetJsonData()->remote_spool_dir;
+            if (dir.empty())
+                return;
+            Util::File::CreateDirectory(dir);
+            spool_path_ = dir + "/" + name + ".spool";
+            spool_fd_ = open(spool_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (spool_fd_ < 0)
+            {
+                std::cout << __FILE__ << __LINE__ << "open spool file failed: " << spool_path_ << std::endl;
+                perror(NULL);
+                return;
+            }
+            struct stat st;
+            if (fstat(spool_fd_, &st) == 0)
+                spool_tail_ = st.st_size;//上次没发完的帧，启动后最先重发
+            spool_bytes_.store(spool_tail_, std::memory_order_relaxed);
+            if (spool_tail_ > 0)
+                std::cout << __FILE__ << __LINE__ << "replay " << spool_tail_ << " bytes from " << spool_path_ << std::endl;
+        }
+
+        bool SpoolEmpty() { return spool_head_ >= spool_tail_; }
+
+        // 压缩并分配序号，按顺序放进内存队列或落盘文件
+        void Enqueue(const char *data, size_t len)
+        {
+            const Util::JsonData *conf = Util::JsonData::GetJsonData();
+            Frame::Codec codec = Frame::ParseCodec(conf->remote_codec);
+            std::string body = Frame::Encode(data, len, &codec);
+            PendingFrame f;
+            f.session = session_;
+            f.seq = ++seq_;
+            Frame::FrameHeader h = Frame::MakeHeader(codec, f.session, f.seq, len, body);
+            f.bytes.reserve(sizeof(h) + body.size());
+            f.bytes.append(reinterpret_cast<const char *>(&h), sizeof(h));
+            f.bytes.append(body);
+            frames_.fetch_add(1, std::memory_order_relaxed);
+            if (SpoolEmpty() && mem_bytes_ + f.bytes.size() <= conf->remote_window)
+            {
+                PushInflight(std::move(f));
+                return;
+            }
+            Spool(f.bytes);
+        }
+
+        void PushInflight(PendingFrame &&f)
+        {
+            mem_bytes_ += f.bytes.size();
+            pending_bytes_.store(mem_bytes_, std::memory_order_relaxed);
+            inflight_.push_back(std::move(f));
+        }
+
+        void Spool(const std::string &bytes)
+        {
+            if (spool_fd_ < 0)
+            {
+                if (dropped_.fetch_add(1, std::memory_order_relaxed) == 0)
+                    std::cout << __FILE__ << __LINE__ << "remote log window full and no spool dir, frames dropped" << std::endl;
+                return;
+            }
+            size_t off = 0;
+            while (off < bytes.size())
+            {
+                ssize_t n = write(spool_fd_, bytes.data() + off, bytes.size() - off);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    std::cout << __FILE__ << __LINE__ << "write spool file failed" << std::endl;
+                    perror(NULL);
+                    if (off > 0 && ftruncate(spool_fd_, spool_tail_) == -1)//去掉写了一半的帧
+                        perror("ftruncate spool file failed");
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                off += n;
+            }
+            spool_tail_ += bytes.size();
+            spool_bytes_.store(spool_tail_ - spool_head_, std::memory_order_relaxed);
+            spooled_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // 析构时把内存中未确认的帧也写进落盘文件，下次启动时重发
+        void SpoolInflight()
+        {
+            if (spool_fd_ < 0 || inflight_.empty())
+                return;
+            if (!SpoolEmpty())//落盘文件里还有更新的帧，内存中的帧必须排在它们前面，重写整个文件
+            {
+                std::string rest(spool_tail_ - spool_head_, '\0');
+                if (pread(spool_fd_, &rest[0], rest.size(), spool_head_) != static_cast<ssize_t>(rest.size()))
+                    return;
+                if (ftruncate(spool_fd_, 0) == -1)
+                    return;
+                spool_head_ = spool_tail_ = 0;
+                for (auto &f : inflight_)
+                    Spool(f.bytes);
+                Spool(rest);
+                return;
+            }
+            if (ftruncate(spool_fd_, 0) == -1)
+                return;
+            spool_head_ = spool_tail_ = 0;
+            for (auto &f : inflight_)
+                Spool(f.bytes);
+        }
+
+        // 内存队列有空间时，从落盘文件头按顺序读回帧；读完后清空文件
+        void LoadSpool()
+        {
+            size_t window = Util::JsonData::GetJsonData()->remote_window;
+            while (!SpoolEmpty() && mem_bytes_ < window)
+            {
+                Frame::FrameHeader h;
+                if (pread(spool_fd_, &h, sizeof(h), spool_head_) != static_cast<ssize_t>(sizeof(h)))
+                    return TruncateSpool("short frame header");
+                Frame::FrameHeader parsed = h;
+                if (!Frame::ParseHeader(&parsed) || spool_head_ + static_cast<off_t>(sizeof(h) + parsed.data_len) > spool_tail_)
+                    return TruncateSpool("bad frame");
+                PendingFrame f;
+                f.session = parsed.session;
+                f.seq = parsed.seq;
+                f.bytes.resize(sizeof(h) + parsed.data_len);
+                memcpy(&f.bytes[0], &h, sizeof(h));
+                if (pread(spool_fd_, &f.bytes[sizeof(h)], parsed.data_len, spool_head_ + sizeof(h)) !=
+                    static_cast<ssize_t>(parsed.data_len))
+                    return TruncateSpool("short frame body");
+                spool_head_ += f.bytes.size();
+                spool_bytes_.store(spool_tail_ - spool_head_, std::memory_order_relaxed);
+                PushInflight(std::move(f));
+            }
+            if (spool_fd_ >= 0 && SpoolEmpty() && spool_tail_ > 0)
+                TruncateSpool(nullptr);
+        }
+
+        // 清空落盘文件；reason不为空时说明文件尾部损坏(如写到一半时进程崩溃)，剩下的部分丢弃
+        void TruncateSpool(const char *reason)
+        {
+            if (reason != nullptr)
+                std::cout << __FILE__ << __LINE__ << "spool file " << spool_path_ << ": " << reason
+                          << ", drop " << (spool_tail_ - spool_head_) << " bytes" << std::endl;
+            if (ftruncate(spool_fd_, 0) == -1)
+                perror("ftruncate spool file failed");
+            spool_head_ = spool_tail_ = 0;
+            spool_bytes_.store(0, std::memory_order_relaxed);
+        }
+
+        // 在截止时间之前推进连接、发送和确认，任何一步需要等待而时间用完时直接返回
+        void Pump(Clock::time_point deadline)
+        {
+            LoadSpool();
+            while (true)
+            {
+                if (fd_ < 0 && !StartConnect())
+                    return;
+                if (connecting_)
+                {
+                    if (!WaitFd(POLLOUT, deadline))
+                        return;
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+                    {
+                        Disconnect();
+                        return;
+                    }
+                    connecting_ = false;
+                    backoff_ms_ = 0;
+                }
+                if (!ReadAcks())
+                    return;
+                LoadSpool();
+                if (sent_ >= inflight_.size())
+                    return;//都已发出，确认留到下一次读取
+                if (!SendSome())
+                    return;
+                if (sent_ < inflight_.size() && !WaitFd(POLLOUT, deadline))
+                    return;
+            }
+        }
+
+        bool StartConnect()
+        {
+            if (Clock::now() < next_connect_)
+                return false;
+            fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd_ < 0)
+            {
+                std::cout << __FILE__ << __LINE__ << "socket error : " << strerror(errno) << std::endl;
+                Backoff();
+                return false;
+            }
+            int one = 1;
+            setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            reconnects_.fetch_add(1, std::memory_order_relaxed);
+            if (connect(fd_, (struct sockaddr *)&server_addr_, sizeof(server_addr_)) == 0)
+            {
+                connecting_ = false;
+                backoff_ms_ = 0;
+                return true;
+            }
+            if (errno != EINPROGRESS)
+            {
+                Disconnect();
+                return false;
+            }
+            connecting_ = true;
+            return true;
+        }
+
+        // 等待fd可写(或可读)，超时返回false；等待期间对端断开时也返回false
+        bool WaitFd(short events, Clock::time_point deadline)
+        {
+            struct pollfd pfd = {fd_, events, 0};
+            int ret;
+            do
+                ret = poll(&pfd, 1, Remaining(deadline));
+            while (ret < 0 && errno == EINTR);
+            if (ret <= 0)
+                return false;
+            if ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) && !connecting_)
+            {
+                Disconnect();
+                return false;
+            }
+            return true;
+        }
+
+        // 非阻塞地读取累计确认，弹出已确认的帧；连接断开返回false
+        bool ReadAcks()
+        {
+            char buf[4096];
+            while (true)
+            {
+                ssize_t n = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0)
+                {
+                    Disconnect();
+                    return false;
+                }
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return true;
+                    Disconnect();
+                    return false;
+                }
+                in_.append(buf, n);
+                if (!(http_path_.empty() ? ParseAcks() : ParseResponses()))
+                {
+                    Disconnect();
+                    return false;
+                }
+            }
+        }
+
+        // 直连log_collector：输入就是连续的确认帧
+        bool ParseAcks()
+        {
+            size_t pos = 0;
+            for (; in_.size() - pos >= sizeof(Frame::FrameAck); pos += sizeof(Frame::FrameAck))
+                if (!OnAck(in_.data() + pos, sizeof(Frame::FrameAck)))
+                    return false;
+            in_.erase(0, pos);
+            return true;
+        }
+
+        // HTTP方式：每个响应对应一个请求(一帧)，200的响应体是确认，4xx丢弃该帧，其他状态断开后重发
+        bool ParseResponses()
+        {
+            while (true)
+            {
+                size_t end = in_.find("\r\n\r\n");
+                if (end == std::string::npos)
+                    return true;
+                int status = 0;
+                if (sscanf(in_.c_str(), "HTTP/1.%*d %d", &status) != 1)
+                {
+                    std::cout << __FILE__ << __LINE__ << "bad http response from log server" << std::endl;
+                    return false;
+                }
+                size_t body_len = 0;
+                std::string head = in_.substr(0, end);
+                for (auto &c : head)
+                    c = tolower(c);
+                size_t cl = head.find("content-length:");
+                if (cl != std::string::npos)
+                    body_len = strtoul(head.c_str() + cl + 15, NULL, 10);
+                if (in_.size() < end + 4 + body_len)
+                    return true;
+                const char *body = in_.data() + end + 4;
+                if (status == 200)
+                {
+                    for (size_t off = 0; off + sizeof(Frame::FrameAck) <= body_len; off += sizeof(Frame::FrameAck))
+                        if (!OnAck(body + off, sizeof(Frame::FrameAck)))
+                            return false;
+                }
+                else if (status >= 400 && status < 500 && sent_ > 0)
+                {
+                    std::cout << __FILE__ << __LINE__ << "log server rejected frame " << inflight_.front().seq
+                              << ", status " << status << std::endl;
+                    PopFront();
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+                else
+                {
+                    std::cout << __FILE__ << __LINE__ << "log server status " << status << ", retry later" << std::endl;
+                    return false;
+                }
+                in_.erase(0, end + 4 + body_len);
+            }
+        }
+
+        bool OnAck(const char *data, size_t len)
+        {
+            Frame::FrameAck ack;
+            memcpy(&ack, data, sizeof(ack));
+            if (!Frame::ParseAck(&ack))
+            {
+                std::cout << __FILE__ << __LINE__ << "bad ack from collector" << std::endl;
+                return false;
+            }
+            while (!inflight_.empty() && sent_ > 0 && inflight_.front().session == ack.session &&
+                   inflight_.front().seq <= ack.seq)
+            {
+                PopFront();
+                acked_.fetch_add(1, std::memory_order_relaxed);
+            }
+            return true;
+        }
+
+        void PopFront()
+        {
+            mem_bytes_ -= inflight_.front().bytes.size();
+            inflight_.pop_front();
+            --sent_;
+            pending_bytes_.store(mem_bytes_, std::memory_order_relaxed);
+        }
+
+        // 尽量多地发送未发出的帧，内核缓冲区满时返回true等待可写，出错返回false
+        bool SendSome()
+        {
+            while (sent_ < inflight_.size())
+            {
+                PendingFrame &f = inflight_[sent_];
+                if (!http_path_.empty() && f.head.empty())
+                    f.head = http_head_ + std::to_string(f.bytes.size()) + "\r\n\r\n";
+                // 请求头和帧作为一个整体发送，sent_off_是在两者拼接后的偏移
+                struct iovec iov[2];
+                int cnt = 0;
+                if (sent_off_ < f.head.size())
+                    iov[cnt++] = {&f.head[sent_off_], f.head.size() - sent_off_};
+                size_t body_off = sent_off_ > f.head.size() ? sent_off_ - f.head.size() : 0;
+                iov[cnt++] = {&f.bytes[body_off], f.bytes.size() - body_off};
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = cnt;
+                ssize_t n = sendmsg(fd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return true;
+                    Disconnect();
+                    return false;
+                }
+                sent_off_ += n;
+                if (sent_off_ == f.head.size() + f.bytes.size())
+                {
+                    ++sent_;
+                    sent_off_ = 0;
+                }
+            }
+            return true;
+        }
+
+        void CloseSocket()
+        {
+            if (fd_ >= 0)
+                close(fd_);
+            fd_ = -1;
+            connecting_ = false;
+            sent_ = 0;//未确认的帧重连后从队头重发
+            sent_off_ = 0;
+            in_.clear();
+        }
+
+        void Disconnect()
+        {
+            CloseSocket();
+            Backoff();
+        }
+
+        void Backoff()
+        {
+            backoff_ms_ = backoff_ms_ == 0 ? 100 : std::min<size_t>(backoff_ms_ * 2, 5000);
+            next_connect_ = Clock::now() + std::chrono::milliseconds(backoff_ms_);
+        }
+
+    private:
+        struct sockaddr_in server_addr_;
+        const uint64_t session_;
+        uint64_t seq_ = 0;
+        int fd_ = -1;
+        bool connecting_ = false;
+        size_t backoff_ms_ = 0;
+        Clock::time_point next_connect_;
+        std::deque<PendingFrame> inflight_; // 未确认的帧，前sent_个已经发出
+        size_t sent_ = 0;
+        size_t sent_off_ = 0; // inflight_[sent_]已经发出的字节数
+        size_t mem_bytes_ = 0;
+        std::string http_path_;
+        std::string http_head_; // 请求头中Content-Length之前的固定部分
+        std::string in_;        // 还没解析完的确认或HTTP响应
+        std::string spool_path_;
+        int spool_fd_ = -1;
+        off_t spool_head_ = 0; // 下一个要读回内存的帧在文件中的位置
+        off_t spool_tail_ = 0;
+        std::atomic<uint64_t> frames_{0}, acked_{0}, spooled_{0}, dropped_{0}, reconnects_{0}, pending_bytes_{0}, spool_bytes_{0};
+    };
+} // namespace mylog
@@ -0,0 +1,325 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "Util.hpp"
+/*
+基于文件映射的日志环形缓冲区，用于进程崩溃后找回尚未落地的日志:
+(1)文件放在/dev/shm下(tmpfs，进程崩溃后内容仍在，机器重启后丢失)或普通目录下(mmap到磁盘文件);
+(2)AsyncWorker在把日志写入生产者缓冲区的同时，把同一份数据作为一条记录追加到环中；
+   消费者把一批数据交给落地方向之后，再把环的尾部推进到这批数据的末尾;
+(3)每条记录有状态标记，先写WRITING，数据拷贝完成后才改为COMMITTED，崩溃时写了一半的记录不会被恢复;
+(4)下次启动或用恢复工具打开环时，尾部到头部之间已提交的记录就是崩溃时还没落地的日志。
+环满时覆盖最旧的未落地记录，只影响崩溃取证的覆盖范围，不影响正常的落地。
+写入和推进尾部由调用方串行化(AsyncWorker中都在mtx_下进行)。
+*/
+namespace mylog
+{
+    class ShmRing
+    {
+    public:
+        using ptr = std::shared_ptr<ShmRing>;
+        using RecordCallback = std::function<void(const char *, size_t)>;
+
+        ~ShmRing()
+        {
+            if (base_ != nullptr)
+                munmap(base_, map_size_);
+            if (fd_ != -1)
+                close(fd_); // 关闭文件同时释放flock
+        }
+
+        // 打开已有的环(保留其中的内容用于恢复)，不存在或格式不对时按capacity新建；
+        // 另一个进程正在使用时返回nullptr
+        static ptr Open(const std::string &path, size_t capacity)
+        {
+            ptr ring(new ShmRing());
+            if (!ring->Map(path, capacity, MapMode::OPEN))
+                return nullptr;
+            return ring;
+        }
+
+        // 丢弃已有内容，按capacity重新创建
+        static ptr Create(const std::string &path, size_t capacity)
+        {
+            ptr ring(new ShmRing());
+            if (!ring->Map(path, capacity, MapMode::CREATE))
+                return nullptr;
+            return ring;
+        }
+
+        // 只打开已存在且格式正确的环，供恢复工具使用，不会创建或覆盖文件
+        static ptr Attach(const std::string &path)
+        {
+            ptr ring(new ShmRing());
+            if (!ring->Map(path, 0, MapMode::ATTACH))
+                return nullptr;
+            return ring;
+        }
+
+        // 追加一条记录，记录比整个环还大时不做镜像并返回false
+        bool Append(const char *data, size_t len)
+        {
+            size_t need = RecordSize(len);
+            if (need > header_->capacity)
+                return false;
+            uint64_t head = header_->head.load(std::memory_order_relaxed);
+            size_t room = header_->capacity - head % header_->capacity;
+            if (room < need) // 尾部放不下，填充到环的末尾后从头开始写
+            {
+                MakeRoom(head + room + need);
+                if (room >= sizeof(RecordHeader))
+                {
+                    RecordHeader *pad = At(head);
+                    pad->len = static_cast<uint32_t>(room - sizeof(RecordHeader));
+                    pad->seq = 0;
+                    pad->state.store(kPad, std::memory_order_release);
+                }
+                head += room;
+            }
+            else
+            {
+                MakeRoom(head + need);
+            }
+            RecordHeader *rec = At(head);
+            rec->state.store(kWriting, std::memory_order_relaxed);
+            rec->len = static_cast<uint32_t>(len);
+            rec->seq = header_->next_seq;
+            memcpy(reinterpret_cast<char *>(rec) + sizeof(RecordHeader), data, len);
+            rec->state.store(kCommitted, std::memory_order_release); // 数据写完才标记为已提交
+            header_->head.store(head + need, std::memory_order_release);
+            ++header_->next_seq;
+            header_->written += len;
+            return true;
+        }
+
+        // 当前写入位置，消费者交换缓冲区时记下它，落地完成后用它推进尾部
+        uint64_t Head() const { return header_->head.load(std::memory_order_acquire); }
+
+        // 位置pos之前的记录都已经落地
+        void MarkFlushed(uint64_t pos)
+        {
+            uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+            if (pos <= tail) // 环满时尾部可能已经被Append推过了pos
+                return;
+            header_->freed += pos - tail;
+            header_->tail.store(pos, std::memory_order_release);
+        }
+
+        // 按写入顺序回调尾部到头部之间的记录，返回恢复的记录数；
+        // 如果崩溃发生在记录已提交、头部还没更新之间，头部处序号为next_seq的那条记录也会被恢复
+        size_t Recover(const RecordCallback &cb)
+        {
+            uint64_t pos = header_->tail.load(std::memory_order_acquire);
+            uint64_t head = header_->head.load(std::memory_order_acquire);
+            size_t count = 0;
+            while (pos < head)
+            {
+                size_t room = header_->capacity - pos % header_->capacity;
+                if (room < sizeof(RecordHeader)) // 不足一个记录头的尾巴直接跳过
+                {
+                    pos += room;
+                    continue;
+                }
+                RecordHeader *rec = At(pos);
+                uint32_t state = rec->state.load(std::memory_order_acquire);
+                if (state == kPad)
+                {
+                    pos += room;
+                    continue;
+                }
+                if (state != kCommitted || RecordSize(rec->len) > room)
+                {
+                    std::cout << __FILE__ << __LINE__ << "shm ring corrupted at " << pos << std::endl;
+                    return count;
+                }
+                cb(reinterpret_cast<char *>(rec) + sizeof(RecordHeader), rec->len);
+                ++count;
+                pos += RecordSize(rec->len);
+            }
+
+            size_t room = header_->capacity - pos % header_->capacity;
+            if (room >= sizeof(RecordHeader) && pos - header_->tail.load(std::memory_order_relaxed) < header_->capacity)
+            {
+                RecordHeader *rec = At(pos);
+                if (rec->state.load(std::memory_order_acquire) == kCommitted &&
+                    rec->seq == header_->next_seq && RecordSize(rec->len) <= room)
+                {
+                    cb(reinterpret_cast<char *>(rec) + sizeof(RecordHeader), rec->len);
+                    ++count;
+                }
+            }
+            return count;
+        }
+
+        // 清空环，恢复完成后调用；数据区一并清零，旧的状态标记不会被误认为新记录
+        void Reset()
+        {
+            memset(data_, 0, header_->capacity);
+            header_->head.store(0, std::memory_order_relaxed);
+            header_->tail.store(0, std::memory_order_relaxed);
+            header_->written = header_->freed = 0;
+        }
+
+        size_t Capacity() const { return header_->capacity; }
+        uint64_t Written() const { return header_->written; } // 追加过的日志字节数
+        uint64_t Freed() const { return header_->freed; }      // 已经落地而释放的字节数
+        const std::string &Path() const { return path_; }
+
+    private:
+        static constexpr uint64_t kMagic = 0x474e49524c594d31ull; // "1MYLRING"
+        static constexpr uint32_t kVersion = 1;
+        static constexpr size_t kHeaderSize = 4096;
+        static constexpr uint32_t kWriting = 1, kCommitted = 2, kPad = 3;
+
+        struct RingHeader
+        {
+            uint64_t magic;
+            uint32_t version;
+            uint32_t reserved;
+            uint64_t capacity;               // 数据区大小
+            std::atomic<uint64_t> head;      // 逻辑写入位置(单调递增，对capacity取模得到物理位置)
+            std::atomic<uint64_t> tail;      // 逻辑落地位置
+            uint64_t next_seq;               // 下一条记录的序号
+            uint64_t written;
+            uint64_t freed;
+        };
+
+        struct RecordHeader
+        {
+            std::atomic<uint32_t> state;
+            uint32_t len;
+            uint64_t seq;
+        };
+        static_assert(sizeof(RecordHeader) == 16, "record header must stay 16 bytes");
+
+        enum class MapMode { OPEN, CREATE, ATTACH };
+
+        ShmRing() = default;
+
+        static size_t RecordSize(size_t len)
+        {
+            return (sizeof(RecordHeader) + len + 7) & ~static_cast<size_t>(7); // 8字节对齐
+        }
+
+        RecordHeader *At(uint64_t pos)
+        {
+            return reinterpret_cast<RecordHeader *>(data_ + pos % header_->capacity);
+        }
+
+        // 保证[tail, end)不超过capacity，不够时丢弃最旧的记录
+        void MakeRoom(uint64_t end)
+        {
+            uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+            while (end - tail > header_->capacity)
+            {
+                size_t room = header_->capacity - tail % header_->capacity;
+                if (room < sizeof(RecordHeader))
+                {
+                    tail += room;
+                    continue;
+                }
+                RecordHeader *rec = At(tail);
+                if (rec->state.load(std::memory_order_relaxed) == kPad)
+                    tail += room;
+                else
+                    tail += RecordSize(rec->len);
+            }
+            header_->tail.store(tail, std::memory_order_release);
+        }
+
+        bool Map(const std::string &path, size_t capacity, MapMode mode)
+        {
+            path_ = path;
+            capacity = (capacity + 4095) & ~static_cast<size_t>(4095);
+            if (capacity == 0)
+                capacity = 4096;
+            int flags = O_RDWR | O_CLOEXEC;
+            if (mode != MapMode::ATTACH)
+            {
+                Util::File::CreateDirectory(Util::File::Path(path));
+                flags |= O_CREAT;
+            }
+            fd_ = open(path.c_str(), flags, 0644);
+            if (fd_ == -1)
+            {
+                std::cout << __FILE__ << __LINE__ << "open shm ring failed " << path << std::endl;
+                perror(NULL);
+                return false;
+            }
+            if (flock(fd_, LOCK_EX | LOCK_NB) == -1) // 同一时刻只允许一个进程写同一个环
+            {
+                std::cout << __FILE__ << __LINE__ << "shm ring is in use " << path << std::endl;
+                return false;
+            }
+
+            struct stat st;
+            fstat(fd_, &st);
+            bool reuse = false;
+            if (mode != MapMode::CREATE && static_cast<size_t>(st.st_size) > kHeaderSize)
+            {
+                RingHeader old;
+                if (pread(fd_, &old, sizeof(old), 0) == static_cast<ssize_t>(sizeof(old)) &&
+                    old.magic == kMagic && old.version == kVersion &&
+                    old.capacity + kHeaderSize == static_cast<uint64_t>(st.st_size))
+                {
+                    capacity = old.capacity; // 按文件原有的大小映射，保证能恢复其中的记录
+                    reuse = true;
+                }
+            }
+            if (mode == MapMode::ATTACH && !reuse)
+            {
+                std::cout << __FILE__ << __LINE__ << "not a shm ring " << path << std::endl;
+                return false;
+            }
+            map_size_ = kHeaderSize + capacity;
+            if (!reuse && ftruncate(fd_, 0) == -1)
+                return false;
+            if (!reuse && ftruncate(fd_, map_size_) == -1)
+            {
+                std::cout << __FILE__ << __LINE__ << "resize shm ring failed " << path << std::endl;
+                perror(NULL);
+                return false;
+            }
+            void *base = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (base == MAP_FAILED)
+            {
+                std::cout << __FILE__ << __LINE__ << "mmap shm ring failed " << path << std::endl;
+                perror(NULL);
+                return false;
+            }
+            base_ = static_cast<char *>(base);
+            header_ = reinterpret_cast<RingHeader *>(base_);
+            data_ = base_ + kHeaderSize;
+            if (!reuse) // ftruncate出来的文件内容全为0，只需要填写头部
+            {
+                header_->capacity = capacity;
+                header_->head.store(0, std::memory_order_relaxed);
+                header_->tail.store(0, std::memory_order_relaxed);
+                header_->next_seq = 1;
+                header_->written = header_->freed = 0;
+                header_->version = kVersion;
+                header_->magic = kMagic;
+            }
+            return true;
+        }
+
+        std::string path_;
+        int fd_ = -1;
+        char *base_ = nullptr;
+        size_t map_size_ = 0;
+        RingHeader *header_ = nullptr;
+        char *data_ = nullptr;
+    };
+} // namespace mylog
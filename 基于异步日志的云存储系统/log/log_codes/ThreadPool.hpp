@@ -1,99 +1,267 @@
 #pragma once
+#include <algorithm>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include "Affinity.hpp"
 
+/*
+工作窃取(work-stealing)线程池:
+(1)每个工作线程有一个无锁的本地双端队列(Chase-Lev)，自己从底部取任务，空闲的线程从顶部窃取;
+(2)外部线程提交的任务进入注入队列(injection queue)，工作线程本地队列为空时从中批量取任务;
+(3)任务类型Task只能移动，小的可调用对象直接内联存储在Task内部，避免std::function和shared_ptr<packaged_task>的堆分配;
+(4)enqueue返回future用于获取结果，enqueue_detached不创建future，用于不关心结果的任务(如日志备份);
+(5)可以传入CPU列表，工作线程启动后绑定到这些CPU上(见Affinity.hpp)。
+*/
 class ThreadPool
 {
+public:
+    // 只能移动的任务，kInlineSize字节以内的可调用对象不做堆分配
+    class Task
+    {
+    public:
+        static constexpr size_t kInlineSize = 64;
+
+        Task() noexcept = default;
+
+        template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+        Task(F &&f)
+        {
+            using Fn = typename std::decay<F>::type;
+            if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+                          std::is_nothrow_move_constructible<Fn>::value)
+            {
+                ::new (static_cast<void *>(storage_)) Fn(std::forward<F>(f)); // 内联存储
+                ops_ = &InlineOps<Fn>::table;
+            }
+            else
+            {
+                *reinterpret_cast<Fn **>(storage_) = new Fn(std::forward<F>(f)); // 过大的对象退化为堆存储
+                ops_ = &HeapOps<Fn>::table;
+            }
+        }
+
+        Task(Task &&other) noexcept { MoveFrom(other); }
+        Task &operator=(Task &&other) noexcept
+        {
+            if (this != &other)
+            {
+                Reset();
+                MoveFrom(other);
+            }
+            return *this;
+        }
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task() { Reset(); }
+
+        void operator()() { ops_->invoke(storage_); }
+        explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    private:
+        struct Ops
+        {
+            void (*invoke)(void *);
+            void (*move)(void *from, void *to) noexcept; // 把from中的对象移动到to，并析构from中的对象
+            void (*destroy)(void *) noexcept;
+        };
+
+        template <class Fn>
+        struct InlineOps
+        {
+            static void Invoke(void *p) { (*static_cast<Fn *>(p))(); }
+            static void Move(void *from, void *to) noexcept
+            {
+                ::new (to) Fn(std::move(*static_cast<Fn *>(from)));
+                static_cast<Fn *>(from)->~Fn();
+            }
+            static void Destroy(void *p) noexcept { static_cast<Fn *>(p)->~Fn(); }
+            static constexpr Ops table{&Invoke, &Move, &Destroy};
+        };
+
+        template <class Fn>
+        struct HeapOps
+        {
+            static void Invoke(void *p) { (**static_cast<Fn **>(p))(); }
+            static void Move(void *from, void *to) noexcept { *static_cast<Fn **>(to) = *static_cast<Fn **>(from); }
+            static void Destroy(void *p) noexcept { delete *static_cast<Fn **>(p); }
+            static constexpr Ops table{&Invoke, &Move, &Destroy};
+        };
+
+        void MoveFrom(Task &other) noexcept
+        {
+            if (other.ops_ == nullptr)
+                return;
+            other.ops_->move(other.storage_, storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+
+        void Reset() noexcept
+        {
+            if (ops_ != nullptr)
+            {
+                ops_->destroy(storage_);
+                ops_ = nullptr;
+            }
+        }
+
+        alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+        const Ops *ops_ = nullptr;
+    };
+
+private:
+    /*
+    Chase-Lev无锁双端队列(定长环形数组):
+    只有所属的工作线程调用Push/Pop(操作bottom_)，其他线程调用Steal(CAS竞争top_)。
+    Task不是平凡类型，不能像指针一样在CAS之前读出，所以窃取者先CAS抢到下标再移动出任务，
+    每个槽位用full标记是否已被取走，防止所属线程在窃取者移动完成之前覆盖该槽位。
+    */
+    class WorkStealingDeque
+    {
+    public:
+        static constexpr int64_t kCapacity = 1024; // 必须是2的幂，满了以后任务改投注入队列
+
+        bool Push(Task &task)
+        {
+            int64_t b = bottom_.load(std::memory_order_relaxed);
+            int64_t t = top_.load(std::memory_order_acquire);
+            if (b - t >= kCapacity)
+                return false;
+            Slot &slot = slots_[b & (kCapacity - 1)];
+            if (slot.full.load(std::memory_order_acquire)) // 窃取者还没把旧任务移走
+                return false;
+            slot.task = std::move(task);
+            slot.full.store(true, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool Pop(Task &out)
+        {
+            int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top_.load(std::memory_order_relaxed);
+            if (t > b) // 队列为空
+            {
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            if (t == b) // 只剩最后一个任务，和窃取者竞争
+            {
+                if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    bottom_.store(b + 1, std::memory_order_relaxed);
+                    return false;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+            Take(b, out);
+            return true;
+        }
+
+        bool Steal(Task &out)
+        {
+            int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom_.load(std::memory_order_acquire);
+            if (t >= b)
+                return false;
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return false; // 被其他线程抢先，由调用者换一个队列再试
+            Take(t, out);
+            return true;
+        }
+
+    private:
+        struct Slot
+        {
+            std::atomic<bool> full{false};
+            Task task;
+        };
+
+        void Take(int64_t index, Task &out)
+        {
+            Slot &slot = slots_[index & (kCapacity - 1)];
+            out = std::move(slot.task);
+            slot.full.store(false, std::memory_order_release);
+        }
+
+        alignas(64) std::atomic<int64_t> top_{0};
+        alignas(64) std::atomic<int64_t> bottom_{0};
+        std::unique_ptr<Slot[]> slots_{new Slot[kCapacity]};
+    };
+
 public:
     /*用于初始化线程池，启动指定数量的线程。
-    对于每个线程，使用 std::thread 创建一个新线程，并定义线程的执行体。
-    在 lambda 函数中，线程会进入一个无限循环，不断尝试从任务队列中获取任务。
-    使用 std::unique_lock<std::mutex> 加锁，确保线程安全地访问任务队列。
-   调用 condition.wait(lock, [this]{ return this->stop || !this->tasks.empty(); }) 使线程进入等待状态，直到满足以下两个条件之一：线程池停止（stop 为 true）或任务队列不为空。
-   如果线程池停止且任务队列为空，线程会退出循环。
-    从任务队列中取出一个任务，并将其移动到局部变量 task 中，然后解锁。
-     执行取出的任务。
+    每个线程依次尝试：本地队列 -> 注入队列 -> 窃取其他线程的队列，都没有任务时在条件变量上休眠，空闲时不占用CPU。
+    析构时线程池会先把已提交的任务执行完再退出。cpus不为空时所有工作线程绑定到这些CPU上。
      */
-    ThreadPool(size_t threads) // 启动部分线程
-        : stop(false)
+    ThreadPool(size_t threads, std::vector<int> cpus = {}) // 启动部分线程
+        : stop(false), cpus_(std::move(cpus))
     {
+        if (threads == 0)
+            threads = 1;
+        for (size_t i = 0; i < threads; ++i)
+            queues.emplace_back(new WorkStealingDeque());
         for (size_t i = 0; i < threads; ++i)//直接使用可调用函数进行原地构造效率更高，若先单独初始化thread,会多一次临时对象的构造和移动操作
         {
-            workers.emplace_back(
-                [this]
-                {
-                    for (;;)
-                    {
-                        std::function<void()> task;
-                        {
-                            std::unique_lock<std::mutex> lock(this->queue_mutex);
-                            // 等待任务队列不为空或线程池停止
-                            this->condition.wait(lock,
-                                                 [this]
-                                                 { return this->stop || !this->tasks.empty(); });
-                            if (this->stop && this->tasks.empty())
-                                return;
-                            //取出任务
-                            task = std::move(this->tasks.front());
-                            this->tasks.pop();
-                        }
-                        // 执行任务
-                        task();
-                    }
-                });
+            workers.emplace_back([this, i]
+                                 { WorkerLoop(i); });
         }
     }
     template <class F, class... Args>
     // 该函数用于将一个新任务添加到任务队列中，并返回一个 std::future 对象，用于获取任务的执行结果。
-    // 使用 std::packaged_task 将传入的函数 f 和参数 args 打包成一个可调用对象。
-    // 通过 task->get_future() 获取一个 std::future 对象，用于异步获取任务的返回值。
-    // 使用 std::unique_lock<std::mutex> 加锁，确保线程安全地访问任务队列。
-    // 检查线程池是否已经停止，如果停止则抛出异常。
-    // 将打包好的任务封装成一个 lambda 函数，并添加到任务队列中。
-    // 调用 condition.notify_one() 唤醒一个等待的线程，通知它有新任务可用。
-    // 返回 std::future 对象。
+    // packaged_task 本身只能移动，直接放进 Task 里，不再需要 shared_ptr 包一层。
+    // 如果线程池已经停止则抛出异常。
     auto enqueue(F &&f, Args &&...args)
-        -> std::future<typename std::result_of<F(Args...)>::type>//接受任意任务及其参数，返回future对象用于捕获异步结果
+        -> std::future<typename std::invoke_result<F, Args...>::type>//接受任意任务及其参数，返回future对象用于捕获异步结果
     {
-        /*
-        // 错误写法：编译时不知道 F 和 Args 是什么，无法直接写返回类型
-        template<typename F, typename... Args>
-          std::result_of<F(Args...)>::type enqueue(F&& f, Args&&... args) { ... }
-          尾置返回类型允许在参数列表之后声明返回类型，此时 F 和 Args 已经是已知的。
-        */
-        using return_type = typename std::result_of<F(Args...)>::type;//确定返回值类型
-
-        // 创建一个打包任务
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
+        using return_type = typename std::invoke_result<F, Args...>::type;//确定返回值类型
+
+        std::packaged_task<return_type()> task(
             std::bind(std::forward<F>(f), std::forward<Args>(args)...));//完美转发避免不必要拷贝==>返回值是return_type,无参数
+        std::future<return_type> res = task.get_future();
+        Submit(Task(std::move(task)));
+        return res;
+    }
 
-        /*
-        // 假设 F 是 int foo(int, double)，args 是 (42, 3.14)
-                auto task = std::make_shared<std::packaged_task<int()>>(
-                    []() { return foo(42, 3.14); }  // 绑定参数后的 Lambda
-                );
-        */
+    // 不返回future的提交方式，适合不关心执行结果的任务，省去promise/future共享状态的分配。
+    // 没有future接住异常，任务抛出的异常在这里捕获并打印，否则会逃出工作线程导致std::terminate
+    template <class F, class... Args>
+    void enqueue_detached(F &&f, Args &&...args)
+    {
+        Submit(Task([fn = std::forward<F>(f), params = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                    {
+                        try
+                        {
+                            std::apply(fn, std::move(params));
+                        }
+                        catch (const std::exception &e)
+                        {
+                            fprintf(stderr, "detached task exited with exception: %s\n", e.what());
+                        }
+                        catch (...)
+                        {
+                            fprintf(stderr, "detached task exited with unknown exception\n");
+                        } }));
+    }
 
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
+    size_t size() const { return workers.size(); }
 
-            if (stop)// 如果线程池已停止，抛出异常
-                throw std::runtime_error("enqueue on stopped ThreadPool");
-            // 将任务添加到任务队列
-            tasks.emplace([task]()
-                          { (*task)(); });
-        }
-        condition.notify_one();
-        return res;
-    }
     ~ThreadPool()
     {
         {
@@ -108,9 +276,91 @@ public:
     }
 
 private:
-    std::vector<std::thread> workers;        // 线程们
-    std::queue<std::function<void()>> tasks; // 任务队列
-    std::mutex queue_mutex;                  // 任务队列的互斥锁
-    std::condition_variable condition;       // 条件变量，用于任务队列的同步
-    bool stop;
-};
\ No newline at end of file
+    void Submit(Task &&task)
+    {
+        // 工作线程内部提交的任务放入自己的本地队列，析构排空队列期间这些子任务仍然允许提交，
+        // 提交者自己还没退出，回到WorkerLoop时pending>0，会把它执行完
+        if (tls_pool_ == this && queues[tls_index_]->Push(task))
+        {
+            pending.fetch_add(1, std::memory_order_seq_cst);
+        }
+        else
+        {
+            // 外部线程提交的任务放入注入队列。stop在锁内检查，pending也在锁内增加：
+            // 析构函数在锁内置stop，工作线程在锁内判断退出条件，所以任务要么被拒绝，要么一定会被执行
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            if (stop.load(std::memory_order_relaxed) && tls_pool_ != this)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+            tasks.emplace_back(std::move(task));
+            pending.fetch_add(1, std::memory_order_seq_cst);
+        }
+        if (sleepers.load(std::memory_order_seq_cst) > 0)
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);//加锁保证不会错过正在进入休眠的线程
+            condition.notify_one();
+        }
+    }
+
+    // 从注入队列取一个任务，并顺带搬一批到本地队列，后续可以无锁地执行或被其他线程窃取
+    bool PopInjected(size_t index, Task &out)
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (tasks.empty())
+            return false;
+        out = std::move(tasks.front());
+        tasks.pop_front();
+        size_t batch = std::min<size_t>(tasks.size() / workers.size(), 32);
+        while (batch-- > 0 && queues[index]->Push(tasks.front()))
+            tasks.pop_front();
+        return true;
+    }
+
+    bool StealFromOthers(size_t index, Task &out)
+    {
+        size_t n = queues.size();
+        for (size_t k = 1; k < n; ++k)
+        {
+            if (queues[(index + k) % n]->Steal(out))
+                return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(size_t index)
+    {
+        mylog::Affinity::PinCurrentThread(cpus_);
+        tls_pool_ = this;
+        tls_index_ = index;
+        for (;;)
+        {
+            Task task;
+            if (queues[index]->Pop(task) || PopInjected(index, task) || StealFromOthers(index, task))
+            {
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                task();// 执行任务
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            // 等待有新任务或线程池停止
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            condition.wait(lock, [this]
+                           { return stop.load() || pending.load(std::memory_order_seq_cst) > 0; });
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+            if (stop.load() && pending.load() <= 0)
+                return;
+        }
+    }
+
+    std::vector<std::thread> workers;                        // 线程们
+    std::vector<std::unique_ptr<WorkStealingDeque>> queues;  // 每个线程的本地队列
+    std::deque<Task> tasks;                                  // 注入队列，外部线程提交的任务
+    std::mutex queue_mutex;                                  // 注入队列的互斥锁
+    std::condition_variable condition;                       // 条件变量，用于空闲线程的休眠与唤醒
+    std::atomic<int64_t> pending{0};                         // 已提交但尚未被取走的任务数
+    std::atomic<int> sleepers{0};                            // 正在休眠的线程数
+    std::atomic<bool> stop;
+    std::vector<int> cpus_;                                  // 工作线程绑定的CPU，为空表示不绑定
+
+    static inline thread_local ThreadPool *tls_pool_ = nullptr; // 当前线程所属的线程池(非工作线程为nullptr)
+    static inline thread_local size_t tls_index_ = 0;
+};
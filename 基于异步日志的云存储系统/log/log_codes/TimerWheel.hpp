@@ -0,0 +1,307 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+/*
+分层时间轮(hierarchical timing wheel)，由一个定时器线程驱动:
+    4层 x 256个槽，tick为1ms，第0层覆盖256ms，第1层65.5s，第2层4.6h，第3层约49天；
+    定时器节点放在预分配的节点池里，槽内用下标组成双向链表，插入和取消都是O(1)；
+    句柄里带有节点的代数(generation)，节点复用后旧句柄取消不会误删新定时器；
+    没有定时器时线程阻塞在条件变量上，有定时器时只在最近的到期点或第0层转完一圈时醒来。
+回调在定时器线程中执行，耗时操作应由回调投递到其他线程。
+*/
+namespace mylog
+{
+    class TimerWheel
+    {
+    public:
+        using Callback = std::function<void()>;
+
+        struct TimerId
+        {
+            uint32_t index = kNil;
+            uint32_t generation = 0;
+            bool Valid() const { return index != kNil; }
+        };
+
+        TimerWheel() : start_(std::chrono::steady_clock::now())
+        {
+            for (auto &level : slots_)
+                for (auto &head : level)
+                    head = kNil;
+        }
+        ~TimerWheel() { Stop(); }
+
+        TimerWheel(const TimerWheel &) = delete;
+        TimerWheel &operator=(const TimerWheel &) = delete;
+
+        // delay之后在定时器线程中执行cb，返回可用于取消的句柄
+        TimerId Schedule(std::chrono::milliseconds delay, Callback cb)
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (stop_)
+                return TimerId();
+            if (!thread_.joinable())
+                thread_ = std::thread(&TimerWheel::ThreadEntry, this);
+
+            uint64_t now = NowTick();
+            if (count_ == 0 && now > current_)
+                current_ = now; // 空闲期间没有推进时间轮，直接跳到当前时刻
+            uint64_t ticks = delay.count() > 0 ? static_cast<uint64_t>(delay.count()) : 0;
+            uint32_t index = AllocNode();
+            Node &node = nodes_[index];
+            // NowTick向下取整，多加一个tick保证不会提前触发；同时到期时刻至少在下一个tick，不会落在已经处理过的槽里
+            node.expire = std::max(now + ticks + 1, current_ + 1);
+            node.cb = std::move(cb);
+            Place(index);
+            ++count_;
+
+            TimerId id{index, node.generation};
+            if (node.expire < next_wake_)
+            {
+                lock.unlock();
+                cv_.notify_one(); // 比线程当前等待的时刻更早，唤醒它重新计算
+            }
+            return id;
+        }
+
+        // 取消尚未执行的定时器，已经执行或已经取消时返回false
+        bool Cancel(TimerId id)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (id.index >= nodes_.size())
+                return false;
+            Node &node = nodes_[id.index];
+            if (!node.active || node.generation != id.generation)
+                return false;
+            Unlink(id.index);
+            FreeNode(id.index);
+            --count_;
+            return true;
+        }
+
+        // 尚未到期的定时器数量
+        size_t Size()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            return count_;
+        }
+
+        // 停止定时器线程，未到期的定时器不再执行，它们的回调被丢弃(捕获的promise随之析构，等待方得到broken_promise)；
+        // 之后再调用Schedule会重新启动定时器线程
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            if (thread_.joinable())
+                thread_.join();
+
+            std::vector<Callback> dropped;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                for (uint32_t i = 0; i < nodes_.size(); ++i)
+                {
+                    if (!nodes_[i].active)
+                        continue;
+                    dropped.push_back(std::move(nodes_[i].cb));
+                    FreeNode(i);
+                }
+                for (auto &level : slots_)
+                    for (auto &head : level)
+                        head = kNil;
+                count_ = 0;
+                next_wake_ = UINT64_MAX;
+                stop_ = false;
+            }
+            // 回调捕获的对象在锁外析构，析构中再调用Schedule/Cancel不会死锁
+        }
+
+    private:
+        static constexpr uint32_t kNil = UINT32_MAX;
+        static constexpr int kLevels = 4;
+        static constexpr int kSlotBits = 8;
+        static constexpr uint64_t kSlots = 1ull << kSlotBits;
+        static constexpr uint64_t kSlotMask = kSlots - 1;
+
+        struct Node
+        {
+            uint64_t expire = 0;
+            Callback cb;
+            uint32_t prev = kNil;
+            uint32_t next = kNil;
+            uint32_t generation = 0;
+            uint16_t slot = 0; // level * kSlots + index，用于O(1)摘除
+            bool active = false;
+        };
+
+        uint64_t NowTick() const
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - start_)
+                .count();
+        }
+
+        uint32_t AllocNode()
+        {
+            uint32_t index;
+            if (free_head_ != kNil)
+            {
+                index = free_head_;
+                free_head_ = nodes_[index].next;
+            }
+            else
+            {
+                index = static_cast<uint32_t>(nodes_.size());
+                nodes_.emplace_back();
+            }
+            Node &node = nodes_[index];
+            node.active = true;
+            node.prev = node.next = kNil;
+            return index;
+        }
+
+        void FreeNode(uint32_t index)
+        {
+            Node &node = nodes_[index];
+            node.active = false;
+            node.cb = nullptr;
+            ++node.generation;
+            node.next = free_head_;
+            free_head_ = index;
+        }
+
+        // 按距离当前tick的远近放入对应层，层内的槽由到期时刻对应的位决定
+        void Place(uint32_t index)
+        {
+            Node &node = nodes_[index];
+            uint64_t delta = node.expire - current_;
+            int level = 0;
+            while (level < kLevels - 1 && delta >= (1ull << (kSlotBits * (level + 1))))
+                ++level;
+            uint64_t expire = node.expire;
+            if (level == kLevels - 1 && delta >= (1ull << (kSlotBits * kLevels)))
+                expire = current_ + (1ull << (kSlotBits * kLevels)) - 1; // 超出范围的先放在最远的槽，级联时再放置
+            uint16_t slot = static_cast<uint16_t>(level * kSlots + ((expire >> (kSlotBits * level)) & kSlotMask));
+            uint32_t &head = slots_[level][slot % kSlots];
+            node.slot = slot;
+            node.prev = kNil;
+            node.next = head;
+            if (head != kNil)
+                nodes_[head].prev = index;
+            head = index;
+        }
+
+        void Unlink(uint32_t index)
+        {
+            Node &node = nodes_[index];
+            uint32_t &head = slots_[node.slot / kSlots][node.slot % kSlots];
+            if (node.prev != kNil)
+                nodes_[node.prev].next = node.next;
+            else
+                head = node.next;
+            if (node.next != kNil)
+                nodes_[node.next].prev = node.prev;
+        }
+
+        // 把上层一个槽里的节点重新放置到更低的层
+        void Cascade(int level)
+        {
+            uint64_t idx = (current_ >> (kSlotBits * level)) & kSlotMask;
+            if (idx == 0 && level + 1 < kLevels)
+                Cascade(level + 1);
+            uint32_t index = slots_[level][idx];
+            slots_[level][idx] = kNil;
+            while (index != kNil)
+            {
+                uint32_t next = nodes_[index].next;
+                Place(index);
+                index = next;
+            }
+        }
+
+        // 时间轮前进一个tick，把到期的回调取出到due中
+        void Advance(std::vector<Callback> &due)
+        {
+            ++current_;
+            uint64_t idx = current_ & kSlotMask;
+            if (idx == 0)
+                Cascade(1);
+            uint32_t index = slots_[0][idx];
+            slots_[0][idx] = kNil;
+            while (index != kNil)
+            {
+                uint32_t next = nodes_[index].next;
+                due.push_back(std::move(nodes_[index].cb));
+                FreeNode(index);
+                --count_;
+                index = next;
+            }
+        }
+
+        // 下一次需要醒来的tick: 第0层中最近的非空槽，或第0层转完一圈需要级联的时刻
+        uint64_t NextWakeTick() const
+        {
+            uint64_t idx = current_ & kSlotMask;
+            for (uint64_t i = idx + 1; i < kSlots; ++i)
+                if (slots_[0][i] != kNil)
+                    return current_ + (i - idx);
+            return (current_ | kSlotMask) + 1;
+        }
+
+        void ThreadEntry()
+        {
+            std::vector<Callback> due;
+            std::unique_lock<std::mutex> lock(mtx_);
+            while (!stop_)
+            {
+                if (count_ == 0)
+                {
+                    next_wake_ = UINT64_MAX;
+                    cv_.wait(lock, [this]
+                             { return stop_ || count_ > 0; });
+                    continue;
+                }
+                uint64_t now = NowTick();
+                while (current_ < now && count_ > 0)
+                    Advance(due);
+                if (count_ == 0 && current_ < now)
+                    current_ = now;
+                if (!due.empty())
+                {
+                    lock.unlock();
+                    for (auto &cb : due)
+                        cb();
+                    due.clear();
+                    lock.lock();
+                    continue; // 回调执行期间时间在流逝，重新检查
+                }
+                if (count_ == 0)
+                    continue;
+                next_wake_ = NextWakeTick();
+                cv_.wait_until(lock, start_ + std::chrono::milliseconds(next_wake_));
+            }
+        }
+
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        std::thread thread_;
+        bool stop_ = false;
+
+        const std::chrono::steady_clock::time_point start_;
+        uint64_t current_ = 0;              // 时间轮已经处理到的tick
+        uint64_t next_wake_ = UINT64_MAX;   // 定时器线程计划醒来的tick
+        size_t count_ = 0;
+
+        std::vector<Node> nodes_;           // 节点池，下标即句柄
+        uint32_t free_head_ = kNil;         // 空闲节点链表
+        uint32_t slots_[kLevels][kSlots];   // 每个槽的链表头
+    };
+} // namespace mylog
@@ -3,9 +3,14 @@
 #include<sys/types.h>
 #include<jsoncpp/json/json.h>
 
+#include<atomic>
+#include<cstdlib>
 #include<ctime>
 #include<fstream>
 #include<iostream>
+#include<mutex>
+#include<sstream>
+#include "Level.hpp"
 using std::cout;
 using std::endl;
 
@@ -52,6 +57,7 @@ namespace mylog
                             if(pos==std::string::npos)//未找到分割符，即当前是最后一级目录
                             {
                                 mkdir(pathname.c_str(),0755);//创建目录
+                                break;//最后一级已处理，否则index=npos+1会回到0，陷入死循环
                             }
                             if(pos==index)//跳过连续的分割符
                             {
@@ -146,28 +152,75 @@ namespace mylog
                     std::cout <<__FILE__<<__LINE__<<"parse error" << err<<std::endl;
                     return false;
                 }
-                return false;
+                return true;
 
            }
       };
-      /*单例模式的配置管理类，用于从JSON中配置文件加载日志系统的参数*/
+      /*
+      配置管理类，用于从JSON配置文件加载日志系统的参数。
+      每次加载得到一个不可变的配置快照，通过原子指针发布，热路径上读取配置只需要一次原子load；
+      Reload/Publish生成新快照替换旧快照，旧快照不释放(读者可能还持有指针，重载次数很少，占用可以忽略)。
+      配置文件路径默认为 ../../log_system/logs_code/config.conf，可以用环境变量 MYLOG_CONFIG 覆盖。
+      thread_count、shm_ring_*、crash_handler、*_cpus 只在启动时生效，其余参数在下一个安全点(刷盘、交换缓冲区、写日志)生效。
+      */
         struct JsonData{
-            static JsonData* GetJsonData()//加载config.conf到内存
+            static JsonData* GetJsonData()//当前生效的配置快照，第一次调用时加载配置文件
+            {
+               JsonData* cur = current_.load(std::memory_order_acquire);
+               if (cur != nullptr)
+                   return cur;
+               static std::once_flag once;
+               std::call_once(once, []() {
+                   JsonData* data = new JsonData;
+                   data->Load(ConfigPath());
+                   current_.store(data, std::memory_order_release);
+               });
+               return current_.load(std::memory_order_acquire);
+            }
+
+            static std::string ConfigPath()
+            {
+                const char* env = getenv("MYLOG_CONFIG");
+                if (env != nullptr && env[0] != '\0')
+                    return env;
+                return "../../log_system/logs_code/config.conf";
+            }
+
+            // 重新读取配置文件，读取或解析失败时保留原来的配置并返回false
+            static bool Reload(const std::string& path = ConfigPath())
             {
-               static JsonData* json_data = new JsonData;
-               return json_data;
-            }//单例模式
+                JsonData data(*GetJsonData());
+                if (!data.Load(path))
+                    return false;
+                Publish(data);
+                return true;
+            }
+
+            // 发布一份新的配置快照(程序内修改配置也走这里，而不是直接改当前快照)
+            static void Publish(const JsonData& data)
+            {
+                std::lock_guard<std::mutex> lock(PublishMutex());
+                JsonData* next = new JsonData(data);
+                next->version = GetJsonData()->version + 1;
+                current_.store(next, std::memory_order_release);
+            }
+
             private:
-                JsonData(){
+                JsonData() = default;
+
+                bool Load(const std::string& path)
+                {
                 std::string content;
                 mylog::Util::File file;
-                if (file.GetContent(&content, "../../log_system/logs_code/config.conf") == false)//读取日志文件内容
+                if (file.GetContent(&content, path) == false)//读取日志文件内容
                 {
                     std::cout << __FILE__ << __LINE__ << "open config.conf failed" << std::endl;
                     perror(NULL);
+                    return false;
                 }
                 Json::Value root;//解析json
-                mylog::Util::JsonUtil::UnSerialize(content, &root); // 反序列化，反序列化字符串为 Json::Value 对象 root。
+                if (!mylog::Util::JsonUtil::UnSerialize(content, &root)) // 反序列化，反序列化字符串为 Json::Value 对象 root。
+                    return false;
                 buffer_size = root["buffer_size"].asInt64();//初始化成员变量
                 threshold = root["threshold"].asInt64();//buffer_size和threshold决定日志缓冲区的内存管理策略
                 linear_growth = root["linear_growth"].asInt64();
@@ -175,15 +228,66 @@ namespace mylog
                 backup_addr = root["backup_addr"].asString();
                 backup_port = root["backup_port"].asInt();
                 thread_count = root["thread_count"].asInt();
-            }
+                shm_ring_dir = root["shm_ring_dir"].asString();
+                shm_ring_size = root["shm_ring_size"].asUInt64();
+                crash_handler = root["crash_handler"].asBool();
+                log_level = ParseLevel(root["log_level"].asString());
+                backend_cpus = root["backend_cpus"].asString();
+                pool_cpus = root["pool_cpus"].asString();
+                scheduler_cpus = root["scheduler_cpus"].asString();
+                reserved_cpus = root["reserved_cpus"].asString();
+                huge_pages = root["huge_pages"].asString();
+                buffer_idle_ms = root["buffer_idle_ms"].asUInt64();
+                large_payload_size = root["large_payload_size"].asUInt64();
+                fatal_sync = root["fatal_sync"].asBool();
+                remote_budget_ms = root["remote_budget_ms"].asUInt64();
+                remote_window = root["remote_window"].asUInt64();
+                remote_spool_dir = root["remote_spool_dir"].asString();
+                remote_codec = root["remote_codec"].asString();
+                return true;
+                }
+
+                static LogLevel::value ParseLevel(const std::string& name)
+                {
+                    for (auto level : {LogLevel::value::DEBUG, LogLevel::value::INFO, LogLevel::value::WARN,
+                                       LogLevel::value::ERROR, LogLevel::value::FATAL})
+                        if (name == LogLevel::ToString(level))
+                            return level;
+                    return LogLevel::value::DEBUG;//未配置时输出所有等级
+                }
+
+                static std::mutex& PublishMutex()
+                {
+                    static std::mutex mtx;
+                    return mtx;
+                }
+
+                static inline std::atomic<JsonData*> current_{nullptr};
             public:
-                size_t buffer_size;//缓冲区基础容量
-                size_t threshold;// 倍数扩容阈值
-                size_t linear_growth;// 线性增长容量
-                size_t flush_log;//控制日志同步到磁盘的时机，默认为0,1调用fflush，2调用fsync
+                size_t buffer_size = 0;//缓冲区基础容量
+                size_t threshold = 0;// 倍数扩容阈值
+                size_t linear_growth = 0;// 线性增长容量
+                size_t flush_log = 0;//控制日志同步到磁盘的时机，默认为0,1调用fflush，2调用fsync
                 std::string backup_addr;
-                uint16_t backup_port;
-                size_t thread_count;
+                uint16_t backup_port = 0;
+                size_t thread_count = 0;
+                std::string shm_ring_dir;//崩溃恢复用的共享内存环所在目录(如/dev/shm/mylog/)，为空表示不启用
+                size_t shm_ring_size = 0;//每个日志器的环大小
+                bool crash_handler = false;//是否在致命信号时把未落地的日志写到落地文件
+                LogLevel::value log_level = LogLevel::value::DEBUG;//低于该等级的日志直接丢弃
+                std::string backend_cpus;//日志消费者线程绑定的CPU列表，如"2-3"，为空不绑定
+                std::string pool_cpus;//线程池(备份、业务任务)工作线程绑定的CPU列表
+                std::string scheduler_cpus;//TaskScheduler工作线程绑定的CPU列表
+                std::string reserved_cpus;//留给事件循环的CPU，以上三类线程都会避开
+                std::string huge_pages;//日志缓冲区是否使用大页："thp"透明大页，"explicit"预留大页(失败时退回thp)，其他值不使用
+                size_t buffer_idle_ms = 0;//日志缓冲区空闲多久后收缩并归还内存，0表示不收缩
+                size_t large_payload_size = 0;//日志体达到该大小时不拷贝进缓冲区，落地时用writev直接写出，0表示不启用
+                bool fatal_sync = false;//FATAL日志是否等到fdatasync完成才返回
+                size_t remote_budget_ms = 0;//远程落地每批最多占用异步线程的时间(毫秒)
+                size_t remote_window = 0;//远程落地在内存中保留的未确认数据上限，超过后写入落盘文件
+                std::string remote_spool_dir;//远程落地断网时的落盘目录，为空表示不落盘(超过窗口的数据丢弃)
+                std::string remote_codec;//远程落地的压缩方式："lz4"、"zstd"，其他值不压缩
+                uint64_t version = 0;//快照版本号，每发布一次加一，用于判断配置是否变化
         };
 
     }
@@ -10,22 +10,23 @@
 #include"../Util.hpp"
 
 /*客户端 必须指定服务端的ip和port*/
-extern mylog::Util::JsonData *g_conf_data;//JsonData格式的数据
 void start_backup(const std::string &message)
 {
     int fd=socket(AF_INET,SOCK_STREAM,0);
-    if(ld>0)
+    if(fd<0)
     {
         std::cout << __FILE__ << __LINE__ << "socket error : " << strerror(errno) << std::endl;
         perror(NULL);
+        return;
     }
+    const mylog::Util::JsonData *conf = mylog::Util::JsonData::GetJsonData();//每次备份读取当前配置，备份目标可以热加载
     struct sockaddr_in server_addr;
     memset(&server_addr,0,sizeof(server_addr));
     server_addr.sin_family=AF_INET;
-    server_addr.sin_port=htons(g_conf_data->backup_port);
-    inet_aton(g_conf_data->backup_addr.c_str(),&(server_addr.sin_addr));
+    server_addr.sin_port=htons(conf->backup_port);
+    inet_aton(conf->backup_addr.c_str(),&(server_addr.sin_addr));
     int cnt=5;
-    while(connet(fd,(struct sockaddr*)&server_addr,sizeof(server_addr)))
+    while(connect(fd,(struct sockaddr*)&server_addr,sizeof(server_addr)))
     {
         std::cout << "正在尝试重连,重连次数还有: " << cnt-- << std::endl;//最多重连五次
         if (cnt <= 0)
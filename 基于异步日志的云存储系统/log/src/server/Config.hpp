@@ -17,6 +17,21 @@ namespace storage
         std::string low_storage_dir_;     // 浅度存储文件的存储路径
         std::string storage_info_;     // 已存储文件的信息
         int bundle_format_;//深度存储的文件后缀，由选择的压缩格式确定
+        std::string ingest_dir_;       // 接收的远程日志分段文件所在目录
+        size_t ingest_segment_size_;   // 分段超过该大小后封存进深度存储
+        size_t ingest_buffer_size_;    // 每个来源的内存写缓冲大小
+        size_t ingest_max_pending_;    // 积压的请求体上限，超过后回复503
+        size_t search_block_size_;     // 检索时每个任务扫描的块大小
+        size_t search_max_matches_;    // 一次检索最多返回的行数
+        bool index_enable_;            // 是否在后台为深度存储的文件建立倒排索引
+        size_t index_block_size_;      // 倒排索引中一个块对应的解压后数据大小
+        int event_loops_;              // 事件循环(线程)个数，0表示与CPU核数相同
+        size_t io_threads_;            // 执行压缩、解压和文件读写的IO线程个数
+        size_t upload_inflight_limit_; // 每个上传已从socket读出、还没写进文件的字节数上限
+        size_t deep_block_size_;       // 深度存储文件中每块压缩前的大小
+        size_t deep_threads_;          // 分块并行压缩、解压的线程数，0表示与CPU核数相同
+        size_t deep_cache_size_;       // 缓存解压后的深度存储块的内存上限，0表示不缓存
+        size_t storage_wal_compact_size_; // 元数据日志超过该大小(且不小于快照)后压缩进快照
     private:
         static std::mutex _mutex;
         static Config *_instance;
@@ -44,7 +59,10 @@ namespace storage
             }
 
             Json::Value root;
-            storage::JsonUtil::UnSerialize(content, &root); // 反序列化，把内容转成jaon value格式
+            if (!storage::JsonUtil::UnSerialize(content, &root)) // 反序列化，把内容转成jaon value格式
+            {
+                return false;
+            }
 
             // 要记得转换的时候用上asint，asstring这种函数，json的数据类型是Value。
             server_port_ = root["server_port"].asInt();
@@ -54,7 +72,23 @@ namespace storage
             deep_storage_dir_ = root["deep_storage_dir"].asString();
             low_storage_dir_ = root["low_storage_dir"].asString();
             bundle_format_ = root["bundle_format"].asInt();
-            
+            // 后加的配置项给出默认值，旧的配置文件没有这些键时按默认值运行，而不是得到0
+            ingest_dir_ = root.get("ingest_dir", "./ingest/").asString();
+            ingest_segment_size_ = root.get("ingest_segment_size", 67108864).asUInt64();
+            ingest_buffer_size_ = root.get("ingest_buffer_size", 4194304).asUInt64();
+            ingest_max_pending_ = root.get("ingest_max_pending", 268435456).asUInt64();
+            search_block_size_ = root.get("search_block_size", 4194304).asUInt64();
+            search_max_matches_ = root.get("search_max_matches", 100000).asUInt64();
+            index_enable_ = root.get("index_enable", true).asBool();
+            index_block_size_ = root.get("index_block_size", 1048576).asUInt64();
+            event_loops_ = root.get("event_loops", 0).asInt();
+            io_threads_ = root.get("io_threads", 4).asUInt64();
+            upload_inflight_limit_ = root.get("upload_inflight_limit", 8388608).asUInt64();
+            deep_block_size_ = root.get("deep_block_size", 1048576).asUInt64();
+            deep_threads_ = root.get("deep_threads", 0).asUInt64();
+            deep_cache_size_ = root.get("deep_cache_size", 268435456).asUInt64();
+            storage_wal_compact_size_ = root.get("storage_wal_compact_size", 16777216).asUInt64();
+
             return true;
         }
         int GetServerPort()
@@ -85,6 +119,66 @@ namespace storage
         {
             return storage_info_;
         }
+        std::string GetIngestDir()
+        {
+            return ingest_dir_;
+        }
+        size_t GetIngestSegmentSize()
+        {
+            return ingest_segment_size_;
+        }
+        size_t GetIngestBufferSize()
+        {
+            return ingest_buffer_size_;
+        }
+        size_t GetIngestMaxPending()
+        {
+            return ingest_max_pending_;
+        }
+        size_t GetSearchBlockSize()
+        {
+            return search_block_size_;
+        }
+        size_t GetSearchMaxMatches()
+        {
+            return search_max_matches_;
+        }
+        bool GetIndexEnable()
+        {
+            return index_enable_;
+        }
+        size_t GetIndexBlockSize()
+        {
+            return index_block_size_;
+        }
+        int GetEventLoops()
+        {
+            return event_loops_;
+        }
+        size_t GetIoThreads()
+        {
+            return io_threads_;
+        }
+        size_t GetUploadInflightLimit()
+        {
+            return upload_inflight_limit_;
+        }
+        size_t GetDeepBlockSize()
+        {
+            return deep_block_size_;
+        }
+        size_t GetDeepThreads()
+        {
+            return deep_threads_;
+        }
+        size_t GetDeepCacheSize()
+        {
+            return deep_cache_size_;
+        }
+        size_t GetStorageWalCompactSize()
+        {
+            return storage_wal_compact_size_;
+        }
 
     public:
         // 获取单例类对象
@@ -1,7 +1,14 @@
 #pragma once
 #include "Config.hpp"
+#include "MetaLog.hpp"
 #include <unordered_map>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <pthread.h>
+
+extern ThreadPool *tp;
 namespace storage
 {
     // 用作初始化存储文件的属性信息
@@ -36,105 +43,102 @@ namespace storage
         }
     } StorageInfo; // namespace StorageInfo
 
+    /*
+    文件元数据的持久化：快照 + 预写日志(见MetaLog)
+    (1)storage_info(storage.data)是快照，格式不变，仍是所有文件信息的json数组；每次Insert/Update/Delete
+       只向storage_info.wal追加一条记录，不再重写整个文件，代价与已存储的文件数无关；
+    (2)日志超过storage_wal_compact_size、并且不小于上次快照的大小时压缩：持锁把日志改名为storage_info.wal.1(只换一个fd)，
+       之后由线程池读出旧快照、重放封存的日志，写成新快照(先写临时文件、fsync后改名)，最后删除封存的日志；
+       压缩期间的修改写进新的日志，不被阻塞；日志至少和快照一样大才压缩，均摊到每次修改仍是O(1)；
+    (3)启动时依次加载快照、重放封存的日志(上次压缩没有完成)和当前日志，有封存的日志时重新压缩；
+       记录是完整的新值，快照已经包含的记录再重放一次结果不变；
+    (4)快照无法解析时加载失败(Loaded()为false)，服务不启动：带着空表继续运行的话，下一次压缩会用它覆盖快照，
+       所有文件的记录都会丢失；长度为0的快照当作空表。
+    */
     class DataManager
     {
     private:
+        typedef std::unordered_map<std::string, StorageInfo> Table;
+
         std::string storage_file_;
         pthread_rwlock_t rwlock_;
-        std::unordered_map<std::string, StorageInfo> table_;
+        Table table_;
         bool need_persist_;
+        std::mutex persist_mtx_; // 多个事件循环线程同时修改时，保证修改table_和追加日志的顺序一致
+        MetaLog wal_;
+        std::string sealed_file_;      // 等待压缩进快照的日志
+        uint64_t compact_size_;
+        std::atomic<uint64_t> snapshot_size_{0};
+        std::atomic<bool> compacting_{false};
+        std::mutex compact_mtx_; // 与compact_cv_一起，析构时等待后台压缩结束
+        std::condition_variable compact_cv_;
+        bool loaded_ = false;
 
     public:
-        DataManager()
+        DataManager() : wal_(storage::Config::GetInstance()->GetStorageInfoFile() + ".wal")
         {
             mylog::GetLogger("asynclogger")->Info("DataManager construct start");
             storage_file_ = storage::Config::GetInstance()->GetStorageInfoFile();
+            sealed_file_ = storage_file_ + ".wal.1";
+            compact_size_ = storage::Config::GetInstance()->GetStorageWalCompactSize();
             pthread_rwlock_init(&rwlock_, NULL);
             need_persist_ = false;
-            InitLoad();
+            if (!InitLoad())
+            {
+                mylog::GetLogger("asynclogger")->Fatal("load metadata from %s failed", storage_file_.c_str());
+                return;
+            }
             need_persist_ = true;
+            if (!wal_.Open())
+            {
+                mylog::GetLogger("asynclogger")->Fatal("open metadata log %s failed", wal_.Path().c_str());
+                return;
+            }
+            loaded_ = true;
+            if (FileUtil(sealed_file_).Exists())
+            {
+                std::unique_lock<std::mutex> lock(persist_mtx_);
+                Compact();
+            }
             mylog::GetLogger("asynclogger")->Info("DataManager construct end");
         }
         ~DataManager()
         {
+            std::unique_lock<std::mutex> lock(compact_mtx_); // 后台压缩还在使用this
+            compact_cv_.wait(lock, [this]()
+                             { return !compacting_; });
             pthread_rwlock_destroy(&rwlock_);
         }
 
-        bool InitLoad() // 初始化程序运行时从文件读取数据
+        // 快照、日志都已加载并且日志可以追加；为false时不能提供服务
+        bool Loaded() const
         {
-            mylog::GetLogger("asynclogger")->Info("init datamanager");
-            storage::FileUtil f(storage_file_);
-            if (!f.Exists()){
-                mylog::GetLogger("asynclogger")->Info("there is no storage file info need to load");
-                return true;
-            }
-
-            std::string body;
-            if (!f.GetContent(&body))
-                return false;
-
-            // 反序列化
-            Json::Value root;
-            storage::JsonUtil::UnSerialize(body, &root);
-            // 3，将反序列化得到的Json::Value中的数据添加到table中
-            for (int i = 0; i < root.size(); i++)
-            {
-                StorageInfo info;
-                info.fsize_ = root[i]["fsize_"].asInt();
-                info.atime_ = root[i]["atime_"].asInt();
-                info.mtime_ = root[i]["mtime_"].asInt();
-                info.storage_path_ = root[i]["storage_path_"].asString();
-                info.url_ = root[i]["url_"].asString();
-                Insert(info);
-            }
-            return true;
+            return loaded_;
         }
 
-        bool Storage()
-        { // 每次有信息改变则需要持久化存储一次
-// 把table_中的数据转成json格式存入文件
-            mylog::GetLogger("asynclogger")->Info("message storage start");
-            std::vector<StorageInfo> arr;
-            if (!GetAll(&arr))
-            {
-                mylog::GetLogger("asynclogger")->Warn("GetAll fail,can't get StorageInfo");
+        bool InitLoad() // 初始化程序运行时从快照和日志读取数据
+        {
+            mylog::GetLogger("asynclogger")->Info("init datamanager");
+            uint64_t size = 0;
+            if (!LoadSnapshot(storage_file_, &table_, &size))
                 return false;
-            }
-
-            Json::Value root; // root中存着json::value对象
-            for (auto e : arr)
-            {
-                Json::Value item;
-                item["mtime_"] = (Json::Int64)e.mtime_;
-                item["atime_"] = (Json::Int64)e.atime_;
-                item["fsize_"] = (Json::Int64)e.fsize_;
-                item["url_"] = e.url_.c_str();
-                item["storage_path_"] = e.storage_path_.c_str();
-                root.append(item); // 作为数组
-            }
-
-            // 序列化
-            std::string body;
-            mylog::GetLogger("asynclogger")->Info("new message for StorageInfo:%s", body.c_str());
-            JsonUtil::Serialize(root, &body);
-
-            // 写入文件
-            FileUtil f(storage_file_);
-            
-            if (f.SetContent(body.c_str(),body.size()) == false)
-                mylog::GetLogger("asynclogger")->Error("SetContent for StorageInfo Error");
-
-            mylog::GetLogger("asynclogger")->Info("message storage end");
+            snapshot_size_ = size;
+            auto apply = [this](const MetaLog::Record &r)
+            { Apply(&table_, r); };
+            if (!MetaLog::Replay(sealed_file_, apply, false) || !MetaLog::Replay(wal_.Path(), apply, true))
+                return false;
+            mylog::GetLogger("asynclogger")->Info("%lu files loaded", static_cast<unsigned long>(table_.size()));
             return true;
         }
 
         bool Insert(const StorageInfo &info)
         {
             mylog::GetLogger("asynclogger")->Info("data_message Insert start");
+            std::unique_lock<std::mutex> lock(persist_mtx_);
             pthread_rwlock_wrlock(&rwlock_); // 加写锁
             table_[info.url_] = info;
             pthread_rwlock_unlock(&rwlock_);
-            if (need_persist_ == true && Storage() == false)
+            if (need_persist_ == true && Persist(MetaLog::kPut, info) == false)
             {
                 mylog::GetLogger("asynclogger")->Error("data_message Insert:Storage Error");
                 return false;
@@ -146,10 +150,11 @@ namespace storage
         bool Update(const StorageInfo &info)
         {
             mylog::GetLogger("asynclogger")->Info("data_message Update start");
+            std::unique_lock<std::mutex> lock(persist_mtx_);
             pthread_rwlock_wrlock(&rwlock_);
             table_[info.url_] = info;
             pthread_rwlock_unlock(&rwlock_);
-            if (Storage() == false)
+            if (Persist(MetaLog::kPut, info) == false)
             {
                 mylog::GetLogger("asynclogger")->Error("data_message Update:Storage Error");
                 return false;
@@ -160,13 +165,14 @@ namespace storage
         bool GetOneByURL(const std::string &key, StorageInfo *info)
         {
             pthread_rwlock_rdlock(&rwlock_);
-            // URL是key，所以直接find()找
-            if (table_.find(key) == table_.end())
+            // URL是key，所以直接find()找；读锁下只能用find，operator[]可能插入元素
+            auto it = table_.find(key);
+            if (it == table_.end())
             {
                 pthread_rwlock_unlock(&rwlock_);
                 return false;
             }
-            *info = table_[key]; // 获取url对应的文件存储信息
+            *info = it->second; // 获取url对应的文件存储信息
             pthread_rwlock_unlock(&rwlock_);
             return true;
         }
@@ -199,6 +205,7 @@ namespace storage
         bool Delete(const std::string &url)
         {
             mylog::GetLogger("asynclogger")->Info("data_message Delete start, url: %s", url.c_str());
+            std::unique_lock<std::mutex> lock(persist_mtx_);
             pthread_rwlock_wrlock(&rwlock_);
             
             // 检查文件是否存在
@@ -214,7 +221,11 @@ namespace storage
             pthread_rwlock_unlock(&rwlock_);
             
             // 持久化更改
-            if (Storage() == false)
+            StorageInfo info;
+            info.mtime_ = info.atime_ = 0;
+            info.fsize_ = 0;
+            info.url_ = url;
+            if (Persist(MetaLog::kDelete, info) == false)
             {
                 mylog::GetLogger("asynclogger")->Error("data_message Delete: Storage Error");
                 return false;
@@ -223,5 +234,168 @@ namespace storage
             mylog::GetLogger("asynclogger")->Info("data_message Delete end, url: %s", url.c_str());
             return true;
         }
+
+    private:
+        // 持有persist_mtx_时调用：追加一条记录，日志足够大时开始压缩
+        bool Persist(MetaLog::Op op, const StorageInfo &info)
+        {
+            MetaLog::Record r{op, info.mtime_, info.atime_, static_cast<int64_t>(info.fsize_), info.url_, info.storage_path_};
+            if (!wal_.Append(r))
+                return false;
+            if (wal_.Size() >= std::max<uint64_t>(compact_size_, snapshot_size_))
+                Compact();
+            return true;
+        }
+
+        // 持有persist_mtx_时调用：封存当前日志(上次没压缩完的封存日志还在时直接用它)，由线程池写新快照
+        void Compact()
+        {
+            if (compacting_.exchange(true))
+                return;
+            if (!FileUtil(sealed_file_).Exists() && !wal_.Rotate(sealed_file_))
+            {
+                FinishCompact();
+                return;
+            }
+            if (tp == nullptr)
+                return CompactSealed();
+            try
+            {
+                tp->enqueue_detached([this]()
+                                     { CompactSealed(); });
+            }
+            catch (const std::runtime_error &e)
+            {
+                CompactSealed(); // 线程池已经停止，就地完成，否则compacting_一直为true，析构时永远等下去
+            }
+        }
+
+        // 旧快照 + 封存的日志 -> 新快照，只读写文件，不访问table_，不阻塞修改
+        void CompactSealed()
+        {
+            Table table;
+            uint64_t size = 0;
+            bool ok = LoadSnapshot(storage_file_, &table, &size) &&
+                      MetaLog::Replay(sealed_file_, [&table](const MetaLog::Record &r)
+                                      { Apply(&table, r); }, false) &&
+                      WriteSnapshot(storage_file_, table, &size);
+            if (ok && remove(sealed_file_.c_str()) == 0)
+            {
+                snapshot_size_ = size;
+                mylog::GetLogger("asynclogger")->Info("metadata compacted: %lu files, snapshot %lu bytes",
+                                                      static_cast<unsigned long>(table.size()), static_cast<unsigned long>(size));
+            }
+            else
+                mylog::GetLogger("asynclogger")->Error("metadata compaction failed, keep %s", sealed_file_.c_str());
+            FinishCompact();
+        }
+
+        // 持锁通知，析构函数被唤醒时这里已经不再访问compact_cv_
+        void FinishCompact()
+        {
+            std::unique_lock<std::mutex> lock(compact_mtx_);
+            compacting_ = false;
+            compact_cv_.notify_all();
+        }
+
+        static void Apply(Table *table, const MetaLog::Record &r)
+        {
+            if (r.op == MetaLog::kDelete)
+            {
+                table->erase(r.url);
+                return;
+            }
+            StorageInfo &info = (*table)[r.url];
+            info.mtime_ = r.mtime;
+            info.atime_ = r.atime;
+            info.fsize_ = r.fsize;
+            info.url_ = r.url;
+            info.storage_path_ = r.storage_path;
+        }
+
+        static bool LoadSnapshot(const std::string &file, Table *table, uint64_t *size)
+        {
+            storage::FileUtil f(file);
+            if (!f.Exists()){
+                mylog::GetLogger("asynclogger")->Info("there is no storage file info need to load");
+                return true;
+            }
+
+            std::string body;
+            if (!f.GetContent(&body))
+                return false;
+            *size = body.size();
+            if (body.empty())
+                return true;
+
+            // 反序列化；没有文件时快照是null
+            Json::Value root;
+            if (!storage::JsonUtil::UnSerialize(body, &root) || !(root.isArray() || root.isNull()))
+            {
+                mylog::GetLogger("asynclogger")->Error("snapshot %s corrupted", file.c_str());
+                return false;
+            }
+            // 将反序列化得到的Json::Value中的数据添加到table中
+            for (Json::ArrayIndex i = 0; i < root.size(); i++)
+            {
+                StorageInfo info;
+                info.fsize_ = root[i]["fsize_"].asInt64();
+                info.atime_ = root[i]["atime_"].asInt64();
+                info.mtime_ = root[i]["mtime_"].asInt64();
+                info.storage_path_ = root[i]["storage_path_"].asString();
+                info.url_ = root[i]["url_"].asString();
+                (*table)[info.url_] = info;
+            }
+            return true;
+        }
+
+        // 先写临时文件并fsync再改名，崩溃时旧快照仍然完整；改名之前快照的内容必须已经落盘，之后才能删除封存的日志
+        static bool WriteSnapshot(const std::string &file, const Table &table, uint64_t *size)
+        {
+            Json::Value root; // root中存着json::value对象
+            for (auto &e : table)
+            {
+                Json::Value item;
+                item["mtime_"] = (Json::Int64)e.second.mtime_;
+                item["atime_"] = (Json::Int64)e.second.atime_;
+                item["fsize_"] = (Json::Int64)e.second.fsize_;
+                item["url_"] = e.second.url_;
+                item["storage_path_"] = e.second.storage_path_;
+                root.append(item); // 作为数组
+            }
+            std::string body;
+            if (!JsonUtil::Serialize(root, &body))
+                return false;
+
+            std::string tmp = FileUtil(file).TempName();
+            int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s", tmp.c_str(), strerror(errno));
+                return false;
+            }
+            const char *p = body.data();
+            size_t len = body.size();
+            while (len > 0)
+            {
+                ssize_t n = write(fd, p, len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                p += n;
+                len -= n;
+            }
+            bool ok = len == 0 && fsync(fd) == 0;
+            close(fd);
+            if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+            {
+                mylog::GetLogger("asynclogger")->Error("write snapshot %s failed: %s", file.c_str(), strerror(errno));
+                remove(tmp.c_str());
+                return false;
+            }
+            *size = body.size();
+            return true;
+        }
     }; // namespace DataManager
 }
\ No newline at end of file
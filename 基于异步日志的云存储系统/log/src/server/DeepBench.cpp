@@ -0,0 +1,94 @@
+/*
+ * 深度存储分块并行压缩的测试工具，容器格式见 DeepContainer.hpp
+ * 依次用1..max_threads个线程把文件打包成分块容器，再并行解压回来，打印吞吐量和相对单线程的加速比，
+ * 同时检查不同线程数打包出的文件逐字节相同、解压结果与原文件相同
+ *
+ * 编译: make deep_bench
+ * 用法: ./deep_bench <file> [max_threads] [block_size] [bundle_format]
+ *       输出写到<file>.deep，结束后删除；bundle_format默认4(LZIP)，与Storage.conf一致
+ */
+#include "DeepContainer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+ThreadPool *tp = nullptr;
+mylog::Util::JsonData *g_conf_data;
+
+static double SecondsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <file> [max_threads] [block_size] [bundle_format]" << std::endl;
+        return 1;
+    }
+    // 公共代码通过"asynclogger"打日志，工具自己输出结果，这里的日志直接丢弃
+    std::shared_ptr<mylog::LoggerBuilder> glb(new mylog::LoggerBuilder());
+    glb->BuildLoggerName("asynclogger");
+    glb->BuildLoggerFlush<mylog::NullFlush>();
+    mylog::LoggerManager::GetInstance().AddLogger(glb->Build());
+
+    std::string src = argv[1], dst = src + ".deep";
+    size_t max_threads = argc > 2 ? atol(argv[2]) : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    size_t block_size = argc > 3 ? atol(argv[3]) : 1024 * 1024;
+    int format = argc > 4 ? atoi(argv[4]) : 4;
+    std::string data, reference;
+    if (!storage::FileUtil(src).GetContent(&data) || data.empty())
+    {
+        std::cerr << "read " << src << " failed" << std::endl;
+        return 1;
+    }
+    double mb = data.size() / 1048576.0;
+    double pack_base = 0, unpack_base = 0;
+    printf("%s: %.1f MB, block_size %zu, format %d\n", src.c_str(), mb, block_size, format);
+    printf("threads  pack MB/s  speedup  unpack MB/s  speedup  ratio\n");
+    for (size_t n = 1; n <= std::max<size_t>(max_threads, 1); ++n)
+    {
+        ThreadPool pool(n);
+        auto start = std::chrono::steady_clock::now();
+        storage::DeepContainer::Writer w(dst, format, block_size, &pool);
+        if (!w.Append(data.data(), data.size()) || !w.Finish())
+        {
+            std::cerr << "pack failed" << std::endl;
+            return 1;
+        }
+        double pack = mb / SecondsSince(start);
+
+        std::string packed, raw;
+        storage::FileUtil(dst).GetContent(&packed);
+        if (n == 1)
+            reference = packed;
+        else if (packed != reference)
+        {
+            std::cerr << "output with " << n << " threads differs from 1 thread" << std::endl;
+            return 1;
+        }
+        storage::DeepContainer deep;
+        start = std::chrono::steady_clock::now();
+        bool ok = deep.Open(dst) && deep.ForEachBlock([&raw](uint32_t, std::string &block)
+                                                      {
+                                                          raw += block;
+                                                          return true; },
+                                                      &pool);
+        double unpack = mb / SecondsSince(start);
+        if (!ok || raw != data)
+        {
+            std::cerr << "unpacked data differs from " << src << std::endl;
+            return 1;
+        }
+        if (n == 1)
+        {
+            pack_base = pack;
+            unpack_base = unpack;
+        }
+        printf("%7zu  %9.1f  %6.2fx  %11.1f  %6.2fx  %5.3f\n", n, pack, pack / pack_base, unpack, unpack / unpack_base,
+               static_cast<double>(packed.size()) / data.size());
+    }
+    remove(dst.c_str());
+    return 0;
+}
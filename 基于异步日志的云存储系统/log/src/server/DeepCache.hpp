@@ -0,0 +1,163 @@
+#pragma once
+#include "Config.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace storage
+{
+    /*
+    深度存储解压结果的内存缓存，热点文件重复下载时不再解压：
+    (1)缓存单位是解压后的块(DeepContainer的一块)，key = URL + ETag + 块号；ETag包含文件大小和修改时间，
+       文件被替换后旧的块不会再命中，之后被LRU淘汰；
+    (2)总大小不超过deep_cache_size字节，0表示不缓存；单块超过容量1/4的不缓存(旧格式整个文件是一块)，避免一次冲掉整个缓存；
+    (3)同一块同时被多个请求需要时只解压一次：第一个请求登记一个shared_future并在自己的线程里解压，
+       其他请求等待同一个结果；解压失败不缓存，这次的等待者都得到失败，之后的请求会重试；
+    (4)块用shared_ptr<const std::string>共享，被淘汰时正在发送它的响应仍持有引用，发送完才释放；
+    (5)命中、未命中、合并等计数可以通过/stats查看。
+    */
+    class DeepCache
+    {
+    public:
+        typedef std::shared_ptr<const std::string> Block;
+
+        struct Stats
+        {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t coalesced = 0; // 等待其他请求解压结果的次数
+            uint64_t evictions = 0;
+            uint64_t entries = 0;
+            uint64_t bytes = 0;
+            uint64_t capacity = 0;
+        };
+
+        static DeepCache *GetInstance()
+        {
+            static DeepCache cache(Config::GetInstance()->GetDeepCacheSize());
+            return &cache;
+        }
+
+        explicit DeepCache(size_t capacity) : capacity_(capacity) {}
+        DeepCache(const DeepCache &) = delete;
+        DeepCache &operator=(const DeepCache &) = delete;
+
+        static std::string Key(const std::string &url, const std::string &etag, uint32_t block)
+        {
+            return url + '\n' + etag + '\n' + std::to_string(block);
+        }
+
+        // 取出key对应的块，不在缓存中时由load在调用者线程中解压；失败返回空指针。在IO线程中调用，可能阻塞
+        Block Get(const std::string &key, const std::function<bool(std::string *)> &load)
+        {
+            std::promise<Block> promise;
+            std::shared_future<Block> wait;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto it = index_.find(key);
+                if (it != index_.end())
+                {
+                    ++stats_.hits;
+                    lru_.splice(lru_.begin(), lru_, it->second);
+                    return it->second->second;
+                }
+                auto l = loading_.find(key);
+                if (l != loading_.end())
+                {
+                    ++stats_.coalesced;
+                    wait = l->second;
+                }
+                else
+                {
+                    ++stats_.misses;
+                    loading_.emplace(key, promise.get_future().share());
+                }
+            }
+            if (wait.valid())
+                return wait.get();
+
+            Block block;
+            try
+            {
+                std::shared_ptr<std::string> raw = std::make_shared<std::string>();
+                if (load(raw.get()))
+                    block = raw;
+            }
+            catch (...)
+            {
+                Finish(key, NULL);
+                promise.set_value(NULL);
+                throw;
+            }
+            Finish(key, block);
+            promise.set_value(block);
+            return block;
+        }
+
+        // 文件被删除时丢掉它的所有块；否则同名文件在同一秒内重新上传、大小也相同时ETag不变，会命中旧内容
+        void Erase(const std::string &url)
+        {
+            std::string prefix = url + '\n';
+            std::unique_lock<std::mutex> lock(mtx_);
+            for (auto it = lru_.begin(); it != lru_.end();)
+            {
+                if (it->first.compare(0, prefix.size(), prefix) != 0)
+                {
+                    ++it;
+                    continue;
+                }
+                bytes_ -= it->second->size();
+                index_.erase(it->first);
+                it = lru_.erase(it);
+            }
+        }
+
+        Stats GetStats()
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            Stats s = stats_;
+            s.entries = index_.size();
+            s.bytes = bytes_;
+            s.capacity = capacity_;
+            return s;
+        }
+
+    private:
+        // 解压结束：撤销登记，成功的块放进缓存，超出容量时从最久未使用的一端淘汰
+        void Finish(const std::string &key, const Block &block)
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            loading_.erase(key);
+            if (!block || block->size() > capacity_ / 4)
+                return;
+            lru_.emplace_front(key, block);
+            index_[key] = lru_.begin();
+            bytes_ += block->size();
+            while (bytes_ > capacity_)
+            {
+                auto &victim = lru_.back();
+                bytes_ -= victim.second->size();
+                index_.erase(victim.first);
+                lru_.pop_back();
+                ++stats_.evictions;
+            }
+        }
+
+    private:
+        typedef std::list<std::pair<std::string, Block>> LruList;
+
+        std::mutex mtx_;
+        size_t capacity_;
+        size_t bytes_ = 0;
+        LruList lru_; // 表头是最近使用的
+        std::unordered_map<std::string, LruList::iterator> index_;
+        std::unordered_map<std::string, std::shared_future<Block>> loading_; // 正在解压的块
+        Stats stats_;
+    };
+}
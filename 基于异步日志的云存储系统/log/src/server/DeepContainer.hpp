@@ -0,0 +1,456 @@
+#pragma once
+#include "IoPool.hpp"
+#include "../../log_system/logs_code/LogFrame.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace storage
+{
+    /*
+    深度存储文件格式(分块容器)：
+    (1)原始数据按deep_block_size切块，尽量在行边界处切开(块内没有换行时才硬切)，每块单独用bundle压缩后依次写入；
+    (2)文件末尾是块表和尾部，整数都是大端：
+       块表每项 = 压缩数据偏移(8) 压缩长度(4) 原始长度(4) 压缩数据crc32(4)；
+       尾部 = 块大小(4) 块数(4) 原始总大小(8) 块表crc32(4) 版本(4) magic "MLGD"(4)；
+    (3)打开时只读尾部和块表，之后任意一块都可以单独读出、校验、解压(先校验再解压，损坏的数据不会交给解压器)：下载逐块解压(见DeepStream)，内存只和块大小有关；
+       块表的原始长度累加得到每块在原始数据中的起点，Range下载用FindBlock找到区间覆盖的块，只解压这些块；
+       检索和索引只解压需要的块，块之间互不依赖，可以并行压缩和解压；
+    (4)末尾没有magic或块表校验失败的文件按旧格式读：整个文件是一次bundle::pack的结果，当作只有一块；
+    (5)压缩和顺序解压(ForEachBlock)由专用线程池(Workers，deep_threads个线程)按块并行：提交的块按顺序放进一个窗口，
+       窗口最多容纳2倍线程数的块，满了就等最早的块完成并按顺序写出，内存有上界；切块位置只取决于数据，
+       每块单独压缩，所以输出与线程数无关，逐字节相同。调用者(IO线程、全局线程池)只等待，不在Workers中执行，不会互相等死。
+    */
+    class DeepContainer
+    {
+    public:
+        static const uint32_t kMagic = 0x4D4C4744; // "MLGD"
+        static const uint32_t kVersion = 1;
+
+#pragma pack(push, 1)
+        struct BlockEntry
+        {
+            uint64_t offset;
+            uint32_t packed_len;
+            uint32_t raw_len;
+            uint32_t crc;
+        };
+        struct Trailer
+        {
+            uint32_t block_size;
+            uint32_t block_count;
+            uint64_t raw_size;
+            uint32_t table_crc;
+            uint32_t version;
+            uint32_t magic;
+        };
+#pragma pack(pop)
+
+        // 分块压缩、解压用的线程池，第一次使用时创建，和IO线程一样避开事件循环的CPU并降低优先级
+        static ThreadPool *Workers()
+        {
+            static ThreadPool pool(WorkerCount(), mylog::Affinity::CpusFor(mylog::Util::JsonData::GetJsonData()->pool_cpus,
+                                                                           mylog::Util::JsonData::GetJsonData()->reserved_cpus));
+            return &pool;
+        }
+
+        // 边写边压缩，先写临时文件(见FileUtil::TempName)，Finish时写块表并rename，读者不会看到写了一半的文件
+        // pool为空时在调用线程中逐块压缩
+        class Writer
+        {
+        public:
+            Writer(const std::string &path, int format, size_t block_size, ThreadPool *pool = NULL)
+                : path_(path), tmp_(FileUtil(path).TempName()), format_(format), block_size_(std::max<size_t>(block_size, 4096)),
+                  pool_(pool), window_size_(pool ? 2 * pool->size() : 0)
+            {
+                fd_ = open(tmp_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd_ == -1)
+                    mylog::GetLogger("asynclogger")->Error("open %s failed: %s", tmp_.c_str(), strerror(errno));
+            }
+            Writer(const Writer &) = delete;
+            Writer &operator=(const Writer &) = delete;
+            ~Writer()
+            {
+                if (fd_ != -1) // 没有Finish，丢弃临时文件
+                {
+                    close(fd_);
+                    remove(tmp_.c_str());
+                }
+            }
+
+            bool Append(const char *data, size_t len)
+            {
+                if (fd_ == -1)
+                    return false;
+                while (len > 0)
+                {
+                    if (pending_.empty() && len >= block_size_)
+                    {
+                        size_t cut = CutPoint(data, block_size_); // 整块直接压缩，不经过pending_
+                        if (!WriteBlock(data, cut))
+                            return false;
+                        data += cut;
+                        len -= cut;
+                        continue;
+                    }
+                    size_t n = std::min(len, block_size_ - pending_.size());
+                    pending_.append(data, n);
+                    data += n;
+                    len -= n;
+                    if (pending_.size() == block_size_)
+                    {
+                        size_t cut = CutPoint(pending_.data(), block_size_);
+                        if (!WriteBlock(pending_.data(), cut))
+                            return false;
+                        pending_.erase(0, cut);
+                    }
+                }
+                return true;
+            }
+
+            bool Finish()
+            {
+                if (fd_ == -1)
+                    return false;
+                if (!pending_.empty() && !WriteBlock(pending_.data(), pending_.size()))
+                    return false;
+                pending_.clear();
+                while (!window_.empty())
+                    if (!Commit(PopFront()))
+                        return false;
+                std::string tail;
+                for (auto &e : entries_)
+                {
+                    BlockEntry be;
+                    be.offset = htobe64(e.offset);
+                    be.packed_len = htonl(e.packed_len);
+                    be.raw_len = htonl(e.raw_len);
+                    be.crc = htonl(e.crc);
+                    tail.append(reinterpret_cast<const char *>(&be), sizeof(be));
+                }
+                Trailer t;
+                t.block_size = htonl(static_cast<uint32_t>(block_size_));
+                t.block_count = htonl(static_cast<uint32_t>(entries_.size()));
+                t.raw_size = htobe64(raw_size_);
+                t.table_crc = htonl(mylog::Frame::Crc32(tail.data(), tail.size()));
+                t.version = htonl(kVersion);
+                t.magic = htonl(kMagic);
+                tail.append(reinterpret_cast<const char *>(&t), sizeof(t));
+                bool ok = WriteAll(tail.data(), tail.size());
+                ok = close(fd_) == 0 && ok;
+                fd_ = -1;
+                if (ok && rename(tmp_.c_str(), path_.c_str()) == 0)
+                    return true;
+                mylog::GetLogger("asynclogger")->Error("finish %s failed: %s", path_.c_str(), strerror(errno));
+                remove(tmp_.c_str());
+                return false;
+            }
+
+        private:
+            // 在[data, data+n)中最后一个换行之后切开，没有换行就在n处硬切
+            static size_t CutPoint(const char *data, size_t n)
+            {
+                const char *nl = static_cast<const char *>(memrchr(data, '\n', n));
+                return nl ? nl - data + 1 : n;
+            }
+
+            // 一块压缩的结果，crc覆盖压缩后的数据
+            struct Packed
+            {
+                bool ok;
+                uint32_t raw_len;
+                uint32_t crc;
+                std::string data;
+            };
+
+            static Packed PackBlock(int format, const std::string &raw)
+            {
+                IoPool::LowerPriority();
+                Packed p;
+                p.ok = bundle::pack(format, p.data, raw);
+                p.raw_len = static_cast<uint32_t>(raw.size());
+                p.crc = mylog::Frame::Crc32(p.data.data(), p.data.size());
+                return p;
+            }
+
+            bool WriteBlock(const char *data, size_t len)
+            {
+                if (pool_ == NULL)
+                    return Commit(PackBlock(format_, std::string(data, len)));
+                while (window_.size() >= window_size_) // 窗口满了，先按顺序写出最早的块
+                    if (!Commit(PopFront()))
+                        return false;
+                window_.push_back(pool_->enqueue(&Writer::PackBlock, format_, std::string(data, len)));
+                return true;
+            }
+
+            Packed PopFront()
+            {
+                Packed p = window_.front().get();
+                window_.pop_front();
+                return p;
+            }
+
+            // 按提交顺序把压缩好的块写进文件
+            bool Commit(Packed &&p)
+            {
+                if (!p.ok)
+                {
+                    mylog::GetLogger("asynclogger")->Error("%s: bundle pack failed", path_.c_str());
+                    return false;
+                }
+                if (!WriteAll(p.data.data(), p.data.size()))
+                    return false;
+                entries_.push_back(Entry{offset_, static_cast<uint32_t>(p.data.size()), p.raw_len, p.crc});
+                offset_ += p.data.size();
+                raw_size_ += p.raw_len;
+                return true;
+            }
+
+            bool WriteAll(const char *data, size_t len)
+            {
+                while (len > 0)
+                {
+                    ssize_t n = write(fd_, data, len);
+                    if (n < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        mylog::GetLogger("asynclogger")->Error("write %s failed: %s", tmp_.c_str(), strerror(errno));
+                        return false;
+                    }
+                    data += n;
+                    len -= n;
+                }
+                return true;
+            }
+
+            struct Entry
+            {
+                uint64_t offset;
+                uint32_t packed_len;
+                uint32_t raw_len;
+                uint32_t crc;
+            };
+
+            std::string path_;
+            std::string tmp_;
+            int format_;
+            size_t block_size_;
+            int fd_ = -1;
+            ThreadPool *pool_;
+            size_t window_size_;
+            std::deque<std::future<Packed>> window_; // 已提交、还没写出的块，按提交顺序排列
+            std::string pending_;                    // 还不满一块的数据
+            uint64_t offset_ = 0;
+            uint64_t raw_size_ = 0;
+            std::vector<Entry> entries_;
+        };
+
+        // 把文件src打包成深度存储文件dst，逐块读入，内存只和块大小有关
+        static bool PackFile(const std::string &src, const std::string &dst)
+        {
+            Config *conf = Config::GetInstance();
+            int fd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s", src.c_str(), strerror(errno));
+                return false;
+            }
+            Writer w(dst, conf->GetBundleFormat(), conf->GetDeepBlockSize(), Workers());
+            std::string buf(std::max<size_t>(conf->GetDeepBlockSize(), 4096), 0); // 与Writer的块大小下限一致，为0时read会被当成读完
+            bool ok = true;
+            while (ok)
+            {
+                ssize_t n = read(fd, &buf[0], buf.size());
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    ok = n == 0;
+                    break;
+                }
+                ok = w.Append(buf.data(), n);
+            }
+            close(fd);
+            return ok && w.Finish();
+        }
+
+        DeepContainer() {}
+        DeepContainer(const DeepContainer &) = delete;
+        DeepContainer &operator=(const DeepContainer &) = delete;
+        ~DeepContainer()
+        {
+            if (fd_ != -1)
+                close(fd_);
+        }
+
+        // 读出尾部和块表；不是分块容器的文件按旧格式打开
+        bool Open(const std::string &path)
+        {
+            path_ = path;
+            fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd_ == -1 || fstat(fd_, &st) == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s", path.c_str(), strerror(errno));
+                return false;
+            }
+            uint64_t size = st.st_size;
+            Trailer t;
+            if (size >= sizeof(t) && ReadAt(reinterpret_cast<char *>(&t), sizeof(t), size - sizeof(t)) &&
+                ntohl(t.magic) == kMagic && ntohl(t.version) == kVersion)
+            {
+                uint64_t count = ntohl(t.block_count);
+                std::string table;
+                // 先确认块表在文件之内再分配，损坏的尾部不会让这里按块数分配几十GB
+                if (count * sizeof(BlockEntry) + sizeof(t) <= size)
+                    table.resize(count * sizeof(BlockEntry));
+                uint64_t table_off = size - sizeof(t) - table.size();
+                if (table.size() == count * sizeof(BlockEntry) && ReadAt(&table[0], table.size(), table_off) &&
+                    mylog::Frame::Crc32(table.data(), table.size()) == ntohl(t.table_crc))
+                {
+                    entries_.resize(count);
+                    starts_.resize(count);
+                    uint64_t raw = 0;
+                    bool valid = true;
+                    for (uint64_t i = 0; i < count; ++i)
+                    {
+                        BlockEntry e;
+                        memcpy(&e, table.data() + i * sizeof(e), sizeof(e));
+                        entries_[i].offset = be64toh(e.offset);
+                        entries_[i].packed_len = ntohl(e.packed_len);
+                        entries_[i].raw_len = ntohl(e.raw_len);
+                        entries_[i].crc = ntohl(e.crc);
+                        valid = valid && entries_[i].offset + entries_[i].packed_len <= table_off;
+                        starts_[i] = raw;
+                        raw += entries_[i].raw_len;
+                    }
+                    if (valid && raw == be64toh(t.raw_size))
+                    {
+                        block_size_ = ntohl(t.block_size);
+                        raw_size_ = be64toh(t.raw_size);
+                        legacy_ = false;
+                        return true;
+                    }
+                }
+            }
+            // 旧格式：整个文件只有一块，原始长度要解压后才知道
+            entries_.assign(1, BlockEntry{0, static_cast<uint32_t>(size), 0, 0});
+            starts_.assign(1, 0);
+            packed_size_ = size;
+            legacy_ = true;
+            return true;
+        }
+
+        bool IsLegacy() const { return legacy_; }
+        uint32_t BlockCount() const { return static_cast<uint32_t>(entries_.size()); }
+        uint32_t BlockSize() const { return block_size_; }
+        uint64_t RawSize() const { return raw_size_; } // 旧格式为0
+        const BlockEntry &Block(uint32_t i) const { return entries_[i]; }
+        uint64_t BlockStart(uint32_t i) const { return starts_[i]; } // 第i块在原始数据中的起点
+
+        // 原始数据中偏移off所在的块，二分查找块起点；旧格式只有第0块
+        uint32_t FindBlock(uint64_t off) const
+        {
+            auto it = std::upper_bound(starts_.begin(), starts_.end(), off);
+            return it == starts_.begin() ? 0 : static_cast<uint32_t>(it - starts_.begin() - 1);
+        }
+
+        // 读出第i块并解压，分块容器还要校验crc和解压后的长度；可以在多个线程中同时调用
+        bool ReadBlock(uint32_t i, std::string *raw) const
+        {
+            if (i >= entries_.size())
+                return false;
+            const BlockEntry &e = entries_[i];
+            std::string packed(legacy_ ? packed_size_ : e.packed_len, 0);
+            if (!ReadAt(&packed[0], packed.size(), e.offset))
+                return false;
+            if (legacy_)
+            {
+                *raw = bundle::unpack(packed);
+                return !raw->empty() || packed.empty();
+            }
+            if (mylog::Frame::Crc32(packed.data(), packed.size()) != e.crc || !bundle::unpack(*raw, packed) ||
+                raw->size() != e.raw_len)
+            {
+                mylog::GetLogger("asynclogger")->Error("%s: block %u corrupted", path_.c_str(), i);
+                return false;
+            }
+            return true;
+        }
+
+        // 按块号顺序对每一块调用fn，pool不为空时提前并行解压后面的块(最多2倍线程数)；
+        // fn返回false或者某块损坏时停止，返回前等待已提交的块，它们还在访问this
+        bool ForEachBlock(const std::function<bool(uint32_t, std::string &)> &fn, ThreadPool *pool) const
+        {
+            std::deque<std::future<std::pair<bool, std::string>>> window;
+            size_t window_size = pool ? 2 * pool->size() : 0;
+            uint32_t next = 0;
+            bool ok = true;
+            for (uint32_t i = 0; ok && i < entries_.size(); ++i)
+            {
+                for (; pool != NULL && next < entries_.size() && window.size() < window_size; ++next)
+                    window.push_back(pool->enqueue([this, next]()
+                                                   {
+                                                       IoPool::LowerPriority();
+                                                       std::pair<bool, std::string> r;
+                                                       r.first = ReadBlock(next, &r.second);
+                                                       return r; }));
+                std::pair<bool, std::string> r;
+                if (pool != NULL)
+                {
+                    r = window.front().get();
+                    window.pop_front();
+                }
+                else
+                    r.first = ReadBlock(i, &r.second);
+                ok = r.first && fn(i, r.second);
+            }
+            for (auto &f : window)
+                f.wait();
+            return ok;
+        }
+
+    private:
+        static size_t WorkerCount()
+        {
+            size_t n = Config::GetInstance()->GetDeepThreads();
+            return n != 0 ? n : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+
+        bool ReadAt(char *buf, size_t len, uint64_t off) const
+        {
+            while (len > 0)
+            {
+                ssize_t n = pread(fd_, buf, len, off);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                buf += n;
+                len -= n;
+                off += n;
+            }
+            return true;
+        }
+
+    private:
+        std::string path_;
+        int fd_ = -1;
+        bool legacy_ = true;
+        uint32_t block_size_ = 0;
+        uint64_t raw_size_ = 0;
+        uint64_t packed_size_ = 0;
+        std::vector<BlockEntry> entries_;
+        std::vector<uint64_t> starts_;
+    };
+}
@@ -0,0 +1,346 @@
+#pragma once
+#include "DeepCache.hpp"
+#include "DeepContainer.hpp"
+#include "DataManager.hpp"
+#include "HttpRange.hpp"
+
+#include <event.h>
+#include <evhttp.h>
+#include <event2/http.h>
+
+#include <map>
+#include <memory>
+
+namespace storage
+{
+    /*
+    深度存储文件的流式下载：解压出的块直接进入响应，不落盘
+    (1)IO线程打开文件(只读尾部和块表)，按Range算出响应由哪些片段组成：每个区间覆盖的块各截取一段，
+       多个区间时片段之间插入multipart的分隔部分；不带Range时就是全部块。只有区间覆盖的块会被读出和解压，
+       从接近末尾处续传只解压最后几块；
+    (2)第一个块片段也在IO线程解压，成功后才发送响应头，打不开或者损坏还能回复500；分块容器的原始大小记录在尾部，
+       旧格式只有一块，解压后就知道大小，区间直接从解压结果中截取；响应都带Content-Length；
+    (3)块都经过DeepCache取得，热点文件的块直接命中，同时下载同一文件的请求只解压一次；
+       片段引用缓存中的块，不截取拷贝；
+    (4)最多预读kReadAhead个片段：块在IO线程中读出、解压，完成后回到事件循环按片段顺序交给evhttp，
+       数据用evbuffer_add_reference挂到输出缓冲，不再拷贝；已交给evhttp的片段全部写进socket后(写完回调)再继续预读，
+       慢客户端不会让服务端积压整个文件；
+    (5)中途某块损坏时响应头已经发出，只能断开连接，客户端收到的长度不足Content-Length，不会把残缺的文件当成完整的；
+    (6)客户端断开后不再提交新的块，已提交的块完成后释放。
+    */
+    class DeepStream
+    {
+    public:
+        static const size_t kReadAhead = 4;
+
+        // 事件循环线程调用；range是要使用的Range头(没有或者If-Range不匹配时为空)
+        static void Start(struct evhttp_request *req, const StorageInfo &info, const std::string &etag, IoPool *io,
+                          const std::string &range)
+        {
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+            std::shared_ptr<DeepStream> s(new DeepStream(req, info, etag, io));
+            s->base_ = evhttp_connection_get_base(evcon);
+            s->self_ = s; // 结束或者客户端断开、已提交的块都完成后释放
+            evhttp_connection_set_closecb(evcon, OnClose, s.get());
+            s->inflight_ = 1;
+            auto deep = s->deep_;
+            auto plan = std::make_shared<Plan>();
+            if (!io->Submit(
+                    s->base_, [s, deep, plan, range, boundary = HttpRange::NewBoundary()]()
+                    { Prepare(deep.get(), s->info_, s->etag_, range, boundary, plan.get()); },
+                    [s, plan]()
+                    { s->OnPlan(plan.get()); }))
+            {
+                evhttp_connection_set_closecb(evcon, NULL, NULL);
+                s->self_.reset();
+                evhttp_send_reply(req, HTTP_SERVUNAVAIL, "server busy", NULL);
+            }
+        }
+
+    private:
+        // 响应体的一段：某一块中的[off, off+len)，或者multipart的分隔部分(text)
+        struct Piece
+        {
+            uint32_t block = 0;
+            uint64_t off = 0;
+            uint64_t len = 0;
+            DeepCache::Block data; // 解压后的整块或者分隔部分，为空表示还没读出
+        };
+
+        struct Plan
+        {
+            bool ok = false;
+            int code = HTTP_OK;
+            uint64_t size = 0;   // 文件原始大小
+            uint64_t length = 0; // 响应体长度
+            std::string content_type = "application/octet-stream";
+            std::string content_range;
+            std::vector<Piece> pieces;
+        };
+
+        DeepStream(struct evhttp_request *req, const StorageInfo &info, const std::string &etag, IoPool *io)
+            : req_(req), info_(info), io_(io), deep_(std::make_shared<DeepContainer>()), etag_(etag)
+        {
+        }
+
+        // IO线程中执行：打开文件，解析Range，算出片段并解压第一个块片段
+        static void Prepare(DeepContainer *deep, const StorageInfo &info, const std::string &etag, const std::string &range,
+                            const std::string &boundary, Plan *plan)
+        {
+            DeepCache::Block whole; // 旧格式整个文件解压后的内容
+            if (!deep->Open(info.storage_path_))
+                return;
+            if (deep->IsLegacy())
+            {
+                Piece p;
+                if (!ReadPiece(deep, info, etag, &p))
+                    return;
+                whole = p.data;
+            }
+            plan->ok = true;
+            plan->size = deep->IsLegacy() ? whole->size() : deep->RawSize();
+            std::vector<HttpRange::Range> ranges;
+            HttpRange::Result r = HttpRange::Parse(range.empty() ? NULL : range.c_str(), plan->size, &ranges);
+            if (r == HttpRange::kUnsatisfiable)
+            {
+                plan->code = 416;
+                return;
+            }
+            if (r == HttpRange::kFull && plan->size > 0)
+                ranges.push_back(HttpRange::Range{0, plan->size - 1});
+            if (r == HttpRange::kPartial)
+            {
+                plan->code = 206;
+                if (ranges.size() == 1)
+                    plan->content_range = HttpRange::ContentRange(ranges[0], plan->size);
+            }
+            bool multipart = ranges.size() > 1;
+            if (multipart)
+                plan->content_type = "multipart/byteranges; boundary=" + boundary;
+            for (size_t i = 0; i < ranges.size(); ++i)
+            {
+                const HttpRange::Range &rg = ranges[i];
+                if (multipart)
+                    AddText(plan, HttpRange::PartHeader(i, rg, plan->size, boundary, "application/octet-stream"));
+                for (uint32_t b = deep->FindBlock(rg.first); b < deep->BlockCount() && deep->BlockStart(b) <= rg.last; ++b)
+                {
+                    uint64_t start = deep->BlockStart(b);
+                    uint64_t end = deep->IsLegacy() ? whole->size() : start + deep->Block(b).raw_len;
+                    uint64_t from = std::max(rg.first, start), to = std::min(rg.last + 1, end);
+                    if (from >= to)
+                        continue;
+                    Piece p;
+                    p.block = b;
+                    p.off = from - start;
+                    p.len = to - from;
+                    if (deep->IsLegacy())
+                        p.data = whole;
+                    plan->length += p.len;
+                    plan->pieces.push_back(std::move(p));
+                }
+            }
+            if (multipart)
+                AddText(plan, HttpRange::Trailer(boundary));
+            for (auto &p : plan->pieces)
+            {
+                if (p.data)
+                    continue;
+                plan->ok = ReadPiece(deep, info, etag, &p);
+                break;
+            }
+        }
+
+        static void AddText(Plan *plan, std::string &&text)
+        {
+            Piece p;
+            p.len = text.size();
+            p.data = std::make_shared<const std::string>(std::move(text));
+            plan->length += p.len;
+            plan->pieces.push_back(std::move(p));
+        }
+
+        // 从缓存取出片段所在的块，不在缓存中时解压
+        static bool ReadPiece(const DeepContainer *deep, const StorageInfo &info, const std::string &etag, Piece *p)
+        {
+            uint32_t b = p->block;
+            p->data = DeepCache::GetInstance()->Get(DeepCache::Key(info.url_, etag, b), [deep, b](std::string *raw)
+                                                    { return deep->ReadBlock(b, raw); });
+            return p->data != NULL;
+        }
+
+        void OnPlan(Plan *plan)
+        {
+            --inflight_;
+            if (closed_)
+                return Release();
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req_);
+            struct evkeyvalq *headers = evhttp_request_get_output_headers(req_);
+            if (!plan->ok || plan->code == 416 || plan->pieces.empty())
+            {
+                // 这几种情况都不需要流式发送
+                evhttp_connection_set_closecb(evcon, NULL, NULL);
+                closed_ = true;
+                if (!plan->ok)
+                {
+                    mylog::GetLogger("asynclogger")->Error("open or decompress %s failed", info_.storage_path_.c_str());
+                    evhttp_send_reply(req_, HTTP_INTERNAL, "UnCompress failed", NULL);
+                }
+                else if (plan->code == 416)
+                {
+                    evhttp_add_header(headers, "Content-Range", HttpRange::Unsatisfied(plan->size).c_str());
+                    evhttp_send_reply(req_, 416, "Range Not Satisfiable", NULL);
+                }
+                else
+                {
+                    evhttp_add_header(headers, "ETag", etag_.c_str());
+                    evhttp_send_reply(req_, HTTP_OK, "Success", NULL);
+                }
+                return Release();
+            }
+            pieces_ = std::move(plan->pieces);
+            evhttp_add_header(headers, "Content-Length", std::to_string(plan->length).c_str());
+            evhttp_add_header(headers, "Accept-Ranges", "bytes");
+            evhttp_add_header(headers, "ETag", etag_.c_str());
+            evhttp_add_header(headers, "Content-Type", plan->content_type.c_str());
+            if (!plan->content_range.empty())
+                evhttp_add_header(headers, "Content-Range", plan->content_range.c_str());
+            evhttp_send_reply_start(req_, plan->code, plan->code == 206 ? "breakpoint continuous transmission" : "Success");
+            length_ = plan->length;
+            Pump();
+        }
+
+        // 预读后面的片段，窗口是还没写进socket的片段；已经有内容的片段直接进入ready_
+        void Pump()
+        {
+            bool moved = false;
+            for (; !closed_ && next_ < pieces_.size() && next_ - written_ < kReadAhead; ++next_)
+            {
+                Piece &p = pieces_[next_];
+                if (p.data)
+                {
+                    ready_.emplace(next_, p);
+                    moved = true;
+                    continue;
+                }
+                auto self = self_;
+                auto piece = std::make_shared<Piece>(p);
+                auto ok = std::make_shared<bool>(false);
+                size_t i = next_;
+                ++inflight_;
+                if (!io_->Submit(
+                        base_, [self, piece, ok]()
+                        { *ok = ReadPiece(self->deep_.get(), self->info_, self->etag_, piece.get()); },
+                        [self, i, piece, ok]()
+                        { self->OnPiece(i, *ok, *piece); }))
+                {
+                    --inflight_;
+                    return Abort();
+                }
+            }
+            if (moved)
+                SendReady();
+        }
+
+        void OnPiece(size_t i, bool ok, const Piece &piece)
+        {
+            --inflight_;
+            if (closed_)
+                return Release();
+            if (!ok)
+            {
+                mylog::GetLogger("asynclogger")->Error("%s: block %u unreadable, abort download", info_.storage_path_.c_str(),
+                                                       pieces_[i].block);
+                return Abort();
+            }
+            ready_.emplace(i, piece);
+            SendReady();
+        }
+
+        // 按片段顺序把已经准备好的内容交给evhttp
+        void SendReady()
+        {
+            bool sent = false;
+            for (auto it = ready_.find(sent_); it != ready_.end(); it = ready_.find(sent_))
+            {
+                const Piece &p = it->second;
+                DeepCache::Block *ref = new DeepCache::Block(p.data); // 发送完之前块不能释放
+                struct evbuffer *chunk = evbuffer_new();
+                evbuffer_add_reference(chunk, p.data->data() + p.off, p.len, FreeData, ref);
+                ready_.erase(it);
+                evhttp_send_reply_chunk_with_cb(req_, chunk, OnWritten, this);
+                evbuffer_free(chunk);
+                ++sent_;
+                sent = true;
+            }
+            if (sent)
+                Pump();
+        }
+
+        // 已交给evhttp的数据全部写进socket；最后一段写完后才结束响应，
+        // evhttp_send_reply_end只看evhttp自己的输出缓冲，提前调用时HTTP/1.0连接会在数据写完前被关闭
+        static void OnWritten(struct evhttp_connection *evcon, void *arg)
+        {
+            DeepStream *self = static_cast<DeepStream *>(arg);
+            self->written_ = self->sent_;
+            if (self->written_ == self->pieces_.size())
+            {
+                evhttp_connection_set_closecb(evcon, NULL, NULL);
+                evhttp_send_reply_end(self->req_);
+                mylog::GetLogger("asynclogger")->Info("stream %s finish, %lu bytes", self->info_.storage_path_.c_str(),
+                                                      static_cast<unsigned long>(self->length_));
+                self->closed_ = true; // 之后不再使用req_
+                return self->Release();
+            }
+            self->Pump();
+        }
+
+        static void FreeData(const void *data, size_t len, void *arg)
+        {
+            delete static_cast<DeepCache::Block *>(arg);
+        }
+
+        // 响应头已经发出，只能断开连接
+        void Abort()
+        {
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req_);
+            evhttp_connection_set_closecb(evcon, NULL, NULL);
+            closed_ = true;
+            evhttp_connection_free(evcon);
+            Release();
+        }
+
+        // 客户端断开，之后不能再使用req_
+        static void OnClose(struct evhttp_connection *evcon, void *arg)
+        {
+            DeepStream *self = static_cast<DeepStream *>(arg);
+            self->closed_ = true;
+            evhttp_connection_set_closecb(evcon, NULL, NULL);
+            self->Release();
+        }
+
+        void Release()
+        {
+            if (closed_ && inflight_ == 0)
+                self_.reset();
+        }
+
+    private:
+        struct evhttp_request *req_;
+        StorageInfo info_;
+        IoPool *io_;
+        std::shared_ptr<DeepContainer> deep_;
+        std::string etag_;
+        event_base *base_ = NULL;
+        std::shared_ptr<DeepStream> self_;
+
+        // 以下只在事件循环线程中使用
+        std::vector<Piece> pieces_;
+        uint64_t length_ = 0;
+        size_t next_ = 0;    // 下一个要准备的片段
+        size_t sent_ = 0;    // 下一个要交给evhttp的片段
+        size_t written_ = 0; // 已经写进socket的片段数
+        int inflight_ = 0;
+        bool closed_ = false;
+        std::map<size_t, Piece> ready_; // 已准备好、还没轮到发送的片段
+    };
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace storage
+{
+    /*
+    HTTP Range请求(RFC 7233)的解析，以及多个区间时multipart/byteranges响应的分隔部分：
+    (1)只支持bytes单位，区间写法有"a-b"、"a-"、"-n"(最后n字节)，多个区间用逗号分隔；
+       语法错误或者区间数超过kMaxRanges时整个Range忽略，按200发送整个文件；
+    (2)起点不小于文件大小的区间不可满足，终点超出文件大小的截到文件末尾；全部区间都不可满足时回复416；
+    (3)可满足的区间按起点排序，重叠或者相邻的合并成一个，合并后只剩一个区间时按单区间回复，不用multipart；
+       这样重复、交叉的区间不会让同一段数据被读出、解压多次；
+    (4)If-Range由调用者判断，与ETag不一致时不调用Parse。
+    */
+    class HttpRange
+    {
+    public:
+        static const size_t kMaxRanges = 64;
+
+        enum Result
+        {
+            kFull,         // 没有Range或者Range无效，发送整个文件
+            kPartial,      // 至少有一个可满足的区间，回复206
+            kUnsatisfiable // 所有区间都不可满足，回复416
+        };
+
+        struct Range
+        {
+            uint64_t first;
+            uint64_t last; // 包含
+            uint64_t Length() const { return last - first + 1; }
+        };
+
+        static Result Parse(const char *header, uint64_t size, std::vector<Range> *ranges)
+        {
+            ranges->clear();
+            if (header == NULL)
+                return kFull;
+            std::string h(header);
+            size_t pos = h.find_first_not_of(" \t");
+            if (pos == std::string::npos || h.compare(pos, 6, "bytes=") != 0)
+                return kFull;
+            pos += 6;
+            size_t specs = 0;
+            while (pos <= h.size())
+            {
+                size_t comma = h.find(',', pos);
+                std::string spec = Trim(h.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos));
+                pos = comma == std::string::npos ? h.size() + 1 : comma + 1;
+                if (spec.empty())
+                    continue; // RFC允许空的列表元素
+                if (++specs > kMaxRanges)
+                    return Clear(ranges);
+                size_t dash = spec.find('-');
+                if (dash == std::string::npos)
+                    return Clear(ranges);
+                std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+                uint64_t first, last;
+                if (a.empty())
+                {
+                    // 最后n字节
+                    uint64_t n;
+                    if (!ToNumber(b, &n))
+                        return Clear(ranges);
+                    if (n == 0 || size == 0)
+                        continue;
+                    first = n >= size ? 0 : size - n;
+                    last = size - 1;
+                }
+                else
+                {
+                    if (!ToNumber(a, &first))
+                        return Clear(ranges);
+                    if (b.empty())
+                        last = UINT64_MAX;
+                    else if (!ToNumber(b, &last) || last < first)
+                        return Clear(ranges);
+                    if (first >= size)
+                        continue;
+                    if (last >= size)
+                        last = size - 1;
+                }
+                ranges->push_back(Range{first, last});
+            }
+            if (specs == 0)
+                return kFull;
+            if (ranges->empty())
+                return kUnsatisfiable;
+            Coalesce(ranges);
+            return kPartial;
+        }
+
+        static std::string ContentRange(const Range &r, uint64_t size)
+        {
+            return "bytes " + std::to_string(r.first) + "-" + std::to_string(r.last) + "/" + std::to_string(size);
+        }
+
+        // 416的Content-Range
+        static std::string Unsatisfied(uint64_t size)
+        {
+            return "bytes */" + std::to_string(size);
+        }
+
+        // 多个区间时第i个区间之前的分隔行和头部
+        static std::string PartHeader(size_t i, const Range &r, uint64_t size, const std::string &boundary,
+                                      const std::string &content_type)
+        {
+            return std::string(i == 0 ? "" : "\r\n") + "--" + boundary + "\r\nContent-Type: " + content_type +
+                   "\r\nContent-Range: " + ContentRange(r, size) + "\r\n\r\n";
+        }
+
+        static std::string Trailer(const std::string &boundary)
+        {
+            return "\r\n--" + boundary + "--\r\n";
+        }
+
+        // 分隔符不能出现在内容中，用每次不同的随机串
+        static std::string NewBoundary()
+        {
+            static const char kHex[] = "0123456789abcdef";
+            std::string b = "mylog_byteranges_";
+            uint64_t v = (static_cast<uint64_t>(random()) << 32) ^ random();
+            for (int i = 0; i < 16; ++i, v >>= 4)
+                b += kHex[v & 0xf];
+            return b;
+        }
+
+    private:
+        static Result Clear(std::vector<Range> *ranges)
+        {
+            ranges->clear();
+            return kFull;
+        }
+
+        // 按起点排序，合并重叠或者相邻的区间
+        static void Coalesce(std::vector<Range> *ranges)
+        {
+            std::sort(ranges->begin(), ranges->end(), [](const Range &a, const Range &b)
+                      { return a.first < b.first; });
+            size_t n = 0;
+            for (size_t i = 1; i < ranges->size(); ++i)
+            {
+                Range &cur = (*ranges)[n];
+                const Range &next = (*ranges)[i];
+                if (next.first <= cur.last + 1) // last最大是size-1，加1不会溢出
+                    cur.last = std::max(cur.last, next.last);
+                else
+                    (*ranges)[++n] = next;
+            }
+            ranges->resize(n + 1);
+        }
+
+        static std::string Trim(const std::string &s)
+        {
+            size_t b = s.find_first_not_of(" \t");
+            if (b == std::string::npos)
+                return "";
+            size_t e = s.find_last_not_of(" \t");
+            return s.substr(b, e - b + 1);
+        }
+
+        static bool ToNumber(const std::string &s, uint64_t *v)
+        {
+            if (s.empty() || s.size() > 19 || s.find_first_not_of("0123456789") != std::string::npos)
+                return false;
+            *v = strtoull(s.c_str(), NULL, 10);
+            return true;
+        }
+    };
+}
@@ -0,0 +1,183 @@
+/*
+ * 深度存储文件倒排索引的命令行工具，索引格式见 LogIndex.hpp
+ * build  为深度存储文件建立索引(服务端后台建立的索引与此相同)，分块容器格式的文件按容器的块建立，
+ *        block_size只对旧格式(整个文件压缩)的文件有效
+ * check  校验索引的crc并打印统计信息
+ * lookup 打印每个词所在的块号，以*结尾的按前缀查询
+ * search 先查索引，只解压扫描候选块，打印包含关键字的行；--term 按整词匹配
+ *
+ * 编译: make index_tool
+ * 用法: ./index_tool build <deep_file> [block_size]
+ *       ./index_tool check <deep_file>
+ *       ./index_tool lookup <deep_file> <term>...
+ *       ./index_tool search <deep_file> <text> [--term]
+ */
+#include "LogSearch.hpp"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+storage::DataManager *data_;
+ThreadPool *tp = nullptr;
+mylog::Util::JsonData *g_conf_data;
+
+static int Usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " build <deep_file> [block_size]\n"
+              << "       " << prog << " check <deep_file>\n"
+              << "       " << prog << " lookup <deep_file> <term>...\n"
+              << "       " << prog << " search <deep_file> <text> [--term]" << std::endl;
+    return 1;
+}
+
+static double MsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+
+// 打印data中行首落在[begin, end)内且包含text的行
+static size_t GrepBlock(const std::string &data, size_t begin, size_t end, const std::string &text, bool whole)
+{
+    size_t pos = begin, matches = 0;
+    if (begin > 0 && data[begin - 1] != '\n')
+    {
+        size_t nl = data.find('\n', begin);
+        pos = nl == std::string::npos ? data.size() : nl + 1;
+    }
+    // 和LogSearch::Grep一样，查找范围截到end-1所在行的行尾
+    size_t limit = data.size();
+    if (end > 0 && end < data.size())
+    {
+        size_t nl = data.find('\n', end - 1);
+        limit = nl == std::string::npos ? data.size() : nl + 1;
+    }
+    size_t from = pos;
+    while (pos < end && from < limit)
+    {
+        const char *hit = storage::LogSearch::Find(data.data() + from, limit - from, text.data(), text.size());
+        if (hit == NULL)
+            break;
+        size_t at = hit - data.data();
+        if (whole && ((at > 0 && storage::LogIndex::IsTermChar(data[at - 1]) && storage::LogIndex::IsTermChar(text.front())) ||
+                      (at + text.size() < data.size() && storage::LogIndex::IsTermChar(data[at + text.size()]) &&
+                       storage::LogIndex::IsTermChar(text.back()))))
+        {
+            from = at + 1;
+            continue;
+        }
+        size_t line = data.rfind('\n', at);
+        line = (line == std::string::npos || line < pos) ? pos : line + 1;
+        if (line >= end)
+            break;
+        size_t eol = data.find('\n', at);
+        if (eol == std::string::npos)
+            eol = data.size();
+        fwrite(data.data() + line, 1, eol - line, stdout);
+        fputc('\n', stdout);
+        ++matches;
+        pos = from = eol + 1;
+    }
+    return matches;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+        return Usage(argv[0]);
+    // FileUtil等公共代码通过"asynclogger"打日志，工具自己输出错误信息，这里的日志直接丢弃
+    std::shared_ptr<mylog::LoggerBuilder> glb(new mylog::LoggerBuilder());
+    glb->BuildLoggerName("asynclogger");
+    glb->BuildLoggerFlush<mylog::NullFlush>();
+    mylog::LoggerManager::GetInstance().AddLogger(glb->Build());
+    std::string cmd = argv[1], path = argv[2];
+    auto start = std::chrono::steady_clock::now();
+    if (cmd == "build")
+    {
+        size_t block_size = argc > 3 ? atol(argv[3]) : 1024 * 1024;
+        if (block_size == 0 || !storage::LogIndex::Build(path, block_size))
+        {
+            std::cerr << "build index for " << path << " failed" << std::endl;
+            return 1;
+        }
+        std::cerr << "built " << storage::LogIndex::IndexPath(path) << " in " << MsSince(start) << " ms" << std::endl;
+        return 0;
+    }
+
+    storage::LogIndex idx;
+    if (!idx.Open(path))
+    {
+        std::cerr << "no valid index for " << path << " (missing, stale or corrupted)" << std::endl;
+        return 1;
+    }
+    if (cmd == "check")
+    {
+        const storage::LogIndex::IndexHeader &h = idx.Header();
+        std::cout << "terms: " << idx.TermCount() << "\nblocks: " << h.block_count
+                  << "\nblock_size: " << h.block_size << "\nraw_size: " << h.raw_size
+                  << "\nindex_size: " << storage::FileUtil(storage::LogIndex::IndexPath(path)).FileSize() << std::endl;
+        return 0;
+    }
+    if (cmd == "lookup" && argc > 3)
+    {
+        for (int i = 3; i < argc; ++i)
+        {
+            std::vector<uint32_t> blocks;
+            std::string term = argv[i];
+            bool prefix = !term.empty() && term.back() == '*';
+            if (prefix)
+                term.pop_back();
+            if (!idx.Lookup(term, prefix, &blocks))
+            {
+                std::cerr << "index corrupted or too many terms match the prefix" << std::endl;
+                return 1;
+            }
+            std::cout << argv[i] << ":";
+            for (uint32_t b : blocks)
+                std::cout << " " << b;
+            std::cout << std::endl;
+        }
+        std::cerr << "lookup took " << MsSince(start) << " ms" << std::endl;
+        return 0;
+    }
+    if (cmd == "search" && argc > 3)
+    {
+        std::string text = argv[3];
+        bool whole = argc > 4 && std::string(argv[4]) == "--term";
+        std::vector<storage::LogIndex::QueryTerm> terms = storage::LogIndex::QueryTerms(text, whole);
+        std::vector<uint32_t> blocks;
+        uint32_t block_size = idx.Header().block_size;
+        if (terms.empty() || !idx.Candidates(terms, &blocks))
+        {
+            blocks.clear();
+            for (uint32_t b = 0; b < idx.Header().block_count; ++b)
+                blocks.push_back(b); // 没有能用索引的词，只能全部扫描
+        }
+        size_t matches = 0;
+        storage::DeepContainer deep;
+        if (!blocks.empty())
+        {
+            if (!deep.Open(path))
+                return 1;
+            std::string data;
+            if (!deep.IsLegacy())
+            {
+                for (uint32_t b : blocks) // 容器的块号就是索引的块号，每块只解压自己
+                    if (deep.ReadBlock(b, &data))
+                        matches += GrepBlock(data, 0, data.size(), text, whole);
+            }
+            else if (deep.ReadBlock(0, &data))
+            {
+                for (uint32_t b : blocks)
+                {
+                    size_t off = static_cast<size_t>(b) * block_size;
+                    if (off < data.size())
+                        matches += GrepBlock(data, off, std::min<size_t>(off + block_size, data.size()), text, whole);
+                }
+            }
+        }
+        std::cerr << matches << " lines, " << blocks.size() << "/" << idx.Header().block_count
+                  << " blocks scanned, " << MsSince(start) << " ms" << std::endl;
+        return 0;
+    }
+    return Usage(argv[0]);
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include "Config.hpp"
+
+#include <event.h>
+#include <evhttp.h>
+#include <event2/http.h>
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace storage
+{
+    /*
+    IO线程池：压缩、解压、大文件读写这类耗时操作不能放在事件循环里做，否则同一个循环上的其他请求都要等它完成。
+    (1)Submit把work交给专用的线程池(io_threads个线程，和日志备份、检索共用的全局线程池分开，互不挤占)，
+       work完成后把done投递回请求所在的事件循环执行，回复只能在事件循环线程中发送；
+    (2)每个事件循环Attach一个通知器：一个eventfd加一个完成队列，IO线程把done放进队列，
+       队列原来为空时才写一次eventfd，事件循环被唤醒后一次取走整个队列；
+    (3)IO线程的nice值调低(kNice)，CPU不够用时内核优先调度事件循环线程，压缩不会拖慢小请求；
+    (4)客户端在work执行期间断开时，libevent会保留请求对象直到evhttp_send_reply，所以done照常回复即可；
+    (5)其他后台线程(比如日志接收的写线程，见LogIngest)也通过Post把回复投递回事件循环，共用同一个通知器。
+    */
+    class IoPool
+    {
+    public:
+        static constexpr int kNice = 10;
+
+        explicit IoPool(size_t threads)
+        {
+            mylog::Util::JsonData *conf = mylog::Util::JsonData::GetJsonData();
+            // 和全局线程池一样避开事件循环所在的CPU
+            pool_ = new ThreadPool(threads, mylog::Affinity::CpusFor(conf->pool_cpus, conf->reserved_cpus));
+        }
+
+        ~IoPool()
+        {
+            delete pool_; // 先等已提交的work执行完，它们还会访问通知器
+            for (Notifier *n : notifiers_)
+            {
+                event_free(n->ev);
+                close(n->efd);
+                delete n;
+            }
+        }
+
+        // 为一个事件循环注册完成通知，必须在事件循环开始运行之前调用
+        bool Attach(event_base *base)
+        {
+            Notifier *n = new Notifier;
+            n->base = base;
+            n->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (n->efd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Fatal("IoPool eventfd failed: %s", strerror(errno));
+                delete n;
+                return false;
+            }
+            n->ev = event_new(base, n->efd, EV_READ | EV_PERSIST, OnDone, n);
+            event_add(n->ev, NULL);
+            notifiers_.push_back(n);
+            return true;
+        }
+
+        // 事件循环线程调用：work在IO线程中执行，之后done在req所在的事件循环中执行
+        // 线程池已经停止时返回false，由调用者回复503
+        bool Submit(struct evhttp_request *req, std::function<void()> work, std::function<void()> done)
+        {
+            return Submit(evhttp_connection_get_base(evhttp_request_get_connection(req)), std::move(work), std::move(done));
+        }
+
+        // 同上，done在base对应的事件循环中执行，用于还没有形成请求对象的连接(见UploadStream)
+        bool Submit(event_base *base, std::function<void()> work, std::function<void()> done)
+        {
+            Notifier *notifier = Find(base);
+            if (notifier == NULL)
+                return false;
+            try
+            {
+                pool_->enqueue_detached([notifier, work = std::move(work), done = std::move(done)]() mutable
+                                        {
+                                            LowerPriority();
+                                            work();
+                                            Post(notifier, std::move(done)); });
+            }
+            catch (const std::runtime_error &)
+            {
+                return false;
+            }
+            return true;
+        }
+
+        // 任意线程调用：fn在base对应的事件循环中执行，base没有Attach时返回false
+        bool Post(event_base *base, std::function<void()> fn)
+        {
+            Notifier *notifier = Find(base);
+            if (notifier == NULL)
+                return false;
+            Post(notifier, std::move(fn));
+            return true;
+        }
+
+        bool Attached(event_base *base) const { return Find(base) != NULL; }
+
+        // Linux上setpriority对单个线程(tid)生效，每个线程只需设置一次；分块压缩的线程(见DeepContainer)也调用
+        static void LowerPriority()
+        {
+            static thread_local bool lowered = false;
+            if (lowered)
+                return;
+            lowered = true;
+            if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), kNice) != 0)
+                mylog::GetLogger("asynclogger")->Warn("IoPool setpriority failed: %s", strerror(errno));
+        }
+
+    private:
+        // 一个事件循环的完成通知，IO线程把done放进队列后写eventfd
+        struct Notifier
+        {
+            event_base *base;
+            int efd;
+            struct event *ev;
+            std::mutex mtx;
+            std::vector<std::function<void()>> done;
+        };
+
+        Notifier *Find(event_base *base) const
+        {
+            for (Notifier *n : notifiers_)
+                if (n->base == base)
+                    return n;
+            return NULL;
+        }
+
+        static void Post(Notifier *n, std::function<void()> fn)
+        {
+            bool wake;
+            {
+                std::unique_lock<std::mutex> lock(n->mtx);
+                wake = n->done.empty();
+                n->done.push_back(std::move(fn));
+            }
+            if (wake)
+            {
+                uint64_t one = 1;
+                ssize_t ret = write(n->efd, &one, sizeof(one));
+                (void)ret;
+            }
+        }
+
+        // 事件循环中执行IO线程完成的回调
+        static void OnDone(evutil_socket_t fd, short events, void *arg)
+        {
+            Notifier *n = static_cast<Notifier *>(arg);
+            uint64_t cnt;
+            while (read(fd, &cnt, sizeof(cnt)) > 0)
+                ;
+            std::vector<std::function<void()>> done;
+            {
+                std::unique_lock<std::mutex> lock(n->mtx);
+                done.swap(n->done);
+            }
+            for (auto &fn : done)
+                fn();
+        }
+
+    private:
+        ThreadPool *pool_ = nullptr;
+        std::vector<Notifier *> notifiers_; // 每个事件循环一个，启动后不再修改
+    };
+}
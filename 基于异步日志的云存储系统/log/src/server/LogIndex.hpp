@@ -0,0 +1,492 @@
+#pragma once
+#include "DataManager.hpp"
+#include "DeepContainer.hpp"
+#include "../../log_system/logs_code/LogFrame.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+extern storage::DataManager *data_;
+extern ThreadPool *tp;
+namespace storage
+{
+    /*
+    深度存储文件的倒排索引，保存在压缩文件旁边(文件名加.idx)，由线程池在后台建立：
+    (1)分块容器格式的文件(见DeepContainer)直接用容器的块号，容器在行边界处切块，每一行都完整地属于一个块；
+       旧格式的文件把解压后的数据按index_block_size切块，每一行属于它第一个字节所在的块(与检索的分块规则一致)；
+       词是连续的字母、数字和下划线，短于kMinTerm的词不进索引，长于kMaxTerm的词只索引前kMaxTerm个字节；
+       建索引时用DeepContainer::ForEachBlock逐块解压(后面的块在Workers中并行解压)，只保存不重复的词和块号，
+       内存与原始数据的大小无关(旧格式只有一块，仍要整体解压)；
+    (2)文件格式：文件头 + 按字典序排列的词条 + 重启点表 + 尾部；
+       词条 = varint(与前一个词的公共前缀长度) varint(剩余长度) 剩余字节 varint(块数) 块号的差值(varint)；
+       每kRestartInterval个词设一个重启点(公共前缀为0)，查询时先二分重启点，再顺序比较不超过kRestartInterval个词；
+    (3)文件头记录原文件的大小和修改时间，原文件被覆盖后索引自动失效；尾部的crc32覆盖前面所有内容，
+       打开时校验，不符时当作没有索引，检索退回全部扫描，启动时补建；临时文件名带进程号和序号，并发建同一个索引时不会互相覆盖；
+    (4)检索时query中两端都是分隔符的完整词按整词查询；query末尾的词可能只是某个词的前缀，按前缀查询
+       (字典有序，前缀相同的词是连续的)；query开头的词可能是某个词的后缀，不能用索引；term=1时两端都按整词查询；
+       长度不在[kMinTerm, kMaxTerm]之间的词不参与过滤，没有能用的词时全部扫描；
+       取这些词的块号交集，交集为空的文件直接跳过，不读也不解压，其余文件只扫描交集中的块。
+    */
+    class LogIndex
+    {
+    public:
+        static const uint32_t kMagic = 0x4D4C4749; // "MLGI"
+        static const uint32_t kVersion = 2;
+        static const size_t kMinTerm = 3;
+        static const size_t kMaxTerm = 64;
+        static const int kRestartInterval = 16;
+        static const size_t kMaxPrefixTerms = 256; // 前缀匹配的词超过这个数时不再用索引过滤
+
+#pragma pack(push, 1)
+        struct IndexHeader
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t block_size;
+            uint32_t block_count;
+            uint64_t raw_size;  // 解压后的大小
+            uint64_t src_size;  // 压缩文件的大小
+            int64_t src_mtime;  // 压缩文件的修改时间
+        };
+        struct IndexFooter
+        {
+            uint32_t restart_count;
+            uint32_t term_count;
+            uint32_t crc;
+        };
+#pragma pack(pop)
+
+        struct QueryTerm
+        {
+            std::string text;
+            bool prefix; // 按前缀匹配
+        };
+
+        LogIndex() {}
+        LogIndex(const LogIndex &) = delete;
+        LogIndex &operator=(const LogIndex &) = delete;
+        ~LogIndex()
+        {
+            if (map_ != NULL)
+                munmap(map_, map_size_);
+        }
+
+        static std::string IndexPath(const std::string &path)
+        {
+            return path + ".idx";
+        }
+
+        static bool IsTermChar(unsigned char c)
+        {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        }
+
+        // query中可以用索引的词；whole为true时query两端也算词的边界，否则开头的词不能用，末尾的词按前缀匹配
+        static std::vector<QueryTerm> QueryTerms(const std::string &q, bool whole)
+        {
+            std::vector<QueryTerm> terms;
+            size_t i = 0;
+            while (i < q.size())
+            {
+                if (!IsTermChar(q[i]))
+                {
+                    ++i;
+                    continue;
+                }
+                size_t j = i;
+                while (j < q.size() && IsTermChar(q[j]))
+                    ++j;
+                if ((i > 0 || whole) && j - i >= kMinTerm && j - i <= kMaxTerm)
+                    terms.push_back(QueryTerm{q.substr(i, j - i), j == q.size() && !whole});
+                i = j;
+            }
+            return terms;
+        }
+
+        // 建索引时收集每个词出现在哪些块中，块按块号升序加入，只保存不重复的词和块号，内存与原始数据的大小无关
+        class Builder
+        {
+        public:
+            // [data, data+len)整段都属于block(分块容器的一块)
+            void Add(const char *data, size_t len, uint32_t block)
+            {
+                ForEachTerm(data, len, [&](const char *term, size_t n, size_t)
+                            { AddTerm(term, n, block); });
+            }
+
+            // 旧格式解压后的数据：按block_size等长切块，每一行属于它第一个字节所在的块
+            void AddLines(const char *data, size_t len, size_t block_size)
+            {
+                ForEachTerm(data, len, [&](const char *term, size_t n, size_t line_start)
+                            { AddTerm(term, n, static_cast<uint32_t>(line_start / block_size)); });
+            }
+
+            std::string Finish(size_t block_size, uint32_t block_count, uint64_t raw_size, uint64_t src_size, int64_t src_mtime)
+            {
+                std::vector<const Postings::value_type *> terms;
+                terms.reserve(postings_.size());
+                for (auto &p : postings_)
+                    terms.push_back(&p);
+                std::sort(terms.begin(), terms.end(), [](const Postings::value_type *a, const Postings::value_type *b)
+                          { return a->first < b->first; });
+
+                IndexHeader h;
+                h.magic = htonl(kMagic);
+                h.version = htonl(kVersion);
+                h.block_size = htonl(static_cast<uint32_t>(block_size));
+                h.block_count = htonl(block_count);
+                h.raw_size = htobe64(raw_size);
+                h.src_size = htobe64(src_size);
+                h.src_mtime = htobe64(src_mtime);
+                std::string out(reinterpret_cast<const char *>(&h), sizeof(h));
+                std::vector<uint32_t> restarts;
+                const std::string *prev = NULL;
+                for (size_t k = 0; k < terms.size(); ++k)
+                {
+                    const std::string &term = terms[k]->first;
+                    size_t shared = 0;
+                    if (k % kRestartInterval == 0)
+                        restarts.push_back(static_cast<uint32_t>(out.size()));
+                    else
+                        while (shared < prev->size() && shared < term.size() && (*prev)[shared] == term[shared])
+                            ++shared;
+                    PutVarint(&out, shared);
+                    PutVarint(&out, term.size() - shared);
+                    out.append(term.data() + shared, term.size() - shared);
+                    const std::vector<uint32_t> &blocks = terms[k]->second;
+                    PutVarint(&out, blocks.size());
+                    uint32_t last = 0;
+                    for (uint32_t b : blocks)
+                    {
+                        PutVarint(&out, b - last);
+                        last = b;
+                    }
+                    prev = &term;
+                }
+                for (uint32_t r : restarts)
+                {
+                    uint32_t be = htonl(r);
+                    out.append(reinterpret_cast<const char *>(&be), sizeof(be));
+                }
+                IndexFooter f;
+                f.restart_count = htonl(static_cast<uint32_t>(restarts.size()));
+                f.term_count = htonl(static_cast<uint32_t>(terms.size()));
+                out.append(reinterpret_cast<const char *>(&f), sizeof(f) - sizeof(f.crc));
+                uint32_t crc = htonl(mylog::Frame::Crc32(out.data(), out.size()));
+                out.append(reinterpret_cast<const char *>(&crc), sizeof(crc));
+                return out;
+            }
+
+        private:
+            typedef std::unordered_map<std::string, std::vector<uint32_t>> Postings;
+
+            // 对每个词调用fn(词, 长度, 所在行的行首偏移)
+            template <class Fn>
+            static void ForEachTerm(const char *data, size_t len, const Fn &fn)
+            {
+                size_t line_start = 0;
+                size_t i = 0;
+                while (i < len)
+                {
+                    unsigned char c = data[i];
+                    if (!IsTermChar(c))
+                    {
+                        if (c == '\n')
+                            line_start = i + 1;
+                        ++i;
+                        continue;
+                    }
+                    size_t j = i;
+                    while (j < len && IsTermChar(data[j]))
+                        ++j;
+                    fn(data + i, j - i, line_start);
+                    i = j;
+                }
+            }
+
+            // 超过kMaxTerm的词按前kMaxTerm个字节索引，按前缀查询时才能找到它
+            void AddTerm(const char *term, size_t n, uint32_t block)
+            {
+                if (n < kMinTerm)
+                    return;
+                std::vector<uint32_t> &blocks = postings_[std::string(term, n < kMaxTerm ? n : kMaxTerm)];
+                if (blocks.empty() || blocks.back() != block)
+                    blocks.push_back(block);
+            }
+
+            Postings postings_;
+        };
+
+        // 逐块解压path并在旁边生成索引，先写临时文件再rename，检索线程不会读到写了一半的索引
+        static bool Build(const std::string &path, size_t block_size)
+        {
+            struct stat st;
+            DeepContainer deep;
+            if (stat(path.c_str(), &st) == -1 || !deep.Open(path))
+                return false;
+            Builder builder;
+            uint64_t raw_size = 0;
+            // 后面的块在Workers中提前解压，本线程按块号顺序收集词
+            bool ok = deep.ForEachBlock([&](uint32_t b, std::string &block)
+                                        {
+                                            if (deep.IsLegacy()) // 旧格式只有一块，只能整体解压
+                                                builder.AddLines(block.data(), block.size(), block_size);
+                                            else
+                                                builder.Add(block.data(), block.size(), b);
+                                            raw_size += block.size();
+                                            return true; },
+                                        DeepContainer::Workers());
+            if (!ok)
+                return false;
+            std::string idx = deep.IsLegacy()
+                                  ? builder.Finish(block_size, static_cast<uint32_t>((raw_size + block_size - 1) / block_size),
+                                                   raw_size, st.st_size, st.st_mtime)
+                                  : builder.Finish(deep.BlockSize(), deep.BlockCount(), raw_size, st.st_size, st.st_mtime);
+            std::string tmp = FileUtil(IndexPath(path)).TempName();
+            if (FileUtil(tmp).SetContent(idx.data(), idx.size()) && rename(tmp.c_str(), IndexPath(path).c_str()) == 0)
+                return true;
+            remove(tmp.c_str());
+            return false;
+        }
+
+        // 打开path的索引并校验crc，索引不存在、已经过期或者损坏时返回false
+        bool Open(const std::string &path)
+        {
+            struct stat src, st;
+            std::string idx_path = IndexPath(path);
+            if (stat(path.c_str(), &src) == -1)
+                return false;
+            int fd = open(idx_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                return false;
+            if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(IndexHeader) + sizeof(IndexFooter)))
+            {
+                close(fd);
+                return false;
+            }
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (m == MAP_FAILED)
+                return false;
+            map_ = static_cast<char *>(m);
+            map_size_ = st.st_size;
+
+            memcpy(&header_, map_, sizeof(header_));
+            header_.magic = ntohl(header_.magic);
+            header_.version = ntohl(header_.version);
+            header_.block_size = ntohl(header_.block_size);
+            header_.block_count = ntohl(header_.block_count);
+            header_.raw_size = be64toh(header_.raw_size);
+            header_.src_size = be64toh(header_.src_size);
+            header_.src_mtime = be64toh(header_.src_mtime);
+            if (header_.magic != kMagic || header_.version != kVersion || header_.block_size == 0 ||
+                header_.src_size != static_cast<uint64_t>(src.st_size) || header_.src_mtime != src.st_mtime)
+                return false;
+
+            IndexFooter f;
+            memcpy(&f, map_ + map_size_ - sizeof(f), sizeof(f));
+            restart_count_ = ntohl(f.restart_count);
+            term_count_ = ntohl(f.term_count);
+            if (mylog::Frame::Crc32(map_, map_size_ - sizeof(f.crc)) != ntohl(f.crc))
+                return false;
+            size_t tail = sizeof(f) + static_cast<size_t>(restart_count_) * 4;
+            if (tail > map_size_ - sizeof(IndexHeader))
+                return false;
+            restarts_ = map_ + map_size_ - tail;
+            entries_end_ = restarts_;
+            for (uint32_t i = 0; i < restart_count_; ++i)
+                if (Restart(i) < sizeof(IndexHeader) || Restart(i) >= static_cast<size_t>(entries_end_ - map_))
+                    return false;
+            return true;
+        }
+
+        // 查询一个词出现在哪些块中，块号升序；prefix为true时取所有以term开头的词的并集，
+        // 索引损坏或者前缀匹配的词太多时返回false，调用者应当退回全部扫描
+        bool Lookup(const std::string &term, bool prefix, std::vector<uint32_t> *blocks)
+        {
+            blocks->clear();
+            if (restart_count_ == 0)
+                return true;
+            // 找最后一个首词不大于term的重启点
+            uint32_t lo = 0, hi = restart_count_;
+            while (hi - lo > 1)
+            {
+                uint32_t mid = (lo + hi) / 2;
+                const char *p = map_ + Restart(mid);
+                std::string key;
+                if (!NextTerm(&p, &key, NULL))
+                    return false;
+                if (key <= term)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            // 从重启点往后顺序比较，下一个重启点的首词已经大于term，所以最多比较kRestartInterval个不匹配的词
+            const char *p = map_ + Restart(lo);
+            std::string key;
+            std::vector<uint32_t> one, merged;
+            size_t matched = 0;
+            while (p < entries_end_)
+            {
+                one.clear();
+                if (!NextTerm(&p, &key, &one))
+                    return false;
+                if (key < term)
+                    continue;
+                if (key == term && !prefix)
+                {
+                    blocks->swap(one);
+                    return true;
+                }
+                if (!prefix || key.compare(0, term.size(), term) != 0)
+                    break;
+                if (++matched > kMaxPrefixTerms)
+                    return false;
+                merged.clear();
+                std::set_union(blocks->begin(), blocks->end(), one.begin(), one.end(), std::back_inserter(merged));
+                blocks->swap(merged);
+            }
+            return true;
+        }
+
+        // 所有词的块号交集
+        bool Candidates(const std::vector<QueryTerm> &terms, std::vector<uint32_t> *blocks)
+        {
+            std::vector<uint32_t> one, merged;
+            for (size_t i = 0; i < terms.size(); ++i)
+            {
+                if (!Lookup(terms[i].text, terms[i].prefix, i == 0 ? blocks : &one))
+                    return false;
+                if (i > 0)
+                {
+                    merged.clear();
+                    std::set_intersection(blocks->begin(), blocks->end(), one.begin(), one.end(), std::back_inserter(merged));
+                    blocks->swap(merged);
+                }
+                if (blocks->empty())
+                    break;
+            }
+            return true;
+        }
+
+        const IndexHeader &Header() const
+        {
+            return header_;
+        }
+        uint32_t TermCount() const
+        {
+            return term_count_;
+        }
+
+        // 后台为一个深度存储文件建立索引
+        static void Schedule(const std::string &path)
+        {
+            if (!Config::GetInstance()->GetIndexEnable())
+                return;
+            try
+            {
+                tp->enqueue_detached(&LogIndex::BuildAndLog, path);
+            }
+            catch (const std::runtime_error &e)
+            {
+                mylog::GetLogger("asynclogger")->Warn("thread pool stopped, skip index of %s", path.c_str());
+            }
+        }
+
+        // 启动时为还没有索引或者索引已经过期的深度存储文件补建索引
+        static void Backfill()
+        {
+            if (!Config::GetInstance()->GetIndexEnable())
+                return;
+            std::vector<StorageInfo> files;
+            data_->GetAll(&files);
+            std::string deep_dir = Config::GetInstance()->GetDeepStorageDir();
+            for (auto &f : files)
+            {
+                if (f.storage_path_.find(deep_dir) == std::string::npos)
+                    continue;
+                LogIndex idx;
+                if (!idx.Open(f.storage_path_))
+                    Schedule(f.storage_path_);
+            }
+        }
+
+    private:
+        static void BuildAndLog(const std::string &path)
+        {
+            if (LogIndex::Build(path, std::max<size_t>(Config::GetInstance()->GetIndexBlockSize(), 64 * 1024)))
+                mylog::GetLogger("asynclogger")->Info("index built for %s", path.c_str());
+            else
+                mylog::GetLogger("asynclogger")->Error("build index for %s failed", path.c_str());
+        }
+
+        static void PutVarint(std::string *out, uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                out->push_back(static_cast<char>(v | 0x80));
+                v >>= 7;
+            }
+            out->push_back(static_cast<char>(v));
+        }
+
+        bool GetVarint(const char **p, uint64_t *v)
+        {
+            *v = 0;
+            for (int shift = 0; shift < 64 && *p < entries_end_; shift += 7)
+            {
+                unsigned char c = *(*p)++;
+                *v |= static_cast<uint64_t>(c & 0x7F) << shift;
+                if ((c & 0x80) == 0)
+                    return true;
+            }
+            return false;
+        }
+
+        uint32_t Restart(uint32_t i)
+        {
+            uint32_t off;
+            memcpy(&off, restarts_ + i * 4, 4);
+            return ntohl(off);
+        }
+
+        // 解码*p处的一个词条，key中是上一个词，解码后换成这个词；blocks为NULL时跳过块号
+        bool NextTerm(const char **p, std::string *key, std::vector<uint32_t> *blocks)
+        {
+            uint64_t shared, unshared, count, delta;
+            if (!GetVarint(p, &shared) || !GetVarint(p, &unshared) || shared > key->size() ||
+                unshared > static_cast<uint64_t>(entries_end_ - *p))
+                return false;
+            key->resize(shared);
+            key->append(*p, unshared);
+            *p += unshared;
+            if (!GetVarint(p, &count))
+                return false;
+            uint32_t block = 0;
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                if (!GetVarint(p, &delta))
+                    return false;
+                block += static_cast<uint32_t>(delta);
+                if (blocks != NULL)
+                    blocks->push_back(block);
+            }
+            return true;
+        }
+
+    private:
+        char *map_ = NULL;
+        size_t map_size_ = 0;
+        IndexHeader header_;
+        uint32_t restart_count_ = 0;
+        uint32_t term_count_ = 0;
+        const char *restarts_ = NULL;
+        const char *entries_end_ = NULL;
+    };
+}
@@ -0,0 +1,487 @@
+#pragma once
+#include "DataManager.hpp"
+#include "DeepContainer.hpp"
+#include "LogIndex.hpp"
+#include "IoPool.hpp"
+#include "../../log_system/logs_code/LogFrame.hpp"
+
+#include <event.h>
+#include <evhttp.h>
+#include <event2/http.h>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <climits>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern storage::DataManager *data_;
+extern ThreadPool *tp;
+namespace storage
+{
+    /*
+    日志接收模块：远程日志器(RemoteFlush)把一批批日志按LogFrame格式POST到/ingest，这里负责落盘。
+    (1)事件循环线程只把请求体的evbuffer整体移交给写线程(只移动链表节点，不拷贝数据)，请求先不回复；
+    (2)写线程每次取走所有积压的请求作为一组：校验crc、解压、按(session,seq)去重后追加到来源(LogSource请求头)
+       对应的分段文件；每个session只接受紧接在水位(已连续落盘的最大seq)之后的帧，前面有空缺的帧(比如前一帧被503拒绝)
+       不写入也不确认，等发送端重连后按顺序重发；每个来源的写缓冲只记录指向请求体的iovec，攒满ingest_buffer_size才用writev写出，
+       请求体在这一组提交完成之前不释放；用户态唯一的一次拷贝是写线程把请求体拼成连续内存，压缩帧直接从这块内存解压，
+       事件循环不拷贝数据；
+       一组处理完后每个写过的分段只做一次fdatasync(组提交)，然后通过IoPool的通知器让请求所在的事件循环回复这一组请求，
+       回复体是每个session的累计确认(FrameAck)，所以客户端收到确认时数据已经在磁盘上；
+       writev或fdatasync失败时把分段截回上次提交的长度，这一组写入该分段的session水位回退，相关请求回复500且不带确认，
+       发送端重发后重新写入；
+    (3)分段超过ingest_segment_size后封存：交给线程池压缩进deep_storage，并在DataManager中登记，之后可以像普通文件一样下载；
+       上次退出时没有封存的分段在启动时封存；
+    (4)积压的请求体超过ingest_max_pending时直接回复503，让客户端稍后重发，避免内存无限增长；
+    (5)有多个事件循环时只有一个写线程，回复通过IoPool::Post投递(和IO线程共用每个事件循环的eventfd)，
+       请求在哪个循环收到就在哪个循环回复。
+    */
+    /*
+    每个session的水位：seq不大于水位的帧都已经写入分段。只在写线程中使用。
+    第一次见到的session(发送端新启动，或者本服务重启后内存中没有记录)从收到的第一帧开始计；
+    Check只判断不修改，帧真正写入时才Advance，这一组的分段写失败时用Rollback退回组开始时的水位。
+    */
+    class SessionMarks
+    {
+    public:
+        enum Verdict
+        {
+            kWrite,     // 紧接在水位之后，需要写入
+            kDuplicate, // 已经写过的重发帧，只确认
+            kGap        // 前面还有帧没收到，不写入也不确认
+        };
+
+        Verdict Check(uint64_t session, uint64_t seq) const
+        {
+            auto it = marks_.find(session);
+            if (it == marks_.end())
+                return kWrite;
+            if (seq <= it->second)
+                return kDuplicate;
+            return seq == it->second + 1 ? kWrite : kGap;
+        }
+
+        // Check返回kWrite的帧写入后调用
+        void Advance(uint64_t session, uint64_t seq)
+        {
+            auto it = marks_.find(session);
+            if (it == marks_.end())
+                it = marks_.emplace(session, seq - 1).first;
+            group_start_.emplace(session, it->second); // 只记录本组第一次写入时的水位
+            it->second = seq;
+        }
+
+        uint64_t Mark(uint64_t session) const
+        {
+            auto it = marks_.find(session);
+            return it == marks_.end() ? 0 : it->second;
+        }
+
+        void Rollback(uint64_t session)
+        {
+            auto it = group_start_.find(session);
+            if (it != group_start_.end())
+                marks_[session] = it->second;
+        }
+
+        void EndGroup() { group_start_.clear(); }
+
+    private:
+        std::unordered_map<uint64_t, uint64_t> marks_;
+        std::unordered_map<uint64_t, uint64_t> group_start_;
+    };
+
+    class LogIngest
+    {
+    public:
+        // io用来把回复投递回事件循环，必须比LogIngest活得久
+        explicit LogIngest(IoPool *io) : io_(io)
+        {
+            Config *conf = Config::GetInstance();
+            dir_ = conf->GetIngestDir();
+            segment_size_ = conf->GetIngestSegmentSize();
+            buffer_size_ = conf->GetIngestBufferSize();
+            max_pending_ = conf->GetIngestMaxPending();
+            FileUtil(dir_).CreateDirectory();
+            SealLeftover();
+            writer_ = std::thread(&LogIngest::WriterLoop, this);
+        }
+
+        ~LogIngest()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            if (writer_.joinable())
+                writer_.join();
+        }
+
+        // 事件循环线程调用，积压过多时返回false，由调用者回复503
+        // 成功时接管body
+        bool Submit(struct evhttp_request *req, const std::string &source, struct evbuffer *body)
+        {
+            size_t len = evbuffer_get_length(body);
+            event_base *base = evhttp_connection_get_base(evhttp_request_get_connection(req));
+            if (!io_->Attached(base))
+                return false;
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (pending_bytes_ + len > max_pending_)
+                return false;
+            pending_bytes_ += len;
+            pending_.push_back(Pending{req, source, body, base});
+            cond_.notify_one();
+            return true;
+        }
+
+        // 来源名会成为文件名的一部分，只保留字母数字和-_.
+        static std::string SanitizeSource(const char *source)
+        {
+            std::string name;
+            for (const char *p = source; p != NULL && *p != '\0' && name.size() < 64; ++p)
+                if (isalnum((unsigned char)*p) || *p == '-' || *p == '_' || *p == '.')
+                    name += *p;
+            return name.empty() ? "unknown" : name;
+        }
+
+    private:
+        struct Segment;
+        struct Done
+        {
+            struct evhttp_request *req;
+            int code;
+            std::string reason;
+            std::string acks;
+            Segment *seg = NULL;            // 这个请求写入的分段，分段提交失败时整个请求回复500
+            std::vector<uint64_t> sessions; // 需要确认的session，提交之后才生成确认
+        };
+        struct Pending
+        {
+            struct evhttp_request *req;
+            std::string source;
+            struct evbuffer *body;
+            event_base *base; // 请求所在的事件循环，回复投递到这里
+        };
+        struct Segment
+        {
+            int fd = -1;
+            std::string path;
+            size_t size = 0;                 // 已经write的字节数
+            std::vector<struct iovec> iov;   // 还没write的数据，指向本组的请求体或解压结果
+            size_t iov_bytes = 0;
+            bool dirty = false;              // 本组是否写过，需要fdatasync
+            bool failed = false;             // 本组写入或fdatasync失败
+            size_t committed = 0;            // 上次成功提交时的长度，失败时截回这里
+            std::vector<uint64_t> sessions;  // 本组写入过这个分段的session，失败时回退它们的水位
+        };
+
+        void WriterLoop()
+        {
+            std::vector<Pending> group;
+            std::vector<Done> done;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    cond_.wait(lock, [this]()
+                               { return stop_ || !pending_.empty(); });
+                    if (pending_.empty()) // stop_且没有积压
+                        break;
+                    group.swap(pending_);//上一组fdatasync期间到达的请求都在这里，自然形成下一组
+                    pending_bytes_ = 0;
+                }
+                done.clear();
+                for (auto &p : group)
+                    done.push_back(Append(p));
+                for (auto &it : segments_)
+                    Commit(it.second);
+                for (auto &d : done)
+                    Finish(d);
+                marks_.EndGroup();
+                for (auto &it : segments_)
+                    it.second.failed = false;
+                for (auto &p : group)//iovec已经全部写出，请求体可以释放了
+                    evbuffer_free(p.body);
+                decoded_.clear();
+                for (auto it = segments_.begin(); it != segments_.end();)
+                {
+                    if (it->second.size >= segment_size_)
+                    {
+                        Seal(it->second);
+                        it = segments_.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+                // 通知器的队列原来为空时才写eventfd，同一组的请求一般只唤醒目标循环一次
+                for (size_t i = 0; i < group.size(); ++i)
+                    io_->Post(group[i].base, [d = std::move(done[i])]() mutable
+                              { Reply(d); });
+                group.clear();
+            }
+            for (auto &it : segments_)//退出时剩下的数据写完，分段留到下次启动时封存
+            {
+                Commit(it.second);
+                close(it.second.fd);
+            }
+            segments_.clear();
+        }
+
+        // 解析一个请求中的所有帧，追加到对应来源的分段，返回这个请求的回复(确认在提交之后由Finish生成)
+        Done Append(Pending &p)
+        {
+            Done d{p.req, HTTP_OK, "OK", std::string()};
+            size_t size = evbuffer_get_length(p.body);
+            const char *body = reinterpret_cast<const char *>(evbuffer_pullup(p.body, -1));//拼成连续内存，在写线程中完成
+            size_t pos = 0;
+            while (pos < size)
+            {
+                mylog::Frame::FrameHeader h;
+                if (size - pos < sizeof(h))
+                    return Done{p.req, HTTP_BADREQUEST, "truncated frame", std::string()};
+                memcpy(&h, body + pos, sizeof(h));
+                if (!mylog::Frame::ParseHeader(&h) || size - pos - sizeof(h) < h.data_len)
+                    return Done{p.req, HTTP_BADREQUEST, "bad frame", std::string()};
+                const char *data = body + pos + sizeof(h);
+                pos += sizeof(h) + h.data_len;
+                if (mylog::Frame::Crc32(data, h.data_len) != h.crc)
+                    return Done{p.req, HTTP_BADREQUEST, "crc mismatch", std::string()};
+                if (d.sessions.empty() || d.sessions.back() != h.session)
+                    d.sessions.push_back(h.session);
+                SessionMarks::Verdict verdict = marks_.Check(h.session, h.seq);
+                if (verdict == SessionMarks::kDuplicate)
+                    continue; // 重发的帧只确认不写入
+                if (verdict == SessionMarks::kGap)
+                    continue; // 前面有帧还没收到(比如被503拒绝)，不写也不确认，等发送端重连后按顺序重发
+                Segment &seg = SegmentFor(p.source);
+                if (seg.fd == -1)
+                    return Done{p.req, HTTP_INTERNAL, "open segment failed", std::string()};
+                std::string *decoded = NULL;
+                if (h.codec != mylog::Frame::NONE)
+                {
+                    decoded_.emplace_back();
+                    decoded = &decoded_.back();
+                    if (!mylog::Frame::Decode(static_cast<mylog::Frame::Codec>(h.codec),
+                                              data, h.data_len, h.raw_len, decoded))
+                        return Done{p.req, HTTP_BADREQUEST, "decode failed", std::string()};
+                }
+                marks_.Advance(h.session, h.seq);
+                d.seg = &seg;
+                seg.sessions.push_back(h.session);
+                if (decoded == NULL)
+                    Write(seg, data, h.data_len);
+                else
+                    Write(seg, decoded->data(), decoded->size());
+            }
+            return d;
+        }
+
+        // 分段已经提交：写失败的请求回复500且不确认，其他请求按session的当前水位生成累计确认
+        void Finish(Done &d)
+        {
+            if (d.code != HTTP_OK)
+                return;
+            if (d.seg != NULL && d.seg->failed)
+            {
+                d.code = HTTP_INTERNAL;
+                d.reason = "write segment failed";
+                d.sessions.clear();
+                return;
+            }
+            for (uint64_t session : d.sessions)
+            {
+                uint64_t mark = marks_.Mark(session);
+                if (mark == 0)
+                    continue;
+                mylog::Frame::FrameAck ack = mylog::Frame::MakeAck(session, mark);
+                d.acks.append(reinterpret_cast<const char *>(&ack), sizeof(ack));
+            }
+        }
+
+        // 只记录iovec，攒满buffer_size_或IOV_MAX个再writev
+        void Write(Segment &seg, const char *data, size_t len)
+        {
+            seg.dirty = true;
+            if (seg.failed) // 这一组已经写失败，剩下的不再写，提交时整体回退
+                return;
+            seg.iov.push_back({const_cast<char *>(data), len});
+            seg.iov_bytes += len;
+            if (seg.iov_bytes >= buffer_size_ || seg.iov.size() >= IOV_MAX)
+                WriteIov(seg);
+        }
+
+        // 写出所有iovec，处理部分写入；失败时标记分段，由Commit回退
+        void WriteIov(Segment &seg)
+        {
+            size_t idx = 0;
+            while (idx < seg.iov.size())
+            {
+                int cnt = static_cast<int>(std::min<size_t>(seg.iov.size() - idx, IOV_MAX));
+                ssize_t n = writev(seg.fd, &seg.iov[idx], cnt);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    mylog::GetLogger("asynclogger")->Error("write segment %s failed: %s", seg.path.c_str(), strerror(errno));
+                    seg.failed = true;
+                    break;
+                }
+                seg.size += n;
+                while (n > 0 && idx < seg.iov.size())
+                {
+                    if (static_cast<size_t>(n) >= seg.iov[idx].iov_len)
+                    {
+                        n -= seg.iov[idx].iov_len;
+                        ++idx;
+                    }
+                    else
+                    {
+                        seg.iov[idx].iov_base = static_cast<char *>(seg.iov[idx].iov_base) + n;
+                        seg.iov[idx].iov_len -= n;
+                        n = 0;
+                    }
+                }
+            }
+            seg.iov.clear();
+            seg.iov_bytes = 0;
+        }
+
+        // 组提交：写出剩下的iovec，一次fdatasync覆盖这一组所有请求。
+        // 失败时截掉这一组写了一半的数据，回退写过这个分段的session的水位，发送端收到500后重发
+        void Commit(Segment &seg)
+        {
+            if (!seg.dirty)
+                return;
+            if (!seg.failed)
+                WriteIov(seg);
+            if (!seg.failed && fdatasync(seg.fd) == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("fdatasync segment %s failed: %s", seg.path.c_str(), strerror(errno));
+                seg.failed = true;
+            }
+            if (seg.failed)
+            {
+                if (ftruncate(seg.fd, seg.committed) != 0)
+                    mylog::GetLogger("asynclogger")->Error("truncate segment %s failed: %s", seg.path.c_str(), strerror(errno));
+                seg.size = seg.committed;
+                for (uint64_t session : seg.sessions)
+                    marks_.Rollback(session);
+            }
+            seg.committed = seg.size;
+            seg.sessions.clear();
+            seg.dirty = false;
+        }
+
+        Segment &SegmentFor(const std::string &source)
+        {
+            Segment &seg = segments_[source];
+            if (seg.fd != -1)
+                return seg;
+            time_t now = time(NULL);
+            struct tm t;
+            localtime_r(&now, &t);
+            char ts[32];
+            strftime(ts, sizeof(ts), "%Y%m%d%H%M%S", &t);
+            seg.path = dir_ + source + "-" + ts + "-" + std::to_string(++segment_cnt_) + ".log";
+            seg.fd = open(seg.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (seg.fd == -1)
+                mylog::GetLogger("asynclogger")->Error("open segment %s failed: %s", seg.path.c_str(), strerror(errno));
+            seg.size = 0;
+            seg.committed = 0;
+            return seg;
+        }
+
+        // 封存分段：关闭文件，交给线程池压缩进deep_storage并登记，不阻塞写线程
+        void Seal(Segment &seg)
+        {
+            close(seg.fd);
+            seg.fd = -1;
+            std::string path = seg.path;
+            mylog::GetLogger("asynclogger")->Info("seal segment %s, size %lu", path.c_str(), seg.size);
+            try
+            {
+                tp->enqueue_detached(&LogIngest::SealToDeep, path);
+            }
+            catch (const std::runtime_error &e)
+            {
+                SealToDeep(path);//线程池已经停止，就地完成
+            }
+        }
+
+        static void SealToDeep(const std::string &path)
+        {
+            FileUtil fu(path);
+            std::string deep_dir = Config::GetInstance()->GetDeepStorageDir();
+            FileUtil(deep_dir).CreateDirectory();
+            std::string deep_path = deep_dir + fu.FileName();
+            // 分段逐块读入、逐块压缩，不需要把整个分段读进内存
+            if (!DeepContainer::PackFile(path, deep_path))
+            {
+                mylog::GetLogger("asynclogger")->Error("compress segment %s failed", path.c_str());
+                return;
+            }
+            StorageInfo info;
+            if (!info.NewStorageInfo(deep_path))
+                return;
+            data_->Insert(info);
+            LogIndex::Schedule(deep_path);
+            remove(path.c_str());
+            mylog::GetLogger("asynclogger")->Info("segment %s sealed into %s", path.c_str(), deep_path.c_str());
+        }
+
+        // 启动时把上次没有封存的分段全部封存
+        void SealLeftover()
+        {
+            std::vector<std::string> files;
+            FileUtil(dir_).ScanDirectory(&files);
+            for (auto &f : files)
+            {
+                if (f.size() < 4 || f.compare(f.size() - 4, 4, ".log") != 0)
+                    continue;
+                mylog::GetLogger("asynclogger")->Info("seal leftover segment %s", f.c_str());
+                tp->enqueue_detached(&LogIngest::SealToDeep, f);
+            }
+        }
+
+        // 事件循环中回复已经提交的请求
+        static void Reply(Done &d)
+        {
+            if (!d.acks.empty())
+            {
+                evbuffer_add(evhttp_request_get_output_buffer(d.req), d.acks.data(), d.acks.size());
+                evhttp_add_header(evhttp_request_get_output_headers(d.req), "Content-Type", "application/octet-stream");
+            }
+            evhttp_send_reply(d.req, d.code, d.reason.c_str(), NULL);
+        }
+
+    private:
+        std::string dir_;
+        size_t segment_size_ = 0;
+        size_t buffer_size_ = 0;
+        size_t max_pending_ = 0;
+
+        std::mutex mtx_;
+        std::condition_variable cond_;
+        std::vector<Pending> pending_;
+        size_t pending_bytes_ = 0;
+        bool stop_ = false;
+
+        IoPool *io_;
+
+        // 以下只在写线程中使用
+        std::unordered_map<std::string, Segment> segments_;
+        SessionMarks marks_;                              // 每个session已连续落盘的最大seq
+        std::deque<std::string> decoded_;                 // 本组解压出来的数据，提交后释放
+        size_t segment_cnt_ = 0;
+        std::thread writer_;
+    };
+}
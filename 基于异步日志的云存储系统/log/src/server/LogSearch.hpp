@@ -0,0 +1,441 @@
+#pragma once
+#include "DataManager.hpp"
+#include "LogIndex.hpp"
+
+#include <event.h>
+#include <evhttp.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern storage::DataManager *data_;
+extern ThreadPool *tp;
+namespace storage
+{
+    /*
+    日志全文检索：GET /search?q=关键字&from=起始时间&to=结束时间&limit=最多返回的行数&term=1
+    (1)from/to是unix时间戳，按文件的最后修改时间过滤，不填表示不限；检索范围是DataManager中登记的文件
+       加上ingest目录中还没封存的分段；
+    (2)普通文件按search_block_size切块，每块一个线程池任务，用pread读取；分块容器格式的深度存储文件(见DeepContainer)
+       每个压缩块一个任务，各自读出、解压、扫描；旧格式的深度存储文件是整个文件压缩的，先由一个任务解压，
+       再把解压结果切块派发，所以大文件也能用满所有线程；有倒排索引(见LogIndex)时先查索引，
+       没有候选块的文件不读也不解压，有候选块的只扫描这些块；term=1表示按整词匹配，关键字两边必须是词的边界；
+    (3)每一行只属于它第一个字节所在的块，块边界处的行由前一块读完，不会重复也不会漏掉；
+    (4)匹配的行以"url:行内容"的格式通过chunked响应陆续发回：任务把结果追加到输出缓冲，
+       通过eventfd通知事件循环发送，libevent的接口只在事件循环线程中调用；
+    (5)客户端断开或者匹配行数达到上限时置取消标记，还没开始的任务直接返回，正在扫描的任务在下一次匹配时退出；
+       所有任务结束后事件循环释放这次检索。
+    */
+    class LogSearch
+    {
+    public:
+        // 事件循环线程调用，参数错误时直接回复400
+        static void Start(struct evhttp_request *req)
+        {
+            struct evkeyvalq params;
+            const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+            if (query == NULL || evhttp_parse_query_str(query, &params) != 0)
+            {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "bad query", NULL);
+                return;
+            }
+            const char *q = evhttp_find_header(&params, "q");
+            const char *from = evhttp_find_header(&params, "from");
+            const char *to = evhttp_find_header(&params, "to");
+            const char *limit = evhttp_find_header(&params, "limit");
+            const char *term = evhttp_find_header(&params, "term");
+            bool whole = term != NULL && atoi(term) != 0;
+            std::string needle = q ? q : "";
+            time_t from_time = from ? atoll(from) : 0;
+            time_t to_time = to ? atoll(to) : 0;
+            size_t max_matches = Config::GetInstance()->GetSearchMaxMatches();
+            if (limit != NULL && atoll(limit) > 0)
+                max_matches = std::min<size_t>(max_matches, atoll(limit));
+            evhttp_clear_headers(&params);
+            if (needle.empty() || needle.find('\n') != std::string::npos)
+            {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "missing q", NULL);
+                return;
+            }
+
+            struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+            std::shared_ptr<LogSearch> job(new LogSearch(req, needle, whole, max_matches));
+            job->efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (job->efd_ == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("search eventfd failed: %s", strerror(errno));
+                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
+                return;
+            }
+            job->ev_ = event_new(evhttp_connection_get_base(evcon), job->efd_, EV_READ | EV_PERSIST, OnReady, job.get());
+            event_add(job->ev_, NULL);
+            job->self_ = job; // 所有任务结束后在OnReady中释放
+            evhttp_connection_set_closecb(evcon, OnClose, job.get());
+            evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain;charset=utf-8");
+            evhttp_send_reply_start(req, HTTP_OK, "OK");
+            mylog::GetLogger("asynclogger")->Info("search start, q: %s, from: %ld, to: %ld", needle.c_str(), from_time, to_time);
+            job->Dispatch(from_time, to_time);
+        }
+
+        // 在[data, data+len)中查找needle，返回第一次出现的位置，没有找到返回NULL
+        // 先用SSE2同时比较16个位置的首字节和尾字节，两者都相同的位置再memcmp，
+        // 大部分位置在向量比较时就被排除；不支持SSE2的平台和不足16字节的尾部交给memmem
+        static const char *Find(const char *data, size_t len, const char *needle, size_t n)
+        {
+            if (n == 0 || n > len)
+                return n == 0 ? data : NULL;
+#ifdef __SSE2__
+            if (n >= 2)
+            {
+                const __m128i first = _mm_set1_epi8(needle[0]);
+                const __m128i last = _mm_set1_epi8(needle[n - 1]);
+                size_t i = 0;
+                for (; i + n - 1 + 16 <= len; i += 16)
+                {
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + n - 1));
+                    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+                    while (mask != 0)
+                    {
+                        unsigned bit = __builtin_ctz(mask);
+                        if (memcmp(data + i + bit + 1, needle + 1, n - 2) == 0)
+                            return data + i + bit;
+                        mask &= mask - 1;
+                    }
+                }
+                return static_cast<const char *>(memmem(data + i, len - i, needle, n));
+            }
+#endif
+            return static_cast<const char *>(memmem(data, len, needle, n));
+        }
+
+        ~LogSearch()
+        {
+            if (efd_ != -1)
+                close(efd_);
+        }
+
+    private:
+        LogSearch(struct evhttp_request *req, const std::string &needle, bool whole, size_t max_matches)
+            : req_(req), needle_(needle), whole_(whole), terms_(LogIndex::QueryTerms(needle, whole)), max_matches_(max_matches),
+              block_size_(std::max<size_t>(Config::GetInstance()->GetSearchBlockSize(), 64 * 1024))
+        {
+        }
+
+        // 列出时间范围内的文件并派发任务；tasks_初始为1，派发完再减掉，避免派发过程中提前结束
+        void Dispatch(time_t from, time_t to)
+        {
+            std::vector<StorageInfo> files;
+            data_->GetAll(&files);
+            std::string low_dir = Config::GetInstance()->GetLowStorageDir();
+            std::vector<std::pair<std::string, std::string>> plain; // (url, path)
+            for (auto &f : files)
+            {
+                FileUtil fu(f.storage_path_);
+                time_t mtime = fu.LastModifyTime();
+                if (mtime == -1 || (from > 0 && mtime < from) || (to > 0 && mtime > to))
+                    continue;
+                if (f.storage_path_.find(low_dir) != std::string::npos)
+                    plain.emplace_back(f.url_, f.storage_path_);
+                else
+                    Submit(&LogSearch::ScanDeep, f.url_, f.storage_path_);
+            }
+            std::string ingest_dir = Config::GetInstance()->GetIngestDir();
+            std::vector<std::string> segments;
+            if (FileUtil(ingest_dir).Exists())
+                FileUtil(ingest_dir).ScanDirectory(&segments);
+            for (auto &s : segments)
+            {
+                time_t mtime = FileUtil(s).LastModifyTime();
+                if (mtime == -1 || (from > 0 && mtime < from) || (to > 0 && mtime > to))
+                    continue;
+                plain.emplace_back("ingest:" + FileUtil(s).FileName(), s);
+            }
+            for (auto &p : plain)
+            {
+                int64_t size = FileUtil(p.second).FileSize(); // 正在写的分段只检索当前已有的部分
+                for (int64_t off = 0; off < size; off += block_size_)
+                    Submit(&LogSearch::ScanBlock, p.first, p.second, off, std::min<int64_t>(off + block_size_, size));
+            }
+            TaskDone();
+        }
+
+        template <class Fn, class... Args>
+        void Submit(Fn fn, Args... args)
+        {
+            tasks_.fetch_add(1);
+            auto self = self_;
+            auto task = [self, fn, args...]()
+            {
+                if (!self->cancelled_.load(std::memory_order_relaxed))
+                    ((*self).*fn)(args...);
+                self->TaskDone();
+            };
+            try
+            {
+                tp->enqueue_detached(task);
+            }
+            catch (const std::runtime_error &e)
+            {
+                task(); // 线程池已经停止，就地完成
+            }
+        }
+
+        // 检索普通文件中[begin, end)这一块，多读前一个字节判断块首是否是行首，块尾的行读到换行为止
+        void ScanBlock(std::string url, std::string path, int64_t begin, int64_t end)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("search open %s failed: %s", path.c_str(), strerror(errno));
+                return;
+            }
+            int64_t base = begin > 0 ? begin - 1 : 0;
+            std::string buf;
+            int64_t want = end - base + 4096;
+            while (true)
+            {
+                size_t old = buf.size();
+                buf.resize(old + want);
+                ssize_t n = pread(fd, &buf[old], want, base + old);
+                if (n < 0 && errno == EINTR)
+                {
+                    buf.resize(old);
+                    continue;
+                }
+                buf.resize(old + std::max<ssize_t>(n, 0));
+                size_t from = std::max<size_t>(old, end - base - 1); // 之前读到的部分已经确认没有换行
+                if (n <= 0 || (from < buf.size() && memchr(buf.data() + from, '\n', buf.size() - from) != NULL))
+                    break;
+                want = 64 * 1024; // 块尾的行还没读完
+            }
+            close(fd);
+            Grep(url, buf.data(), buf.size(), begin - base, std::min<size_t>(end - base, buf.size()));
+        }
+
+        // 深度存储的文件先查索引；分块容器只读出、解压候选块，旧格式整体解压后切块派发
+        void ScanDeep(std::string url, std::string path)
+        {
+            std::vector<uint32_t> blocks;
+            bool filtered = false;
+            size_t index_block = 0;
+            if (!terms_.empty())
+            {
+                LogIndex idx;
+                if (idx.Open(path) && idx.Candidates(terms_, &blocks))
+                {
+                    if (blocks.empty())
+                        return; // 关键字中的词不在这个文件中
+                    filtered = true;
+                    index_block = idx.Header().block_size;
+                }
+            }
+            auto deep = std::make_shared<DeepContainer>();
+            if (!deep->Open(path))
+                return;
+            if (!deep->IsLegacy())
+            {
+                // 索引的块号就是容器的块号
+                if (!filtered)
+                    for (uint32_t b = 0; b < deep->BlockCount(); ++b)
+                        blocks.push_back(b);
+                for (uint32_t b : blocks)
+                    if (b < deep->BlockCount())
+                        Submit(&LogSearch::ScanContainerBlock, url, deep, b);
+                return;
+            }
+            std::string raw;
+            if (!deep->ReadBlock(0, &raw))
+                return;
+            auto data = std::make_shared<std::string>(std::move(raw));
+            if (filtered)
+            {
+                for (uint32_t b : blocks)
+                {
+                    size_t off = static_cast<size_t>(b) * index_block;
+                    if (off < data->size())
+                        Submit(&LogSearch::ScanBuffer, url, data, off, std::min(off + index_block, data->size()));
+                }
+                return;
+            }
+            for (size_t off = 0; off < data->size(); off += block_size_)
+                Submit(&LogSearch::ScanBuffer, url, data, off, std::min(off + block_size_, data->size()));
+        }
+
+        // 容器的块在行边界处切开，整块都属于自己
+        void ScanContainerBlock(std::string url, std::shared_ptr<DeepContainer> deep, uint32_t b)
+        {
+            std::string raw;
+            if (deep->ReadBlock(b, &raw))
+                Grep(url, raw.data(), raw.size(), 0, raw.size());
+        }
+
+        void ScanBuffer(std::string url, std::shared_ptr<std::string> data, size_t begin, size_t end)
+        {
+            Grep(url, data->data(), data->size(), begin, end);
+        }
+
+        // 输出[data, data+len)中行首落在[begin, end)内且包含needle_的行
+        void Grep(const std::string &url, const char *data, size_t len, size_t begin, size_t end)
+        {
+            size_t pos = begin;
+            if (begin > 0 && data[begin - 1] != '\n') // 块首的半行属于前一块
+            {
+                const char *nl = static_cast<const char *>(memchr(data + begin, '\n', len - begin));
+                pos = nl ? nl - data + 1 : len;
+            }
+            // 只有行首在end之前的行属于这一块，查找范围截到end-1所在行的行尾；
+            // 否则每次Find都会扫到缓冲区末尾，旧格式文件整体解压后按块派发时总工作量是平方级的
+            size_t limit = len;
+            if (end > 0 && end < len)
+            {
+                const char *nl = static_cast<const char *>(memchr(data + end - 1, '\n', len - end + 1));
+                limit = nl ? nl - data + 1 : len;
+            }
+            std::string out;
+            size_t from = pos; // pos始终是行首，from是下一次查找的起点
+            while (pos < end && from < limit && !cancelled_.load(std::memory_order_relaxed))
+            {
+                const char *hit = Find(data + from, limit - from, needle_.data(), needle_.size());
+                if (hit == NULL)
+                    break;
+                if (whole_ && !WholeTerm(data, len, hit))
+                {
+                    from = hit - data + 1;
+                    continue;
+                }
+                const char *line = static_cast<const char *>(memrchr(data + pos, '\n', hit - data - pos));
+                line = line ? line + 1 : data + pos;
+                if (static_cast<size_t>(line - data) >= end)
+                    break;
+                const char *eol = static_cast<const char *>(memchr(hit, '\n', data + len - hit));
+                if (eol == NULL)
+                    eol = data + len;
+                if (matches_.fetch_add(1) >= max_matches_)
+                {
+                    cancelled_ = true;
+                    break;
+                }
+                out.append(url).append(1, ':').append(line, eol - line).append(1, '\n');
+                if (out.size() >= 64 * 1024)
+                {
+                    Emit(out);
+                    out.clear();
+                }
+                pos = from = eol - data + 1;
+            }
+            if (!out.empty())
+                Emit(out);
+        }
+
+        // hit处的关键字两边是否都是词的边界
+        bool WholeTerm(const char *data, size_t len, const char *hit)
+        {
+            const char *tail = hit + needle_.size();
+            if (hit > data && LogIndex::IsTermChar(hit[-1]) && LogIndex::IsTermChar(needle_.front()))
+                return false;
+            if (tail < data + len && LogIndex::IsTermChar(*tail) && LogIndex::IsTermChar(needle_.back()))
+                return false;
+            return true;
+        }
+
+        void Emit(const std::string &out)
+        {
+            bool notify;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                notify = out_.empty(); // 缓冲非空说明通知已经发出，事件循环还没取走
+                out_ += out;
+            }
+            if (notify)
+                Notify();
+        }
+
+        void TaskDone()
+        {
+            if (tasks_.fetch_sub(1) == 1)
+                Notify();
+        }
+
+        void Notify()
+        {
+            uint64_t one = 1;
+            if (write(efd_, &one, sizeof(one)) == -1)
+                mylog::GetLogger("asynclogger")->Error("search notify failed: %s", strerror(errno));
+        }
+
+        // 事件循环中发送已有的结果，所有任务结束后结束响应并释放这次检索
+        static void OnReady(evutil_socket_t fd, short events, void *arg)
+        {
+            LogSearch *self = static_cast<LogSearch *>(arg);
+            uint64_t cnt;
+            while (read(fd, &cnt, sizeof(cnt)) > 0)
+                ;
+            bool done = self->tasks_.load() == 0; // 先判断再取结果，任务结束前的输出都能取到
+            std::string out;
+            {
+                std::unique_lock<std::mutex> lock(self->mtx_);
+                out.swap(self->out_);
+            }
+            if (!self->closed_ && !out.empty())
+            {
+                struct evbuffer *chunk = evbuffer_new();
+                evbuffer_add(chunk, out.data(), out.size());
+                evhttp_send_reply_chunk(self->req_, chunk);
+                evbuffer_free(chunk);
+            }
+            if (!done)
+                return;
+            if (!self->closed_)
+            {
+                evhttp_connection_set_closecb(evhttp_request_get_connection(self->req_), NULL, NULL);
+                evhttp_send_reply_end(self->req_);
+            }
+            mylog::GetLogger("asynclogger")->Info("search finish, q: %s, matches: %lu%s", self->needle_.c_str(),
+                                                  std::min(self->matches_.load(), self->max_matches_),
+                                                  self->closed_ ? ", client closed" : "");
+            event_free(self->ev_); // 最后一个任务可能晚于这里析构，event要在事件循环线程中释放
+            self->ev_ = NULL;
+            self->self_.reset();
+        }
+
+        // 客户端断开，之后不能再使用req_
+        static void OnClose(struct evhttp_connection *evcon, void *arg)
+        {
+            LogSearch *self = static_cast<LogSearch *>(arg);
+            self->closed_ = true;
+            self->cancelled_ = true;
+            evhttp_connection_set_closecb(evcon, NULL, NULL);
+        }
+
+    private:
+        struct evhttp_request *req_;
+        std::string needle_;
+        bool whole_;
+        std::vector<LogIndex::QueryTerm> terms_; // 可以用索引过滤的词
+        size_t max_matches_;
+        size_t block_size_;
+        std::shared_ptr<LogSearch> self_;
+
+        std::atomic<int> tasks_{1};
+        std::atomic<size_t> matches_{0};
+        std::atomic<bool> cancelled_{false};
+        bool closed_ = false; // 只在事件循环线程中使用
+
+        std::mutex mtx_;
+        std::string out_; // 还没发送的结果
+        int efd_ = -1;
+        struct event *ev_ = NULL;
+    };
+}
@@ -0,0 +1,213 @@
+#pragma once
+#include "Util.hpp"
+#include "../../log_system/logs_code/LogFrame.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <functional>
+#include <string>
+
+namespace storage
+{
+    /*
+    文件元数据的预写日志(WAL)，每次Insert/Update/Delete追加一条记录，代价与已存储的文件数无关：
+    (1)记录 = 负载长度(4) 负载crc32(4) 负载，整数都是大端；
+       负载 = 操作(1) mtime(8) atime(8) fsize(8) url长度(4) url 存储路径长度(4) 存储路径，删除只填url；
+    (2)记录是完整的新值(或者删除)，重放多少次结果都一样，快照和日志有重叠也没关系；
+    (3)崩溃时最后一条记录可能只写了一半，重放遇到长度越界或者crc不符就停下，并把文件截到最后一条完整记录，
+       之后追加的记录不会接在半条记录后面；
+    (4)只负责记录的编码、追加和重放，加锁、快照和压缩由DataManager负责。
+    */
+    class MetaLog
+    {
+    public:
+        enum Op
+        {
+            kPut = 1,
+            kDelete = 2
+        };
+
+        struct Record
+        {
+            Op op;
+            int64_t mtime;
+            int64_t atime;
+            int64_t fsize;
+            std::string url;
+            std::string storage_path;
+        };
+
+        static const uint32_t kMaxRecord = 1 << 20;
+
+        explicit MetaLog(const std::string &path) : path_(path) {}
+        MetaLog(const MetaLog &) = delete;
+        MetaLog &operator=(const MetaLog &) = delete;
+        ~MetaLog() { Close(); }
+
+        const std::string &Path() const { return path_; }
+        uint64_t Size() const { return size_; }
+
+        bool Open()
+        {
+            fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            struct stat st;
+            if (fd_ == -1 || fstat(fd_, &st) == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s", path_.c_str(), strerror(errno));
+                return false;
+            }
+            size_ = st.st_size;
+            return true;
+        }
+
+        void Close()
+        {
+            if (fd_ != -1)
+                close(fd_);
+            fd_ = -1;
+        }
+
+        // 一条记录用一次write追加
+        bool Append(const Record &r)
+        {
+            std::string payload;
+            payload.push_back(static_cast<char>(r.op));
+            PutU64(&payload, r.mtime);
+            PutU64(&payload, r.atime);
+            PutU64(&payload, r.fsize);
+            PutU32(&payload, r.url.size());
+            payload += r.url;
+            PutU32(&payload, r.storage_path.size());
+            payload += r.storage_path;
+            std::string rec;
+            PutU32(&rec, payload.size());
+            PutU32(&rec, mylog::Frame::Crc32(payload.data(), payload.size()));
+            rec += payload;
+            const char *p = rec.data();
+            size_t len = rec.size();
+            while (len > 0)
+            {
+                ssize_t n = write(fd_, p, len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    mylog::GetLogger("asynclogger")->Error("append %s failed: %s", path_.c_str(), strerror(errno));
+                    if (ftruncate(fd_, size_) != 0) // 去掉写了一半的记录，否则之后的记录重放时都会被丢掉
+                        mylog::GetLogger("asynclogger")->Error("truncate %s failed: %s", path_.c_str(), strerror(errno));
+                    return false;
+                }
+                p += n;
+                len -= n;
+            }
+            size_ += rec.size();
+            return true;
+        }
+
+        // 把日志改名为sealed封存(压缩的输入)，重新打开一个空日志
+        bool Rotate(const std::string &sealed)
+        {
+            Close();
+            if (rename(path_.c_str(), sealed.c_str()) != 0)
+            {
+                mylog::GetLogger("asynclogger")->Error("rename %s failed: %s", path_.c_str(), strerror(errno));
+                Open();
+                return false;
+            }
+            return Open();
+        }
+
+        // 按顺序对每条完整的记录调用fn；truncate为true时截掉末尾不完整的记录。文件不存在时返回true
+        static bool Replay(const std::string &path, const std::function<void(const Record &)> &fn, bool truncate)
+        {
+            std::string body;
+            FileUtil f(path);
+            if (!f.Exists())
+                return true;
+            if (!f.GetContent(&body))
+                return false;
+            size_t off = 0, count = 0;
+            while (off + 8 <= body.size())
+            {
+                const char *p = body.data() + off;
+                uint32_t len = GetU32(p), crc = GetU32(p + 4);
+                if (len > kMaxRecord || off + 8 + len > body.size() || mylog::Frame::Crc32(p + 8, len) != crc)
+                    break;
+                Record r;
+                if (!Decode(p + 8, len, &r))
+                    break;
+                fn(r);
+                off += 8 + len;
+                ++count;
+            }
+            if (off != body.size())
+            {
+                mylog::GetLogger("asynclogger")->Warn("%s: %lu bytes of incomplete record at offset %lu", path.c_str(),
+                                                      static_cast<unsigned long>(body.size() - off), static_cast<unsigned long>(off));
+                if (truncate && ::truncate(path.c_str(), off) != 0)
+                    mylog::GetLogger("asynclogger")->Error("truncate %s failed: %s", path.c_str(), strerror(errno));
+            }
+            mylog::GetLogger("asynclogger")->Info("replay %s: %lu records", path.c_str(), static_cast<unsigned long>(count));
+            return true;
+        }
+
+    private:
+        static bool Decode(const char *p, uint32_t len, Record *r)
+        {
+            const char *end = p + len;
+            if (len < 1 + 24 + 4)
+                return false;
+            r->op = static_cast<Op>(static_cast<uint8_t>(*p++));
+            r->mtime = GetU64(p);
+            r->atime = GetU64(p + 8);
+            r->fsize = GetU64(p + 16);
+            p += 24;
+            uint32_t n = GetU32(p);
+            p += 4;
+            if (n > static_cast<size_t>(end - p))
+                return false;
+            r->url.assign(p, n);
+            p += n;
+            if (end - p < 4)
+                return false;
+            n = GetU32(p);
+            p += 4;
+            if (n != static_cast<size_t>(end - p))
+                return false;
+            r->storage_path.assign(p, n);
+            return r->op == kPut || r->op == kDelete;
+        }
+
+        static void PutU32(std::string *s, uint32_t v)
+        {
+            v = htobe32(v);
+            s->append(reinterpret_cast<const char *>(&v), sizeof(v));
+        }
+        static void PutU64(std::string *s, uint64_t v)
+        {
+            v = htobe64(v);
+            s->append(reinterpret_cast<const char *>(&v), sizeof(v));
+        }
+        static uint32_t GetU32(const char *p)
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return be32toh(v);
+        }
+        static uint64_t GetU64(const char *p)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            return be64toh(v);
+        }
+
+    private:
+        std::string path_;
+        int fd_ = -1;
+        uint64_t size_ = 0;
+    };
+}
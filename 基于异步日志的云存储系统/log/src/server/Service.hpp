@@ -1,5 +1,11 @@
 #pragma once
 #include "DataManager.hpp"
+#include "DeepCache.hpp"
+#include "DeepContainer.hpp"
+#include "DeepStream.hpp"
+#include "LogIngest.hpp"
+#include "LogSearch.hpp"
+#include "UploadStream.hpp"
 
 #include <sys/queue.h>
 #include <event.h>
@@ -9,6 +15,11 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <thread>
 
 #include <regex>
 
@@ -32,55 +43,140 @@ namespace storage
             mylog::GetLogger("asynclogger")->Debug("Service end(Construct)");
 #endif
         }
+        // 启动event_loops个事件循环，每个循环有自己的event_base、evhttp和监听socket，
+        // 一个循环被大文件上传之类的慢请求占住时，其他循环照常处理新连接；当前线程运行第0个循环
         bool RunModule()
         {
-            // 初始化环境
-            event_base *base = event_base_new();
-            if (base == NULL)
+            // 事件循环线程绑定到预留的CPU上，后台线程会避开这些CPU(见日志配置reserved_cpus)
+            std::vector<int> cpus = mylog::Affinity::ParseCpuList(mylog::Util::JsonData::GetJsonData()->reserved_cpus);
+            int loops = Config::GetInstance()->GetEventLoops();
+            if (loops <= 0)
+                loops = std::max(1u, std::thread::hardware_concurrency());
+            // 上传的压缩/写盘和下载的解压在IO线程池中执行，完成后回到请求所在的事件循环回复
+            io_ = new IoPool(Config::GetInstance()->GetIoThreads());
+            // 远程日志接收，写线程提交完成后通过IoPool回到请求所在的事件循环回复
+            ingest_ = new LogIngest(io_);
+            // 上传的请求体边收边写进临时文件，不在内存中攒整个文件
+            upload_ = new UploadStream(io_);
+            // 为上次退出前还没建好索引的深度存储文件补建索引
+            LogIndex::Backfill();
+
+            std::vector<event_base *> bases;
+            std::vector<evhttp *> httpds;
+            int shared_fd = -1;
+            bool ok = true;
+            for (int i = 0; i < loops; ++i)
+            {
+                // 初始化环境
+                event_base *base = event_base_new();
+                if (base == NULL)
+                {
+                    mylog::GetLogger("asynclogger")->Fatal("event_base_new err!");
+                    ok = false;
+                    break;
+                }
+                bases.push_back(base);
+                // http 服务器,创建evhttp上下文
+                evhttp *httpd = evhttp_new(base);
+                httpds.push_back(httpd);
+                int fd = Listen(&shared_fd);
+                if (fd == -1 || evhttp_accept_socket(httpd, fd) != 0)
+                {
+                    mylog::GetLogger("asynclogger")->Fatal("evhttp_bind_socket failed!");
+                    if (fd != -1)
+                        close(fd);
+                    ok = false;
+                    break;
+                }
+                if (!io_->Attach(base))
+                {
+                    ok = false;
+                    break;
+                }
+                // 设定回调函数
+                // 指定generic callback，也可以为特定的URI指定callback
+                evhttp_set_gencb(httpd, GenHandler, this);
+                evhttp_set_bevcb(httpd, UploadStream::MakeBev, upload_);
+            }
+            if (ok)
+            {
+                mylog::GetLogger("asynclogger")->Info("start %d event loops on port %d", loops, server_port_);
+                std::vector<std::thread> threads;
+                for (size_t i = 1; i < bases.size(); ++i)
+                    threads.emplace_back(&Service::RunLoop, bases[i], cpus);
+                RunLoop(bases[0], cpus);
+                for (auto &t : threads)
+                    t.join();
+            }
+            for (auto httpd : httpds)
+                evhttp_free(httpd);
+            delete ingest_;
+            ingest_ = nullptr;
+            delete io_;
+            io_ = nullptr;
+            delete upload_;
+            upload_ = nullptr;
+            for (auto base : bases)
+                event_base_free(base);
+            return ok;
+        }
+
+    private:
+        uint16_t server_port_;
+        std::string server_ip_;
+        std::string download_prefix_;
+        LogIngest *ingest_ = nullptr;
+        IoPool *io_ = nullptr;
+        UploadStream *upload_ = nullptr;
+
+    private:
+        static void RunLoop(event_base *base, std::vector<int> cpus)
+        {
+            mylog::Affinity::PinCurrentThread(cpus);
+#ifdef DEBUG_LOG
+            mylog::GetLogger("asynclogger")->Debug("event_base_dispatch");
+#endif
+            if (-1 == event_base_dispatch(base))
             {
-                mylog::GetLogger("asynclogger")->Fatal("event_base_new err!");
-                return false;
+                mylog::GetLogger("asynclogger")->Debug("event_base_dispatch err");
             }
+        }
+
+        // 每个事件循环一个设置了SO_REUSEPORT的监听socket，由内核把新连接均匀分给各个循环；
+        // 系统不支持SO_REUSEPORT时退回共用第一个监听socket，其余循环使用dup出来的fd
+        int Listen(int *shared_fd)
+        {
+            if (*shared_fd != -1)
+                return dup(*shared_fd);
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("socket failed: %s", strerror(errno));
+                return -1;
+            }
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            bool reuseport = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0;
             // 设置监听的端口和地址
             sockaddr_in sin;
             memset(&sin, 0, sizeof(sin));
             sin.sin_family = AF_INET;
             sin.sin_port = htons(server_port_);
-            // http 服务器,创建evhttp上下文
-            evhttp *httpd = evhttp_new(base);
-            // 绑定端口和ip
-            if (evhttp_bind_socket(httpd, "0.0.0.0", server_port_) != 0)
+            sin.sin_addr.s_addr = htonl(INADDR_ANY);
+            if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 1024) != 0)
             {
-                mylog::GetLogger("asynclogger")->Fatal("evhttp_bind_socket failed!");
-                return false;
+                mylog::GetLogger("asynclogger")->Error("bind/listen port %d failed: %s", server_port_, strerror(errno));
+                close(fd);
+                return -1;
             }
-            // 设定回调函数
-            // 指定generic callback，也可以为特定的URI指定callback
-            evhttp_set_gencb(httpd, GenHandler, NULL);
-
-            if (base)
+            if (!reuseport)
             {
-#ifdef DEBUG_LOG
-                mylog::GetLogger("asynclogger")->Debug("event_base_dispatch");
-#endif
-                if (-1 == event_base_dispatch(base))
-                {
-                    mylog::GetLogger("asynclogger")->Debug("event_base_dispatch err");
-                }
+                mylog::GetLogger("asynclogger")->Warn("SO_REUSEPORT unsupported, event loops share one listener");
+                *shared_fd = fd;
             }
-            if (base)
-                event_base_free(base);
-            if (httpd)
-                evhttp_free(httpd);
-            return true;
+            return fd;
         }
 
-    private:
-        uint16_t server_port_;
-        std::string server_ip_;
-        std::string download_prefix_;
-
-    private:
         static void GenHandler(struct evhttp_request *req, void *arg)
         {
             std::string path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
@@ -98,6 +194,21 @@ namespace storage
             {
                 Upload(req, arg);
             }
+            // 远程日志器推送的日志
+            else if (path == "/ingest")
+            {
+                Ingest(req, arg);
+            }
+            // 在已存储的日志中检索关键字，结果分块陆续返回
+            else if (path == "/search")
+            {
+                LogSearch::Start(req);
+            }
+            // 运行时计数，目前是深度存储解压缓存的命中情况
+            else if (path == "/stats")
+            {
+                Stats(req);
+            }
             // 这里是删除请求
             else if (path == "/delete")
             {
@@ -119,6 +230,17 @@ namespace storage
             mylog::GetLogger("asynclogger")->Info("Upload start");
             // 约定：请求中包含"low_storage"，说明请求中存在文件数据,并希望普通存储\
                 包含"deep_storage"字段则压缩后存储
+            Service *self = static_cast<Service *>(arg);
+            // 带Content-Length的上传请求体已经由UploadStream边收边写进了临时文件(spool_path)
+            std::string spool_path;
+            bool spool_ok = false;
+            bool spooled = self->upload_->Claim(req, &spool_path, &spool_ok);
+            if (spooled && !spool_ok)
+            {
+                mylog::GetLogger("asynclogger")->Error("upload spool failed, evhttp_send_reply: HTTP_INTERNAL");
+                evhttp_send_reply(req, HTTP_INTERNAL, "server error", NULL);
+                return;
+            }
             // 获取请求体内容
             struct evbuffer *buf = evhttp_request_get_input_buffer(req);
             if (buf == nullptr)
@@ -129,20 +251,12 @@ namespace storage
 
             size_t len = evbuffer_get_length(buf); // 获取请求体的长度
             mylog::GetLogger("asynclogger")->Info("evbuffer_get_length is %u", len);
-            if (0 == len)
+            if (0 == len && !spooled)
             {
                 evhttp_send_reply(req, HTTP_BADREQUEST, "file empty", NULL);
                 mylog::GetLogger("asynclogger")->Info("request body is empty");
                 return;
             }
-            std::string content(len, 0);
-            if (-1 == evbuffer_copyout(buf, (void *)content.c_str(), len))
-            {
-                mylog::GetLogger("asynclogger")->Error("evbuffer_copyout error");
-                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
-                return;
-            }
-
             // 获取文件名
             std::string filename = evhttp_find_header(req->input_headers, "FileName");
             // 解码文件名
@@ -164,28 +278,71 @@ namespace storage
             {
                 mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: HTTP_BADREQUEST");
                 evhttp_send_reply(req, HTTP_BADREQUEST, "Illegal storage type", NULL);
+                if (spooled)
+                    remove(spool_path.c_str());
                 return;
             }
 
-            // 如果不存在就创建low或deep目录
-            FileUtil dirCreate(storage_path);
-            dirCreate.CreateDirectory();
-
-            // 目录创建后加可以加上文件名，这个就是最终要写入的文件路径
+            // 加上文件名，这个就是最终要写入的文件路径，目录在IO线程中创建
             storage_path += filename;
 #ifdef DEBUG_LOG
             mylog::GetLogger("asynclogger")->Debug("storage_path:%s", storage_path.c_str());
 #endif
 
+            // 没有经过UploadStream的请求体(如chunked)整体移交给IO线程(只移动链表节点，不拷贝数据)，
+            // 压缩、写盘都不在事件循环里做
+            struct evbuffer *body = NULL;
+            if (!spooled)
+            {
+                body = evbuffer_new();
+                evbuffer_add_buffer(body, buf);
+            }
+            auto ok = std::make_shared<bool>(false);
+            if (!self->io_->Submit(
+                    req, [body, spool_path, storage_path, storage_type, ok]()
+                    { *ok = Store(body, spool_path, storage_path, storage_type);
+                      if (body != NULL)
+                          evbuffer_free(body); },
+                    [req, ok]()
+                    {
+                        if (*ok)
+                        {
+                            evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+                            mylog::GetLogger("asynclogger")->Info("upload finish:success");
+                        }
+                        else
+                            evhttp_send_reply(req, HTTP_INTERNAL, "server error", NULL);
+                    }))
+            {
+                if (body != NULL)
+                    evbuffer_free(body);
+                else
+                    remove(spool_path.c_str());
+                evhttp_send_reply(req, HTTP_SERVUNAVAIL, "server busy", NULL);
+            }
+        }
+
+        // IO线程中执行：写入或压缩上传的文件，并登记到数据管理模块
+        // body为空时文件内容在临时文件spool_path中，普通存储直接rename过去，完整的文件原子地出现在low_storage
+        static bool Store(struct evbuffer *body, const std::string &spool_path,
+                          const std::string &storage_path, const std::string &storage_type)
+        {
+            // 如果不存在就创建low或deep目录
+            FileUtil dirCreate(storage_type == "low" ? Config::GetInstance()->GetLowStorageDir()
+                                                     : Config::GetInstance()->GetDeepStorageDir());
+            dirCreate.CreateDirectory();
+
             // 看路径里是low还是deep存储，是deep就压缩，是low就直接写入
-            FileUtil fu(storage_path);
-            if (storage_path.find("low_storage") != std::string::npos)
+            if (storage_type == "low")
             {
-                if (fu.SetContent(content.c_str(), len) == false)
+                bool stored = body != NULL ? WriteBuffer(storage_path, body)
+                                           : rename(spool_path.c_str(), storage_path.c_str()) == 0;
+                if (stored == false)
                 {
+                    if (body == NULL)
+                        remove(spool_path.c_str());
                     mylog::GetLogger("asynclogger")->Error("low_storage fail, evhttp_send_reply: HTTP_INTERNAL");
-                    evhttp_send_reply(req, HTTP_INTERNAL, "server error", NULL);
-                    return;
+                    return false;
                 }
                 else
                 {
@@ -194,11 +351,30 @@ namespace storage
             }
             else
             {
-                if (fu.Compress(content, Config::GetInstance()->GetBundleFormat()) == false)
+                // 按块压缩成分块容器：落盘的上传从临时文件逐块读入，内存只和块大小有关；
+                // 缓存在内存中的请求体(chunked)直接按evbuffer的各段送进压缩，不拼成连续内存
+                bool packed;
+                if (body != NULL)
+                {
+                    DeepContainer::Writer w(storage_path, Config::GetInstance()->GetBundleFormat(),
+                                            Config::GetInstance()->GetDeepBlockSize(), DeepContainer::Workers());
+                    std::vector<evbuffer_iovec> vec(std::max(evbuffer_peek(body, -1, NULL, NULL, 0), 0));
+                    evbuffer_peek(body, -1, NULL, vec.data(), vec.size());
+                    packed = true;
+                    for (size_t i = 0; packed && i < vec.size(); ++i)
+                        packed = w.Append(static_cast<const char *>(vec[i].iov_base), vec[i].iov_len);
+                    packed = packed && w.Finish();
+                    evbuffer_drain(body, evbuffer_get_length(body));
+                }
+                else
+                {
+                    packed = DeepContainer::PackFile(spool_path, storage_path);
+                    remove(spool_path.c_str());
+                }
+                if (packed == false)
                 {
                     mylog::GetLogger("asynclogger")->Error("deep_storage fail, evhttp_send_reply: HTTP_INTERNAL");
-                    evhttp_send_reply(req, HTTP_INTERNAL, "server error", NULL);
-                    return;
+                    return false;
                 }
                 else
                 {
@@ -210,9 +386,58 @@ namespace storage
             StorageInfo info;
             info.NewStorageInfo(storage_path); // 组织存储的文件信息
             data_->Insert(info);               // 向数据管理模块添加存储的文件信息
+            if (storage_type == "deep")
+                LogIndex::Schedule(storage_path); // 后台建立倒排索引
+            return true;
+        }
 
-            evhttp_send_reply(req, HTTP_OK, "Success", NULL);
-            mylog::GetLogger("asynclogger")->Info("upload finish:success");
+        // 把evbuffer直接写进文件(writev)，写出的部分随即从evbuffer中释放，不需要拼成连续内存
+        static bool WriteBuffer(const std::string &path, struct evbuffer *body)
+        {
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s", path.c_str(), strerror(errno));
+                return false;
+            }
+            while (evbuffer_get_length(body) > 0)
+            {
+                if (evbuffer_write(body, fd) < 0 && errno != EINTR)
+                {
+                    mylog::GetLogger("asynclogger")->Error("write %s failed: %s", path.c_str(), strerror(errno));
+                    close(fd);
+                    return false;
+                }
+            }
+            close(fd);
+            return true;
+        }
+
+        // 请求体是一个或多个LogFrame帧，LogSource请求头标识来源；落盘后才回复，回复体是累计确认
+        static void Ingest(struct evhttp_request *req, void *arg)
+        {
+            if (evhttp_request_get_command(req) != EVHTTP_REQ_POST)
+            {
+                evhttp_send_reply(req, HTTP_BADMETHOD, "POST only", NULL);
+                return;
+            }
+            struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+            size_t len = evbuffer_get_length(buf);
+            if (len == 0)
+            {
+                evhttp_send_reply(req, HTTP_BADREQUEST, "empty batch", NULL);
+                return;
+            }
+            struct evbuffer *body = evbuffer_new();
+            evbuffer_add_buffer(body, buf); // 只移动链表节点，不拷贝数据
+            std::string source = LogIngest::SanitizeSource(evhttp_find_header(req->input_headers, "LogSource"));
+            Service *self = static_cast<Service *>(arg);
+            if (!self->ingest_->Submit(req, source, body))
+            {
+                evbuffer_free(body);
+                mylog::GetLogger("asynclogger")->Warn("ingest backlog full, reject batch from %s", source.c_str());
+                evhttp_send_reply(req, HTTP_SERVUNAVAIL, "ingest busy", NULL);
+            }
         }
 
         static void Delete(struct evhttp_request *req, void *arg)
@@ -249,6 +474,8 @@ namespace storage
                 }
                 mylog::GetLogger("asynclogger")->Info("Delete: physical file removed: %s", info.storage_path_.c_str());
             }
+            remove(LogIndex::IndexPath(info.storage_path_).c_str()); // 深度存储文件的索引，没有就忽略
+            DeepCache::GetInstance()->Erase(info.url_);
 
             // 从数据管理器中删除记录
             if (!data_->Delete(file_url))
@@ -323,6 +550,27 @@ namespace storage
             ss << std::fixed << std::setprecision(2) << size << " " << units[unit_index];
             return ss.str();
         }
+        static void Stats(struct evhttp_request *req)
+        {
+            DeepCache::Stats cs = DeepCache::GetInstance()->GetStats();
+            Json::Value root, cache;
+            cache["hits"] = Json::UInt64(cs.hits);
+            cache["misses"] = Json::UInt64(cs.misses);
+            cache["coalesced"] = Json::UInt64(cs.coalesced);
+            cache["evictions"] = Json::UInt64(cs.evictions);
+            cache["entries"] = Json::UInt64(cs.entries);
+            cache["bytes"] = Json::UInt64(cs.bytes);
+            cache["capacity"] = Json::UInt64(cs.capacity);
+            uint64_t lookups = cs.hits + cs.misses + cs.coalesced;
+            cache["hit_ratio"] = lookups == 0 ? 0.0 : static_cast<double>(cs.hits + cs.coalesced) / lookups;
+            root["deep_cache"] = cache;
+            std::string body;
+            JsonUtil::Serialize(root, &body);
+            evbuffer_add(evhttp_request_get_output_buffer(req), body.data(), body.size());
+            evhttp_add_header(req->output_headers, "Content-Type", "application/json");
+            evhttp_send_reply(req, HTTP_OK, "Success", NULL);
+        }
+
         static void ListShow(struct evhttp_request *req, void *arg)
         {
             mylog::GetLogger("asynclogger")->Info("ListShow()");
@@ -372,52 +620,42 @@ namespace storage
             StorageInfo info;
             std::string resource_path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
             resource_path = UrlDecode(resource_path);
-            data_->GetOneByURL(resource_path, &info);
             mylog::GetLogger("asynclogger")->Info("request resource_path:%s", resource_path.c_str());
+            if (!data_->GetOneByURL(resource_path, &info))
+            {
+                evhttp_send_reply(req, HTTP_NOTFOUND, "file not exists", NULL);
+                return;
+            }
 
-            std::string download_path = info.storage_path_;
-            // 2.如果压缩过了就解压到新文件给用户下载
+            // 2.深度存储的文件由IO线程只解压请求区间覆盖的块，直接流式写进响应，不落盘(见DeepStream)
             if (info.storage_path_.find(Config::GetInstance()->GetLowStorageDir()) == std::string::npos)
             {
-                mylog::GetLogger("asynclogger")->Info("uncompressing:%s", info.storage_path_.c_str());
-                FileUtil fu(info.storage_path_);
-                download_path = Config::GetInstance()->GetLowStorageDir() +
-                                std::string(download_path.begin() + download_path.find_last_of('/') + 1, download_path.end());
-                FileUtil dirCreate(Config::GetInstance()->GetLowStorageDir());
-                dirCreate.CreateDirectory();
-                fu.UnCompress(download_path); // 将文件解压到low_storage下去或者再创一个文件夹做中转
+                Service *self = static_cast<Service *>(arg);
+                DeepStream::Start(req, info, GetETag(info), self->io_, GetRange(req, info));
+                return;
             }
+            SendFile(req, info, info.storage_path_);
+        }
+
+        // 要使用的Range头：有If-Range字段时，只有它与请求文件的最新etag一致才按区间发送(断点续传)，
+        // 否则文件已经变了，忽略Range发送整个文件
+        static std::string GetRange(struct evhttp_request *req, const StorageInfo &info)
+        {
+            const char *range = evhttp_find_header(req->input_headers, "Range");
+            const char *if_range = evhttp_find_header(req->input_headers, "If-Range");
+            if (range == NULL || (if_range != NULL && GetETag(info) != if_range))
+                return "";
+            return range;
+        }
+
+        // 在事件循环中发送文件，文件内容由evbuffer_add_file交给内核发送(sendfile)，不在用户态读取；
+        // 区间请求只把请求的区间挂到输出缓冲，多个区间时每个区间用一个dup出的fd，组成multipart/byteranges
+        static void SendFile(struct evhttp_request *req, const StorageInfo &info, std::string download_path)
+        {
             mylog::GetLogger("asynclogger")->Info("request download_path:%s", download_path.c_str());
             FileUtil fu(download_path);
-            if (fu.Exists() == false && info.storage_path_.find("deep_storage") != std::string::npos)
-            {
-                // 如果是压缩文件，且解压失败，是服务端的错误
-                mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: 500 - UnCompress failed");
-                evhttp_send_reply(req, HTTP_INTERNAL, NULL, NULL);
-            }
-            else if (fu.Exists() == false && info.storage_path_.find("low_storage") == std::string::npos)
-            {
-                // 如果是普通文件，且文件不存在，是客户端的错误
-                mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: 400 - bad request,file not exists");
-                evhttp_send_reply(req, HTTP_BADREQUEST, "file not exists", NULL);
-            }
-
-            // 3.确认文件是否需要断点续传
-            bool retrans = false;
-            std::string old_etag;
-            auto if_range = evhttp_find_header(req->input_headers, "If-Range");
-            if (NULL != if_range)
-            {
-                old_etag = if_range;
-                // 有If-Range字段且，这个字段的值与请求文件的最新etag一致则符合断点续传
-                if (old_etag == GetETag(info))
-                {
-                    retrans = true;
-                    mylog::GetLogger("asynclogger")->Info("%s need breakpoint continuous transmission", download_path.c_str());
-                }
-            }
 
-            // 4. 读取文件数据，放入rsp.body中
+            // 3. 读取文件数据，放入rsp.body中
             if (fu.Exists() == false)
             {
                 mylog::GetLogger("asynclogger")->Info("%s not exists", download_path.c_str());
@@ -425,6 +663,19 @@ namespace storage
                 evhttp_send_reply(req, 404, download_path.c_str(), NULL);
                 return;
             }
+            // 4.确认文件是否需要断点续传，解析请求的区间
+            uint64_t size = fu.FileSize();
+            std::vector<HttpRange::Range> ranges;
+            std::string range = GetRange(req, info);
+            HttpRange::Result r = HttpRange::Parse(range.empty() ? NULL : range.c_str(), size, &ranges);
+            if (r == HttpRange::kUnsatisfiable)
+            {
+                evhttp_add_header(req->output_headers, "Content-Range", HttpRange::Unsatisfied(size).c_str());
+                evhttp_send_reply(req, 416, "Range Not Satisfiable", NULL);
+                return;
+            }
+            if (r == HttpRange::kFull && size > 0)
+                ranges.assign(1, HttpRange::Range{0, size - 1});
             evbuffer *outbuf = evhttp_request_get_output_buffer(req);
             int fd = open(download_path.c_str(), O_RDONLY);
             if (fd == -1)
@@ -433,29 +684,54 @@ namespace storage
                 evhttp_send_reply(req, HTTP_INTERNAL, strerror(errno), NULL);
                 return;
             }
-            // 和前面用的evbuffer_add类似，但是效率更高，具体原因可以看函数声明
-            if (-1 == evbuffer_add_file(outbuf, fd, 0, fu.FileSize()))
+            std::string boundary = ranges.size() > 1 ? HttpRange::NewBoundary() : "";
+            for (size_t i = 0; i < ranges.size(); ++i)
             {
-                mylog::GetLogger("asynclogger")->Error("evbuffer_add_file: %d -- %s -- %s", fd, download_path.c_str(), strerror(errno));
+                if (ranges.size() > 1)
+                {
+                    std::string part = HttpRange::PartHeader(i, ranges[i], size, boundary, "application/octet-stream");
+                    evbuffer_add(outbuf, part.data(), part.size());
+                }
+                // evbuffer_add_file接管fd，发送完后关闭，除了最后一个区间都用dup出的fd
+                int part_fd = i + 1 == ranges.size() ? fd : dup(fd);
+                // 和前面用的evbuffer_add类似，但是效率更高，具体原因可以看函数声明
+                if (part_fd == -1 || -1 == evbuffer_add_file(outbuf, part_fd, ranges[i].first, ranges[i].Length()))
+                {
+                    mylog::GetLogger("asynclogger")->Error("evbuffer_add_file: %d -- %s -- %s", part_fd, download_path.c_str(), strerror(errno));
+                    if (part_fd != -1 && part_fd != fd)
+                        close(part_fd);
+                    close(fd);
+                    evbuffer_drain(outbuf, evbuffer_get_length(outbuf));
+                    evhttp_send_reply(req, HTTP_INTERNAL, "read file failed", NULL);
+                    return;
+                }
+            }
+            if (ranges.empty())
+                close(fd); // 空文件
+            if (ranges.size() > 1)
+            {
+                std::string trailer = HttpRange::Trailer(boundary);
+                evbuffer_add(outbuf, trailer.data(), trailer.size());
             }
             // 5. 设置响应头部字段： ETag， Accept-Ranges: bytes
             evhttp_add_header(req->output_headers, "Accept-Ranges", "bytes");
             evhttp_add_header(req->output_headers, "ETag", GetETag(info).c_str());
-            evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
-            if (retrans == false)
+            if (r == HttpRange::kFull)
             {
+                evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
                 evhttp_send_reply(req, HTTP_OK, "Success", NULL);
                 mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: HTTP_OK");
+                return;
             }
-            else
-            {
-                evhttp_send_reply(req, 206, "breakpoint continuous transmission", NULL); // 区间请求响应的是206
-                mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: 206");
-            }
-            if (download_path != info.storage_path_)
+            if (ranges.size() == 1)
             {
-                remove(download_path.c_str()); // 删除文件
+                evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+                evhttp_add_header(req->output_headers, "Content-Range", HttpRange::ContentRange(ranges[0], size).c_str());
             }
+            else
+                evhttp_add_header(req->output_headers, "Content-Type", ("multipart/byteranges; boundary=" + boundary).c_str());
+            evhttp_send_reply(req, 206, "breakpoint continuous transmission", NULL); // 区间请求响应的是206
+            mylog::GetLogger("asynclogger")->Info("evhttp_send_reply: 206, %lu ranges", static_cast<unsigned long>(ranges.size()));
         }
     };
 }
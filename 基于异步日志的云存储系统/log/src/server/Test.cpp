@@ -21,7 +21,8 @@ void service_module()
 void log_system_module_init()
 {
     g_conf_data = mylog::Util::JsonData::GetJsonData();
-    tp = new ThreadPool(g_conf_data->thread_count);
+    tp = new ThreadPool(g_conf_data->thread_count,
+                        mylog::Affinity::CpusFor(g_conf_data->pool_cpus, g_conf_data->reserved_cpus));
     std::shared_ptr<mylog::LoggerBuilder> Glb(new mylog::LoggerBuilder());
     Glb->BuildLoggerName("asynclogger");
     Glb->BuildLoggerFlush<mylog::RollFileFlush>("./logfile/RollFile_log",
@@ -29,11 +30,19 @@ void log_system_module_init()
     // The LoggerManger has been built and is managed by members of the LoggerManger class
     //The logger is assigned to the managed object, and the caller lands the log by invoking the singleton managed object
     mylog::LoggerManager::GetInstance().AddLogger(Glb->Build());
+    // 监视日志配置文件，修改flush_log、log_level、备份地址等参数后无需重启服务
+    mylog::ConfigWatcher::GetInstance().Start();
 }
 int main()
 {
     log_system_module_init();
     data_ = new storage::DataManager();
+    if (!data_->Loaded()) // 元数据损坏时不启动，避免之后的压缩覆盖快照
+    {
+        delete data_;
+        delete (tp);
+        return 1;
+    }
 
     thread t1(service_module);
 
@@ -0,0 +1,545 @@
+#pragma once
+#include "IoPool.hpp"
+#include "Util.hpp"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace storage
+{
+    /*
+    流式上传：evhttp要把整个请求体收进内存才回调Upload，上传大文件时内存占用和文件大小成正比。
+    (1)通过evhttp_set_bevcb给每个连接套一层bufferevent过滤器，evhttp读到的数据都先经过InputFilter；
+    (2)过滤器解析请求头，遇到带Content-Length的POST /upload时截下请求体：边收边攒成chunk，
+       交给IO线程用pwritev按偏移写进low_storage下的临时文件，请求头暂不交给evhttp；
+    (3)每个上传在途(已从socket读出、还没写进文件)的字节数不超过upload_inflight_limit，到上限后过滤器不再取数据，
+       底层socket的输入缓冲攒到kMaxBuffered后停止读socket，由TCP把压力传回客户端；一块写完后再唤醒过滤器；
+    (4)请求体全部写进临时文件后，才把改写过的请求头(Content-Length: 0，加上X-Upload-Spool)交给evhttp，
+       Upload凭这个请求头认领临时文件，在IO线程中原子地rename进low_storage(或压缩进deep_storage)；
+       evhttp在回复之前不再读这个连接，所以请求头只能等请求体收完再交出去；
+       X-Upload-Spool的值是随机生成的，临时文件只能由写入它的连接上的请求认领，连接关闭时没有认领的临时文件随之删除；
+    (5)其他请求原样透传，只去掉客户端自带的X-Upload-Spool；出现分块传输(chunked)的请求后，
+       这个连接之后的数据都原样透传，由evhttp按原来的方式处理；
+    (6)输出方向：OutputFilter把回复搬进底层socket的输出缓冲(最多kMaxBuffered)，但不报告进展，evhttp的写完回调
+       由OnFlush在底层缓冲也写空之后补发。否则evhttp以为已经写完，HTTP/1.0等需要关闭的连接会丢掉底层缓冲中的数据，
+       流式下载(DeepStream)也就没有了背压。
+    内存占用只和在途上限、并发上传数有关，与文件大小无关。
+    */
+    class UploadStream
+    {
+    public:
+        static constexpr const char *kSpoolHeader = "X-Upload-Spool";
+        static constexpr const char *kSpoolPrefix = ".upload-";
+        static constexpr size_t kChunkSize = 1024 * 1024;   // 每个写任务的数据量
+        static constexpr size_t kMaxBuffered = 256 * 1024; // 底层socket输入缓冲的高水位
+        static constexpr size_t kMaxHead = 64 * 1024;      // 超过这个长度还没有收完的请求头交给evhttp处理
+
+        explicit UploadStream(IoPool *io) : io_(io)
+        {
+            Config *conf = Config::GetInstance();
+            dir_ = conf->GetLowStorageDir();
+            inflight_limit_ = std::max<size_t>(conf->GetUploadInflightLimit(), kMaxBuffered);
+            flush_size_ = std::min(kChunkSize, inflight_limit_);
+            FileUtil(dir_).CreateDirectory();
+            // 上次退出时没有完成的上传留下的临时文件
+            std::vector<std::string> files;
+            FileUtil(dir_).ScanDirectory(&files);
+            for (auto &f : files)
+                if (FileUtil(f).FileName().compare(0, strlen(kSpoolPrefix), kSpoolPrefix) == 0)
+                    remove(f.c_str());
+        }
+
+        // evhttp_set_bevcb的回调，为每个新连接创建带输入过滤器的bufferevent
+        static struct bufferevent *MakeBev(struct event_base *base, void *arg)
+        {
+            Conn *c = new Conn;
+            c->owner = static_cast<UploadStream *>(arg);
+            c->base = base;
+            c->under = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+            if (c->under == NULL)
+            {
+                delete c;
+                return NULL;
+            }
+            c->bev = bufferevent_filter_new(c->under, InputFilter, OutputFilter, BEV_OPT_CLOSE_ON_FREE, FreeConn, c);
+            if (c->bev == NULL)
+            {
+                bufferevent_free(c->under);
+                delete c;
+                return NULL;
+            }
+            c->kick_ev = evtimer_new(base, OnKick, c);
+            c->flush_ev = event_new(base, -1, 0, OnFlush, c);
+            c->out_cb = evbuffer_add_cb(bufferevent_get_output(c->bev), OnOutput, c);
+            c->under_out_cb = evbuffer_add_cb(bufferevent_get_output(c->under), OnUnderOutput, c);
+            c->chunk = evbuffer_new();
+            // 过滤器不取数据时底层缓冲攒到高水位就停止读socket；底层输出缓冲超过高水位时回复停在过滤器里
+            bufferevent_setwatermark(c->under, EV_READ, 0, kMaxBuffered);
+            bufferevent_setwatermark(c->under, EV_WRITE, 0, kMaxBuffered);
+            bufferevent_set_max_single_read(c->under, kMaxBuffered / 2);
+            return c->bev;
+        }
+
+        // 事件循环线程调用：请求带有X-Upload-Spool时认领对应的临时文件，认领后由调用者负责改名或删除
+        // 不是流式上传的请求返回false；*ok为false表示请求体没能完整写进临时文件
+        bool Claim(struct evhttp_request *req, std::string *temp_path, bool *ok)
+        {
+            const char *token = evhttp_find_header(evhttp_request_get_input_headers(req), kSpoolHeader);
+            if (token == NULL)
+                return false;
+            struct bufferevent *bev = evhttp_connection_get_bufferevent(evhttp_request_get_connection(req));
+            std::shared_ptr<Spool> spool;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto it = spools_.find(token);
+                if (it == spools_.end() || it->second->bev != bev) // 透传模式下没能去掉的伪造请求头
+                    return false;
+                spool = it->second;
+                spools_.erase(it);
+            }
+            *ok = !spool->failed;
+            spool->claimed = *ok; // 写失败的临时文件随Spool一起删除
+            *temp_path = spool->path;
+            return true;
+        }
+
+    private:
+        struct Conn;
+        // 一个上传请求体对应的临时文件
+        struct Spool
+        {
+            std::string token;
+            std::string path;
+            int fd = -1;
+            size_t inflight = 0; // 在途字节数，只在事件循环线程中访问
+            size_t pending = 0;  // 还没完成的写任务数，只在事件循环线程中访问
+            std::atomic<bool> failed{false};
+            bool claimed = false;
+            Conn *conn = nullptr; // 连接已经关闭或请求体已经收完时为空
+            struct bufferevent *bev = nullptr; // 写入这个临时文件的连接，只有这个连接上的请求可以认领
+
+            ~Spool()
+            {
+                if (fd != -1)
+                    close(fd);
+                if (!claimed)
+                    remove(path.c_str());
+            }
+        };
+
+        enum class Mode
+        {
+            kHead, // 等待下一个请求头
+            kPass, // 透传非上传请求的请求体
+            kBody, // 截下上传请求的请求体写进临时文件
+            kRaw   // 之后的数据全部透传
+        };
+
+        // 每个连接一个，随过滤器bufferevent一起释放(FreeConn)
+        struct Conn
+        {
+            UploadStream *owner;
+            event_base *base;
+            struct bufferevent *under = NULL; // 读写socket的bufferevent
+            struct bufferevent *bev = NULL;   // 交给evhttp的过滤器
+            struct event *kick_ev = NULL;
+            struct event *flush_ev = NULL;
+            struct evbuffer_cb_entry *out_cb = NULL;
+            struct evbuffer_cb_entry *under_out_cb = NULL;
+            bool write_pending = false; // 有回复数据经过OutputFilter，写空后要补发写完回调
+            Mode mode = Mode::kHead;
+            uint64_t remaining = 0;   // 当前请求体还没收到的字节数
+            uint64_t offset = 0;      // 下一个chunk在临时文件中的偏移
+            std::string head;         // 改写后的上传请求头，请求体收完后交给evhttp
+            struct evbuffer *chunk = NULL;
+            std::shared_ptr<Spool> spool;
+        };
+
+        static void FreeConn(void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            if (c->spool)
+                c->spool->conn = nullptr; // 连接中途断开，写任务完成后临时文件随Spool删除
+            // 已经收完但没有被认领的(比如请求被evhttp拒绝，没有走到Upload)一起丢掉，过滤器的地址之后可能被新连接复用
+            std::vector<std::shared_ptr<Spool>> orphans;
+            {
+                std::unique_lock<std::mutex> lock(c->owner->mtx_);
+                auto &spools = c->owner->spools_;
+                for (auto it = spools.begin(); it != spools.end();)
+                {
+                    if (it->second->bev == c->bev)
+                    {
+                        orphans.push_back(std::move(it->second));
+                        it = spools.erase(it);
+                    }
+                    else
+                        ++it;
+                }
+            }
+            evbuffer_remove_cb_entry(bufferevent_get_output(c->bev), c->out_cb);
+            evbuffer_remove_cb_entry(bufferevent_get_output(c->under), c->under_out_cb);
+            event_free(c->kick_ev);
+            event_free(c->flush_ev);
+            evbuffer_free(c->chunk);
+            delete c;
+        }
+
+        // libevent 2.1的过滤器只在数据写入输出缓冲时处理输出，而evhttp先写回复、后开启EV_WRITE，
+        // 回复会一直停在过滤器里；写入时激活flush_ev，等evhttp开启EV_WRITE后在本轮循环中再刷一次
+        static void OnOutput(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            if (info->n_added > 0)
+                event_active(c->flush_ev, EV_WRITE, 0);
+        }
+
+        // 底层socket的输出缓冲写空
+        static void OnUnderOutput(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            if (info->n_deleted > 0 && evbuffer_get_length(buf) == 0)
+                event_active(c->flush_ev, EV_WRITE, 0);
+        }
+
+        // 不在bufferevent的回调中执行，evhttp在写完回调里释放连接也是安全的
+        static void OnFlush(evutil_socket_t fd, short events, void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            bufferevent_flush(c->bev, EV_WRITE, BEV_NORMAL);
+            if (c->write_pending && evbuffer_get_length(bufferevent_get_output(c->bev)) == 0 &&
+                evbuffer_get_length(bufferevent_get_output(c->under)) == 0)
+            {
+                c->write_pending = false;
+                bufferevent_trigger(c->bev, EV_WRITE, 0);
+            }
+        }
+
+        // 把回复搬进底层输出缓冲，limit是底层高水位剩下的空间；返回BEV_NEED_MORE，过滤器不会立即调用写完回调
+        static enum bufferevent_filter_result OutputFilter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t limit,
+                                                            enum bufferevent_flush_mode state, void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            size_t n = evbuffer_get_length(src);
+            if (limit >= 0)
+                n = std::min<size_t>(n, limit);
+            if (n > 0)
+            {
+                evbuffer_remove_buffer(src, dst, n);
+                c->write_pending = true;
+            }
+            return BEV_NEED_MORE;
+        }
+
+        // src是socket收到的数据，dst是evhttp读到的数据；有进展返回BEV_OK，否则BEV_NEED_MORE
+        static enum bufferevent_filter_result InputFilter(struct evbuffer *src, struct evbuffer *dst, ev_ssize_t limit,
+                                                           enum bufferevent_flush_mode state, void *arg)
+        {
+            Conn *c = static_cast<Conn *>(arg);
+            bool progress = false;
+            while (true)
+            {
+                size_t len = evbuffer_get_length(src);
+                if (c->mode == Mode::kRaw || c->mode == Mode::kPass)
+                {
+                    size_t n = c->mode == Mode::kRaw ? len : std::min<uint64_t>(len, c->remaining);
+                    if (n == 0)
+                        break;
+                    evbuffer_remove_buffer(src, dst, n); // 只移动链表节点
+                    progress = true;
+                    if (c->mode == Mode::kPass && (c->remaining -= n) == 0)
+                        c->mode = Mode::kHead;
+                }
+                else if (c->mode == Mode::kBody)
+                {
+                    if (!c->owner->Take(c, src, dst))
+                        break;
+                    progress = true;
+                }
+                else
+                {
+                    if (len == 0 || !c->owner->ParseHead(c, src, dst))
+                        break;
+                    progress = true;
+                }
+            }
+            return progress ? BEV_OK : BEV_NEED_MORE;
+        }
+
+        // 解析一个完整的请求头，上传请求进入kBody，其他请求原样交给evhttp；请求头还没收完返回false
+        bool ParseHead(Conn *c, struct evbuffer *src, struct evbuffer *dst)
+        {
+            struct evbuffer_ptr end = evbuffer_search(src, "\r\n\r\n", 4, NULL);
+            if (end.pos < 0)
+            {
+                if (evbuffer_get_length(src) <= kMaxHead)
+                    return false;
+                c->mode = Mode::kRaw;
+                return true;
+            }
+            size_t head_len = end.pos + 4;
+            std::string head(head_len, 0);
+            evbuffer_copyout(src, &head[0], head_len);
+
+            // 请求行：METHOD URI VERSION
+            size_t eol = head.find("\r\n");
+            std::string line = head.substr(0, eol);
+            size_t sp1 = line.find(' ');
+            size_t sp2 = sp1 == std::string::npos ? sp1 : line.find(' ', sp1 + 1);
+            bool upload = false;
+            if (sp2 != std::string::npos)
+            {
+                std::string uri = line.substr(sp1 + 1, sp2 - sp1 - 1);
+                upload = line.compare(0, sp1, "POST") == 0 && uri.substr(0, uri.find('?')) == "/upload";
+            }
+
+            // 头部字段：所有请求都去掉客户端自带的X-Upload-Spool(stripped)，上传请求再去掉Content-Length和Expect(kept)
+            int64_t content_length = 0;
+            bool chunked = false, expect = false, forged = false;
+            std::string kept = line + "\r\n";
+            std::string stripped = kept;
+            for (size_t pos = eol + 2; pos + 2 < head_len;)
+            {
+                size_t next = head.find("\r\n", pos);
+                std::string field = head.substr(pos, next - pos);
+                pos = next + 2;
+                size_t colon = field.find(':');
+                std::string name = field.substr(0, colon);
+                std::string value = colon == std::string::npos ? "" : field.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t") + 1);
+                if (strcasecmp(name.c_str(), kSpoolHeader) == 0)
+                {
+                    forged = true;
+                    continue;
+                }
+                stripped += field + "\r\n";
+                if (strcasecmp(name.c_str(), "Content-Length") == 0)
+                {
+                    char *endp = NULL;
+                    content_length = strtoll(value.c_str(), &endp, 10);
+                    if (value.empty() || *endp != '\0' || content_length < 0)
+                        content_length = -1; // 交给evhttp拒绝
+                    continue;
+                }
+                if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+                    chunked = true;
+                else if (strcasecmp(name.c_str(), "Expect") == 0)
+                {
+                    expect = strcasecmp(value.c_str(), "100-continue") == 0;
+                    continue;
+                }
+                kept += field + "\r\n";
+            }
+            stripped += "\r\n";
+
+            // 透传请求头：没有X-Upload-Spool时只移动链表节点，否则换成去掉它的请求头
+            auto pass = [&]()
+            {
+                if (!forged)
+                {
+                    evbuffer_remove_buffer(src, dst, head_len);
+                    return;
+                }
+                evbuffer_drain(src, head_len);
+                evbuffer_add(dst, stripped.data(), stripped.size());
+            };
+            if (chunked || content_length < 0)
+            {
+                pass();
+                c->mode = Mode::kRaw;
+                return true;
+            }
+            if (upload && content_length > 0 && Open(c))
+            {
+                evbuffer_drain(src, head_len);
+                c->head = std::move(kept);
+                c->remaining = content_length;
+                c->offset = 0;
+                c->mode = Mode::kBody;
+                if (expect) // 请求头没有交给evhttp，由这里回复100 Continue
+                    bufferevent_write(c->under, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+                return true;
+            }
+            pass();
+            if (content_length > 0)
+            {
+                c->remaining = content_length;
+                c->mode = Mode::kPass;
+            }
+            return true;
+        }
+
+        // 临时文件名同时是认领凭据，用libevent的安全随机数生成，不能被其他连接猜到
+        static std::string NewToken()
+        {
+            static const char kHex[] = "0123456789abcdef";
+            unsigned char rnd[16];
+            evutil_secure_rng_get_bytes(rnd, sizeof(rnd));
+            std::string token = kSpoolPrefix;
+            for (unsigned char b : rnd)
+            {
+                token += kHex[b >> 4];
+                token += kHex[b & 0xf];
+            }
+            return token;
+        }
+
+        bool Open(Conn *c)
+        {
+            auto spool = std::make_shared<Spool>();
+            spool->token = NewToken();
+            spool->path = dir_ + spool->token;
+            spool->fd = open(spool->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (spool->fd == -1)
+            {
+                mylog::GetLogger("asynclogger")->Error("open %s failed: %s, fall back to buffered upload",
+                                                       spool->path.c_str(), strerror(errno));
+                spool->claimed = true;
+                return false;
+            }
+            spool->conn = c;
+            spool->bev = c->bev;
+            c->spool = spool;
+            return true;
+        }
+
+        // 从src中取请求体，在途字节数到上限时不取；请求体收完且全部写完后把请求头交给evhttp
+        bool Take(Conn *c, struct evbuffer *src, struct evbuffer *dst)
+        {
+            Spool *spool = c->spool.get();
+            size_t n = std::min<uint64_t>(evbuffer_get_length(src), c->remaining);
+            n = std::min(n, inflight_limit_ - std::min(inflight_limit_, spool->inflight));
+            if (n > 0)
+            {
+                evbuffer_remove_buffer(src, c->chunk, n);
+                c->remaining -= n;
+                spool->inflight += n;
+                if (evbuffer_get_length(c->chunk) >= flush_size_ || c->remaining == 0)
+                    Flush(c);
+            }
+            if (c->remaining == 0 && spool->pending == 0)
+            {
+                Finish(c, dst);
+                return true;
+            }
+            return n > 0;
+        }
+
+        void Flush(Conn *c)
+        {
+            struct evbuffer *chunk = c->chunk;
+            size_t n = evbuffer_get_length(chunk);
+            if (n == 0)
+                return;
+            c->chunk = evbuffer_new();
+            std::shared_ptr<Spool> spool = c->spool;
+            uint64_t off = c->offset;
+            c->offset += n;
+            ++spool->pending;
+            if (!io_->Submit(
+                    c->base, [spool, chunk, off]()
+                    {
+                        if (!WriteAt(spool->fd, chunk, off))
+                            spool->failed = true;
+                        evbuffer_free(chunk); },
+                    [spool, n]()
+                    {
+                        spool->inflight -= n;
+                        --spool->pending;
+                        if (spool->conn)
+                            Kick(spool->conn);
+                    }))
+            {
+                evbuffer_free(chunk);
+                spool->failed = true;
+                spool->inflight -= n;
+                --spool->pending;
+            }
+        }
+
+        // 请求体已经全部写进临时文件，登记后把改写过的请求头交给evhttp
+        void Finish(Conn *c, struct evbuffer *dst)
+        {
+            std::shared_ptr<Spool> spool = std::move(c->spool);
+            spool->conn = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                spools_[spool->token] = spool;
+            }
+            c->head += std::string(kSpoolHeader) + ": " + spool->token + "\r\nContent-Length: 0\r\n\r\n";
+            evbuffer_add(dst, c->head.data(), c->head.size());
+            c->head.clear();
+            c->mode = Mode::kHead;
+        }
+
+        // 写任务完成后重新运行过滤器；evhttp正在处理这个连接上的前一个请求时(没有开启读)，稍后再试
+        static void Kick(Conn *c)
+        {
+            if (bufferevent_get_enabled(c->bev) & EV_READ)
+            {
+                bufferevent_trigger(c->under, EV_READ, BEV_TRIG_IGNORE_WATERMARKS);
+            }
+            else
+            {
+                struct timeval tv = {0, 10000};
+                evtimer_add(c->kick_ev, &tv);
+            }
+        }
+
+        static void OnKick(evutil_socket_t fd, short events, void *arg)
+        {
+            Kick(static_cast<Conn *>(arg));
+        }
+
+        // IO线程中执行：把chunk按偏移写进临时文件，处理部分写入
+        static bool WriteAt(int fd, struct evbuffer *chunk, uint64_t off)
+        {
+            while (evbuffer_get_length(chunk) > 0)
+            {
+                struct evbuffer_iovec vec[64];
+                int n = evbuffer_peek(chunk, -1, NULL, vec, 64);
+                struct iovec iov[64];
+                for (int i = 0; i < n && i < 64; ++i)
+                {
+                    iov[i].iov_base = vec[i].iov_base;
+                    iov[i].iov_len = vec[i].iov_len;
+                }
+                ssize_t w = pwritev(fd, iov, std::min(n, 64), off);
+                if (w < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    mylog::GetLogger("asynclogger")->Error("upload spool write failed: %s", strerror(errno));
+                    return false;
+                }
+                off += w;
+                evbuffer_drain(chunk, w);
+            }
+            return true;
+        }
+
+    private:
+        IoPool *io_;
+        std::string dir_;
+        size_t inflight_limit_ = 0;
+        size_t flush_size_ = 0;
+
+        std::mutex mtx_;
+        std::unordered_map<std::string, std::shared_ptr<Spool>> spools_; // 请求体已经收完、等待Upload认领
+    };
+}
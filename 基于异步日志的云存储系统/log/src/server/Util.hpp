@@ -1,5 +1,6 @@
 #pragma once
 #include "jsoncpp/json/json.h"
+#include <atomic>
 #include <cassert>
 #include <sstream>
 #include <memory>
@@ -9,6 +10,7 @@
 #include <experimental/filesystem>
 #include <string>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 #include <fstream>
 #include "../../log_system/logs_code/MyLog.hpp"
@@ -113,6 +115,13 @@ namespace storage
             return filename_.substr(pos + 1, std::string::npos);
         }
 
+        // 同目录下的临时文件名，带进程号和序号，多个线程或进程同时生成同一个文件时不会写到同一个临时文件
+        std::string TempName()
+        {
+            static std::atomic<uint64_t> seq(0);
+            return filename_ + ".tmp." + std::to_string(getpid()) + "." + std::to_string(seq.fetch_add(1));
+        }
+
         // 从文件POS处获取len长度字符给content
         bool GetPosLen(std::string *content, size_t pos, size_t len)
         {
@@ -271,7 +280,7 @@ namespace storage
                 mylog::GetLogger("asynclogger")->Info("parse error");
                 return false;
             }
-            return false;
+            return true;
         }
     };
 }
\ No newline at end of file
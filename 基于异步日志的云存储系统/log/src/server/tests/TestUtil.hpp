@@ -0,0 +1,88 @@
+#pragma once
+/*
+服务端单元测试的公共部分，每个测试是一个独立的程序(见Makefile的check目标)：
+(1)CHECK失败只记录并继续，main最后调用Report，有失败时返回非0；
+(2)EnterTempDir在/tmp下建一个临时目录并切换进去，Storage.conf和测试数据都放在里面，不碰源码目录；
+(3)WriteConfig写出一份完整的Storage.conf，再用overrides中的键覆盖，必须在第一次Config::GetInstance之前调用；
+(4)InitLogger在临时目录中写一份日志配置，注册丢弃输出的asynclogger，服务端代码打日志时不需要真正落地。
+*/
+#include "Config.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+namespace storage
+{
+    class DataManager;
+}
+storage::DataManager *data_;
+ThreadPool *tp = nullptr;
+mylog::Util::JsonData *g_conf_data;
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++g_failures;                                                            \
+        }                                                                            \
+    } while (0)
+
+namespace test
+{
+    inline std::string EnterTempDir(const char *name)
+    {
+        std::string tmpl = std::string("/tmp/") + name + "-XXXXXX";
+        if (mkdtemp(&tmpl[0]) == NULL || chdir(tmpl.c_str()) != 0)
+        {
+            perror("create temp dir failed");
+            exit(2);
+        }
+        return tmpl;
+    }
+
+    inline void WriteConfig(const Json::Value &overrides = Json::Value(Json::objectValue))
+    {
+        Json::Value root;
+        root["server_port"] = 0;
+        root["server_ip"] = "127.0.0.1";
+        root["download_prefix"] = "/download/";
+        root["deep_storage_dir"] = "./deep_storage/";
+        root["low_storage_dir"] = "./low_storage/";
+        root["bundle_format"] = 4;
+        root["storage_info"] = "./storage.data";
+        root["ingest_dir"] = "./ingest/";
+        for (const auto &key : overrides.getMemberNames())
+            root[key] = overrides[key];
+        std::string body;
+        storage::JsonUtil::Serialize(root, &body);
+        storage::FileUtil(storage::Config_File).SetContent(body.c_str(), body.size());
+    }
+
+    inline void InitLogger()
+    {
+        const char *conf = "{\"buffer_size\": 1048576, \"threshold\": 67108864, \"linear_growth\": 1048576, "
+                           "\"flush_log\": 0, \"thread_count\": 1, \"log_level\": \"WARN\"}";
+        storage::FileUtil("mylog.conf").SetContent(conf, strlen(conf));
+        setenv("MYLOG_CONFIG", "mylog.conf", 1);
+        g_conf_data = mylog::Util::JsonData::GetJsonData();
+        std::shared_ptr<mylog::LoggerBuilder> glb(new mylog::LoggerBuilder());
+        glb->BuildLoggerName("asynclogger");
+        glb->BuildLoggerFlush<mylog::NullFlush>();
+        mylog::LoggerManager::GetInstance().AddLogger(glb->Build());
+    }
+
+    inline int Report(const char *name)
+    {
+        if (g_failures == 0)
+            fprintf(stderr, "%s: OK\n", name);
+        else
+            fprintf(stderr, "%s: %d check(s) failed\n", name, g_failures);
+        return g_failures == 0 ? 0 : 1;
+    }
+}
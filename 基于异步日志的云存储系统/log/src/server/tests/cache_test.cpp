@@ -0,0 +1,143 @@
+/*
+ * DeepCache 的测试：命中与未命中、LRU淘汰、超过容量1/4的块不缓存、容量为0时不缓存，
+ * 同一块同时被多个线程需要时只解压一次，解压失败不缓存，Erase丢掉一个URL的所有块。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "DeepCache.hpp"
+
+#include <thread>
+
+// 返回一个长度为len、内容为c的块，并记录调用次数
+static std::function<bool(std::string *)> Loader(size_t len, char c, std::atomic<int> *calls)
+{
+    return [len, c, calls](std::string *raw)
+    {
+        ++*calls;
+        raw->assign(len, c);
+        return true;
+    };
+}
+
+static void TestLru()
+{
+    storage::DeepCache cache(1000);
+    std::atomic<int> calls(0);
+    std::string a = storage::DeepCache::Key("/download/a", "etag1", 0);
+    std::string b = storage::DeepCache::Key("/download/a", "etag1", 1);
+    std::string c = storage::DeepCache::Key("/download/b", "etag2", 0);
+    std::string d = storage::DeepCache::Key("/download/b", "etag2", 1);
+    std::string e = storage::DeepCache::Key("/download/c", "etag3", 0);
+
+    storage::DeepCache::Block blk = cache.Get(a, Loader(250, 'a', &calls));
+    CHECK(blk && *blk == std::string(250, 'a'));
+    CHECK(cache.Get(a, Loader(250, 'x', &calls)) == blk); // 命中，不再调用load
+    CHECK(calls == 1);
+
+    cache.Get(b, Loader(250, 'b', &calls));
+    cache.Get(c, Loader(250, 'c', &calls));
+    cache.Get(a, Loader(250, 'x', &calls)); // a变成最近使用的
+    cache.Get(d, Loader(250, 'd', &calls)); // 正好等于容量
+    cache.Get(e, Loader(250, 'e', &calls)); // 超出容量，淘汰最久未使用的b
+    storage::DeepCache::Stats s = cache.GetStats();
+    CHECK(s.entries == 4 && s.bytes == 1000 && s.evictions == 1);
+    CHECK(s.hits == 2 && s.misses == 5);
+    calls = 0;
+    cache.Get(a, Loader(250, 'x', &calls));
+    cache.Get(b, Loader(250, 'b', &calls));
+    CHECK(calls == 1); // 只有b需要重新解压
+
+    // 超过容量1/4的块照常返回但不缓存
+    calls = 0;
+    std::string big = storage::DeepCache::Key("/download/big", "e", 0);
+    CHECK(cache.Get(big, Loader(251, 'B', &calls))->size() == 251);
+    cache.Get(big, Loader(251, 'B', &calls));
+    CHECK(calls == 2);
+
+    // 删除文件时丢掉它的所有块，不影响前缀相同的其他URL
+    std::string ab = storage::DeepCache::Key("/download/ab", "e", 0);
+    cache.Get(ab, Loader(10, 'x', &calls));
+    cache.Erase("/download/a");
+    calls = 0;
+    cache.Get(ab, Loader(10, 'x', &calls));
+    CHECK(calls == 0);
+    cache.Get(a, Loader(250, 'a', &calls));
+    CHECK(calls == 1);
+
+    storage::DeepCache none(0);
+    calls = 0;
+    none.Get(a, Loader(1, 'a', &calls));
+    none.Get(a, Loader(1, 'a', &calls));
+    CHECK(calls == 2 && none.GetStats().entries == 0);
+}
+
+static void TestCoalesceAndFailure()
+{
+    storage::DeepCache cache(1 << 20);
+    std::string key = storage::DeepCache::Key("/download/hot", "e", 3);
+    std::atomic<int> calls(0);
+    std::atomic<bool> release(false);
+    auto slow = [&](std::string *raw)
+    {
+        ++calls;
+        while (!release)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        raw->assign(100, 'h');
+        return true;
+    };
+    std::vector<std::thread> threads;
+    std::atomic<int> ok(0);
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&]()
+                             {
+                                 storage::DeepCache::Block b = cache.Get(key, slow);
+                                 if (b && b->size() == 100)
+                                     ++ok; });
+    // 等其他线程都挂到第一个请求的结果上再放行
+    while (cache.GetStats().misses + cache.GetStats().coalesced < 4)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    release = true;
+    for (auto &t : threads)
+        t.join();
+    CHECK(calls == 1 && ok == 4);
+    CHECK(cache.GetStats().coalesced == 3);
+
+    // 解压失败：返回空指针，不缓存，下一次重试
+    std::string bad = storage::DeepCache::Key("/download/bad", "e", 0);
+    calls = 0;
+    auto fail = [&](std::string *)
+    {
+        ++calls;
+        return false;
+    };
+    CHECK(!cache.Get(bad, fail));
+    CHECK(!cache.Get(bad, fail));
+    CHECK(calls == 2);
+
+    // load抛异常：异常传给调用者，登记被撤销，之后的请求可以重新解压
+    bool thrown = false;
+    try
+    {
+        cache.Get(bad, [](std::string *) -> bool
+                  { throw std::runtime_error("boom"); });
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+    calls = 0;
+    CHECK(cache.Get(bad, Loader(5, 'r', &calls)) && calls == 1);
+}
+
+int main()
+{
+    test::EnterTempDir("cache_test");
+    test::WriteConfig();
+    test::InitLogger();
+
+    TestLru();
+    TestCoalesceAndFailure();
+    return test::Report("cache_test");
+}
@@ -0,0 +1,145 @@
+/*
+ * DeepContainer 的测试：
+ * (1)在行边界处切块，逐块读回与原始数据相同，FindBlock/BlockStart与块表一致；
+ * (2)用Workers并行压缩与在调用线程中压缩的输出逐字节相同，ForEachBlock按块号顺序返回；
+ * (3)块数据损坏时ReadBlock失败；尾部的块数被改大时按旧格式打开，不按块数分配块表；
+ * (4)deep_block_size为0时PackFile仍然按4096字节一块读入；没有魔数的文件按旧格式整体解压。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "DeepContainer.hpp"
+
+static std::string MakeLines(size_t n)
+{
+    std::string data;
+    for (size_t i = 0; i < n; ++i)
+        data += "line " + std::to_string(i) + " of the test log, with some padding to fill blocks\n";
+    return data;
+}
+
+static bool Write(const std::string &path, const std::string &data, size_t block_size, ThreadPool *pool)
+{
+    storage::DeepContainer::Writer w(path, storage::Config::GetInstance()->GetBundleFormat(), block_size, pool);
+    // 分几次写入，覆盖pending_拼块和整块直接压缩两条路径
+    size_t step = block_size / 3 + 7;
+    for (size_t off = 0; off < data.size(); off += step)
+        if (!w.Append(data.data() + off, std::min(step, data.size() - off)))
+            return false;
+    return w.Finish();
+}
+
+static std::string ReadAll(const std::string &path)
+{
+    std::string content;
+    storage::FileUtil(path).GetContent(&content);
+    return content;
+}
+
+static void TestRoundTrip()
+{
+    std::string data = MakeLines(2000);
+    CHECK(Write("serial.lz", data, 4096, NULL));
+    CHECK(Write("parallel.lz", data, 4096, storage::DeepContainer::Workers()));
+    CHECK(ReadAll("serial.lz") == ReadAll("parallel.lz"));
+
+    storage::DeepContainer deep;
+    CHECK(deep.Open("parallel.lz"));
+    CHECK(!deep.IsLegacy());
+    CHECK(deep.RawSize() == data.size());
+    CHECK(deep.BlockCount() > 1);
+    std::string joined, block;
+    for (uint32_t i = 0; i < deep.BlockCount(); ++i)
+    {
+        CHECK(deep.ReadBlock(i, &block));
+        CHECK(deep.BlockStart(i) == joined.size());
+        CHECK(!block.empty() && block.back() == '\n'); // 在行边界处切开
+        CHECK(deep.FindBlock(joined.size()) == i);
+        CHECK(deep.FindBlock(joined.size() + block.size() - 1) == i);
+        joined += block;
+    }
+    CHECK(joined == data);
+
+    std::string ordered;
+    uint32_t expect = 0;
+    CHECK(deep.ForEachBlock([&](uint32_t i, std::string &raw)
+                            {
+                                CHECK(i == expect++);
+                                ordered += raw;
+                                return true; },
+                            storage::DeepContainer::Workers()));
+    CHECK(ordered == data);
+
+    // 没有换行时在块大小处硬切
+    std::string flat(10000, 'x');
+    CHECK(Write("flat.lz", flat, 4096, NULL));
+    storage::DeepContainer f;
+    CHECK(f.Open("flat.lz") && f.BlockCount() == 3 && f.Block(0).raw_len == 4096);
+}
+
+static void TestCorruption()
+{
+    std::string body = ReadAll("serial.lz");
+    std::string bad = body;
+    bad[10] ^= 1; // 第0块的压缩数据
+    storage::FileUtil("bad_block.lz").SetContent(bad.data(), bad.size());
+    storage::DeepContainer deep;
+    CHECK(deep.Open("bad_block.lz") && !deep.IsLegacy());
+    std::string raw;
+    CHECK(!deep.ReadBlock(0, &raw));
+    CHECK(deep.ReadBlock(1, &raw));
+
+    // 尾部的块数改成0xFFFFFFFF：块表超出文件，不能按块数分配
+    bad = body;
+    size_t count_off = bad.size() - sizeof(storage::DeepContainer::Trailer) + 4;
+    memset(&bad[count_off], 0xFF, 4);
+    storage::FileUtil("bad_count.lz").SetContent(bad.data(), bad.size());
+    storage::DeepContainer huge;
+    bool opened = false;
+    try
+    {
+        opened = huge.Open("bad_count.lz");
+    }
+    catch (const std::bad_alloc &)
+    {
+    }
+    CHECK(opened && huge.IsLegacy() && huge.BlockCount() == 1);
+}
+
+static void TestPackFileAndLegacy()
+{
+    std::string data = MakeLines(500);
+    storage::FileUtil("src.log").SetContent(data.data(), data.size());
+    CHECK(storage::DeepContainer::PackFile("src.log", "packed.lz"));
+    storage::DeepContainer deep;
+    CHECK(deep.Open("packed.lz") && !deep.IsLegacy());
+    CHECK(deep.RawSize() == data.size() && deep.BlockSize() == 4096);
+
+    std::string packed = bundle::pack(storage::Config::GetInstance()->GetBundleFormat(), data);
+    storage::FileUtil("legacy.lz").SetContent(packed.data(), packed.size());
+    storage::DeepContainer legacy;
+    std::string raw;
+    CHECK(legacy.Open("legacy.lz") && legacy.IsLegacy() && legacy.BlockCount() == 1);
+    CHECK(legacy.ReadBlock(0, &raw) && raw == data);
+
+    // Writer的临时文件都已经改名或删除
+    std::vector<std::string> files;
+    storage::FileUtil(".").ScanDirectory(&files);
+    for (auto &f : files)
+        CHECK(f.find(".tmp.") == std::string::npos);
+}
+
+int main()
+{
+    test::EnterTempDir("container_test");
+    Json::Value conf;
+    conf["deep_block_size"] = 0;
+    conf["deep_threads"] = 2;
+    test::WriteConfig(conf);
+    test::InitLogger();
+
+    TestRoundTrip();
+    TestCorruption();
+    TestPackFileAndLegacy();
+    return test::Report("container_test");
+}
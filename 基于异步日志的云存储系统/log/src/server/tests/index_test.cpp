@@ -0,0 +1,111 @@
+/*
+ * LogIndex 的测试：
+ * (1)QueryTerms：开头的词不用，末尾的词按前缀，长度不在[kMinTerm, kMaxTerm]之间的词不参与过滤；
+ * (2)对分块容器逐块建索引，按整词、前缀查询块号，包括超过kMaxTerm的长词按前缀能查到，多个词取交集；
+ * (3)索引内容被改坏时Open校验crc失败，建索引后目录中不留临时文件。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "LogIndex.hpp"
+
+static void TestQueryTerms()
+{
+    std::vector<storage::LogIndex::QueryTerm> t = storage::LogIndex::QueryTerms("ror code=42 timeout", false);
+    CHECK(t.size() == 2); // "ror"可能是某个词的后缀，"42"太短
+    CHECK(t.size() == 2 && t[0].text == "code" && !t[0].prefix);
+    CHECK(t.size() == 2 && t[1].text == "timeout" && t[1].prefix);
+
+    t = storage::LogIndex::QueryTerms("ror code", true);
+    CHECK(t.size() == 2 && t[0].text == "ror" && !t[1].prefix);
+
+    std::string long_word(storage::LogIndex::kMaxTerm + 1, 'w');
+    CHECK(storage::LogIndex::QueryTerms("x " + long_word, false).empty());
+    CHECK(storage::LogIndex::QueryTerms(long_word, true).empty());
+}
+
+// 建一个三块的容器：每块一行，块大小4096，每行都凑满一块
+static std::string MakeContainer(const std::vector<std::string> &lines)
+{
+    std::string path = "./deep_storage/app.log.lz";
+    storage::FileUtil("./deep_storage/").CreateDirectory();
+    storage::DeepContainer::Writer w(path, storage::Config::GetInstance()->GetBundleFormat(), 4096);
+    for (auto &l : lines)
+    {
+        std::string line = l;
+        line.resize(4095, ' ');
+        line += '\n';
+        CHECK(w.Append(line.data(), line.size()));
+    }
+    CHECK(w.Finish());
+    return path;
+}
+
+static std::vector<uint32_t> Lookup(storage::LogIndex &idx, const std::string &term, bool prefix)
+{
+    std::vector<uint32_t> blocks;
+    CHECK(idx.Lookup(term, prefix, &blocks));
+    return blocks;
+}
+
+static void TestBuildAndLookup()
+{
+    std::string long_word = "session_" + std::string(storage::LogIndex::kMaxTerm, 'a') + "_end";
+    std::string path = MakeContainer({"INFO connect ok user_id=17",
+                                      "ERROR timeout while reading " + long_word,
+                                      "ERROR connect refused user_id=17"});
+    CHECK(storage::LogIndex::Build(path, 64 * 1024));
+
+    std::vector<std::string> files;
+    storage::FileUtil("./deep_storage/").ScanDirectory(&files);
+    CHECK(files.size() == 2); // 容器和索引，没有残留的临时文件
+
+    storage::LogIndex idx;
+    CHECK(idx.Open(path));
+    CHECK(idx.Header().block_count == 3);
+    CHECK(idx.Header().raw_size == 3 * 4096);
+    CHECK(Lookup(idx, "ERROR", false) == std::vector<uint32_t>({1, 2}));
+    CHECK(Lookup(idx, "connect", false) == std::vector<uint32_t>({0, 2}));
+    CHECK(Lookup(idx, "conn", true) == std::vector<uint32_t>({0, 2}));
+    CHECK(Lookup(idx, "conn", false).empty());
+    CHECK(Lookup(idx, "missing", false).empty());
+    // 长词只索引前kMaxTerm个字节，前缀查询要能找到它
+    CHECK(Lookup(idx, "session_aaa", true) == std::vector<uint32_t>({1}));
+    CHECK(Lookup(idx, long_word.substr(0, storage::LogIndex::kMaxTerm), false) == std::vector<uint32_t>({1}));
+
+    std::vector<uint32_t> blocks;
+    CHECK(idx.Candidates(storage::LogIndex::QueryTerms("ERROR connect", true), &blocks));
+    CHECK(blocks == std::vector<uint32_t>({2}));
+    CHECK(idx.Candidates(storage::LogIndex::QueryTerms(" timeout while read", false), &blocks));
+    CHECK(blocks == std::vector<uint32_t>({1}));
+    CHECK(idx.Candidates(storage::LogIndex::QueryTerms(" INFO refused", true), &blocks));
+    CHECK(blocks.empty());
+
+    // 改坏一个词条中的字节：边界检查发现不了，crc可以
+    std::string body;
+    storage::FileUtil(storage::LogIndex::IndexPath(path)).GetContent(&body);
+    body[sizeof(storage::LogIndex::IndexHeader) + 3] ^= 1;
+    storage::FileUtil(storage::LogIndex::IndexPath(path)).SetContent(body.data(), body.size());
+    storage::LogIndex bad;
+    CHECK(!bad.Open(path));
+}
+
+static void TestTempName()
+{
+    storage::FileUtil f("./x.idx");
+    std::string a = f.TempName(), b = f.TempName();
+    CHECK(a != b);
+    CHECK(a.compare(0, 12, "./x.idx.tmp.") == 0);
+}
+
+int main()
+{
+    test::EnterTempDir("index_test");
+    test::WriteConfig();
+    test::InitLogger();
+
+    TestQueryTerms();
+    TestBuildAndLookup();
+    TestTempName();
+    return test::Report("index_test");
+}
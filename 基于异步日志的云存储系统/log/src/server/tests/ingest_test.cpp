@@ -0,0 +1,241 @@
+/*
+ * LogIngest 的测试：
+ * (1)SessionMarks：按序写入、重发去重、有空缺时不写也不确认、分段写失败后回退水位；
+ * (2)端到端：在本机起一个只有/ingest的evhttp服务，按RemoteFlush的方式一个请求一帧地POST，
+ *    检查回复的累计确认和分段文件的内容，包括前一帧被拒绝后后一帧先到、重发，
+ *    以及用RLIMIT_FSIZE让writev失败时回复500、不确认、分段截回上次提交的长度。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "LogIngest.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+static const uint64_t kSession = 0x5eed;
+
+static std::string MakeFrame(uint64_t seq, const std::string &data)
+{
+    mylog::Frame::FrameHeader h = mylog::Frame::MakeHeader(mylog::Frame::NONE, kSession, seq, data.size(), data);
+    return std::string(reinterpret_cast<const char *>(&h), sizeof(h)) + data;
+}
+
+static std::string Line(uint64_t seq)
+{
+    return "frame " + std::to_string(seq) + "\n";
+}
+
+struct Reply
+{
+    int status = 0;
+    uint64_t ack = 0; // kSession的累计确认，没有确认时为0
+};
+
+// 一个连接发一个请求，读到对端关闭为止
+static Reply Post(int port, const std::string &path, const std::string &body)
+{
+    Reply r;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return r;
+    }
+    std::string req = "POST " + path + " HTTP/1.1\r\nHost: test\r\nConnection: close\r\nLogSource: app\r\n"
+                      "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    if (write(fd, req.data(), req.size()) != static_cast<ssize_t>(req.size()))
+    {
+        close(fd);
+        return r;
+    }
+    std::string resp;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        resp.append(buf, n);
+    close(fd);
+    sscanf(resp.c_str(), "HTTP/1.%*d %d", &r.status);
+    size_t end = resp.find("\r\n\r\n");
+    if (end == std::string::npos)
+        return r;
+    for (size_t off = end + 4; off + sizeof(mylog::Frame::FrameAck) <= resp.size(); off += sizeof(mylog::Frame::FrameAck))
+    {
+        mylog::Frame::FrameAck a;
+        memcpy(&a, resp.data() + off, sizeof(a));
+        if (mylog::Frame::ParseAck(&a) && a.session == kSession)
+            r.ack = a.seq;
+    }
+    return r;
+}
+
+static std::string SegmentContent()
+{
+    std::vector<std::string> files;
+    storage::FileUtil("./ingest/").ScanDirectory(&files);
+    std::string content;
+    if (files.size() == 1)
+        storage::FileUtil(files[0]).GetContent(&content);
+    return content;
+}
+
+static void TestSessionMarks()
+{
+    storage::SessionMarks m;
+    CHECK(m.Mark(1) == 0);
+    CHECK(m.Check(1, 7) == storage::SessionMarks::kWrite); // 第一次见到的session从第一帧开始计
+    m.Advance(1, 7);
+    CHECK(m.Check(1, 8) == storage::SessionMarks::kWrite);
+    m.Advance(1, 8);
+    CHECK(m.Check(1, 8) == storage::SessionMarks::kDuplicate);
+    CHECK(m.Check(1, 10) == storage::SessionMarks::kGap);
+    CHECK(m.Mark(1) == 8);
+    m.EndGroup();
+
+    m.Advance(1, 9);
+    m.Advance(1, 10);
+    m.Advance(2, 1);
+    m.Rollback(1); // 分段写失败：回到本组开始时的水位
+    CHECK(m.Mark(1) == 8);
+    CHECK(m.Mark(2) == 1);
+    m.Rollback(2);
+    CHECK(m.Mark(2) == 0);
+    CHECK(m.Check(2, 1) == storage::SessionMarks::kWrite);
+    m.EndGroup();
+    m.Rollback(1); // 组结束后没有可回退的
+    CHECK(m.Mark(1) == 8);
+}
+
+struct Server
+{
+    event_base *base = NULL;
+    evhttp *http = NULL;
+    storage::LogIngest *ingest = NULL;
+    int port = 0;
+};
+
+static void OnRequest(struct evhttp_request *req, void *arg)
+{
+    Server *s = static_cast<Server *>(arg);
+    std::string uri = evhttp_request_get_uri(req);
+    if (uri == "/quit")
+    {
+        evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+        struct timeval later = {0, 100 * 1000}; // 留时间把回复发完并关闭连接
+        event_base_loopexit(s->base, &later);
+        return;
+    }
+    struct evbuffer *body = evbuffer_new();
+    evbuffer_add_buffer(body, evhttp_request_get_input_buffer(req));
+    std::string source = storage::LogIngest::SanitizeSource(evhttp_find_header(evhttp_request_get_input_headers(req), "LogSource"));
+    if (!s->ingest->Submit(req, source, body))
+    {
+        evbuffer_free(body);
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "ingest busy", NULL);
+    }
+}
+
+static void TestEndToEnd(Server &s)
+{
+    std::string expect;
+    for (uint64_t seq = 1; seq <= 3; ++seq)
+    {
+        Reply r = Post(s.port, "/ingest", MakeFrame(seq, Line(seq)));
+        CHECK(r.status == 200 && r.ack == seq);
+        expect += Line(seq);
+    }
+    CHECK(SegmentContent() == expect);
+
+    // 第4帧被拒绝(比如503)，第5帧先到：不写入，确认仍停在3
+    Reply r = Post(s.port, "/ingest", MakeFrame(5, Line(5)));
+    CHECK(r.status == 200 && r.ack == 3);
+    CHECK(SegmentContent() == expect);
+    // 发送端重连后从第4帧开始按顺序重发
+    r = Post(s.port, "/ingest", MakeFrame(4, Line(4)));
+    CHECK(r.status == 200 && r.ack == 4);
+    r = Post(s.port, "/ingest", MakeFrame(5, Line(5)));
+    CHECK(r.status == 200 && r.ack == 5);
+    expect += Line(4) + Line(5);
+    CHECK(SegmentContent() == expect);
+
+    // 已经写过的帧重发：只确认不写入
+    r = Post(s.port, "/ingest", MakeFrame(2, Line(2)));
+    CHECK(r.status == 200 && r.ack == 5);
+    CHECK(SegmentContent() == expect);
+
+    // 文件大小限制让writev写了一部分后失败：回复500不带确认，分段截回上次提交的长度
+    struct rlimit old, lim;
+    getrlimit(RLIMIT_FSIZE, &old);
+    lim = old;
+    lim.rlim_cur = expect.size() + 4;
+    setrlimit(RLIMIT_FSIZE, &lim);
+    std::string big(4096, 'x');
+    big += '\n';
+    r = Post(s.port, "/ingest", MakeFrame(6, big));
+    CHECK(r.status == 500 && r.ack == 0);
+    CHECK(SegmentContent() == expect);
+    setrlimit(RLIMIT_FSIZE, &old);
+    // 重发后写入，水位已经回退，不会被当成重复帧
+    r = Post(s.port, "/ingest", MakeFrame(6, big));
+    CHECK(r.status == 200 && r.ack == 6);
+    expect += big;
+    CHECK(SegmentContent() == expect);
+
+    // 坏帧
+    std::string bad = MakeFrame(7, Line(7));
+    bad[bad.size() - 1] ^= 1;
+    r = Post(s.port, "/ingest", bad);
+    CHECK(r.status == 400 && r.ack == 0);
+    CHECK(SegmentContent() == expect);
+}
+
+int main()
+{
+    signal(SIGXFSZ, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    test::EnterTempDir("ingest_test");
+    Json::Value conf;
+    conf["ingest_segment_size"] = 64 * 1024 * 1024;
+    conf["ingest_buffer_size"] = 1024;
+    conf["ingest_max_pending"] = 64 * 1024 * 1024;
+    test::WriteConfig(conf);
+    test::InitLogger();
+
+    TestSessionMarks();
+
+    Server s;
+    s.base = event_base_new();
+    s.http = evhttp_new(s.base);
+    evhttp_set_gencb(s.http, OnRequest, &s);
+    struct evhttp_bound_socket *sock = evhttp_bind_socket_with_handle(s.http, "127.0.0.1", 0);
+    CHECK(sock != NULL);
+    if (sock == NULL)
+        return test::Report("ingest_test");
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(evhttp_bound_socket_get_fd(sock), reinterpret_cast<struct sockaddr *>(&addr), &len);
+    s.port = ntohs(addr.sin_port);
+    storage::IoPool *io = new storage::IoPool(1);
+    CHECK(io->Attach(s.base));
+    s.ingest = new storage::LogIngest(io);
+
+    std::thread loop([&s]()
+                     { event_base_dispatch(s.base); });
+    TestEndToEnd(s);
+    Post(s.port, "/quit", "");
+    loop.join();
+
+    delete s.ingest;
+    delete io;
+    evhttp_free(s.http);
+    event_base_free(s.base);
+    return test::Report("ingest_test");
+}
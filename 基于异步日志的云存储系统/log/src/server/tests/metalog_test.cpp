@@ -0,0 +1,191 @@
+/*
+ * MetaLog 和 DataManager 元数据持久化的测试：
+ * (1)MetaLog：追加、重放，末尾半条记录和crc不符的记录被截掉，之后追加的记录能正常重放；
+ * (2)DataManager：重启后从快照+日志恢复，压缩(同步和线程池中)后日志清空、快照包含全部记录，
+ *    上次压缩没完成留下的封存日志在启动时补压缩，写快照不留下临时文件；
+ * (3)快照损坏时Loaded()为false，长度为0的快照当作空表。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "DataManager.hpp"
+
+static storage::StorageInfo MakeInfo(const std::string &name, size_t size)
+{
+    storage::StorageInfo info;
+    info.mtime_ = 1700000000;
+    info.atime_ = 1700000001;
+    info.fsize_ = size;
+    info.url_ = "/download/" + name;
+    info.storage_path_ = "./low_storage/" + name;
+    return info;
+}
+
+static std::vector<storage::MetaLog::Record> ReplayAll(const std::string &path, bool truncate)
+{
+    std::vector<storage::MetaLog::Record> records;
+    CHECK(storage::MetaLog::Replay(path, [&records](const storage::MetaLog::Record &r)
+                                   { records.push_back(r); }, truncate));
+    return records;
+}
+
+static void TestMetaLog()
+{
+    {
+        storage::MetaLog log("meta.wal");
+        CHECK(log.Open());
+        CHECK(log.Append({storage::MetaLog::kPut, 1, 2, 3, "/download/a", "./low_storage/a"}));
+        CHECK(log.Append({storage::MetaLog::kDelete, 0, 0, 0, "/download/a", ""}));
+        CHECK(log.Size() == storage::FileUtil("meta.wal").FileSize());
+    }
+    std::vector<storage::MetaLog::Record> r = ReplayAll("meta.wal", false);
+    CHECK(r.size() == 2);
+    CHECK(r.size() == 2 && r[0].op == storage::MetaLog::kPut && r[0].fsize == 3 && r[0].storage_path == "./low_storage/a");
+    CHECK(r.size() == 2 && r[1].op == storage::MetaLog::kDelete && r[1].url == "/download/a");
+    CHECK(ReplayAll("missing.wal", false).empty());
+
+    // 崩溃时写了一半的记录：重放到它之前为止，truncate后文件只剩完整的记录
+    int64_t good = storage::FileUtil("meta.wal").FileSize();
+    std::string body;
+    storage::FileUtil("meta.wal").GetContent(&body);
+    std::string torn = body + body.substr(0, 13);
+    storage::FileUtil("meta.wal").SetContent(torn.data(), torn.size());
+    CHECK(ReplayAll("meta.wal", false).size() == 2);
+    CHECK(storage::FileUtil("meta.wal").FileSize() == static_cast<int64_t>(torn.size()));
+    CHECK(ReplayAll("meta.wal", true).size() == 2);
+    CHECK(storage::FileUtil("meta.wal").FileSize() == good);
+    {
+        storage::MetaLog log("meta.wal");
+        CHECK(log.Open());
+        CHECK(log.Append({storage::MetaLog::kPut, 4, 5, 6, "/download/b", "./low_storage/b"}));
+    }
+    r = ReplayAll("meta.wal", true);
+    CHECK(r.size() == 3 && r[2].url == "/download/b");
+
+    // 负载被改坏：crc不符，从这条开始丢弃
+    storage::FileUtil("meta.wal").GetContent(&body);
+    body[12] ^= 1;
+    storage::FileUtil("meta.wal").SetContent(body.data(), body.size());
+    CHECK(ReplayAll("meta.wal", true).empty());
+    CHECK(storage::FileUtil("meta.wal").FileSize() == 0);
+}
+
+static void TestRecovery()
+{
+    {
+        storage::DataManager dm;
+        CHECK(dm.Loaded());
+        CHECK(dm.Insert(MakeInfo("a.log", 10)));
+        CHECK(dm.Insert(MakeInfo("b.log", 20)));
+        CHECK(dm.Update(MakeInfo("a.log", 11)));
+        CHECK(dm.Delete("/download/b.log"));
+        CHECK(!dm.Delete("/download/b.log"));
+    }
+    CHECK(!storage::FileUtil("./storage.data").Exists()); // 没到压缩阈值，只写了日志
+    storage::DataManager dm;
+    CHECK(dm.Loaded());
+    storage::StorageInfo info;
+    CHECK(dm.GetOneByURL("/download/a.log", &info) && info.fsize_ == 11 && info.storage_path_ == "./low_storage/a.log");
+    CHECK(!dm.GetOneByURL("/download/b.log", &info));
+    CHECK(dm.GetOneByStoragePath("./low_storage/a.log", &info) && info.url_ == "/download/a.log");
+}
+
+// tp为空时在调用线程中压缩，否则在线程池中
+static void TestCompaction(bool pool)
+{
+    if (pool)
+        tp = new ThreadPool(1);
+    {
+        storage::DataManager dm;
+        CHECK(dm.Loaded());
+        for (int i = 0; i < 50; ++i)
+            CHECK(dm.Insert(MakeInfo("f" + std::to_string(i), i)));
+        for (int i = 0; i < 50; i += 2)
+            CHECK(dm.Delete("/download/f" + std::to_string(i)));
+    } // 析构时等待后台压缩结束
+    delete tp;
+    tp = nullptr;
+    CHECK(!storage::FileUtil("./storage.data.wal.1").Exists());
+    CHECK(storage::FileUtil("./storage.data").Exists());
+    std::vector<std::string> files;
+    storage::FileUtil(".").ScanDirectory(&files);
+    for (auto &f : files)
+        CHECK(f.find(".tmp.") == std::string::npos); // 快照的临时文件都已经改名
+
+    storage::DataManager dm;
+    CHECK(dm.Loaded());
+    std::vector<storage::StorageInfo> all;
+    dm.GetAll(&all);
+    CHECK(all.size() == 25);
+    storage::StorageInfo info;
+    CHECK(dm.GetOneByURL("/download/f49", &info) && info.fsize_ == 49);
+    CHECK(!dm.GetOneByURL("/download/f48", &info));
+}
+
+// 上次压缩没完成：封存的日志还在，启动时重放并补压缩
+static void TestSealedLeftover()
+{
+    {
+        storage::MetaLog sealed("./storage.data.wal.1");
+        CHECK(sealed.Open());
+        storage::StorageInfo i = MakeInfo("sealed.log", 7);
+        CHECK(sealed.Append({storage::MetaLog::kPut, i.mtime_, i.atime_, 7, i.url_, i.storage_path_}));
+    }
+    storage::DataManager dm;
+    CHECK(dm.Loaded());
+    storage::StorageInfo info;
+    CHECK(dm.GetOneByURL("/download/sealed.log", &info) && info.fsize_ == 7);
+    CHECK(!storage::FileUtil("./storage.data.wal.1").Exists());
+    std::string snapshot;
+    storage::FileUtil("./storage.data").GetContent(&snapshot);
+    CHECK(snapshot.find("/download/sealed.log") != std::string::npos);
+}
+
+static void TestCorruptSnapshot()
+{
+    std::string good;
+    storage::FileUtil("./storage.data").GetContent(&good);
+    std::string bad = good.substr(0, good.size() / 2);
+    storage::FileUtil("./storage.data").SetContent(bad.data(), bad.size());
+    {
+        storage::DataManager dm;
+        CHECK(!dm.Loaded());
+    }
+    // 加载失败时不能改写快照
+    std::string after;
+    storage::FileUtil("./storage.data").GetContent(&after);
+    CHECK(after == bad);
+
+    storage::FileUtil("./storage.data").SetContent("{\"url_\": 1}", 11); // 合法的json，但不是数组
+    {
+        storage::DataManager dm;
+        CHECK(!dm.Loaded());
+    }
+
+    storage::FileUtil("./storage.data").SetContent("", 0);
+    storage::DataManager dm;
+    CHECK(dm.Loaded());
+}
+
+int main()
+{
+    test::EnterTempDir("metalog_test");
+    Json::Value conf;
+    conf["storage_wal_compact_size"] = 1 << 30; // 先不压缩，只写日志
+    test::WriteConfig(conf);
+    test::InitLogger();
+
+    TestMetaLog();
+    TestRecovery();
+
+    // 阈值改成1字节，每次修改都可能压缩；DataManager构造时读取阈值
+    test::EnterTempDir("metalog_test");
+    conf["storage_wal_compact_size"] = 1;
+    test::WriteConfig(conf);
+    storage::Config::GetInstance()->ReadConfig();
+    TestCompaction(false);
+    TestCompaction(true);
+    TestSealedLeftover();
+    TestCorruptSnapshot();
+    return test::Report("metalog_test");
+}
@@ -0,0 +1,84 @@
+/*
+ * HttpRange 的测试：各种区间写法、截到文件末尾、不可满足与语法错误，
+ * 以及重叠、相邻、乱序的区间排序合并，合并后只剩一个区间时按单区间回复。
+ *
+ * 编译运行: make check (见上级目录 Makefile)
+ */
+#include "TestUtil.hpp"
+#include "HttpRange.hpp"
+
+using storage::HttpRange;
+
+// 把解析结果写成"first-last,first-last"便于比较
+static std::string Parse(const char *header, uint64_t size, HttpRange::Result *result = NULL)
+{
+    std::vector<HttpRange::Range> ranges;
+    HttpRange::Result r = HttpRange::Parse(header, size, &ranges);
+    if (result != NULL)
+        *result = r;
+    std::string out;
+    for (auto &rg : ranges)
+        out += (out.empty() ? "" : ",") + std::to_string(rg.first) + "-" + std::to_string(rg.last);
+    return out;
+}
+
+static void TestForms()
+{
+    HttpRange::Result r;
+    CHECK(Parse("bytes=0-99", 1000, &r) == "0-99" && r == HttpRange::kPartial);
+    CHECK(Parse("bytes=900-", 1000) == "900-999");
+    CHECK(Parse("bytes=-100", 1000) == "900-999");
+    CHECK(Parse("bytes=-5000", 1000) == "0-999");
+    CHECK(Parse("bytes=990-2000", 1000) == "990-999");
+    CHECK(Parse(" bytes= 0-0 , ,10-19", 1000) == "0-0,10-19");
+
+    CHECK(Parse(NULL, 1000, &r) == "" && r == HttpRange::kFull);
+    CHECK(Parse("items=0-1", 1000, &r) == "" && r == HttpRange::kFull);
+    CHECK(Parse("bytes=5-1", 1000, &r) == "" && r == HttpRange::kFull);
+    CHECK(Parse("bytes=0-1,x", 1000, &r) == "" && r == HttpRange::kFull);
+    CHECK(Parse("bytes=", 1000, &r) == "" && r == HttpRange::kFull);
+
+    CHECK(Parse("bytes=1000-", 1000, &r) == "" && r == HttpRange::kUnsatisfiable);
+    CHECK(Parse("bytes=-0", 1000, &r) == "" && r == HttpRange::kUnsatisfiable);
+    CHECK(Parse("bytes=0-", 0, &r) == "" && r == HttpRange::kUnsatisfiable);
+    CHECK(Parse("bytes=2000-3000,0-9", 1000, &r) == "0-9" && r == HttpRange::kPartial);
+
+    std::string many = "bytes=";
+    for (size_t i = 0; i <= HttpRange::kMaxRanges; ++i)
+        many += std::to_string(i * 10) + "-" + std::to_string(i * 10) + ",";
+    CHECK(Parse(many.c_str(), 100000, &r) == "" && r == HttpRange::kFull);
+}
+
+static void TestCoalesce()
+{
+    CHECK(Parse("bytes=500-599,0-99", 1000) == "0-99,500-599");      // 排序
+    CHECK(Parse("bytes=0-99,50-149", 1000) == "0-149");              // 重叠
+    CHECK(Parse("bytes=0-99,100-199", 1000) == "0-199");             // 相邻
+    CHECK(Parse("bytes=0-99,101-199", 1000) == "0-99,101-199");      // 中间空一个字节
+    CHECK(Parse("bytes=10-20,0-999,500-", 1000) == "0-999");         // 包含
+    CHECK(Parse("bytes=0-9,0-9,0-9", 1000) == "0-9");                // 重复
+    CHECK(Parse("bytes=-100,800-949,0-0", 1000) == "0-0,800-999");  // 后缀区间参与合并
+    CHECK(Parse("bytes=900-,950-2000", 1000) == "900-999");          // 截到末尾后合并
+}
+
+static void TestHeaders()
+{
+    HttpRange::Range r{10, 19};
+    CHECK(r.Length() == 10);
+    CHECK(HttpRange::ContentRange(r, 1000) == "bytes 10-19/1000");
+    CHECK(HttpRange::Unsatisfied(1000) == "bytes */1000");
+    std::string b = HttpRange::NewBoundary();
+    CHECK(b != HttpRange::NewBoundary());
+    CHECK(HttpRange::PartHeader(0, r, 1000, b, "text/plain") ==
+          "--" + b + "\r\nContent-Type: text/plain\r\nContent-Range: bytes 10-19/1000\r\n\r\n");
+    CHECK(HttpRange::PartHeader(1, r, 1000, b, "text/plain").compare(0, 2, "\r\n") == 0);
+    CHECK(HttpRange::Trailer(b) == "\r\n--" + b + "--\r\n");
+}
+
+int main()
+{
+    TestForms();
+    TestCoalesce();
+    TestHeaders();
+    return test::Report("range_test");
+}